@@ -0,0 +1,220 @@
+/* aes-crypt-bench.c
+ * Known-answer tests and a benchmark for the AES-256-CTR implementations
+ * in aes-crypt
+ *
+ * See aes-crypt.h and aes-crypt.c for more details
+ *
+ * Every implementation this CPU supports is checked against the NIST
+ * SP 800-38A CTR-AES256 vectors, then against OpenSSL on random keys,
+ * lengths and counters, including counters that carry out of the low
+ * 64 bits and wrap the whole block. Then each is timed on chunk-sized
+ * and large buffers, as is aes_ctr_crypt() (auto), which picks one by
+ * length.
+ *
+ * Usage: aes-crypt-bench [-k] [-t SECONDS]
+ *   -k          run the checks only
+ *   -t SECONDS  time each implementation and size this long (default 1)
+ *
+ * Exits 1 if any implementation disagrees with OpenSSL.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aes-crypt.h"
+
+#define IMPLS 3
+#define RANDOM_CASES 2000
+#define MAX_CASE 2048
+
+static const unsigned char kat_key[AES_CRYPT_KEYLEN] = {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+    0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+    0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+    0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+};
+static const unsigned char kat_iv[AES_CRYPT_IVLEN] = {
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+static const unsigned char kat_plain[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const unsigned char kat_cipher[64] = {
+    0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+    0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+    0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+    0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+    0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c,
+    0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+    0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6,
+    0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The NIST vectors, whole and cut short, and in place */
+static int check_kat(int impl)
+{
+    unsigned char buf[sizeof(kat_plain)];
+    size_t len;
+
+    for(len = 0; len <= sizeof(kat_plain); len++){
+	memset(buf, 0, sizeof(buf));
+	if(!aes_ctr_crypt_impl(impl, kat_key, kat_iv, kat_plain, buf, len) ||
+	   memcmp(buf, kat_cipher, len) != 0)
+	    return 0;
+    }
+    memcpy(buf, kat_cipher, sizeof(buf));
+    if(!aes_ctr_crypt_impl(impl, kat_key, kat_iv, buf, buf, sizeof(buf)) ||
+       memcmp(buf, kat_plain, sizeof(buf)) != 0)
+	return 0;
+    return 1;
+}
+
+/* Random cases against OpenSSL; every fourth counter is a few blocks
+ * short of a carry out of the low 64 bits, every eighth of wrapping */
+static int check_random(int impl)
+{
+    unsigned char key[AES_CRYPT_KEYLEN];
+    unsigned char iv[AES_CRYPT_IVLEN];
+    static unsigned char in[MAX_CASE];
+    static unsigned char want[MAX_CASE];
+    static unsigned char got[MAX_CASE];
+    unsigned char len2[2];
+    size_t len;
+    int i;
+
+    for(i = 0; i < RANDOM_CASES; i++){
+	if(!random_bytes(key, sizeof(key)) || !random_bytes(iv, sizeof(iv)) ||
+	   !random_bytes(len2, sizeof(len2)) || !random_bytes(in, sizeof(in)))
+	    return 0;
+	len = (len2[0] | len2[1] << 8) % (MAX_CASE + 1);
+	if(i % 4 == 0){
+	    memset(iv + 8, 0xff, 7);
+	    iv[15] = 0xff - (len2[0] & 15);
+	}
+	if(i % 8 == 0)
+	    memset(iv, 0xff, 8);
+	if(!aes_ctr_crypt_evp(key, iv, in, want, len) ||
+	   !aes_ctr_crypt_impl(impl, key, iv, in, got, len) ||
+	   memcmp(want, got, len) != 0){
+	    fprintf(stderr, "%s: differs from openssl at length %zu\n",
+		    aes_ctr_name(impl), len);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* MB/s of impl (or of aes_ctr_crypt() if impl is -1) on size byte
+ * buffers, one call per buffer */
+static double bench(int impl, size_t size, double secs)
+{
+    unsigned char key[AES_CRYPT_KEYLEN];
+    unsigned char iv[AES_CRYPT_IVLEN];
+    unsigned char* buf;
+    double start, t;
+    size_t done = 0;
+    int i;
+
+    buf = calloc(1, size);
+    if(!buf)
+	return 0;
+    memset(key, 0x5a, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+    start = now();
+    do {
+	for(i = 0; i < 16; i++){
+	    iv[0]++;
+	    if(impl < 0)
+		aes_ctr_crypt(key, iv, buf, buf, size);
+	    else
+		aes_ctr_crypt_impl(impl, key, iv, buf, buf, size);
+	    done += size;
+	}
+	t = now() - start;
+    } while(t < secs);
+    free(buf);
+    return done / t / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 64, 512, 4096, 16384, 65536, 1 << 20 };
+    double secs = 1;
+    int kat_only = 0;
+    int bad = 0;
+    int impl;
+    size_t s;
+    int opt;
+
+    while((opt = getopt(argc, argv, "kt:")) != -1){
+	switch(opt){
+	case 'k':
+	    kat_only = 1;
+	    break;
+	case 't':
+	    secs = atof(optarg);
+	    if(secs > 0)
+		break;
+	    /* fall through */
+	default:
+	    fprintf(stderr, "usage: %s [-k] [-t SECONDS]\n", argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    printf("aes_ctr_crypt() uses %s below %d bytes, openssl from there\n",
+	   aes_ctr_name(aes_ctr_best()), AES_CTR_EVP_MIN);
+    for(impl = 0; impl < IMPLS; impl++){
+	if(!aes_ctr_supported(impl)){
+	    printf("%-8s not supported by this CPU\n", aes_ctr_name(impl));
+	    continue;
+	}
+	if(!check_kat(impl)){
+	    printf("%-8s FAILED the NIST vectors\n", aes_ctr_name(impl));
+	    bad = 1;
+	} else if(!check_random(impl)){
+	    printf("%-8s FAILED against openssl\n", aes_ctr_name(impl));
+	    bad = 1;
+	} else {
+	    printf("%-8s ok\n", aes_ctr_name(impl));
+	}
+    }
+    if(kat_only || bad)
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    printf("\n%-8s", "MB/s");
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	printf(" %10zu", sizes[s]);
+    printf("\n");
+    for(impl = -1; impl < IMPLS; impl++){
+	if(impl >= 0 && !aes_ctr_supported(impl))
+	    continue;
+	printf("%-8s", impl < 0 ? "auto" : aes_ctr_name(impl));
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	    printf(" %10.0f", bench(impl, sizes[s], secs));
+	printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
@@ -17,6 +17,16 @@
 
 #include "aes-crypt.h"
 
+#include <stdint.h>
+#include <openssl/rand.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AES_CTR_X86 1
+#include <immintrin.h>
+#else
+#define AES_CTR_X86 0
+#endif
+
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
@@ -33,7 +43,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int writelen;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
+    EVP_CIPHER_CTX *ctx = NULL;
     unsigned char key[32];
     unsigned char iv[32];
     int nrounds = 5;
@@ -57,8 +67,12 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    return 0;
 	}
 	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+	    fprintf(stderr, "EVP_CIPHER_CTX_new failed\n");
+	    return 0;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
     }    
 
     /* Loop through Input File*/
@@ -72,10 +86,10 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
 		{
 		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
+		    EVP_CIPHER_CTX_free(ctx);
 		    return 0;
 		}
 	}
@@ -90,7 +104,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
+	    EVP_CIPHER_CTX_free(ctx);
 	    return 0;
 	}
     }
@@ -98,17 +112,367 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
 	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
 	    {
 		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		EVP_CIPHER_CTX_free(ctx);
 		return 0;
 	    }
 	/* Write remainign cipher block + padding*/
 	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	EVP_CIPHER_CTX_free(ctx);
     }
     
     /* Success */
     return 1;
 }
+
+extern int aes_ctr_crypt_evp(const unsigned char* key, const unsigned char* iv,
+			     const unsigned char* in, unsigned char* out,
+			     size_t len){
+    EVP_CIPHER_CTX *ctx;
+    int outlen;
+    int chunk;
+    int ok = 1;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx)
+	return FAILURE;
+    if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv))
+	ok = 0;
+    /* EVP takes int lengths */
+    while(ok && len > 0){
+	chunk = len > (1 << 30) ? (1 << 30) : (int)len;
+	if(!EVP_EncryptUpdate(ctx, out, &outlen, in, chunk))
+	    ok = 0;
+	in += chunk;
+	out += chunk;
+	len -= chunk;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok ? SUCCESS : FAILURE;
+}
+
+#if AES_CTR_X86
+/* Hand-interleaved AES-256-CTR: ACCEL_BLOCKS counter blocks go through
+ * the rounds together, so the AES unit works on one while the others
+ * are in flight. The counter is the whole 16-byte block, big-endian, as
+ * EVP_aes_256_ctr() counts it. It is kept byte-reversed so adding to it
+ * is one vector add while the low 64 bits do not wrap. */
+
+#define ACCEL_BLOCKS 8
+#define VAES_BLOCKS 16
+
+#define KEY_256_ASSIST_1(t1, t2) do {				\
+	__m128i t4_;						\
+	t2 = _mm_shuffle_epi32(t2, 0xff);			\
+	t4_ = _mm_slli_si128(t1, 4);				\
+	t1 = _mm_xor_si128(t1, t4_);				\
+	t4_ = _mm_slli_si128(t4_, 4);				\
+	t1 = _mm_xor_si128(t1, t4_);				\
+	t4_ = _mm_slli_si128(t4_, 4);				\
+	t1 = _mm_xor_si128(t1, t4_);				\
+	t1 = _mm_xor_si128(t1, t2);				\
+    } while(0)
+
+#define KEY_256_ASSIST_2(t1, t3) do {				\
+	__m128i t2_, t4_;					\
+	t4_ = _mm_aeskeygenassist_si128(t1, 0x00);		\
+	t2_ = _mm_shuffle_epi32(t4_, 0xaa);			\
+	t4_ = _mm_slli_si128(t3, 4);				\
+	t3 = _mm_xor_si128(t3, t4_);				\
+	t4_ = _mm_slli_si128(t4_, 4);				\
+	t3 = _mm_xor_si128(t3, t4_);				\
+	t4_ = _mm_slli_si128(t4_, 4);				\
+	t3 = _mm_xor_si128(t3, t4_);				\
+	t3 = _mm_xor_si128(t3, t2_);				\
+    } while(0)
+
+#define KEY_256_ROUND(rk, i, rcon) do {				\
+	t2 = _mm_aeskeygenassist_si128(t3, rcon);		\
+	KEY_256_ASSIST_1(t1, t2);				\
+	rk[i] = t1;						\
+	if(i < 14){						\
+	    KEY_256_ASSIST_2(t1, t3);				\
+	    rk[i + 1] = t3;					\
+	}							\
+    } while(0)
+
+/* The 15 round keys of an AES-256 encryption key */
+static inline __attribute__((always_inline, target("aes,sse4.1")))
+void aesni_expand(const unsigned char* key, __m128i rk[15]){
+    __m128i t1, t2, t3;
+
+    t1 = _mm_loadu_si128((const __m128i*)key);
+    t3 = _mm_loadu_si128((const __m128i*)(key + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+    KEY_256_ROUND(rk, 2, 0x01);
+    KEY_256_ROUND(rk, 4, 0x02);
+    KEY_256_ROUND(rk, 6, 0x04);
+    KEY_256_ROUND(rk, 8, 0x08);
+    KEY_256_ROUND(rk, 10, 0x10);
+    KEY_256_ROUND(rk, 12, 0x20);
+    KEY_256_ROUND(rk, 14, 0x40);
+}
+
+/* Counter arithmetic on byte-reversed blocks, carrying into the high
+ * 64 bits */
+static inline __attribute__((always_inline, target("aes,sse4.1")))
+__m128i ctr_add(__m128i c, uint64_t n){
+    uint64_t lo = (uint64_t)_mm_cvtsi128_si64(c);
+    uint64_t hi = (uint64_t)_mm_extract_epi64(c, 1);
+
+    if(lo + n < lo)
+	hi++;
+    return _mm_set_epi64x((long long)hi, (long long)(lo + n));
+}
+
+static inline __attribute__((always_inline, target("aes,sse4.1")))
+int ctr_fast(__m128i c, uint64_t n){
+    return (uint64_t)_mm_cvtsi128_si64(c) <= UINT64_MAX - n;
+}
+
+/* The last blocks, and any short tail, one block at a time */
+static inline __attribute__((always_inline, target("aes,sse4.1")))
+void aesni_ctr_tail(const __m128i rk[15], __m128i c,
+			   const unsigned char* in, unsigned char* out,
+			   size_t len){
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				       8, 9, 10, 11, 12, 13, 14, 15);
+    unsigned char ks[AES_CRYPT_IVLEN];
+    __m128i b;
+    size_t i;
+    int r;
+
+    while(len > 0){
+	b = _mm_xor_si128(_mm_shuffle_epi8(c, bswap), rk[0]);
+	for(r = 1; r < 14; r++)
+	    b = _mm_aesenc_si128(b, rk[r]);
+	b = _mm_aesenclast_si128(b, rk[14]);
+	if(len < AES_CRYPT_IVLEN){
+	    _mm_storeu_si128((__m128i*)ks, b);
+	    for(i = 0; i < len; i++)
+		out[i] = in[i] ^ ks[i];
+	    break;
+	}
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i*)in));
+	_mm_storeu_si128((__m128i*)out, b);
+	c = ctr_add(c, 1);
+	in += AES_CRYPT_IVLEN;
+	out += AES_CRYPT_IVLEN;
+	len -= AES_CRYPT_IVLEN;
+    }
+}
+
+__attribute__((target("aes,sse4.1")))
+static void aesni_ctr(const unsigned char* key, const unsigned char* iv,
+		      const unsigned char* in, unsigned char* out, size_t len){
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				       8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i one = _mm_set_epi64x(0, 1);
+    __m128i rk[15];
+    __m128i b[ACCEL_BLOCKS];
+    __m128i c;
+    int i, r;
+
+    aesni_expand(key, rk);
+    c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)iv), bswap);
+    while(len >= ACCEL_BLOCKS * AES_CRYPT_IVLEN){
+	if(ctr_fast(c, ACCEL_BLOCKS)){
+	    for(i = 0; i < ACCEL_BLOCKS; i++){
+		b[i] = _mm_xor_si128(_mm_shuffle_epi8(c, bswap), rk[0]);
+		c = _mm_add_epi64(c, one);
+	    }
+	} else {
+	    for(i = 0; i < ACCEL_BLOCKS; i++){
+		b[i] = _mm_xor_si128(_mm_shuffle_epi8(c, bswap), rk[0]);
+		c = ctr_add(c, 1);
+	    }
+	}
+	for(r = 1; r < 14; r++)
+	    for(i = 0; i < ACCEL_BLOCKS; i++)
+		b[i] = _mm_aesenc_si128(b[i], rk[r]);
+	for(i = 0; i < ACCEL_BLOCKS; i++){
+	    b[i] = _mm_aesenclast_si128(b[i], rk[14]);
+	    b[i] = _mm_xor_si128(b[i],
+				 _mm_loadu_si128((const __m128i*)in + i));
+	    _mm_storeu_si128((__m128i*)out + i, b[i]);
+	}
+	in += ACCEL_BLOCKS * AES_CRYPT_IVLEN;
+	out += ACCEL_BLOCKS * AES_CRYPT_IVLEN;
+	len -= ACCEL_BLOCKS * AES_CRYPT_IVLEN;
+    }
+    aesni_ctr_tail(rk, c, in, out, len);
+}
+
+/* The same with VAES: each 256-bit register holds two counter blocks,
+ * so twice the blocks are in flight for the same instructions */
+__attribute__((target("vaes,avx2,aes,sse4.1")))
+static void vaes_ctr(const unsigned char* key, const unsigned char* iv,
+		     const unsigned char* in, unsigned char* out, size_t len){
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				       8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256i bswap2 = _mm256_broadcastsi128_si256(bswap);
+    const __m256i two = _mm256_set_epi64x(0, 2, 0, 2);
+    __m128i rk[15];
+    __m256i rk2[15];
+    __m256i b[VAES_BLOCKS / 2];
+    __m256i c2[VAES_BLOCKS / 2];
+    __m128i c;
+    int i, r;
+
+    aesni_expand(key, rk);
+    for(r = 0; r < 15; r++)
+	rk2[r] = _mm256_broadcastsi128_si256(rk[r]);
+    c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)iv), bswap);
+    while(len >= VAES_BLOCKS * AES_CRYPT_IVLEN){
+	if(ctr_fast(c, VAES_BLOCKS)){
+	    c2[0] = _mm256_set_m128i(_mm_add_epi64(c, _mm_set_epi64x(0, 1)), c);
+	    for(i = 1; i < VAES_BLOCKS / 2; i++)
+		c2[i] = _mm256_add_epi64(c2[i - 1], two);
+	} else {
+	    for(i = 0; i < VAES_BLOCKS / 2; i++)
+		c2[i] = _mm256_set_m128i(ctr_add(c, 2 * i + 1),
+					 ctr_add(c, 2 * i));
+	}
+	c = ctr_add(c, VAES_BLOCKS);
+	for(i = 0; i < VAES_BLOCKS / 2; i++)
+	    b[i] = _mm256_xor_si256(_mm256_shuffle_epi8(c2[i], bswap2),
+				    rk2[0]);
+	for(r = 1; r < 14; r++)
+	    for(i = 0; i < VAES_BLOCKS / 2; i++)
+		b[i] = _mm256_aesenc_epi128(b[i], rk2[r]);
+	for(i = 0; i < VAES_BLOCKS / 2; i++){
+	    b[i] = _mm256_aesenclast_epi128(b[i], rk2[14]);
+	    b[i] = _mm256_xor_si256(b[i],
+				    _mm256_loadu_si256((const __m256i*)in + i));
+	    _mm256_storeu_si256((__m256i*)out + i, b[i]);
+	}
+	in += VAES_BLOCKS * AES_CRYPT_IVLEN;
+	out += VAES_BLOCKS * AES_CRYPT_IVLEN;
+	len -= VAES_BLOCKS * AES_CRYPT_IVLEN;
+    }
+    aesni_ctr_tail(rk, c, in, out, len);
+}
+#endif /* AES_CTR_X86 */
+
+extern int aes_ctr_supported(int impl){
+    switch(impl){
+    case AES_CTR_OPENSSL:
+	return 1;
+#if AES_CTR_X86
+    case AES_CTR_AESNI:
+	return __builtin_cpu_supports("aes") &&
+	    __builtin_cpu_supports("sse4.1");
+    case AES_CTR_VAES:
+	return __builtin_cpu_supports("vaes") &&
+	    __builtin_cpu_supports("avx2") &&
+	    aes_ctr_supported(AES_CTR_AESNI);
+#endif
+    }
+    return 0;
+}
+
+extern int aes_ctr_best(void){
+    if(aes_ctr_supported(AES_CTR_VAES))
+	return AES_CTR_VAES;
+    if(aes_ctr_supported(AES_CTR_AESNI))
+	return AES_CTR_AESNI;
+    return AES_CTR_OPENSSL;
+}
+
+extern const char* aes_ctr_name(int impl){
+    switch(impl){
+    case AES_CTR_OPENSSL:
+	return "openssl";
+    case AES_CTR_AESNI:
+	return "aesni";
+    case AES_CTR_VAES:
+	return "vaes";
+    }
+    return "unknown";
+}
+
+extern int aes_ctr_crypt_impl(int impl, const unsigned char* key,
+			      const unsigned char* iv, const unsigned char* in,
+			      unsigned char* out, size_t len){
+    if(!aes_ctr_supported(impl))
+	return FAILURE;
+    switch(impl){
+#if AES_CTR_X86
+    case AES_CTR_AESNI:
+	aesni_ctr(key, iv, in, out, len);
+	return SUCCESS;
+    case AES_CTR_VAES:
+	vaes_ctr(key, iv, in, out, len);
+	return SUCCESS;
+#endif
+    }
+    return aes_ctr_crypt_evp(key, iv, in, out, len);
+}
+
+/* Short buffers, like headers and chunks, are dominated by EVP context
+ * and key setup, which the kernels skip; long ones go to libcrypto, whose
+ * own assembly streams wider on CPUs that have it */
+extern int aes_ctr_crypt(const unsigned char* key, const unsigned char* iv,
+			 const unsigned char* in, unsigned char* out, size_t len){
+    if(len >= AES_CTR_EVP_MIN)
+	return aes_ctr_crypt_evp(key, iv, in, out, len);
+    return aes_ctr_crypt_impl(aes_ctr_best(), key, iv, in, out, len);
+}
+
+/* HMAC built from plain digests so it works unchanged on OpenSSL 1.0
+ * through 3.x, where the HMAC_CTX API is deprecated */
+extern int hmac_sha256(const unsigned char* key, size_t keylen,
+		       const unsigned char* d1, size_t l1,
+		       const unsigned char* d2, size_t l2, unsigned char* mac){
+    unsigned char pad[64];
+    unsigned char inner[AES_CRYPT_MACLEN];
+    EVP_MD_CTX *md;
+    int ok;
+    size_t i;
+
+    if(keylen > sizeof(pad))
+	return FAILURE;
+    md = EVP_MD_CTX_create();
+    if(!md)
+	return FAILURE;
+
+    memset(pad, 0x36, sizeof(pad));
+    for(i = 0; i < keylen; i++)
+	pad[i] ^= key[i];
+    ok = EVP_DigestInit_ex(md, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(md, pad, sizeof(pad)) &&
+	(l1 == 0 || EVP_DigestUpdate(md, d1, l1)) &&
+	(l2 == 0 || EVP_DigestUpdate(md, d2, l2)) &&
+	EVP_DigestFinal_ex(md, inner, NULL);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for(i = 0; i < keylen; i++)
+	pad[i] ^= key[i];
+    ok = ok &&
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(md, pad, sizeof(pad)) &&
+	EVP_DigestUpdate(md, inner, sizeof(inner)) &&
+	EVP_DigestFinal_ex(md, mac, NULL);
+
+    EVP_MD_CTX_destroy(md);
+    return ok ? SUCCESS : FAILURE;
+}
+
+extern int derive_key(const char* key_str, const unsigned char* salt,
+		      size_t saltlen, unsigned iterations,
+		      unsigned char* out, size_t outlen){
+    if(!key_str)
+	return FAILURE;
+    if(!PKCS5_PBKDF2_HMAC(key_str, strlen(key_str), salt, saltlen,
+			  iterations, EVP_sha256(), outlen, out))
+	return FAILURE;
+    return SUCCESS;
+}
+
+extern int random_bytes(unsigned char* buf, size_t len){
+    return RAND_bytes(buf, len) == 1 ? SUCCESS : FAILURE;
+}
@@ -29,6 +29,10 @@
 #define FAILURE 0
 #define SUCCESS 1
 
+#define AES_CRYPT_KEYLEN 32
+#define AES_CRYPT_IVLEN 16
+#define AES_CRYPT_MACLEN 32
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
@@ -39,4 +43,80 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* AES-256-CTR implementations, all producing the same output */
+#define AES_CTR_OPENSSL 0	/* EVP_aes_256_ctr(), always available */
+#define AES_CTR_AESNI 1		/* 8 blocks interleaved, AES-NI */
+#define AES_CTR_VAES 2		/* 16 blocks in 8 registers, VAES and AVX2 */
+#define AES_CTR_EVP_MIN 8192	/* aes_ctr_crypt() leaves longer buffers to OpenSSL */
+
+/* int aes_ctr_crypt(const unsigned char* key, const unsigned char* iv,
+ *                   const unsigned char* in, unsigned char* out, size_t len)
+ * Purpose: AES-256-CTR encrypt or decrypt (the same operation) a buffer,
+ *          with the fastest implementation this CPU supports below
+ *          AES_CTR_EVP_MIN bytes and OpenSSL's from there on
+ * Args: const unsigned char* key : AES_CRYPT_KEYLEN byte key
+ *       const unsigned char* iv  : AES_CRYPT_IVLEN byte initial counter block
+ *       const unsigned char* in  : Input buffer
+ *       unsigned char* out       : Output buffer, may equal in
+ *       size_t len               : Bytes to transform
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_ctr_crypt(const unsigned char* key, const unsigned char* iv,
+			 const unsigned char* in, unsigned char* out, size_t len);
+
+/* int aes_ctr_crypt_impl(int impl, const unsigned char* key,
+ *                        const unsigned char* iv, const unsigned char* in,
+ *                        unsigned char* out, size_t len)
+ * int aes_ctr_crypt_evp(const unsigned char* key, const unsigned char* iv,
+ *                       const unsigned char* in, unsigned char* out, size_t len)
+ * Purpose: aes_ctr_crypt() with implementation impl (AES_CTR_*), or with
+ *          OpenSSL's, for comparing them
+ * Return: FAILURE on error or if this CPU lacks impl, SUCCESS on success
+ */
+extern int aes_ctr_crypt_impl(int impl, const unsigned char* key,
+			      const unsigned char* iv, const unsigned char* in,
+			      unsigned char* out, size_t len);
+extern int aes_ctr_crypt_evp(const unsigned char* key, const unsigned char* iv,
+			     const unsigned char* in, unsigned char* out,
+			     size_t len);
+
+/* int aes_ctr_supported(int impl)
+ * int aes_ctr_best(void)
+ * const char* aes_ctr_name(int impl)
+ * Purpose: Whether this CPU can run AES_CTR_* implementation impl, the
+ *          one aes_ctr_crypt() uses on short buffers (picked by CPUID),
+ *          and a name for it
+ */
+extern int aes_ctr_supported(int impl);
+extern int aes_ctr_best(void);
+extern const char* aes_ctr_name(int impl);
+
+/* int hmac_sha256(const unsigned char* key, size_t keylen,
+ *                 const unsigned char* d1, size_t l1,
+ *                 const unsigned char* d2, size_t l2, unsigned char* mac)
+ * Purpose: HMAC-SHA256 over the concatenation of two buffers
+ * Args: const unsigned char* key : MAC key (at most 64 bytes)
+ *       d1/l1, d2/l2             : Message parts, either may be empty
+ *       unsigned char* mac       : AES_CRYPT_MACLEN byte output
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int hmac_sha256(const unsigned char* key, size_t keylen,
+		       const unsigned char* d1, size_t l1,
+		       const unsigned char* d2, size_t l2, unsigned char* mac);
+
+/* int derive_key(const char* key_str, const unsigned char* salt, size_t saltlen,
+ *                unsigned iterations, unsigned char* out, size_t outlen)
+ * Purpose: PBKDF2-HMAC-SHA256 key derivation from a passphrase
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int derive_key(const char* key_str, const unsigned char* salt,
+		      size_t saltlen, unsigned iterations,
+		      unsigned char* out, size_t outlen);
+
+/* int random_bytes(unsigned char* buf, size_t len)
+ * Purpose: Fill buf from the OpenSSL CSPRNG
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int random_bytes(unsigned char* buf, size_t len);
+
 #endif
@@ -0,0 +1,132 @@
+/* encfs-archive.c
+ * Ciphertext archive stream of a pa5-encfs mirror
+ *
+ * See encfs-archive.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "encfs-archive.h"
+
+// Header field offsets
+#define ARC_TYPE 0
+#define ARC_MODE 4
+#define ARC_UID 8
+#define ARC_GID 12
+#define ARC_SIZE 16
+#define ARC_OFFSET 24
+#define ARC_MTIME_SEC 32
+#define ARC_MTIME_NSEC 40
+#define ARC_NAME_LEN 44
+#define ARC_XATTR_LEN 48
+// 52 to 64 are zero
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *p, unsigned n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+void encr_arc_encode(const struct encr_arc_entry *e, unsigned char *buf)
+{
+	memset(buf, 0, ENCR_ARC_HDR_SIZE);
+	put_le(buf + ARC_TYPE, e->type, 4);
+	put_le(buf + ARC_MODE, e->mode, 4);
+	put_le(buf + ARC_UID, e->uid, 4);
+	put_le(buf + ARC_GID, e->gid, 4);
+	put_le(buf + ARC_SIZE, e->size, 8);
+	put_le(buf + ARC_OFFSET, e->offset, 8);
+	put_le(buf + ARC_MTIME_SEC, (uint64_t) e->mtime_sec, 8);
+	put_le(buf + ARC_MTIME_NSEC, e->mtime_nsec, 4);
+	put_le(buf + ARC_NAME_LEN, e->name_len, 4);
+	put_le(buf + ARC_XATTR_LEN, e->xattr_len, 4);
+}
+
+int encr_arc_decode(const unsigned char *buf, struct encr_arc_entry *e)
+{
+	e->type = get_le(buf + ARC_TYPE, 4);
+	e->mode = get_le(buf + ARC_MODE, 4);
+	e->uid = get_le(buf + ARC_UID, 4);
+	e->gid = get_le(buf + ARC_GID, 4);
+	e->size = get_le(buf + ARC_SIZE, 8);
+	e->offset = get_le(buf + ARC_OFFSET, 8);
+	e->mtime_sec = (int64_t) get_le(buf + ARC_MTIME_SEC, 8);
+	e->mtime_nsec = get_le(buf + ARC_MTIME_NSEC, 4);
+	e->name_len = get_le(buf + ARC_NAME_LEN, 4);
+	e->xattr_len = get_le(buf + ARC_XATTR_LEN, 4);
+
+	if (e->type < ENCR_ARC_DIR || e->type > ENCR_ARC_END ||
+	    e->name_len >= PATH_MAX || e->xattr_len > ENCR_ARC_MAX_XATTRS ||
+	    e->mtime_nsec >= 1000000000)
+		return -EINVAL;
+	switch (e->type) {
+	case ENCR_ARC_DATA:
+		if (e->size > ENCR_ARC_SEGMENT || e->name_len != 0)
+			return -EINVAL;
+		break;
+	case ENCR_ARC_SYMLINK:
+	case ENCR_ARC_LINK:
+		if (e->size == 0 || e->size >= PATH_MAX)
+			return -EINVAL;
+		break;
+	case ENCR_ARC_FILE:
+	case ENCR_ARC_END:
+		break;
+	default:
+		if (e->size != 0)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+uint64_t encr_arc_body_len(const struct encr_arc_entry *e)
+{
+	switch (e->type) {
+	case ENCR_ARC_DATA:
+	case ENCR_ARC_SYMLINK:
+	case ENCR_ARC_LINK:
+		return e->size;
+	default:
+		return 0;
+	}
+}
+
+int encr_arc_name_ok(const char *name, size_t len)
+{
+	const char *p = name;
+	const char *end = name + len;
+	const char *slash;
+	size_t n;
+
+	if (len == 1 && name[0] == '.')
+		return 1;
+	if (len == 0 || memchr(name, '\0', len) != NULL)
+		return 0;
+	while (p <= end) {
+		slash = memchr(p, '/', end - p);
+		if (slash == NULL)
+			slash = end;
+		n = slash - p;
+		if (n == 0 || (n == 1 && p[0] == '.') ||
+		    (n == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		p = slash + 1;
+	}
+	return 1;
+}
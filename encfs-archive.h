@@ -0,0 +1,91 @@
+/* encfs-archive.h
+ * Ciphertext archive stream of a pa5-encfs mirror
+ *
+ * encfs-export writes a mirror, as it is on disk, to one sequential
+ * stream and encfs-import writes it back out; neither needs the key,
+ * since file data, headers, xattrs and the .encfs directory are copied
+ * as stored, still encrypted. The stream is ENCR_ARC_MAGIC, then
+ * entries, then an ENCR_ARC_END entry. Each entry is a header of
+ * ENCR_ARC_HDR_SIZE bytes, then:
+ *
+ *   name    name_len bytes, the path from the mirror's root with no
+ *           leading '/' ("." for the root itself), not terminated
+ *   body    size bytes: the target of a SYMLINK or LINK, the data of
+ *           a DATA entry, nothing for the rest
+ *   xattrs  xattr_len bytes, per xattr: name length (u32), value
+ *           length (u32), the name, the value
+ *
+ * A FILE entry gives the file's size, which it is created at; the DATA
+ * entries that follow it, up to the next other entry, hold the data at
+ * offset, at most ENCR_ARC_SEGMENT bytes each. Holes have no DATA.
+ * Directories come before what is in them, and the first of several
+ * hard links to a file before the LINK entries naming it. All numbers
+ * are little-endian.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_ARCHIVE_H
+#define ENCFS_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENCR_ARC_MAGIC "ENCRARC1"
+#define ENCR_ARC_MAGIC_SIZE 8
+#define ENCR_ARC_HDR_SIZE 64
+#define ENCR_ARC_SEGMENT (1024 * 1024)	// most data in one DATA entry
+#define ENCR_ARC_MAX_XATTRS (1024 * 1024)	// most xattr bytes per entry
+
+enum encr_arc_type {
+	ENCR_ARC_DIR = 1,
+	ENCR_ARC_FILE,		// size = the file's size
+	ENCR_ARC_DATA,		// size bytes at offset of the last FILE
+	ENCR_ARC_SYMLINK,	// size = length of the target
+	ENCR_ARC_LINK,		// size = length of the path linked to
+	ENCR_ARC_NODE,		// fifo or device, offset = rdev
+	ENCR_ARC_END,		// offset = entries before it, size = DATA bytes
+};
+
+struct encr_arc_entry {
+	uint32_t type;		// ENCR_ARC_*
+	uint32_t mode;		// st_mode
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t offset;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t name_len;
+	uint32_t xattr_len;
+};
+
+/* void encr_arc_encode(const struct encr_arc_entry *e, unsigned char *buf)
+ * Purpose: Write the header of e to buf, ENCR_ARC_HDR_SIZE bytes
+ */
+extern void encr_arc_encode(const struct encr_arc_entry *e,
+			    unsigned char *buf);
+
+/* int encr_arc_decode(const unsigned char *buf, struct encr_arc_entry *e)
+ * Purpose: Read an entry header from buf, ENCR_ARC_HDR_SIZE bytes
+ * Return: 0 on success, -EINVAL if it is not a header this version
+ *         writes (an unknown type, or lengths out of range)
+ */
+extern int encr_arc_decode(const unsigned char *buf,
+			   struct encr_arc_entry *e);
+
+/* uint64_t encr_arc_body_len(const struct encr_arc_entry *e)
+ * Return: Bytes of body that follow e's name
+ */
+extern uint64_t encr_arc_body_len(const struct encr_arc_entry *e);
+
+/* int encr_arc_name_ok(const char *name, size_t len)
+ * Purpose: Check that an entry's name stays inside the directory it is
+ *          restored to: "." or relative, with no empty, "." or ".."
+ *          parts and no NUL
+ * Return: 1 if it does, 0 if not
+ */
+extern int encr_arc_name_ok(const char *name, size_t len);
+
+#endif
@@ -0,0 +1,647 @@
+/* encfs-bench.c
+ * In-process workload driver for the pa5-encfs callbacks
+ *
+ * See encfs-ops.h for details
+ *
+ * Runs the filesystem callbacks of encfs-ops.c directly on a mirror
+ * directory, with no mount, no kernel and no /dev/fuse in the way, so
+ * they can be profiled under perf or checked under valgrind and the
+ * sanitizers on any machine. Threads share the files of one directory,
+ * ENCR_BENCH_DIR in the mirror, file i going to thread i % threads, and
+ * go through the phases given with -m in order:
+ *
+ *   create   create each file and write it in block-sized writes
+ *   stat     getattr each file
+ *   read     open each file, read it back in blocks and check it
+ *   randrw   open each file and do size / block random block reads and
+ *            writes, half of each
+ *   readdir  list the directory ENCR_BENCH_LISTS times per thread and
+ *            check each file comes with its plaintext size, as far as
+ *            the attribute cache has room for (see encfs-cache.h)
+ *   ls       list the directory once per thread and getattr each file
+ *            in the order listed, as ls -l does, starting from an empty
+ *            attribute cache; at least as many lookups as one listing
+ *            has room to fill in must come from the cache, which the
+ *            phase reports
+ *   unlink   remove each file
+ *
+ * For each phase it prints the calls made, ops/s, MB/s of file data and
+ * the mean and 99th percentile latency of one op: one file for create,
+ * read and unlink, one call for stat and ls, one block for randrw, one
+ * listing for readdir. Any callback error, or data read back wrong, fails the
+ * run.
+ *
+ * Usage: encfs-bench [-t threads] [-n files] [-s size] [-b block]
+ *                    [-m phase,...] [-o opt,...] [-B]
+ *                    <Key Phrase> <Mirror Directory>
+ *
+ * -o takes the storage options of pa5-encfs: chunk_size=N, chunk_auto,
+ * compress, dedup, log, direct_backing, pack, pack_max=N, track_changes,
+ * roots=DIR[:DIR...], cache_dir=DIR, cache_size=N, cache_writeback,
+ * io_sched, io_slots=N, io_weights=..., io_user_rate=N,
+ * io_readahead_rate=N, io_background_rate=N, attr_cache_size=N and
+ * xattr_cache_size=N; with no mount, every thread is the same user to
+ * the scheduler. -B starts the background threads (log cleaner, packer,
+ * cache flusher) as a mount would. The mirror may be one pa5-encfs has
+ * used before, with the same key phrase.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#include "params.h"
+
+#define FUSE_USE_VERSION 28
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "encfs-ops.h"
+#include "encfs-io.h"
+#include "encfs-cache.h"
+
+#define ENCR_BENCH_DIR "/encfs-bench"
+#define ENCR_BENCH_LISTS 10
+#define MAXTHREADS 256
+
+enum bench_phase {
+	PHASE_CREATE,
+	PHASE_STAT,
+	PHASE_READ,
+	PHASE_RANDRW,
+	PHASE_READDIR,
+	PHASE_LS,
+	PHASE_UNLINK,
+	PHASES
+};
+
+static const char *phase_names[PHASES] = {
+	"create", "stat", "read", "randrw", "readdir", "ls", "unlink"
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int id;
+	int phase;
+	unsigned seed;
+	char *buf;
+	double *lat;		// one per op
+	unsigned long ops;
+	unsigned long long bytes;
+	int error;		// -errno of the first failure
+	char where[PATH_MAX];	// the call that failed
+};
+
+static int nthreads = 1;
+static unsigned nfiles = 1000;
+static size_t filesize = 64 * 1024;
+static size_t blocksize = 4096;
+static char *pattern;		// block 0 of every file; block n is it rotated
+static struct encr_acache *acache;
+static pthread_barrier_t listed;	// ls: between the listings and lookups
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_path(char *path, unsigned i)
+{
+	snprintf(path, PATH_MAX, "%s/f%06u", ENCR_BENCH_DIR, i);
+}
+
+/* Block off of a file holds the pattern starting at off % blocksize, so
+ * a block read from the wrong place does not match */
+static void bench_fill(char *buf, off_t off, size_t len)
+{
+	size_t rot = (size_t) (off / blocksize) % blocksize;
+	size_t n = blocksize - rot < len ? blocksize - rot : len;
+
+	memcpy(buf, pattern + rot, n);
+	memcpy(buf + n, pattern, len - n);
+}
+
+static int bench_fail(struct bench_thread *t, const char *call,
+		      const char *path, int res)
+{
+	t->error = res;
+	snprintf(t->where, sizeof(t->where), "%s %s", call, path);
+	return res;
+}
+
+static int bench_write(struct bench_thread *t, const char *path)
+{
+	struct fuse_file_info fi;
+	off_t off;
+	size_t len;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	res = encr_oper.create(path, 0644, &fi);
+	if (res != 0)
+		return bench_fail(t, "create", path, res);
+	for (off = 0; off < (off_t) filesize; off += len) {
+		len = filesize - off < blocksize ? filesize - off : blocksize;
+		bench_fill(t->buf, off, len);
+		res = encr_oper.write(path, t->buf, len, off, &fi);
+		if (res != (int) len) {
+			encr_oper.release(path, &fi);
+			return bench_fail(t, "write", path, res < 0 ? res : -EIO);
+		}
+		t->bytes += len;
+	}
+	res = encr_oper.release(path, &fi);
+	return res != 0 ? bench_fail(t, "release", path, res) : 0;
+}
+
+static int bench_read(struct bench_thread *t, const char *path)
+{
+	struct fuse_file_info fi;
+	char *want = t->buf + blocksize;
+	off_t off;
+	size_t len;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	res = encr_oper.open(path, &fi);
+	if (res != 0)
+		return bench_fail(t, "open", path, res);
+	for (off = 0; off < (off_t) filesize; off += len) {
+		len = filesize - off < blocksize ? filesize - off : blocksize;
+		res = encr_oper.read(path, t->buf, blocksize, off, &fi);
+		bench_fill(want, off, len);
+		if (res != (int) len || memcmp(t->buf, want, len) != 0) {
+			encr_oper.release(path, &fi);
+			return bench_fail(t, "read", path, res < 0 ? res : -EIO);
+		}
+		t->bytes += len;
+	}
+	res = encr_oper.release(path, &fi);
+	return res != 0 ? bench_fail(t, "release", path, res) : 0;
+}
+
+/* Whole blocks only, so the file keeps its contents for a later read */
+static int bench_randrw(struct bench_thread *t, const char *path)
+{
+	struct fuse_file_info fi;
+	size_t blocks = filesize / blocksize;
+	size_t n;
+	off_t off;
+	double start;
+	int res;
+
+	if (blocks == 0)
+		return 0;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	res = encr_oper.open(path, &fi);
+	if (res != 0)
+		return bench_fail(t, "open", path, res);
+	for (n = 0; n < blocks; n++) {
+		off = (off_t) (rand_r(&t->seed) % blocks) * blocksize;
+		start = now();
+		if (rand_r(&t->seed) & 1) {
+			bench_fill(t->buf, off, blocksize);
+			res = encr_oper.write(path, t->buf, blocksize, off, &fi);
+		} else {
+			res = encr_oper.read(path, t->buf, blocksize, off, &fi);
+		}
+		t->lat[t->ops++] = now() - start;
+		if (res != (int) blocksize) {
+			encr_oper.release(path, &fi);
+			return bench_fail(t, "randrw", path, res < 0 ? res : -EIO);
+		}
+		t->bytes += blocksize;
+	}
+	res = encr_oper.release(path, &fi);
+	return res != 0 ? bench_fail(t, "release", path, res) : 0;
+}
+
+struct bench_listing {
+	unsigned long entries;
+	unsigned long sized;	// files listed with their plaintext size
+	unsigned long wrong;	// or with another
+	unsigned *order;	// ls: the files' numbers as listed
+	unsigned long nfiles;
+};
+
+/* An entry with only its type has no link count */
+static int bench_count(void *buf, const char *name, const struct stat *st,
+		       off_t off)
+{
+	struct bench_listing *l = buf;
+	unsigned i;
+
+	(void) off;
+	l->entries++;
+	if (st != NULL && S_ISREG(st->st_mode) && st->st_nlink != 0) {
+		if (st->st_size == (off_t) filesize)
+			l->sized++;
+		else
+			l->wrong++;
+	}
+	if (l->order != NULL && l->nfiles < nfiles &&
+	    sscanf(name, "f%06u", &i) == 1)
+		l->order[l->nfiles++] = i;
+	return 0;
+}
+
+/* Files one listing comes with the attributes of, at least */
+static unsigned long bench_room(void)
+{
+	struct encr_alisting l;
+
+	encr_acache_listing(acache, &l);
+	return l.room < nfiles ? l.room : nfiles;
+}
+
+static int bench_list(struct bench_thread *t, struct bench_listing *l)
+{
+	struct fuse_file_info fi;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	res = encr_oper.opendir(ENCR_BENCH_DIR, &fi);
+	if (res != 0)
+		return bench_fail(t, "opendir", ENCR_BENCH_DIR, res);
+	res = encr_oper.readdir(ENCR_BENCH_DIR, l, bench_count, 0, &fi);
+	encr_oper.releasedir(ENCR_BENCH_DIR, &fi);
+	if (res != 0)
+		return bench_fail(t, "readdir", ENCR_BENCH_DIR, res);
+	// . and .. as well
+	if (l->entries < nfiles + 2)
+		return bench_fail(t, "readdir", ENCR_BENCH_DIR, -ENOENT);
+	// Files with their attributes, so ls -l needs no more
+	if (l->sized < bench_room() || l->wrong != 0)
+		return bench_fail(t, "readdir", ENCR_BENCH_DIR, -EIO);
+	return 0;
+}
+
+/* Waits at listed twice whatever happens, for bench_run to count the
+ * cache's hits in between */
+static int bench_ls(struct bench_thread *t)
+{
+	struct bench_listing l;
+	char path[PATH_MAX];
+	struct stat st;
+	double start;
+	unsigned long i;
+	int res;
+
+	memset(&l, 0, sizeof(l));
+	l.order = malloc(sizeof(unsigned) * (nfiles + 1));
+	res = l.order == NULL ? bench_fail(t, "malloc", "", -ENOMEM) :
+		bench_list(t, &l);
+	pthread_barrier_wait(&listed);
+	pthread_barrier_wait(&listed);
+	for (i = 0; i < l.nfiles && res == 0; i++) {
+		bench_path(path, l.order[i]);
+		start = now();
+		res = encr_oper.getattr(path, &st);
+		t->lat[t->ops++] = now() - start;
+		if (res == 0 && st.st_size != (off_t) filesize)
+			res = -EIO;
+		if (res != 0)
+			bench_fail(t, "getattr", path, res);
+	}
+	free(l.order);
+	return res;
+}
+
+static void *bench_worker(void *data)
+{
+	struct bench_thread *t = data;
+	char path[PATH_MAX];
+	struct stat st;
+	double start;
+	unsigned i;
+	int res = 0;
+
+	if (t->phase == PHASE_READDIR) {
+		struct bench_listing l;
+
+		for (i = 0; i < ENCR_BENCH_LISTS && res == 0; i++) {
+			memset(&l, 0, sizeof(l));
+			start = now();
+			res = bench_list(t, &l);
+			t->lat[t->ops++] = now() - start;
+		}
+		return NULL;
+	}
+	if (t->phase == PHASE_LS) {
+		bench_ls(t);
+		return NULL;
+	}
+	for (i = t->id; i < nfiles && res == 0; i += nthreads) {
+		bench_path(path, i);
+		if (t->phase == PHASE_RANDRW) {
+			res = bench_randrw(t, path);
+			continue;
+		}
+		start = now();
+		switch (t->phase) {
+		case PHASE_CREATE:
+			res = bench_write(t, path);
+			break;
+		case PHASE_STAT:
+			res = encr_oper.getattr(path, &st);
+			if (res == 0 && st.st_size != (off_t) filesize)
+				res = -EIO;
+			if (res != 0)
+				bench_fail(t, "getattr", path, res);
+			break;
+		case PHASE_READ:
+			res = bench_read(t, path);
+			break;
+		case PHASE_UNLINK:
+			res = encr_oper.unlink(path);
+			if (res != 0)
+				bench_fail(t, "unlink", path, res);
+			break;
+		}
+		t->lat[t->ops++] = now() - start;
+	}
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_run(int phase)
+{
+	struct bench_thread threads[MAXTHREADS];
+	unsigned long per = nfiles / nthreads + 1;
+	unsigned long ops = 0;
+	unsigned long long bytes = 0;
+	unsigned long hits = 0, misses = 0;
+	unsigned long hits_after, misses_after;
+	double *lat;
+	double elapsed;
+	double sum = 0;
+	unsigned long n;
+	int bad = 0;
+	int i;
+
+	if (phase == PHASE_RANDRW)
+		per *= filesize / blocksize;
+	else if (phase == PHASE_READDIR)
+		per = ENCR_BENCH_LISTS;
+	else if (phase == PHASE_LS)
+		per = nfiles + 1;
+	lat = malloc(sizeof(double) * (per * nthreads + 1));
+	if (lat == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(threads, 0, sizeof(threads));
+	if (phase == PHASE_LS) {
+		encr_acache_inval_all(acache);
+		pthread_barrier_init(&listed, NULL, nthreads + 1);
+	}
+	elapsed = now();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		threads[i].phase = phase;
+		threads[i].seed = i + 1;
+		threads[i].lat = lat + per * i;
+		threads[i].buf = malloc(2 * blocksize);
+		if (threads[i].buf == NULL ||
+		    pthread_create(&threads[i].tid, NULL, bench_worker,
+				   &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (phase == PHASE_LS) {
+		pthread_barrier_wait(&listed);
+		encr_acache_stats(acache, &hits, &misses);
+		pthread_barrier_wait(&listed);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		free(threads[i].buf);
+		if (threads[i].error) {
+			fprintf(stderr, "%s: %s: %s\n", phase_names[phase],
+				threads[i].where, strerror(-threads[i].error));
+			bad = 1;
+		}
+		// Close up the gaps so the latencies can be sorted together
+		memmove(lat + ops, threads[i].lat,
+			sizeof(double) * threads[i].ops);
+		ops += threads[i].ops;
+		bytes += threads[i].bytes;
+	}
+	elapsed = now() - elapsed;
+
+	for (n = 0; n < ops; n++)
+		sum += lat[n];
+	qsort(lat, ops, sizeof(double), bench_cmp);
+	printf("%-8s %10lu %12.0f %10.2f %10.1f %10.1f\n", phase_names[phase],
+	       ops, ops / elapsed, bytes / elapsed / 1e6,
+	       ops ? sum / ops * 1e6 : 0.0,
+	       ops ? lat[ops * 99 / 100] * 1e6 : 0.0);
+	free(lat);
+	if (phase == PHASE_LS) {
+		pthread_barrier_destroy(&listed);
+		encr_acache_stats(acache, &hits_after, &misses_after);
+		hits = hits_after - hits;
+		misses = misses_after - misses;
+		printf("%-8s %lu of %lu lookups from the attribute cache\n",
+		       "", hits, hits + misses);
+		if (!bad && hits < bench_room()) {
+			fprintf(stderr, "%s: %lu lookups from the attribute "
+				"cache, not %lu\n", phase_names[phase], hits,
+				bench_room());
+			bad = 1;
+		}
+	}
+	return bad ? -1 : 0;
+}
+
+/* -o: the storage options; everything else is a mount option */
+static int bench_opts(struct encr_state *s, char *opts)
+{
+	char *save;
+	char *o;
+
+	for (o = strtok_r(opts, ",", &save); o != NULL;
+	     o = strtok_r(NULL, ",", &save)) {
+		if (sscanf(o, "chunk_size=%u", &s->chunk_size) == 1 ||
+		    sscanf(o, "pack_max=%u", &s->pack_max) == 1 ||
+		    sscanf(o, "attr_cache_size=%u", &s->attr_cache_size) == 1 ||
+		    sscanf(o, "xattr_cache_size=%u", &s->xattr_cache_size) == 1 ||
+		    sscanf(o, "cache_size=%u", &s->cache_size) == 1 ||
+		    sscanf(o, "io_slots=%u", &s->io_slots) == 1 ||
+		    sscanf(o, "io_user_rate=%u", &s->io_user_rate) == 1 ||
+		    sscanf(o, "io_readahead_rate=%u",
+			   &s->io_readahead_rate) == 1 ||
+		    sscanf(o, "io_background_rate=%u",
+			   &s->io_background_rate) == 1)
+			continue;
+		if (!strcmp(o, "compress"))
+			s->compress = 1;
+		else if (!strcmp(o, "dedup"))
+			s->dedup = 1;
+		else if (!strcmp(o, "log"))
+			s->log = 1;
+		else if (!strcmp(o, "direct_backing"))
+			s->direct_backing = 1;
+		else if (!strcmp(o, "pack"))
+			s->pack = 1;
+		else if (!strcmp(o, "chunk_auto"))
+			s->chunk_auto = 1;
+		else if (!strcmp(o, "track_changes"))
+			s->track_changes = 1;
+		else if (!strncmp(o, "roots=", 6))
+			s->roots = o + 6;
+		else if (!strncmp(o, "cache_dir=", 10))
+			s->cache_dir = o + 10;
+		else if (!strcmp(o, "cache_writeback"))
+			s->cache_writeback = 1;
+		else if (!strcmp(o, "io_sched"))
+			s->io_sched = 1;
+		else if (!strncmp(o, "io_weights=", 11))
+			s->io_weights = o + 11;
+		else
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static int bench_phases(char *list, int *run)
+{
+	char *save;
+	char *p;
+	int i;
+
+	for (p = strtok_r(list, ",", &save); p != NULL;
+	     p = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < PHASES && strcmp(p, phase_names[i]); i++)
+			;
+		if (i == PHASES)
+			return -EINVAL;
+		run[i] = 1;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s %s\n", prog,
+		"[-t threads] [-n files] [-s size] [-b block] [-m phase,...] "
+		"[-o opt,...] [-B] <Key Phrase> <Mirror Directory>");
+	fprintf(stderr, "phases: create,stat,read,randrw,readdir,ls,unlink "
+		"(default all)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct encr_state state;
+	int run[PHASES];
+	int background = 0;
+	int bad = 0;
+	size_t i;
+	int opt;
+	int res;
+
+	encr_ops_defaults(&state);
+	for (i = 0; i < PHASES; i++)
+		run[i] = 1;
+	while ((opt = getopt(argc, argv, "t:n:s:b:m:o:B")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage(argv[0]);
+			break;
+		case 'n':
+			nfiles = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			filesize = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			blocksize = strtoul(optarg, NULL, 0);
+			if (blocksize == 0 || blocksize > ENCR_MAX_REQUEST)
+				usage(argv[0]);
+			break;
+		case 'm':
+			memset(run, 0, sizeof(run));
+			if (bench_phases(optarg, run) != 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			if (bench_opts(&state, optarg) != 0)
+				usage(argv[0]);
+			break;
+		case 'B':
+			background = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2 || encr_ops_check(&state) != 0)
+		usage(argv[0]);
+	state.key_phrase = argv[optind];
+	state.rootdir = realpath(argv[optind + 1], NULL);
+	if (state.rootdir == NULL) {
+		perror(argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+
+	pattern = malloc(blocksize);
+	if (pattern == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	srand(getpid());
+	for (i = 0; i < blocksize; i++)
+		pattern[i] = rand();
+
+	encr_ops_bind(&state);
+	if (encr_ops_open(&state) != 0)
+		return EXIT_FAILURE;
+	acache = state.acache;
+	if (background)
+		encr_ops_start(&state);
+	res = encr_oper.mkdir(ENCR_BENCH_DIR, 0755);
+	if (res != 0 && res != -EEXIST) {
+		fprintf(stderr, "mkdir %s: %s\n", ENCR_BENCH_DIR, strerror(-res));
+		encr_ops_close(&state);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %10s %12s %10s %10s %10s\n", "phase", "ops", "ops/s",
+	       "MB/s", "avg us", "p99 us");
+	for (i = 0; i < PHASES && !bad; i++)
+		if (run[i] && bench_run(i) != 0)
+			bad = 1;
+	if (run[PHASE_UNLINK] && !bad)
+		encr_oper.rmdir(ENCR_BENCH_DIR);
+
+	encr_ops_close(&state);
+	free(state.rootdir);
+	free(pattern);
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,685 @@
+/* encfs-cache.c
+ * In-process metadata caches for pa5-encfs
+ *
+ * See encfs-cache.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/xattr.h>
+
+#include "encfs-cache.h"
+
+/* Largest name list and value the kernel will hand out (linux/limits.h) */
+#define ENCR_XATTR_LIST_MAX 65536
+#define ENCR_XATTR_SIZE_MAX 65536
+
+struct encr_aentry {
+	struct encr_aentry *next;	// hash chain
+	struct encr_aentry *lru_prev;
+	struct encr_aentry *lru_next;
+	int err;
+	double expires;
+	struct stat st;
+	char path[];
+};
+
+struct encr_xattr {
+	struct encr_xattr *next;
+	size_t len;
+	char *value;
+	char name[];
+};
+
+struct encr_xentry {
+	struct encr_xentry *next;	// hash chain
+	struct encr_xentry *lru_prev;
+	struct encr_xentry *lru_next;
+	dev_t dev;
+	ino_t ino;
+	double expires;
+	size_t bytes;			// charged against max_bytes
+	struct encr_xattr *attrs;	// in llistxattr() order
+};
+
+static double encr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a over the first len bytes of path
+static size_t encr_phash(const char *path, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) path[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (size_t) h;
+}
+
+struct encr_acache *encr_acache_new(double attr_timeout,
+				    double negative_timeout,
+				    size_t max_entries)
+{
+	struct encr_acache *c = calloc(1, sizeof(struct encr_acache));
+
+	if (c == NULL)
+		return NULL;
+	c->attr_timeout = attr_timeout;
+	c->negative_timeout = negative_timeout;
+	c->max_entries = max_entries;
+	c->nbuckets = 1;
+	while (c->nbuckets < max_entries)
+		c->nbuckets <<= 1;
+	c->buckets = calloc(c->nbuckets, sizeof(struct encr_aentry *));
+	c->stamps = calloc(c->nbuckets, sizeof(unsigned long));
+	if (c->buckets == NULL || c->stamps == NULL) {
+		free(c->buckets);
+		free(c->stamps);
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+static void encr_lru_unlink(struct encr_acache *c, struct encr_aentry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void encr_lru_push(struct encr_acache *c, struct encr_aentry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = e;
+	else
+		c->lru_tail = e;
+	c->lru_head = e;
+}
+
+static size_t encr_abucket(struct encr_acache *c, const char *path,
+			   size_t len)
+{
+	return encr_phash(path, len) & (c->nbuckets - 1);
+}
+
+static struct encr_aentry **encr_afind(struct encr_acache *c,
+				       const char *path, size_t len)
+{
+	struct encr_aentry **pp;
+
+	pp = &c->buckets[encr_abucket(c, path, len)];
+	for (; *pp != NULL; pp = &(*pp)->next)
+		if (strlen((*pp)->path) == len && !memcmp((*pp)->path, path, len))
+			break;
+	return pp;
+}
+
+static void encr_aremove(struct encr_acache *c, struct encr_aentry **pp)
+{
+	struct encr_aentry *e = *pp;
+
+	*pp = e->next;
+	encr_lru_unlink(c, e);
+	c->nentries--;
+	free(e);
+}
+
+void encr_acache_free(struct encr_acache *c)
+{
+	if (c == NULL)
+		return;
+	encr_acache_inval_all(c);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c->stamps);
+	free(c);
+}
+
+int encr_acache_get(struct encr_acache *c, const char *path, struct stat *st)
+{
+	struct encr_aentry **pp;
+	struct encr_aentry *e;
+	int res = 0;
+
+	pthread_mutex_lock(&c->lock);
+	pp = encr_afind(c, path, strlen(path));
+	e = *pp;
+	if (e != NULL) {
+		if (e->expires < encr_now()) {
+			encr_aremove(c, pp);
+		} else {
+			if (e->err) {
+				res = e->err;
+			} else {
+				*st = e->st;
+				res = 1;
+			}
+			encr_lru_unlink(c, e);
+			encr_lru_push(c, e);
+		}
+	}
+	if (res != 0)
+		c->hits++;
+	else
+		c->misses++;
+	pthread_mutex_unlock(&c->lock);
+
+	return res;
+}
+
+unsigned long encr_acache_generation(struct encr_acache *c)
+{
+	return __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE);
+}
+
+void encr_acache_listing(struct encr_acache *c, struct encr_alisting *l)
+{
+	l->gen = encr_acache_generation(c);
+	l->room = c->attr_timeout > 0 ?
+		c->max_entries / ENCR_ACACHE_LISTING : 0;
+	l->until = encr_now() + c->attr_timeout / 2;
+}
+
+int encr_acache_prefill(struct encr_alisting *l)
+{
+	if (l->room == 0)
+		return 0;
+	if (encr_now() > l->until) {
+		l->room = 0;
+		return 0;
+	}
+	l->room--;
+	return 1;
+}
+
+void encr_acache_stats(struct encr_acache *c, unsigned long *hits,
+		       unsigned long *misses)
+{
+	pthread_mutex_lock(&c->lock);
+	*hits = c->hits;
+	*misses = c->misses;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Remove path's entry and note when its bucket was last invalidated;
+// with c->lock held
+static void encr_ainval(struct encr_acache *c, const char *path, size_t len)
+{
+	struct encr_aentry **pp = encr_afind(c, path, len);
+
+	if (*pp != NULL)
+		encr_aremove(c, pp);
+	c->stamps[encr_abucket(c, path, len)] = c->generation;
+}
+
+void encr_acache_put(struct encr_acache *c, const char *path,
+		     const struct stat *st, int err, unsigned long gen)
+{
+	struct encr_aentry **pp;
+	struct encr_aentry *e;
+	double ttl = err ? c->negative_timeout : c->attr_timeout;
+	size_t len = strlen(path);
+
+	if (ttl <= 0 || c->max_entries == 0 || (err && err != -ENOENT))
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	// Only an invalidation of this bucket (or of everything) since gen
+	// could make the result stale
+	if (c->stamps[encr_abucket(c, path, len)] > gen || c->flushed > gen) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	pp = encr_afind(c, path, len);
+	if (*pp != NULL)
+		encr_aremove(c, pp);
+	e = malloc(sizeof(struct encr_aentry) + len + 1);
+	if (e == NULL) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	memcpy(e->path, path, len + 1);
+	e->err = err;
+	if (!err)
+		e->st = *st;
+	e->expires = encr_now() + ttl;
+	// An entry just removed from pp leaves the rest of the chain there
+	e->next = *pp;
+	*pp = e;
+	encr_lru_push(c, e);
+	c->nentries++;
+	while (c->nentries > c->max_entries)
+		encr_aremove(c, encr_afind(c, c->lru_tail->path,
+					   strlen(c->lru_tail->path)));
+	pthread_mutex_unlock(&c->lock);
+}
+
+void encr_acache_inval(struct encr_acache *c, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t plen;
+
+	pthread_mutex_lock(&c->lock);
+	__atomic_store_n(&c->generation, c->generation + 1, __ATOMIC_RELEASE);
+	encr_ainval(c, path, strlen(path));
+	// The parent's mtime and link count change along with the entry
+	if (slash != NULL) {
+		plen = slash == path ? 1 : (size_t) (slash - path);
+		encr_ainval(c, path, plen);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void encr_acache_inval_attr(struct encr_acache *c, const char *path)
+{
+	pthread_mutex_lock(&c->lock);
+	__atomic_store_n(&c->generation, c->generation + 1, __ATOMIC_RELEASE);
+	encr_ainval(c, path, strlen(path));
+	pthread_mutex_unlock(&c->lock);
+}
+
+void encr_acache_inval_all(struct encr_acache *c)
+{
+	size_t b;
+
+	pthread_mutex_lock(&c->lock);
+	__atomic_store_n(&c->generation, c->generation + 1, __ATOMIC_RELEASE);
+	c->flushed = c->generation;
+	for (b = 0; b < c->nbuckets; b++)
+		while (c->buckets[b] != NULL)
+			encr_aremove(c, &c->buckets[b]);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static struct encr_xattr *encr_xattr_new(const char *name, const char *value,
+					 size_t len)
+{
+	size_t nlen = strlen(name) + 1;
+	struct encr_xattr *a = malloc(sizeof(struct encr_xattr) + nlen + len);
+
+	if (a == NULL)
+		return NULL;
+	a->next = NULL;
+	a->len = len;
+	memcpy(a->name, name, nlen);
+	a->value = a->name + nlen;
+	memcpy(a->value, value, len);
+	return a;
+}
+
+static size_t encr_xattr_bytes(const struct encr_xattr *a)
+{
+	return sizeof(struct encr_xattr) + strlen(a->name) + 1 + a->len;
+}
+
+static void encr_xentry_free(struct encr_xentry *e)
+{
+	struct encr_xattr *a;
+
+	while ((a = e->attrs) != NULL) {
+		e->attrs = a->next;
+		free(a);
+	}
+	free(e);
+}
+
+struct encr_xcache *encr_xcache_new(double timeout, size_t max_bytes)
+{
+	struct encr_xcache *c = calloc(1, sizeof(struct encr_xcache));
+
+	if (c == NULL)
+		return NULL;
+	c->timeout = timeout;
+	c->max_bytes = max_bytes;
+	c->nbuckets = 1024;
+	c->buckets = calloc(c->nbuckets, sizeof(struct encr_xentry *));
+	if (c->buckets == NULL) {
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+static void encr_xlru_unlink(struct encr_xcache *c, struct encr_xentry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void encr_xlru_push(struct encr_xcache *c, struct encr_xentry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = e;
+	else
+		c->lru_tail = e;
+	c->lru_head = e;
+}
+
+static struct encr_xentry **encr_xfind(struct encr_xcache *c,
+				       dev_t dev, ino_t ino)
+{
+	struct encr_xentry **pp;
+	uint64_t h = (((uint64_t) dev << 32) ^ (uint64_t) ino) *
+		0x9e3779b97f4a7c15ULL;
+
+	pp = &c->buckets[(h >> 32) & (c->nbuckets - 1)];
+	for (; *pp != NULL; pp = &(*pp)->next)
+		if ((*pp)->dev == dev && (*pp)->ino == ino)
+			break;
+	return pp;
+}
+
+static void encr_xremove(struct encr_xcache *c, struct encr_xentry **pp)
+{
+	struct encr_xentry *e = *pp;
+
+	*pp = e->next;
+	encr_xlru_unlink(c, e);
+	c->nbytes -= e->bytes;
+	encr_xentry_free(e);
+}
+
+static void encr_xevict(struct encr_xcache *c)
+{
+	while (c->nbytes > c->max_bytes && c->lru_tail != NULL)
+		encr_xremove(c, encr_xfind(c, c->lru_tail->dev,
+					   c->lru_tail->ino));
+}
+
+void encr_xcache_free(struct encr_xcache *c)
+{
+	size_t b;
+
+	if (c == NULL)
+		return;
+	for (b = 0; b < c->nbuckets; b++)
+		while (c->buckets[b] != NULL)
+			encr_xremove(c, &c->buckets[b]);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
+
+// Read every xattr of fpath into a new, unlinked entry
+static int encr_xload(const struct stat *st, const char *fpath,
+		      struct encr_xentry **ep)
+{
+	struct encr_xentry *e;
+	struct encr_xattr **tail;
+	char *list;
+	char *value;
+	char *name;
+	ssize_t listlen;
+	ssize_t len;
+	int res = 0;
+
+	e = calloc(1, sizeof(struct encr_xentry));
+	list = malloc(ENCR_XATTR_LIST_MAX);
+	value = malloc(ENCR_XATTR_SIZE_MAX);
+	if (e == NULL || list == NULL || value == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->bytes = sizeof(struct encr_xentry);
+	tail = &e->attrs;
+
+	listlen = llistxattr(fpath, list, ENCR_XATTR_LIST_MAX);
+	if (listlen == -1) {
+		res = -errno;
+		goto out;
+	}
+	for (name = list; name < list + listlen; name += strlen(name) + 1) {
+		len = lgetxattr(fpath, name, value, ENCR_XATTR_SIZE_MAX);
+		if (len == -1) {
+			// Removed since the list was read
+			if (errno == ENODATA)
+				continue;
+			res = -errno;
+			goto out;
+		}
+		*tail = encr_xattr_new(name, value, len);
+		if (*tail == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		e->bytes += encr_xattr_bytes(*tail);
+		tail = &(*tail)->next;
+	}
+
+out:
+	free(list);
+	free(value);
+	if (res != 0 && e != NULL) {
+		encr_xentry_free(e);
+		e = NULL;
+	}
+	*ep = e;
+	return res;
+}
+
+// Find a live entry for st, loading one from fpath if needed. On success
+// the cache lock is held and *ep is either cached or private (*cached == 0)
+static int encr_xget(struct encr_xcache *c, const struct stat *st,
+		     const char *fpath, struct encr_xentry **ep, int *cached)
+{
+	struct encr_xentry **pp;
+	struct encr_xentry *e;
+	unsigned long gen;
+	int res;
+
+	pthread_mutex_lock(&c->lock);
+	pp = encr_xfind(c, st->st_dev, st->st_ino);
+	if (*pp != NULL) {
+		if ((*pp)->expires >= encr_now()) {
+			e = *pp;
+			encr_xlru_unlink(c, e);
+			encr_xlru_push(c, e);
+			*ep = e;
+			*cached = 1;
+			return 0;
+		}
+		encr_xremove(c, pp);
+	}
+	gen = c->generation;
+	pthread_mutex_unlock(&c->lock);
+
+	res = encr_xload(st, fpath, &e);
+	if (res != 0)
+		return res;
+
+	pthread_mutex_lock(&c->lock);
+	*ep = e;
+	*cached = 0;
+	pp = encr_xfind(c, st->st_dev, st->st_ino);
+	if (gen == c->generation && *pp == NULL && c->timeout > 0 &&
+	    e->bytes <= c->max_bytes / 4) {
+		e->expires = encr_now() + c->timeout;
+		e->next = NULL;
+		*pp = e;
+		encr_xlru_push(c, e);
+		c->nbytes += e->bytes;
+		encr_xevict(c);
+		*cached = 1;
+	}
+	return 0;
+}
+
+static void encr_xput(struct encr_xcache *c, struct encr_xentry *e, int cached)
+{
+	pthread_mutex_unlock(&c->lock);
+	if (!cached)
+		encr_xentry_free(e);
+}
+
+int encr_xcache_getxattr(struct encr_xcache *c, const struct stat *st,
+			 const char *fpath, const char *name,
+			 char *value, size_t size)
+{
+	struct encr_xentry *e;
+	struct encr_xattr *a;
+	int cached;
+	int res;
+
+	res = encr_xget(c, st, fpath, &e, &cached);
+	if (res != 0)
+		return res;
+	res = -ENODATA;
+	for (a = e->attrs; a != NULL; a = a->next) {
+		if (strcmp(a->name, name))
+			continue;
+		if (size == 0) {
+			res = a->len;
+		} else if (size < a->len) {
+			res = -ERANGE;
+		} else {
+			memcpy(value, a->value, a->len);
+			res = a->len;
+		}
+		break;
+	}
+	encr_xput(c, e, cached);
+
+	return res;
+}
+
+int encr_xcache_listxattr(struct encr_xcache *c, const struct stat *st,
+			  const char *fpath, char *list, size_t size)
+{
+	struct encr_xentry *e;
+	struct encr_xattr *a;
+	size_t total = 0;
+	size_t nlen;
+	int cached;
+	int res;
+
+	res = encr_xget(c, st, fpath, &e, &cached);
+	if (res != 0)
+		return res;
+	for (a = e->attrs; a != NULL; a = a->next)
+		total += strlen(a->name) + 1;
+	if (size == 0) {
+		res = total;
+	} else if (size < total) {
+		res = -ERANGE;
+	} else {
+		for (a = e->attrs; a != NULL; a = a->next) {
+			nlen = strlen(a->name) + 1;
+			memcpy(list, a->name, nlen);
+			list += nlen;
+		}
+		res = total;
+	}
+	encr_xput(c, e, cached);
+
+	return res;
+}
+
+void encr_xcache_set(struct encr_xcache *c, const struct stat *st,
+		     const char *name, const char *value, size_t size)
+{
+	struct encr_xentry **pp;
+	struct encr_xentry *e;
+	struct encr_xattr **ap;
+	struct encr_xattr *a;
+
+	pthread_mutex_lock(&c->lock);
+	c->generation++;
+	pp = encr_xfind(c, st->st_dev, st->st_ino);
+	e = *pp;
+	if (e != NULL) {
+		a = encr_xattr_new(name, value, size);
+		if (a == NULL) {
+			encr_xremove(c, pp);
+			pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		for (ap = &e->attrs; *ap != NULL; ap = &(*ap)->next)
+			if (!strcmp((*ap)->name, name))
+				break;
+		if (*ap != NULL) {
+			a->next = (*ap)->next;
+			e->bytes -= encr_xattr_bytes(*ap);
+			c->nbytes -= encr_xattr_bytes(*ap);
+			free(*ap);
+		}
+		*ap = a;
+		e->bytes += encr_xattr_bytes(a);
+		c->nbytes += encr_xattr_bytes(a);
+		encr_xevict(c);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void encr_xcache_remove(struct encr_xcache *c, const struct stat *st,
+			const char *name)
+{
+	struct encr_xentry *e;
+	struct encr_xattr **ap;
+	struct encr_xattr *a;
+
+	pthread_mutex_lock(&c->lock);
+	c->generation++;
+	e = *encr_xfind(c, st->st_dev, st->st_ino);
+	if (e != NULL) {
+		for (ap = &e->attrs; *ap != NULL; ap = &(*ap)->next) {
+			if (strcmp((*ap)->name, name))
+				continue;
+			a = *ap;
+			*ap = a->next;
+			e->bytes -= encr_xattr_bytes(a);
+			c->nbytes -= encr_xattr_bytes(a);
+			free(a);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void encr_xcache_inval(struct encr_xcache *c, const struct stat *st)
+{
+	struct encr_xentry **pp;
+
+	pthread_mutex_lock(&c->lock);
+	c->generation++;
+	pp = encr_xfind(c, st->st_dev, st->st_ino);
+	if (*pp != NULL)
+		encr_xremove(c, pp);
+	pthread_mutex_unlock(&c->lock);
+}
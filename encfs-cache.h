@@ -0,0 +1,200 @@
+/* encfs-cache.h
+ * In-process metadata caches for pa5-encfs
+ *
+ * The attribute cache maps mount-relative paths to the struct stat that
+ * getattr() last returned for them, or to ENOENT for paths that did not
+ * exist. Entries live for the same attr_timeout/negative_timeout the
+ * kernel was given, so the cache only answers the lookups the kernel
+ * itself has stopped caching, and is invalidated explicitly by every
+ * operation that changes metadata.
+ *
+ * The xattr cache keeps every extended attribute of a backing inode,
+ * loaded with one llistxattr() and a getxattr() per name the first time
+ * any of them is asked for. setxattr()/removexattr() edit the cached
+ * copy in place, and the whole cache is capped at a number of bytes.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_CACHE_H
+#define ENCFS_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+// libfuse's own defaults: longer ones mean changes made to the mirror
+// directly, not through the mount, show up that much later
+#define ENCR_DEFAULT_ENTRY_TIMEOUT 1.0
+#define ENCR_DEFAULT_ATTR_TIMEOUT 1.0
+#define ENCR_DEFAULT_NEGATIVE_TIMEOUT 0.0
+#define ENCR_DEFAULT_ACACHE_SIZE 65536
+#define ENCR_ACACHE_LISTING 2		// a listing fills 1/this of the cache
+#define ENCR_DEFAULT_XCACHE_SIZE (4 * 1024 * 1024)
+
+struct encr_aentry;
+struct encr_xentry;
+
+struct encr_acache {
+	pthread_mutex_t lock;
+	double attr_timeout;
+	double negative_timeout;
+	size_t max_entries;
+	size_t nentries;
+	size_t nbuckets;
+	unsigned long generation;	// counts invalidations
+	unsigned long flushed;		// generation of the last inval_all
+	unsigned long *stamps;		// generation each bucket was last
+					// invalidated at
+	struct encr_aentry **buckets;
+	struct encr_aentry *lru_head;	// most recently used
+	struct encr_aentry *lru_tail;	// next to be evicted
+	unsigned long hits;		// gets answered, for encfs-bench
+	unsigned long misses;
+};
+
+// What one directory listing may still add to the attribute cache
+struct encr_alisting {
+	unsigned long gen;		// sampled as the listing started
+	size_t room;			// entries
+	double until;			// and for how long
+};
+
+struct encr_xcache {
+	pthread_mutex_t lock;
+	double timeout;
+	size_t max_bytes;
+	size_t nbytes;
+	size_t nbuckets;
+	unsigned long generation;
+	struct encr_xentry **buckets;
+	struct encr_xentry *lru_head;
+	struct encr_xentry *lru_tail;
+};
+
+/* struct encr_acache *encr_acache_new(double attr_timeout, double negative_timeout, size_t max_entries)
+ * Purpose: Allocate an empty attribute cache
+ * Args: double attr_timeout     : Seconds a positive entry stays valid (0 disables them)
+ *       double negative_timeout : Seconds an ENOENT entry stays valid (0 disables them)
+ *       size_t max_entries      : Least recently used entries are evicted beyond this
+ * Return: New cache, or NULL on allocation failure
+ */
+extern struct encr_acache *encr_acache_new(double attr_timeout,
+					   double negative_timeout,
+					   size_t max_entries);
+
+/* void encr_acache_free(struct encr_acache *c)
+ * Purpose: Free a cache and all of its entries
+ */
+extern void encr_acache_free(struct encr_acache *c);
+
+/* int encr_acache_get(struct encr_acache *c, const char *path, struct stat *st)
+ * Purpose: Look up a cached getattr() result
+ * Return: 1 and *st filled on a positive hit, -ENOENT on a negative hit,
+ *         0 on a miss
+ */
+extern int encr_acache_get(struct encr_acache *c, const char *path,
+			   struct stat *st);
+
+/* unsigned long encr_acache_generation(struct encr_acache *c)
+ * Purpose: Sample the invalidation counter before asking the backing store
+ * Return: Value to hand to encr_acache_put()
+ */
+extern unsigned long encr_acache_generation(struct encr_acache *c);
+
+/* void encr_acache_put(struct encr_acache *c, const char *path, const struct stat *st, int err, unsigned long gen)
+ * Purpose: Remember a getattr() result; st is ignored when err is -ENOENT
+ *          Nothing is stored if path (or a path hashing alongside it) was
+ *          invalidated since gen was sampled, so a slow lookup cannot
+ *          resurrect stale attributes, while changes elsewhere on the
+ *          mount do not keep it from being cached.
+ */
+extern void encr_acache_put(struct encr_acache *c, const char *path,
+			    const struct stat *st, int err, unsigned long gen);
+
+/* void encr_acache_listing(struct encr_acache *c, struct encr_alisting *l)
+ * int encr_acache_prefill(struct encr_alisting *l)
+ * Purpose: Let a directory listing fill in its entries for the lookups
+ *          that follow it. listing starts l, with one generation for the
+ *          whole listing; prefill says whether one more entry is worth
+ *          stat()ing for the cache and counts it. Only the first
+ *          1/ENCR_ACACHE_LISTING of the cache's entries, put in within
+ *          half of attr_timeout, are: any more would push out the first
+ *          ones, or everything else, before they are looked up, or
+ *          outlive their timeout first.
+ * Return: prefill: 1 if so, 0 if not
+ */
+extern void encr_acache_listing(struct encr_acache *c,
+				struct encr_alisting *l);
+extern int encr_acache_prefill(struct encr_alisting *l);
+
+/* void encr_acache_stats(struct encr_acache *c, unsigned long *hits, unsigned long *misses)
+ * Purpose: Count the gets answered from the cache, and not, so far
+ */
+extern void encr_acache_stats(struct encr_acache *c, unsigned long *hits,
+			      unsigned long *misses);
+
+/* void encr_acache_inval(struct encr_acache *c, const char *path)
+ * Purpose: Forget path and the attributes of its parent directory, for
+ *          changes to the directory's entries
+ */
+extern void encr_acache_inval(struct encr_acache *c, const char *path);
+
+/* void encr_acache_inval_attr(struct encr_acache *c, const char *path)
+ * Purpose: Forget path alone, for changes to its data or attributes,
+ *          which leave its parent as it was
+ */
+extern void encr_acache_inval_attr(struct encr_acache *c, const char *path);
+
+/* void encr_acache_inval_all(struct encr_acache *c)
+ * Purpose: Forget everything (directory renames, hard link count changes)
+ */
+extern void encr_acache_inval_all(struct encr_acache *c);
+
+/* struct encr_xcache *encr_xcache_new(double timeout, size_t max_bytes)
+ * Purpose: Allocate an empty xattr cache
+ * Args: double timeout   : Seconds before an inode's xattrs are reloaded
+ *                          (catches changes made outside the mount)
+ *       size_t max_bytes : Least recently used inodes are evicted beyond this
+ * Return: New cache, or NULL on allocation failure
+ */
+extern struct encr_xcache *encr_xcache_new(double timeout, size_t max_bytes);
+
+/* void encr_xcache_free(struct encr_xcache *c)
+ * Purpose: Free a cache and all of its entries
+ */
+extern void encr_xcache_free(struct encr_xcache *c);
+
+/* int encr_xcache_getxattr(struct encr_xcache *c, const struct stat *st, const char *fpath, const char *name, char *value, size_t size)
+ * Purpose: lgetxattr(fpath, name, value, size) answered from the cache
+ *          entry for st's inode, loading it from fpath on a miss
+ * Return: Same as lgetxattr(), but -errno instead of -1
+ */
+extern int encr_xcache_getxattr(struct encr_xcache *c, const struct stat *st,
+				const char *fpath, const char *name,
+				char *value, size_t size);
+
+/* int encr_xcache_listxattr(struct encr_xcache *c, const struct stat *st, const char *fpath, char *list, size_t size)
+ * Purpose: llistxattr(fpath, list, size) answered from the cache
+ * Return: Same as llistxattr(), but -errno instead of -1
+ */
+extern int encr_xcache_listxattr(struct encr_xcache *c, const struct stat *st,
+				 const char *fpath, char *list, size_t size);
+
+/* void encr_xcache_set(struct encr_xcache *c, const struct stat *st, const char *name, const char *value, size_t size)
+ * void encr_xcache_remove(struct encr_xcache *c, const struct stat *st, const char *name)
+ * Purpose: Mirror a successful lsetxattr()/lremovexattr() in the cache
+ */
+extern void encr_xcache_set(struct encr_xcache *c, const struct stat *st,
+			    const char *name, const char *value, size_t size);
+extern void encr_xcache_remove(struct encr_xcache *c, const struct stat *st,
+			       const char *name);
+
+/* void encr_xcache_inval(struct encr_xcache *c, const struct stat *st)
+ * Purpose: Forget st's inode, e.g. once its last link is gone and the
+ *          inode number may be reused
+ */
+extern void encr_xcache_inval(struct encr_xcache *c, const struct stat *st);
+
+#endif
@@ -0,0 +1,234 @@
+/* encfs-changed.c
+ * List what changed in files of a pa5-encfs mount since a generation
+ *
+ * Asks the mount with ENCR_IOC_CHANGES (see encfs-ioctl.h and
+ * encfs-changes.h) which byte ranges of each file changed since the
+ * token given for it, so an incremental backup or sync only has to copy
+ * those. For each file it prints the file's token and path, then one
+ * line per changed range, offset and length in bytes of plaintext:
+ *
+ *   <map>:<generation> <size> <Path>
+ *   	<offset> <length>
+ *
+ * A file with no token, or one that is not from its current map (the
+ * file was rewritten or restored since, or the mount did not stop
+ * cleanly), is listed whole. With -c the current generation is closed
+ * first, so the token printed covers exactly the ranges listed; feed the
+ * output back with -t next time. Without -c the token is the last
+ * closed one and the ranges may include changes made after it.
+ *
+ * Usage: encfs-changed [-c] [-q] [-s TOKEN | -t FILE] <File>...
+ *   -c        close the current generation of each file
+ *   -q        print only the tokens and paths
+ *   -s TOKEN  list the changes since TOKEN (one file only)
+ *   -t FILE   take each file's token from FILE, an earlier output
+ *
+ * Exits 1 if any file could not be asked.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "encfs-ioctl.h"
+
+struct token {
+	uint64_t map;
+	uint32_t gen;
+	char *path;
+};
+
+static int close_gen;
+static int quiet;
+static struct token *tokens;
+static size_t ntokens;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-changed [-c] [-q] [-s TOKEN | -t FILE] "
+		"<File>...\n");
+	exit(EXIT_FAILURE);
+}
+
+static int parse_token(const char *s, uint64_t *map, uint32_t *gen,
+		       const char **rest)
+{
+	unsigned long long m;
+	unsigned long g;
+	char *end;
+
+	m = strtoull(s, &end, 16);
+	if (end == s || *end != ':')
+		return -1;
+	s = end + 1;
+	g = strtoul(s, &end, 10);
+	if (end == s || g > UINT32_MAX)
+		return -1;
+	*map = m;
+	*gen = g;
+	*rest = end;
+	return 0;
+}
+
+// Token lines of an earlier output; range lines start with a tab
+static int load_tokens(const char *file)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	const char *rest;
+	struct token t;
+	struct token *n;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return -1;
+	while ((len = getline(&line, &cap, f)) > 0) {
+		if (line[0] == '\t')
+			continue;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		// <map>:<generation> <size> <Path>
+		if (parse_token(line, &t.map, &t.gen, &rest) != 0 ||
+		    *rest++ != ' ' || (rest = strchr(rest, ' ')) == NULL)
+			continue;
+		n = realloc(tokens, (ntokens + 1) * sizeof(struct token));
+		if (n == NULL || (t.path = strdup(rest + 1)) == NULL) {
+			free(line);
+			fclose(f);
+			errno = ENOMEM;
+			return -1;
+		}
+		tokens = n;
+		tokens[ntokens++] = t;
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+static const struct token *find_token(const char *path)
+{
+	size_t i;
+
+	for (i = ntokens; i-- > 0;)
+		if (strcmp(tokens[i].path, path) == 0)
+			return &tokens[i];
+	return NULL;
+}
+
+static int changed_one(const char *path, const struct token *t)
+{
+	struct encr_changes_query q;
+	uint64_t run_off = 0;
+	uint64_t run_end = 0;
+	uint64_t off, end;
+	uint32_t i;
+	int first = 1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&q, 0, sizeof(q));
+	if (t != NULL) {
+		q.map = t->map;
+		q.since = t->gen;
+	}
+	do {
+		q.flags = first && close_gen ? ENCR_CHANGES_CLOSE : 0;
+		if (ioctl(fd, ENCR_IOC_CHANGES, &q) == -1) {
+			fprintf(stderr, "%s: %s\n", path,
+				errno == EOPNOTSUPP ? "changes not tracked" :
+				strerror(errno));
+			close(fd);
+			return -1;
+		}
+		if (first)
+			printf("%016llx:%u %llu %s\n",
+			       (unsigned long long) q.map, q.generation,
+			       (unsigned long long) q.size, path);
+		first = 0;
+		// The token printed would match from here on; keep asking
+		// for everything
+		if (q.all)
+			q.map = 0;
+		for (i = 0; i < q.count && !quiet; i++) {
+			off = q.ranges[i][0] << q.region_shift;
+			end = q.ranges[i][1] << q.region_shift;
+			if (end > q.size)
+				end = q.size;
+			// Runs split between calls are printed as one
+			if (run_end == off && run_end != 0) {
+				run_end = end;
+				continue;
+			}
+			if (run_end > run_off)
+				printf("\t%llu %llu\n",
+				       (unsigned long long) run_off,
+				       (unsigned long long) (run_end - run_off));
+			run_off = off;
+			run_end = end;
+		}
+	} while (q.count > 0 && q.start << q.region_shift < q.size);
+	if (run_end > run_off)
+		printf("\t%llu %llu\n", (unsigned long long) run_off,
+		       (unsigned long long) (run_end - run_off));
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct token given;
+	const char *rest;
+	int have_given = 0;
+	int failed = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "cqs:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			close_gen = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			if (parse_token(optarg, &given.map, &given.gen,
+					&rest) != 0 || *rest != '\0')
+				usage();
+			have_given = 1;
+			break;
+		case 't':
+			if (load_tokens(optarg) != 0) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || (have_given && (argc - optind != 1 || ntokens)))
+		usage();
+
+	for (i = optind; i < argc; i++)
+		if (changed_one(argv[i], have_given ? &given :
+				find_token(argv[i])) != 0)
+			failed = 1;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
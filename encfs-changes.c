@@ -0,0 +1,431 @@
+/* encfs-changes.c
+ * Per-file change tracking for pa5-encfs
+ *
+ * See encfs-changes.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "encfs-changes.h"
+#include "encfs-ioctl.h"
+#include "encfs-direct.h"
+#include "aes-crypt.h"
+
+#define CMAP_MAGIC "ENCRCHG1"
+#define CMAP_HDR_SIZE 32
+#define CMAP_ID_LABEL "pa5-encfs change map"
+
+struct encr_changes {
+	char dir[PATH_MAX];
+	int dirfd;
+	unsigned live;			// maps loaded, atomic
+};
+
+struct encr_cmap {
+	pthread_mutex_t lock;
+	int fd;				// -1 if the map could not be stored
+	uint64_t id;
+	uint32_t gen;			// the generation writes go into
+	unsigned shift;
+	uint32_t *tags;			// per region, 0 for never changed
+	size_t n;			// regions in use
+	size_t cap;
+	size_t dirty_lo;		// regions to write back, [lo, hi)
+	size_t dirty_hi;
+	int hdr_dirty;
+};
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *p, unsigned n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+static int changes_map_path(const struct encr_changes *c,
+			    const struct encr_keys *k, ino_t ino, char *path)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE,
+			 (const unsigned char *) CMAP_ID_LABEL,
+			 strlen(CMAP_ID_LABEL), NULL, 0, mac))
+		return -EIO;
+	if (snprintf(path, PATH_MAX, "%s/%016llx-%llu", c->dir,
+		     (unsigned long long) get_le(mac, 8),
+		     (unsigned long long) ino) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+// Drop every map, after a mount that did not stop cleanly
+static int changes_reset(const char *dir)
+{
+	struct dirent *d;
+	DIR *dp;
+	int res = 0;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return -errno;
+	while ((d = readdir(dp)) != NULL) {
+		if (d->d_name[0] == '.' ||
+		    strcmp(d->d_name, ENCR_CHANGES_OPEN) == 0)
+			continue;
+		if (unlinkat(dirfd(dp), d->d_name, 0) != 0 && res == 0)
+			res = -errno;
+	}
+	closedir(dp);
+	return res;
+}
+
+int encr_changes_open(const char *rootdir, int create,
+		      struct encr_changes **cp)
+{
+	struct encr_changes *c;
+	int fd;
+	int res;
+
+	*cp = NULL;
+	c = calloc(1, sizeof(struct encr_changes));
+	if (c == NULL)
+		return -ENOMEM;
+	snprintf(c->dir, sizeof(c->dir), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_CHANGES_DIR);
+	if (create && mkdir(c->dir, 0700) != 0 && errno != EEXIST) {
+		res = -errno;
+		free(c);
+		return res;
+	}
+	c->dirfd = open(c->dir, O_RDONLY | O_DIRECTORY);
+	if (c->dirfd == -1) {
+		res = errno == ENOENT ? 0 : -errno;
+		free(c);
+		return res;
+	}
+
+	if (faccessat(c->dirfd, ENCR_CHANGES_OPEN, F_OK, 0) == 0) {
+		fprintf(stderr, "pa5-encfs: the last mount did not stop "
+			"cleanly; every file's changes start over\n");
+		res = changes_reset(c->dir);
+		if (res != 0)
+			goto fail;
+	}
+	fd = openat(c->dirfd, ENCR_CHANGES_OPEN, O_WRONLY | O_CREAT, 0600);
+	if (fd == -1 || fsync(fd) != 0 || fsync(c->dirfd) != 0) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		goto fail;
+	}
+	close(fd);
+	*cp = c;
+	return 0;
+fail:
+	close(c->dirfd);
+	free(c);
+	return res;
+}
+
+void encr_changes_close(struct encr_changes *c)
+{
+	if (c == NULL)
+		return;
+	// Maps still loaded were never written back; the next mount drops them
+	if (__atomic_load_n(&c->live, __ATOMIC_ACQUIRE) == 0 &&
+	    syncfs(c->dirfd) == 0 &&
+	    unlinkat(c->dirfd, ENCR_CHANGES_OPEN, 0) == 0)
+		fsync(c->dirfd);
+	close(c->dirfd);
+	free(c);
+}
+
+static int cmap_grow(struct encr_cmap *m, size_t n)
+{
+	size_t cap = m->cap ? m->cap : 64;
+	uint32_t *tags;
+
+	if (n <= m->cap)
+		return 0;
+	while (cap < n)
+		cap *= 2;
+	tags = realloc(m->tags, cap * sizeof(uint32_t));
+	if (tags == NULL)
+		return -ENOMEM;
+	memset(tags + m->cap, 0, (cap - m->cap) * sizeof(uint32_t));
+	m->tags = tags;
+	m->cap = cap;
+	return 0;
+}
+
+// Read the map in m->fd, if it is one for regions of 1 << shift bytes
+static int cmap_read(struct encr_cmap *m, unsigned shift)
+{
+	unsigned char hdr[CMAP_HDR_SIZE];
+	unsigned char *buf;
+	size_t n;
+	size_t i;
+
+	if (pread(m->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr, CMAP_MAGIC, 8) != 0 ||
+	    get_le(hdr + 20, 4) != shift)
+		return -EINVAL;
+	n = get_le(hdr + 24, 4);
+	buf = malloc(n * 4 + 1);
+	if (buf == NULL)
+		return -ENOMEM;
+	if (cmap_grow(m, n) != 0 ||
+	    pread(m->fd, buf, n * 4, CMAP_HDR_SIZE) != (ssize_t) (n * 4)) {
+		free(buf);
+		return -EINVAL;
+	}
+	for (i = 0; i < n; i++)
+		m->tags[i] = get_le(buf + 4 * i, 4);
+	free(buf);
+	m->id = get_le(hdr + 8, 8);
+	m->gen = get_le(hdr + 16, 4);
+	m->n = n;
+	return m->id != 0 && m->gen != 0 ? 0 : -EINVAL;
+}
+
+// Write back what changed in m since it was read or last written
+static int cmap_flush(struct encr_cmap *m)
+{
+	unsigned char hdr[CMAP_HDR_SIZE];
+	unsigned char *buf;
+	size_t i;
+
+	if (m->fd == -1)
+		return -EBADF;
+	if (m->dirty_lo < m->dirty_hi) {
+		buf = malloc((m->dirty_hi - m->dirty_lo) * 4);
+		if (buf == NULL)
+			return -ENOMEM;
+		for (i = m->dirty_lo; i < m->dirty_hi; i++)
+			put_le(buf + 4 * (i - m->dirty_lo), m->tags[i], 4);
+		if (pwrite(m->fd, buf, (m->dirty_hi - m->dirty_lo) * 4,
+			   CMAP_HDR_SIZE + 4 * m->dirty_lo) !=
+		    (ssize_t) ((m->dirty_hi - m->dirty_lo) * 4)) {
+			free(buf);
+			return -EIO;
+		}
+		free(buf);
+		m->dirty_lo = SIZE_MAX;
+		m->dirty_hi = 0;
+	}
+	if (m->hdr_dirty) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, CMAP_MAGIC, 8);
+		put_le(hdr + 8, m->id, 8);
+		put_le(hdr + 16, m->gen, 4);
+		put_le(hdr + 20, m->shift, 4);
+		put_le(hdr + 24, m->n, 4);
+		if (pwrite(m->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+			return -EIO;
+		m->hdr_dirty = 0;
+	}
+	return 0;
+}
+
+// Load, or start, the map of an open encrypted file
+static struct encr_cmap *cmap_load(struct encr_inode *in)
+{
+	char path[PATH_MAX];
+	struct encr_cmap *m;
+	unsigned shift;
+	int res;
+
+	pthread_mutex_lock(&in->lock);
+	m = in->cmap;
+	if (m != NULL || !in->encrypted)
+		goto out;
+	m = calloc(1, sizeof(struct encr_cmap));
+	if (m == NULL)
+		goto out;
+	pthread_mutex_init(&m->lock, NULL);
+	shift = in->chunk_shift > ENCR_CHANGES_MIN_SHIFT ? in->chunk_shift :
+		ENCR_CHANGES_MIN_SHIFT;
+	m->shift = shift;
+	m->dirty_lo = SIZE_MAX;
+	res = changes_map_path(in->changes, &in->hdr.keys, in->ino, path);
+	m->fd = res == 0 ? open(path, O_RDWR | O_CREAT, 0600) : -1;
+	if (m->fd == -1 && res == 0)
+		unlink(path);		// never leave an old map to be read
+	if (m->fd == -1 || cmap_read(m, shift) != 0) {
+		// A new map: no generation from before it means anything
+		m->n = 0;
+		m->gen = 1;
+		if (!random_bytes((unsigned char *) &m->id, sizeof(m->id)) ||
+		    m->id == 0)
+			m->id = 1;
+		m->hdr_dirty = 1;
+		if (m->fd != -1 && ftruncate(m->fd, 0) != 0) {
+			close(m->fd);
+			m->fd = -1;
+		}
+		if (m->cap > 0)
+			memset(m->tags, 0, m->cap * sizeof(uint32_t));
+	}
+	__atomic_store_n(&in->cmap, m, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&in->changes->live, 1, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&in->lock);
+	return m;
+}
+
+void encr_changes_mark(struct encr_inode *in, off_t off, off_t len)
+{
+	struct encr_cmap *m;
+	size_t first;
+	size_t end;
+	size_t i;
+
+	if (in->changes == NULL || len <= 0)
+		return;
+	m = __atomic_load_n(&in->cmap, __ATOMIC_ACQUIRE);
+	if (m == NULL)
+		m = cmap_load(in);
+	if (m == NULL)
+		return;
+
+	pthread_mutex_lock(&m->lock);
+	first = (uint64_t) off >> m->shift;
+	end = (((uint64_t) off + len - 1) >> m->shift) + 1;
+	if (cmap_grow(m, end) == 0) {
+		for (i = first; i < end; i++)
+			m->tags[i] = m->gen;
+		if (end > m->n) {
+			m->n = end;
+			m->hdr_dirty = 1;
+		}
+		if (first < m->dirty_lo)
+			m->dirty_lo = first;
+		if (end > m->dirty_hi)
+			m->dirty_hi = end;
+	} else if (random_bytes((unsigned char *) &m->id, sizeof(m->id))) {
+		// Cannot be tracked any more: no generation of this map holds
+		m->hdr_dirty = 1;
+	} else {
+		m->id++;
+		m->hdr_dirty = 1;
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+int encr_changes_query(struct encr_inode *in, off_t size,
+		       struct encr_changes_query *q)
+{
+	struct encr_cmap *m;
+	uint64_t regions;
+	uint64_t r;
+	int all;
+
+	if (in->changes == NULL)
+		return -EOPNOTSUPP;
+	m = __atomic_load_n(&in->cmap, __ATOMIC_ACQUIRE);
+	if (m == NULL)
+		m = cmap_load(in);
+	if (m == NULL)
+		return in->encrypted ? -ENOMEM : -EOPNOTSUPP;
+
+	pthread_mutex_lock(&m->lock);
+	all = q->map != m->id || q->since >= m->gen;
+	q->map = m->id;
+	if (q->flags & ENCR_CHANGES_CLOSE) {
+		q->generation = m->gen++;
+		m->hdr_dirty = 1;
+		if (cmap_flush(m) != 0) {
+			// Write it all again next time
+			m->dirty_lo = 0;
+			m->dirty_hi = m->n;
+		}
+	} else {
+		q->generation = m->gen - 1;
+	}
+	q->region_shift = m->shift;
+	q->size = size;
+	q->all = all;
+	q->count = 0;
+	regions = ((uint64_t) size + ((uint64_t) 1 << m->shift) - 1) >>
+		m->shift;
+	for (r = q->start; r < regions && q->count < ENCR_CHANGES_RANGES;) {
+		// Regions past the map were never marked, so are not known
+		if (!all && r < m->n && m->tags[r] <= q->since) {
+			r++;
+			continue;
+		}
+		q->ranges[q->count][0] = r;
+		while (r < regions && (all || r >= m->n ||
+				       m->tags[r] > q->since))
+			r++;
+		q->ranges[q->count++][1] = r;
+	}
+	q->start = r < regions ? r : regions;
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+void encr_changes_drop(struct encr_inode *in)
+{
+	struct encr_cmap *m = in->cmap;
+
+	if (m == NULL)
+		return;
+	if (m->fd != -1) {
+		// A map that is not all there must not be read back
+		if (cmap_flush(m) != 0 && ftruncate(m->fd, 0) != 0)
+			fprintf(stderr, "pa5-encfs: cannot drop a change map: "
+				"%s\n", strerror(errno));
+		close(m->fd);
+	}
+	pthread_mutex_destroy(&m->lock);
+	free(m->tags);
+	free(m);
+	in->cmap = NULL;
+	__atomic_sub_fetch(&in->changes->live, 1, __ATOMIC_RELEASE);
+}
+
+void encr_changes_forget(struct encr_changes *c, const struct encr_keys *mk,
+			 int fd)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	char path[PATH_MAX];
+	struct encr_header hdr;
+	struct stat st;
+	ssize_t n;
+
+	if (c == NULL || fstat(fd, &st) != 0)
+		return;
+	// The fd may be a handle's, opened O_DIRECT
+	n = (fcntl(fd, F_GETFL) & O_DIRECT) ?
+		encr_dio_pread(fd, buf, sizeof(buf), 0) :
+		pread(fd, buf, sizeof(buf), 0);
+	if (n != sizeof(buf) || encr_header_decode(&hdr, mk, buf) != 0)
+		return;
+	if (changes_map_path(c, &hdr.keys, st.st_ino, path) == 0)
+		unlink(path);
+	memset(&hdr, 0, sizeof(hdr));
+}
@@ -0,0 +1,97 @@
+/* encfs-changes.h
+ * Per-file change tracking for pa5-encfs
+ *
+ * So that an incremental backup or sync can copy only the parts of an
+ * encrypted file that changed, every write, copy and truncate through
+ * the mount tags the regions of the file it touches with the file's
+ * current generation. A region is ENCR_CHANGES_MIN_SHIFT bytes of
+ * plaintext, or one chunk if chunks are larger, so it always covers
+ * whole chunk records. Tracking is on whenever the mirror has
+ * .encfs/changes, which -o track_changes creates:
+ *
+ *   .encfs/changes/open           present while a mount is tracking
+ *   .encfs/changes/<id>-<inode>   a file's map: a header (magic, map id,
+ *                                 generation, region size, regions) and
+ *                                 the generation each region was last
+ *                                 changed in, u32 each, little-endian
+ *
+ * where id is derived from the file's data keys, so a map follows its
+ * file through renames and links but not into a rewrite by the
+ * migrator, which gives it new keys. A map is loaded on the first write
+ * or query after its file is opened and written back when the last
+ * handle is closed.
+ *
+ * Asking for the changes since generation G (ENCR_IOC_CHANGES, see
+ * encfs-ioctl.h and encfs-changed) returns every region tagged
+ * after G and, when asked to, closes the current generation and returns
+ * it to be passed next time. A generation only means something together
+ * with the map id it came with: a map that is new since then (a file
+ * that was rewritten, copied outside the mount or restored from an
+ * archive) reports the whole file as changed. So does every map after a
+ * mount that did not stop cleanly, since writes it made may never have
+ * reached the map; all maps are dropped then. Changes made to backing
+ * files outside the mount are not seen.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_CHANGES_H
+#define ENCFS_CHANGES_H
+
+#include <sys/types.h>
+
+#include "encfs-lock.h"
+
+#define ENCR_CHANGES_DIR "changes"	// .encfs/changes
+#define ENCR_CHANGES_OPEN "open"
+#define ENCR_CHANGES_MIN_SHIFT 16	// smallest region, 64 KiB
+
+struct encr_changes;
+struct encr_changes_query;
+
+/* int encr_changes_open(const char *rootdir, int create, struct encr_changes **cp)
+ * Purpose: Start tracking changes in the mirror rootdir, dropping every
+ *          map if the last mount did not stop cleanly
+ * Args: int create               : Set tracking up if the mirror has none
+ *       struct encr_changes **cp : Set to the tracker, or to NULL if there
+ *                                  is none and create is 0
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_changes_open(const char *rootdir, int create,
+			     struct encr_changes **cp);
+
+/* void encr_changes_close(struct encr_changes *c)
+ * Purpose: Flush the maps written back so far and mark the stop clean if
+ *          none is still loaded; c may be NULL
+ */
+extern void encr_changes_close(struct encr_changes *c);
+
+/* void encr_changes_mark(struct encr_inode *in, off_t off, off_t len)
+ * Purpose: Tag the regions covering len bytes at off of an open
+ *          encrypted file as changed; does nothing if in->changes is NULL
+ */
+extern void encr_changes_mark(struct encr_inode *in, off_t off, off_t len);
+
+/* int encr_changes_query(struct encr_inode *in, off_t size, struct encr_changes_query *q)
+ * Purpose: Answer ENCR_IOC_CHANGES for an open file of size bytes
+ * Return: 0 on success, -EOPNOTSUPP if the mirror does not track
+ *         changes, -errno on failure
+ */
+extern int encr_changes_query(struct encr_inode *in, off_t size,
+			      struct encr_changes_query *q);
+
+/* void encr_changes_drop(struct encr_inode *in)
+ * Purpose: Write back and free the inode's map, if it has one loaded;
+ *          called as the inode is freed
+ */
+extern void encr_changes_drop(struct encr_inode *in);
+
+/* void encr_changes_forget(struct encr_changes *c, const struct encr_keys *mk, int fd)
+ * Purpose: Remove the map of the file open as fd, which has just lost its
+ *          last link and handle; c may be NULL
+ */
+extern void encr_changes_forget(struct encr_changes *c,
+				const struct encr_keys *mk, int fd);
+
+#endif
@@ -0,0 +1,261 @@
+/* encfs-chunk.c
+ * Per-file chunk size choice for pa5-encfs
+ *
+ * See encfs-chunk.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <sys/xattr.h>
+
+#include "encfs-chunk.h"
+#include "encfs-format.h"
+
+#define CHUNK_AUTO 0			// rule size: follow the file
+
+struct chunk_rule {
+	char *glob;
+	int whole;			// matched against the whole path
+	unsigned shift;			// or CHUNK_AUTO
+};
+
+struct encr_chunks {
+	unsigned chunk_shift;		// the mount's
+	int adaptive;
+	size_t nrules;
+	struct chunk_rule *rules;
+};
+
+/* Sizes at which auto files step up to larger chunks */
+static const struct {
+	off_t below;
+	unsigned shift;
+} chunk_steps[] = {
+	{ (off_t) 1 << 20, ENCR_DEFAULT_CHUNK_SHIFT },	// 4 KiB up to 1 MiB
+	{ (off_t) 64 << 20, 14 },			// 16 KiB up to 64 MiB
+	{ (off_t) 1 << 30, 16 },			// 64 KiB up to 1 GiB
+};
+#define CHUNK_LARGEST 18			// 256 KiB past that
+
+unsigned encr_chunk_shift(unsigned long long bytes)
+{
+	unsigned shift;
+
+	for (shift = ENCR_MIN_CHUNK_SHIFT; shift <= ENCR_MAX_CHUNK_SHIFT;
+	     shift++)
+		if (bytes == 1ULL << shift)
+			return shift;
+	return 0;
+}
+
+unsigned encr_chunks_for_size(off_t size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(chunk_steps) / sizeof(chunk_steps[0]); i++)
+		if (size < chunk_steps[i].below)
+			return chunk_steps[i].shift;
+	return CHUNK_LARGEST;
+}
+
+// "4096", "4K", "1M" or "auto"; returns -1 for anything else
+static int chunk_parse_size(const char *s, unsigned *shift)
+{
+	unsigned long long n;
+	char *end;
+
+	if (strcmp(s, "auto") == 0) {
+		*shift = CHUNK_AUTO;
+		return 0;
+	}
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno != 0 || end == s)
+		return -1;
+	if (*end == 'K' || *end == 'k')
+		n <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		n <<= 20, end++;
+	*shift = encr_chunk_shift(n);
+	return *end == '\0' && *shift != 0 ? 0 : -1;
+}
+
+static int chunk_load(struct encr_chunks *c, FILE *f, const char *fpath)
+{
+	char line[PATH_MAX + 64];
+	char glob[PATH_MAX];
+	char size[32];
+	char extra;
+	struct chunk_rule *r;
+	unsigned lineno = 0;
+	unsigned shift;
+	char *p;
+	int n;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		n = sscanf(p, "%4095s %31s %c", glob, size, &extra);
+		if (n != 2 || chunk_parse_size(size, &shift) != 0) {
+			fprintf(stderr, "pa5-encfs: %s line %u: expected "
+				"<glob> <power of two size or auto>\n", fpath,
+				lineno);
+			return -EINVAL;
+		}
+		r = realloc(c->rules, (c->nrules + 1) * sizeof(*r));
+		if (r == NULL)
+			return -ENOMEM;
+		c->rules = r;
+		r += c->nrules;
+		r->glob = strdup(glob);
+		if (r->glob == NULL)
+			return -ENOMEM;
+		r->whole = strchr(glob, '/') != NULL;
+		r->shift = shift;
+		c->nrules++;
+	}
+	return ferror(f) ? -EIO : 0;
+}
+
+int encr_chunks_open(const char *rootdir, unsigned chunk_shift, int adaptive,
+		     struct encr_chunks **cp)
+{
+	struct encr_chunks *c;
+	char fpath[PATH_MAX];
+	FILE *f;
+	int res = 0;
+
+	c = calloc(1, sizeof(struct encr_chunks));
+	if (c == NULL)
+		return -ENOMEM;
+	c->chunk_shift = chunk_shift;
+	c->adaptive = adaptive;
+
+	snprintf(fpath, sizeof(fpath), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_CHUNK_POLICY);
+	f = fopen(fpath, "r");
+	if (f == NULL && errno != ENOENT)
+		res = -errno;
+	if (f != NULL) {
+		res = chunk_load(c, f, fpath);
+		fclose(f);
+	}
+	if (res != 0) {
+		encr_chunks_close(c);
+		return res;
+	}
+	*cp = c;
+	return 0;
+}
+
+void encr_chunks_close(struct encr_chunks *c)
+{
+	size_t i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->nrules; i++)
+		free(c->rules[i].glob);
+	free(c->rules);
+	free(c);
+}
+
+static const struct chunk_rule *chunk_match(const struct encr_chunks *c,
+					    const char *path)
+{
+	const char *name = strrchr(path, '/');
+	size_t i;
+
+	name = name != NULL ? name + 1 : path;
+	for (i = 0; i < c->nrules; i++)
+		if (fnmatch(c->rules[i].glob, c->rules[i].whole ? path : name,
+			    0) == 0)
+			return &c->rules[i];
+	return NULL;
+}
+
+unsigned encr_chunks_new(const struct encr_chunks *c, const char *path)
+{
+	const struct chunk_rule *r = chunk_match(c, path);
+
+	return r != NULL && r->shift != CHUNK_AUTO ? r->shift : c->chunk_shift;
+}
+
+int encr_chunks_auto(const struct encr_chunks *c, const char *path)
+{
+	const struct chunk_rule *r = chunk_match(c, path);
+
+	return r != NULL ? r->shift == CHUNK_AUTO : c->adaptive;
+}
+
+unsigned encr_chunks_target(const struct encr_chunks *c, const char *path,
+			    int fd, unsigned cur)
+{
+	const struct chunk_rule *r = chunk_match(c, path);
+	char val[32];
+	unsigned shift;
+	ssize_t len;
+
+	if (r != NULL && r->shift != CHUNK_AUTO)
+		return r->shift;
+	len = fgetxattr(fd, ENCR_XATTR_CHUNK_WANT, val, sizeof(val) - 1);
+	if (len > 0) {
+		val[len] = '\0';
+		if (chunk_parse_size(val, &shift) == 0 && shift != CHUNK_AUTO)
+			return shift;
+	}
+	if (r != NULL || c->adaptive)
+		return cur;
+	return c->chunk_shift;
+}
+
+void encr_chunks_note(struct encr_inode *in, off_t off, size_t size)
+{
+	off_t prev = __atomic_exchange_n(&in->wnext, off + (off_t) size,
+					 __ATOMIC_RELAXED);
+
+	if (off == prev) {
+		__atomic_fetch_add(&in->wseq, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&in->wrand, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&in->wrand_bytes, size, __ATOMIC_RELAXED);
+	}
+}
+
+unsigned encr_chunks_observed(struct encr_inode *in, off_t size)
+{
+	unsigned long seq = __atomic_load_n(&in->wseq, __ATOMIC_RELAXED);
+	unsigned long rnd = __atomic_load_n(&in->wrand, __ATOMIC_RELAXED);
+	unsigned long long bytes;
+	unsigned shift;
+
+	if (seq + rnd < ENCR_CHUNK_SAMPLE)
+		return 0;
+	bytes = __atomic_exchange_n(&in->wrand_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&in->wseq, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&in->wrand, 0, __ATOMIC_RELAXED);
+
+	// Three in four either way, or no opinion
+	if (seq >= 3 * rnd)
+		return encr_chunks_for_size(size);
+	if (rnd < 3 * seq)
+		return 0;
+	// The largest chunk no bigger than the average random write
+	bytes /= rnd;
+	for (shift = ENCR_MIN_CHUNK_SHIFT;
+	     shift < ENCR_CHUNK_MAX_RANDOM && (1ULL << (shift + 1)) <= bytes;
+	     shift++)
+		;
+	return shift;
+}
@@ -0,0 +1,121 @@
+/* encfs-chunk.h
+ * Per-file chunk size choice for pa5-encfs
+ *
+ * Every encrypted file records its own chunk size in its header (see
+ * encfs-format.h). Small chunks suit small files and random updates;
+ * large ones cost less header, tag and crypto overhead per byte on big
+ * sequential files. Which one a file gets is decided here:
+ *
+ *   .encfs/chunking optional policy, one rule per line, first match wins:
+ *                     <glob> <size>
+ *                   size is a power of two in bytes, with an optional
+ *                   K or M suffix, or "auto". A glob holding a '/' is
+ *                   matched against the whole path from the mount's
+ *                   root ('*' also matches '/'), any other against the
+ *                   file's name. Blank lines and '#' comments are
+ *                   skipped. For example:
+ *                     *.sqlite      4K
+ *                     *.mkv         256K
+ *                     /scratch/tmp* auto
+ *
+ * A file matching a rule with a size is created with that size and
+ * kept at it. Any other file is auto if its rule says so, or if no rule
+ * matches and the mount has -o chunk_auto, and is fixed at the mount's
+ * chunk_size otherwise. An auto file starts at the mount's chunk_size
+ * and then follows what is seen of it:
+ *
+ *   size hints   extending the file while it is still empty (truncate,
+ *                or setting the user.pa5-encfs.size-hint xattr to the
+ *                size it will reach, which is not stored) gives it the
+ *                size encr_chunks_for_size() picks, in place
+ *   writes       once it has seen ENCR_CHUNK_SAMPLE writes, mostly
+ *                random ones ask for chunks of about their size, and
+ *                mostly sequential ones for what the file's size picks;
+ *                the answer is left on the file as the
+ *                user.pa5-encfs.chunk-want xattr, in bytes
+ *
+ * A file that holds data is only rewritten to another chunk size by
+ * the migrator (-o migrate) or encfs-rechunk, which go to the file's
+ * rule size, else its chunk-want, else (auto files) the size it has,
+ * else the mount's chunk_size. Setting chunk-want by hand asks for a
+ * size the same way.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_CHUNK_H
+#define ENCFS_CHUNK_H
+
+#include <sys/types.h>
+
+#include "encfs-lock.h"
+
+#define ENCR_CHUNK_POLICY "chunking"	// .encfs/chunking
+#define ENCR_XATTR_CHUNK_WANT "user.pa5-encfs.chunk-want"
+#define ENCR_XATTR_SIZE_HINT "user.pa5-encfs.size-hint"
+#define ENCR_CHUNK_SAMPLE 64		// writes seen before they count
+#define ENCR_CHUNK_MAX_RANDOM 16	// largest chunk random writes ask for
+
+struct encr_chunks;
+
+/* int encr_chunks_open(const char *rootdir, unsigned chunk_shift, int adaptive, struct encr_chunks **cp)
+ * Purpose: Load the mirror's chunk size policy, if it has one
+ * Args: const char *rootdir     : Mirror root
+ *       unsigned chunk_shift    : The mount's chunk size
+ *       int adaptive            : Whether files no rule matches are auto
+ *       struct encr_chunks **cp : Set to the policy
+ * Return: 0 on success, -EINVAL for a bad rule (reported on stderr),
+ *         -errno on failure
+ */
+extern int encr_chunks_open(const char *rootdir, unsigned chunk_shift,
+			    int adaptive, struct encr_chunks **cp);
+
+/* void encr_chunks_close(struct encr_chunks *c)
+ * Purpose: Free c; c may be NULL
+ */
+extern void encr_chunks_close(struct encr_chunks *c);
+
+/* unsigned encr_chunks_new(const struct encr_chunks *c, const char *path)
+ * Purpose: Chunk size (as a shift) to create the file path with
+ */
+extern unsigned encr_chunks_new(const struct encr_chunks *c,
+				const char *path);
+
+/* int encr_chunks_auto(const struct encr_chunks *c, const char *path)
+ * Purpose: Whether the chunk size of path follows hints and writes
+ */
+extern int encr_chunks_auto(const struct encr_chunks *c, const char *path);
+
+/* unsigned encr_chunks_target(const struct encr_chunks *c, const char *path, int fd, unsigned cur)
+ * Purpose: Chunk size a rewrite should give the file path, open as fd
+ *          with chunk size cur
+ */
+extern unsigned encr_chunks_target(const struct encr_chunks *c,
+				   const char *path, int fd, unsigned cur);
+
+/* unsigned encr_chunks_for_size(off_t size)
+ * Purpose: Chunk size for a file of size bytes
+ */
+extern unsigned encr_chunks_for_size(off_t size);
+
+/* unsigned encr_chunk_shift(unsigned long long bytes)
+ * Purpose: log2 of a chunk size in bytes
+ * Return: The shift, or 0 if bytes is not a power of two between
+ *         ENCR_MIN_CHUNK_SHIFT and ENCR_MAX_CHUNK_SHIFT
+ */
+extern unsigned encr_chunk_shift(unsigned long long bytes);
+
+/* void encr_chunks_note(struct encr_inode *in, off_t off, size_t size)
+ * Purpose: Count a write of size bytes at off to in
+ */
+extern void encr_chunks_note(struct encr_inode *in, off_t off, size_t size);
+
+/* unsigned encr_chunks_observed(struct encr_inode *in, off_t size)
+ * Purpose: Chunk size the writes counted so far ask for, the file now
+ *          being size bytes, and start counting again
+ * Return: The shift, or 0 if too few were seen or they were mixed
+ */
+extern unsigned encr_chunks_observed(struct encr_inode *in, off_t size);
+
+#endif
@@ -0,0 +1,143 @@
+/* encfs-compress.c
+ * Per-chunk compression for pa5-encfs
+ *
+ * See encfs-compress.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "encfs-compress.h"
+
+struct encr_zstreams {
+	z_stream def;
+	z_stream inf;
+};
+
+static pthread_key_t zkey;
+static pthread_once_t zonce = PTHREAD_ONCE_INIT;
+
+static void encr_zstreams_free(void *data)
+{
+	struct encr_zstreams *z = data;
+
+	deflateEnd(&z->def);
+	inflateEnd(&z->inf);
+	free(z);
+}
+
+static void encr_zkey_init(void)
+{
+	pthread_key_create(&zkey, encr_zstreams_free);
+}
+
+// This thread's streams, set up on first use and freed when it exits
+static struct encr_zstreams *encr_zstreams(void)
+{
+	struct encr_zstreams *z;
+
+	pthread_once(&zonce, encr_zkey_init);
+	z = pthread_getspecific(zkey);
+	if (z != NULL)
+		return z;
+
+	z = calloc(1, sizeof(struct encr_zstreams));
+	if (z == NULL)
+		return NULL;
+	if (deflateInit(&z->def, Z_BEST_SPEED) != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	if (inflateInit(&z->inf) != Z_OK) {
+		deflateEnd(&z->def);
+		free(z);
+		return NULL;
+	}
+	if (pthread_setspecific(zkey, z) != 0) {
+		encr_zstreams_free(z);
+		return NULL;
+	}
+	return z;
+}
+
+ssize_t encr_chunk_pack(const struct encr_keys *k, uint64_t chunk,
+			const unsigned char *plain, size_t len, int compress,
+			unsigned char *rec, unsigned char *scratch)
+{
+	struct encr_zstreams *z = NULL;
+	size_t plen = 0;
+	int res;
+
+	if (compress) {
+		z = encr_zstreams();
+		if (z == NULL)
+			return -ENOMEM;
+	}
+
+	if (compress && len >= 64) {
+		deflateReset(&z->def);
+		z->def.next_in = (unsigned char *) plain;
+		z->def.avail_in = len;
+		z->def.next_out = scratch + 1;
+		z->def.avail_out = len - len / 8;
+		// Z_OK here means the output did not fit: not worth it
+		if (deflate(&z->def, Z_FINISH) == Z_STREAM_END) {
+			scratch[0] = ENCR_CODEC_ZLIB;
+			plen = 1 + z->def.total_out;
+		}
+	}
+	if (plen == 0) {
+		scratch[0] = ENCR_CODEC_RAW;
+		memcpy(scratch + 1, plain, len);
+		plen = 1 + len;
+	}
+
+	res = encr_chunk_seal(k, chunk, scratch, plen, rec);
+	if (res != 0)
+		return res;
+	return plen + ENCR_CHUNK_OVERHEAD;
+}
+
+int encr_chunk_unpack(const struct encr_keys *k, uint64_t chunk,
+		      unsigned char *rec, size_t reclen,
+		      unsigned char *plain, size_t cs)
+{
+	struct encr_zstreams *z;
+	unsigned char *payload = rec + ENCR_IV_SIZE;
+	int len;
+
+	// Decrypts in place, over the ciphertext once it is authenticated
+	len = encr_chunk_open(k, chunk, rec, reclen, payload);
+	if (len < 0)
+		return len;
+	if (len == 0)
+		return -EBADMSG;
+
+	switch (payload[0]) {
+	case ENCR_CODEC_RAW:
+		if ((size_t) len - 1 > cs)
+			return -EBADMSG;
+		memcpy(plain, payload + 1, len - 1);
+		return len - 1;
+	case ENCR_CODEC_ZLIB:
+		z = encr_zstreams();
+		if (z == NULL)
+			return -ENOMEM;
+		inflateReset(&z->inf);
+		z->inf.next_in = payload + 1;
+		z->inf.avail_in = len - 1;
+		z->inf.next_out = plain;
+		z->inf.avail_out = cs;
+		if (inflate(&z->inf, Z_FINISH) != Z_STREAM_END)
+			return -EBADMSG;
+		return z->inf.total_out;
+	default:
+		return -EBADMSG;
+	}
+}
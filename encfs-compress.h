@@ -0,0 +1,49 @@
+/* encfs-compress.h
+ * Per-chunk compression for pa5-encfs
+ *
+ * Files created while the mirror is mounted with -o compress have every
+ * chunk compressed before it is encrypted. The record plaintext is one
+ * codec byte followed by the compressed chunk; a chunk that does not
+ * shrink by at least an eighth is stored raw instead, so incompressible
+ * data costs one byte per chunk and no decompression. Each thread keeps
+ * its own zlib streams, so packing a chunk never allocates.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_COMPRESS_H
+#define ENCFS_COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+#define ENCR_CODEC_RAW 0
+#define ENCR_CODEC_ZLIB 1
+
+/* ssize_t encr_chunk_pack(const struct encr_keys *k, uint64_t chunk, const unsigned char *plain, size_t len, int compress, unsigned char *rec, unsigned char *scratch)
+ * Purpose: Compress len (<= chunk size) bytes of plaintext and seal them
+ *          into rec, which has room for a whole slot
+ * Args: int compress           : 0 to store the chunk raw without trying
+ *       unsigned char *scratch : len + 1 bytes of working space
+ * Return: Record length, or -errno on failure
+ */
+extern ssize_t encr_chunk_pack(const struct encr_keys *k, uint64_t chunk,
+			       const unsigned char *plain, size_t len,
+			       int compress, unsigned char *rec,
+			       unsigned char *scratch);
+
+/* int encr_chunk_unpack(const struct encr_keys *k, uint64_t chunk, unsigned char *rec, size_t reclen, unsigned char *plain, size_t cs)
+ * Purpose: Authenticate, decrypt and decompress a record read back from a
+ *          slot into plain, which has room for cs bytes; rec is used as
+ *          working space
+ * Return: Plaintext length, -EBADMSG if the record fails authentication
+ *         or does not decompress, -EIO on crypto failure
+ */
+extern int encr_chunk_unpack(const struct encr_keys *k, uint64_t chunk,
+			     unsigned char *rec, size_t reclen,
+			     unsigned char *plain, size_t cs);
+
+#endif
@@ -0,0 +1,150 @@
+/* encfs-cp.c
+ * Copy a file inside a pa5-encfs mount without a trip through userspace
+ *
+ * Asks the mount to do the copy with ENCR_IOC_COPY_RANGE (see
+ * encfs-ioctl.h). A whole encrypted file copied to a new one keeps its
+ * ciphertext, so the copy runs at backing disk speed, or instantly where
+ * the backing filesystem can reflink. Anywhere else (another filesystem,
+ * or a mount that does not know the ioctl) it falls back to read() and
+ * write().
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "encfs-ioctl.h"
+
+#define COPY_BUFSIZE (1024 * 1024)
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-cp <Source File> <Destination File>\n");
+	exit(EXIT_FAILURE);
+}
+
+static int stat_prefix(const char *path, size_t len, struct stat *st)
+{
+	char dir[PATH_MAX];
+
+	if (len == 0)
+		return stat("/", st);
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	return stat(dir, st);
+}
+
+/* Path of src from the root of the filesystem it is on, found by walking
+ * up its directories until the device changes */
+static int mount_relative(const char *src, char *rel, size_t size)
+{
+	char *path = realpath(src, NULL);
+	struct stat st;
+	struct stat up;
+	size_t root;
+	size_t parent;
+	int res = -1;
+
+	if (path == NULL)
+		return -1;
+	if (stat(path, &st) == -1)
+		goto out;
+	// path[0, root) is the directory being tried as the mount root
+	root = strrchr(path, '/') - path;
+	while (root > 0) {
+		parent = (char *) memrchr(path, '/', root) - path;
+		if (stat_prefix(path, parent, &up) == -1 ||
+		    up.st_dev != st.st_dev)
+			break;
+		root = parent;
+	}
+	if (snprintf(rel, size, "%s", path + root) >= (int) size)
+		errno = ENAMETOOLONG;
+	else
+		res = 0;
+out:
+	free(path);
+	return res;
+}
+
+static int copy_plain(int in, int out)
+{
+	char *buf = malloc(COPY_BUFSIZE);
+	ssize_t n;
+	ssize_t w;
+
+	if (buf == NULL)
+		return -1;
+	while ((n = read(in, buf, COPY_BUFSIZE)) > 0) {
+		for (w = 0; w < n; ) {
+			ssize_t r = write(out, buf + w, n - w);
+
+			if (r == -1) {
+				free(buf);
+				return -1;
+			}
+			w += r;
+		}
+	}
+	free(buf);
+	return n == -1 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct encr_copy_range cr;
+	struct stat sst;
+	struct stat dst;
+	int in;
+	int out;
+
+	if (argc != 3)
+		usage();
+
+	in = open(argv[1], O_RDONLY);
+	if (in == -1 || fstat(in, &sst) == -1) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, sst.st_mode & 07777);
+	if (out == -1 || fstat(out, &dst) == -1) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&cr, 0, sizeof(cr));
+	if (dst.st_dev == sst.st_dev && S_ISREG(sst.st_mode) &&
+	    mount_relative(argv[1], cr.src, sizeof(cr.src)) == 0) {
+		cr.len = sst.st_size;
+		if (ioctl(out, ENCR_IOC_COPY_RANGE, &cr) == 0 &&
+		    cr.copied == (uint64_t) sst.st_size)
+			return close(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		if (errno != ENOTTY && errno != ENOSYS && errno != EINVAL) {
+			perror(argv[2]);
+			return EXIT_FAILURE;
+		}
+		// Partly copied by the mount; the rest is just appended
+		if (lseek(in, cr.copied, SEEK_SET) == -1 ||
+		    lseek(out, cr.copied, SEEK_SET) == -1) {
+			perror(argv[2]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (copy_plain(in, out) == -1 || close(out) == -1) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	close(in);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,254 @@
+/* encfs-direct.c
+ * Aligned backing file I/O for pa5-encfs
+ *
+ * See encfs-direct.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "encfs-direct.h"
+
+#define DIO_MASK ((off_t) ENCR_DIO_ALIGN - 1)
+#define DIO_DOWN(x) ((x) & ~DIO_MASK)
+#define DIO_UP(x) (((x) + DIO_MASK) & ~DIO_MASK)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool[ENCR_DIO_POOL_MAX];
+static unsigned pool_idle;
+
+static void *encr_dio_get(void)
+{
+	void *b = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_idle > 0)
+		b = pool[--pool_idle];
+	pthread_mutex_unlock(&pool_lock);
+	if (b == NULL && posix_memalign(&b, ENCR_DIO_ALIGN,
+					ENCR_DIO_BUFSIZE) != 0)
+		return NULL;
+	return b;
+}
+
+static void encr_dio_put(void *b)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_idle < ENCR_DIO_POOL_MAX) {
+		pool[pool_idle++] = b;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(b);
+}
+
+/* Aligned pread of up to len bytes. A short read is the end of the file,
+ * which need not be aligned, so it is never continued. */
+static ssize_t encr_dio_fill(int fd, char *b, size_t len, off_t off)
+{
+	ssize_t res;
+
+	do
+		res = pread(fd, b, len, off);
+	while (res == -1 && errno == EINTR);
+	return res == -1 ? -errno : res;
+}
+
+ssize_t encr_dio_pread(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	char *b;
+	ssize_t n;
+
+	if (len == 0)
+		return 0;
+	b = encr_dio_get();
+	if (b == NULL)
+		return -ENOMEM;
+	while (done < len) {
+		off_t pos = off + done;
+		size_t skip = pos - DIO_DOWN(pos);
+		size_t want = DIO_UP((off_t) (skip + len - done));
+		size_t take;
+
+		if (want > ENCR_DIO_BUFSIZE)
+			want = ENCR_DIO_BUFSIZE;
+		n = encr_dio_fill(fd, b, want, DIO_DOWN(pos));
+		if (n < 0) {
+			encr_dio_put(b);
+			return n;
+		}
+		if ((size_t) n <= skip)
+			break;
+		take = n - skip < len - done ? n - skip : len - done;
+		memcpy((char *) buf + done, b + skip, take);
+		done += take;
+		if ((size_t) n < want)
+			break;
+	}
+	encr_dio_put(b);
+	return done;
+}
+
+static pthread_mutex_t block_locks[ENCR_DIO_STRIPES];
+static pthread_mutex_t grow_locks[ENCR_DIO_STRIPES];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void encr_dio_locks_init(void)
+{
+	int i;
+
+	for (i = 0; i < ENCR_DIO_STRIPES; i++) {
+		pthread_mutex_init(&block_locks[i], NULL);
+		pthread_mutex_init(&grow_locks[i], NULL);
+	}
+}
+
+// Stripe of block blk of a file; every fd of the file agrees on it
+static unsigned encr_dio_stripe(const struct stat *st, uint64_t blk)
+{
+	uint64_t h = ((uint64_t) st->st_dev * 31 + st->st_ino) *
+		0x9e3779b97f4a7c15ULL;
+
+	h ^= blk * 0xc2b2ae3d27d4eb4fULL;
+	return (h >> 32) % ENCR_DIO_STRIPES;
+}
+
+/* Write len bytes at off whose covering blocks fit in b. The first and
+ * last block, if the write only covers part of them, are read back and
+ * kept locked until they are written. */
+static ssize_t encr_dio_window(int fd, const struct stat *st, char *b,
+			       const char *src, size_t len, off_t off)
+{
+	off_t start = DIO_DOWN(off);
+	off_t end = DIO_UP(off + (off_t) len);
+	off_t tail = end - ENCR_DIO_ALIGN;
+	int head_part = off != start;
+	int tail_part = off + (off_t) len != end;
+	int l1 = -1, l2 = -1;
+	size_t done = 0;
+	ssize_t n = len;
+
+	if (head_part)
+		l1 = encr_dio_stripe(st, start / ENCR_DIO_ALIGN);
+	if (tail_part)
+		l2 = encr_dio_stripe(st, tail / ENCR_DIO_ALIGN);
+	if (l1 > l2) {
+		int t = l1;
+		l1 = l2;
+		l2 = t;
+	}
+	if (l1 == l2)
+		l1 = -1;
+	if (l1 != -1)
+		pthread_mutex_lock(&block_locks[l1]);
+	if (l2 != -1)
+		pthread_mutex_lock(&block_locks[l2]);
+
+	if (head_part) {
+		n = encr_dio_fill(fd, b, ENCR_DIO_ALIGN, start);
+		if (n < 0)
+			goto out;
+		memset(b + n, 0, ENCR_DIO_ALIGN - n);
+	}
+	if (tail_part && (tail != start || !head_part)) {
+		n = encr_dio_fill(fd, b + (tail - start), ENCR_DIO_ALIGN, tail);
+		if (n < 0)
+			goto out;
+		memset(b + (tail - start) + n, 0, ENCR_DIO_ALIGN - n);
+	}
+	memcpy(b + (off - start), src, len);
+
+	while (done < (size_t) (end - start)) {
+		n = pwrite(fd, b + done, end - start - done, start + done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			n = -errno;
+			goto out;
+		}
+		done += n;
+	}
+	n = len;
+out:
+	if (l2 != -1)
+		pthread_mutex_unlock(&block_locks[l2]);
+	if (l1 != -1)
+		pthread_mutex_unlock(&block_locks[l1]);
+	return n;
+}
+
+static ssize_t encr_dio_write(int fd, const struct stat *st, const char *buf,
+			      size_t len, off_t off)
+{
+	size_t done = 0;
+	char *b;
+	ssize_t n = 0;
+
+	b = encr_dio_get();
+	if (b == NULL)
+		return -ENOMEM;
+	while (done < len) {
+		off_t pos = off + done;
+		size_t room = DIO_DOWN(pos) + ENCR_DIO_BUFSIZE - pos;
+
+		n = encr_dio_window(fd, st, b, buf + done, room < len - done ?
+				    room : len - done, pos);
+		if (n < 0)
+			break;
+		done += n;
+	}
+	encr_dio_put(b);
+	return n < 0 ? n : (ssize_t) len;
+}
+
+ssize_t encr_dio_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	pthread_mutex_t *grow;
+	struct stat st;
+	off_t end = off + (off_t) len;
+	ssize_t res;
+
+	if (len == 0)
+		return 0;
+	pthread_once(&locks_once, encr_dio_locks_init);
+	/* A file mid-way through a rounded up write is less than one block
+	 * longer than it will be, so this much room means no growing */
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	if (end + ENCR_DIO_ALIGN <= st.st_size)
+		return encr_dio_write(fd, &st, buf, len, off);
+
+	grow = &grow_locks[encr_dio_stripe(&st, 0)];
+	pthread_mutex_lock(grow);
+	if (fstat(fd, &st) == -1) {
+		pthread_mutex_unlock(grow);
+		return -errno;
+	}
+	res = encr_dio_write(fd, &st, buf, len, off);
+	if (res >= 0 && DIO_UP(end) > st.st_size &&
+	    ftruncate(fd, end > st.st_size ? end : st.st_size) == -1)
+		res = -errno;
+	pthread_mutex_unlock(grow);
+	return res;
+}
+
+int encr_dio_enable(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+		return -errno;
+	return 0;
+}
@@ -0,0 +1,52 @@
+/* encfs-direct.h
+ * Aligned backing file I/O for pa5-encfs
+ *
+ * With -o direct_backing, encrypted backing files are opened O_DIRECT so
+ * the kernel caches their plaintext (through the mount) but not their
+ * ciphertext a second time. O_DIRECT wants the file offset, the length
+ * and the memory of every transfer aligned, and records, index entries
+ * and table entries are not: they sit one after another at odd offsets.
+ * These calls bounce through aligned buffers kept in a small pool,
+ * reading back the blocks at either end of a write that the write only
+ * partly covers. They work on any fd, O_DIRECT or not.
+ *
+ * A partly covered block holds bytes of whoever owns the rest of it, so
+ * its read-modify-write is done under a mutex striped by file and block;
+ * callers only need to keep their own bytes from being written twice at
+ * once, as the range locks already do. A write past the end of the file
+ * is rounded up to whole blocks and the file cut back afterwards; those
+ * are serialized per file so no one acts on the rounded size.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_DIRECT_H
+#define ENCFS_DIRECT_H
+
+#include <sys/types.h>
+
+#define ENCR_DIO_ALIGN 4096		// covers 512 and 4096 byte sectors
+#define ENCR_DIO_BUFSIZE (256 * 1024)	// one pooled bounce buffer
+#define ENCR_DIO_POOL_MAX 64		// idle buffers kept for reuse
+#define ENCR_DIO_STRIPES 64		// block and file mutexes
+
+/* ssize_t encr_dio_pread(int fd, void *buf, size_t len, off_t off)
+ * Purpose: pread() all of len bytes, short only at end of file
+ * Return: Bytes read, or -errno on failure
+ */
+extern ssize_t encr_dio_pread(int fd, void *buf, size_t len, off_t off);
+
+/* ssize_t encr_dio_pwrite(int fd, const void *buf, size_t len, off_t off)
+ * Purpose: pwrite() all of len bytes
+ * Return: len, or -errno on failure
+ */
+extern ssize_t encr_dio_pwrite(int fd, const void *buf, size_t len, off_t off);
+
+/* int encr_dio_enable(int fd)
+ * Purpose: Switch an open fd to O_DIRECT
+ * Return: 0 on success, -errno if the filesystem does not support it
+ */
+extern int encr_dio_enable(int fd);
+
+#endif
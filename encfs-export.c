@@ -0,0 +1,728 @@
+/* encfs-export.c
+ * Stream a pa5-encfs mirror, still encrypted, to one archive
+ *
+ * Writes every file, directory, link and xattr of the mirror, the .encfs
+ * directory and pack files included, to an archive stream (see
+ * encfs-archive.h) that encfs-import restores. Nothing is decrypted, so
+ * no key phrase is needed and the result is as safe to keep anywhere as
+ * the mirror itself; restored, it mounts with the same key phrase. The
+ * work is a pipeline so the stream is written as fast as the disks read:
+ *
+ *   walk    one thread lists the mirror and queues its entries in
+ *           order, each regular file as its header and runs of up to
+ *           ENCR_ARC_SEGMENT bytes
+ *   read    -j threads take queued entries as they come and fill them
+ *           in: xattrs, link targets, and each run's data, skipping
+ *           holes, at most -r MiB/s between them
+ *   write   the main thread writes filled entries out in queue order
+ *
+ * The queue holds at most EXPORT_QUEUE entries, so memory stays bounded
+ * however large the files. Run it on an unmounted mirror, or one that
+ * is not being written; a file changing under it is archived torn. A
+ * mirror striped over several roots is refused, as is any root of one:
+ * the archive would hold root 0 alone, and the data of every striped
+ * file past its first stripe would be missing (see encfs-roots.h).
+ *
+ * Usage: encfs-export [-j threads] [-r MiB/s] [-o archive] <Mirror Directory>
+ *   -o  write to archive (standard output by default, which must not be
+ *       a terminal); an archive inside the mirror is left out of itself
+ *
+ * Exits 1 if anything could not be read; what could is still written.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <search.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-archive.h"
+#include "encfs-roots.h"
+
+#define MAXTHREADS 256
+#define EXPORT_QUEUE 64			// entries between walk and write
+#define EXPORT_OUTBUF (1024 * 1024)	// bytes of headers gathered per write
+
+enum { JOB_QUEUED, JOB_READING, JOB_READY };
+
+// One entry of the stream, from the walk to the writer
+struct export_job {
+	struct encr_arc_entry e;
+	char *path;			// full path in the mirror
+	const char *name;		// in path, as archived
+	char *body;			// link target
+	char *xattrs;
+	unsigned char *data;
+	off_t off;			// DATA: the run to read
+	size_t len;
+	int state;
+	int err;			// -errno from reading it
+};
+
+// A file with more than one link, by the first name archived
+struct export_link {
+	dev_t dev;
+	ino_t ino;
+	char *name;
+};
+
+static struct {
+	const char *rootdir;
+	size_t rootlen;
+	struct export_job **jobs;	// ring of EXPORT_QUEUE
+	uint64_t head;			// next to write
+	uint64_t next;			// next to read
+	uint64_t tail;			// next to queue
+	int walked;
+	pthread_mutex_t lock;
+	pthread_cond_t space;		// walker waits for the writer
+	pthread_cond_t work;		// readers wait for the walker
+	pthread_cond_t ready;		// writer waits for the readers
+	void *links;			// tsearch() tree of struct export_link
+	dev_t out_dev;			// the archive, if it is a file
+	ino_t out_ino;
+	double rate;			// bytes per second, 0 for no limit
+	double next_io;
+	int out;
+	unsigned char outbuf[EXPORT_OUTBUF];
+	size_t outlen;
+	unsigned long entries;
+	unsigned long files;
+	unsigned long failed;
+	unsigned long long bytes;
+} ex;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-export [-j threads] [-r MiB/s] "
+		"[-o archive] <Mirror Directory>\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pace reads so all reader threads together stay under the rate
+static void throttle(size_t n)
+{
+	double t;
+	double wait;
+
+	if (ex.rate <= 0)
+		return;
+	pthread_mutex_lock(&ex.lock);
+	t = now();
+	if (ex.next_io < t)
+		ex.next_io = t;
+	wait = ex.next_io - t;
+	ex.next_io += n / ex.rate;
+	pthread_mutex_unlock(&ex.lock);
+	if (wait > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void job_free(struct export_job *j)
+{
+	free(j->path);
+	free(j->body);
+	free(j->xattrs);
+	free(j->data);
+	free(j);
+}
+
+static struct export_job *job_new(uint32_t type, const char *path,
+				  const struct stat *st)
+{
+	struct export_job *j = calloc(1, sizeof(struct export_job));
+
+	if (j == NULL || (j->path = strdup(path)) == NULL) {
+		free(j);
+		return NULL;
+	}
+	j->name = j->path[ex.rootlen] == '\0' ? "." : j->path + ex.rootlen + 1;
+	j->e.type = type;
+	if (type != ENCR_ARC_DATA) {
+		j->e.name_len = strlen(j->name);
+		j->e.mode = st->st_mode;
+		j->e.uid = st->st_uid;
+		j->e.gid = st->st_gid;
+		j->e.mtime_sec = st->st_mtim.tv_sec;
+		j->e.mtime_nsec = st->st_mtim.tv_nsec;
+	}
+	return j;
+}
+
+static void queue_job(struct export_job *j)
+{
+	pthread_mutex_lock(&ex.lock);
+	while (ex.tail - ex.head == EXPORT_QUEUE)
+		pthread_cond_wait(&ex.space, &ex.lock);
+	ex.jobs[ex.tail++ % EXPORT_QUEUE] = j;
+	pthread_cond_signal(&ex.work);
+	pthread_mutex_unlock(&ex.lock);
+}
+
+static int link_cmp(const void *a, const void *b)
+{
+	const struct export_link *x = a;
+	const struct export_link *y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// The name already archived for st's inode, or NULL after noting name
+static const char *link_seen(const struct stat *st, const char *name)
+{
+	struct export_link key;
+	struct export_link *l;
+	void *found;
+
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+	found = tfind(&key, &ex.links, link_cmp);
+	if (found != NULL)
+		return (*(struct export_link **) found)->name;
+	l = malloc(sizeof(struct export_link));
+	if (l == NULL || (l->name = strdup(name)) == NULL) {
+		free(l);
+		return NULL;		// archived again in full
+	}
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	if (tsearch(l, &ex.links, link_cmp) == NULL) {
+		free(l->name);
+		free(l);
+	}
+	return NULL;
+}
+
+static int queue_file(const char *path, const struct stat *st)
+{
+	struct export_job *j;
+	const char *first = NULL;
+	off_t off;
+
+	j = job_new(ENCR_ARC_FILE, path, st);
+	if (j == NULL)
+		return -ENOMEM;
+	if (st->st_nlink > 1)
+		first = link_seen(st, j->name);
+	if (first != NULL) {
+		j->e.type = ENCR_ARC_LINK;
+		j->body = strdup(first);
+		if (j->body == NULL) {
+			job_free(j);
+			return -ENOMEM;
+		}
+		j->e.size = strlen(first);
+		queue_job(j);
+		return 0;
+	}
+	j->e.size = st->st_size;
+	queue_job(j);
+	ex.files++;
+	for (off = 0; off < st->st_size; off += ENCR_ARC_SEGMENT) {
+		j = job_new(ENCR_ARC_DATA, path, st);
+		if (j == NULL)
+			return -ENOMEM;
+		j->off = off;
+		j->len = st->st_size - off < ENCR_ARC_SEGMENT ?
+			(size_t) (st->st_size - off) : ENCR_ARC_SEGMENT;
+		queue_job(j);
+	}
+	return 0;
+}
+
+static int walk_visit(const char *path, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	struct export_job *j = NULL;
+	int res = 0;
+
+	(void) ftw;
+	switch (type) {
+	case FTW_D:
+		j = job_new(ENCR_ARC_DIR, path, st);
+		break;
+	case FTW_SL:
+		j = job_new(ENCR_ARC_SYMLINK, path, st);
+		break;
+	case FTW_F:
+		if (S_ISREG(st->st_mode)) {
+			if (st->st_dev == ex.out_dev && st->st_ino == ex.out_ino)
+				return FTW_CONTINUE;
+			res = queue_file(path, st);
+		} else if (S_ISFIFO(st->st_mode) || S_ISCHR(st->st_mode) ||
+			   S_ISBLK(st->st_mode)) {
+			j = job_new(ENCR_ARC_NODE, path, st);
+			if (j != NULL)
+				j->e.offset = st->st_rdev;
+		} else {
+			fprintf(stderr, "%s: not archived: a socket\n", path);
+			return FTW_CONTINUE;
+		}
+		break;
+	default:
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		__atomic_fetch_add(&ex.failed, 1, __ATOMIC_RELAXED);
+		return FTW_CONTINUE;
+	}
+	if (type != FTW_F || !S_ISREG(st->st_mode)) {
+		if (j == NULL)
+			res = -ENOMEM;
+		else
+			queue_job(j);
+	}
+	if (res != 0) {
+		errno = -res;
+		return FTW_STOP;
+	}
+	return FTW_CONTINUE;
+}
+
+static void *walk_thread(void *data)
+{
+	(void) data;
+	if (nftw(ex.rootdir, walk_visit, 64, FTW_PHYS | FTW_ACTIONRETVAL)
+	    != 0) {
+		fprintf(stderr, "%s: walk stopped: %s\n", ex.rootdir,
+			strerror(errno));
+		__atomic_fetch_add(&ex.failed, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&ex.lock);
+	ex.walked = 1;
+	pthread_cond_broadcast(&ex.work);
+	pthread_cond_signal(&ex.ready);
+	pthread_mutex_unlock(&ex.lock);
+	return NULL;
+}
+
+// Every xattr of path, as the archive lays them out
+static int read_xattrs(struct export_job *j)
+{
+	char *names = NULL;
+	char *blob = NULL;
+	size_t used = 0;
+	ssize_t len;
+	ssize_t vlen;
+	char *n;
+
+	len = llistxattr(j->path, NULL, 0);
+	if (len <= 0)
+		return len == -1 && errno != ENOTSUP ? -errno : 0;
+	names = malloc(len);
+	if (names == NULL)
+		return -ENOMEM;
+	len = llistxattr(j->path, names, len);
+	if (len == -1) {
+		free(names);
+		return -errno;
+	}
+	for (n = names; n < names + len; n += strlen(n) + 1) {
+		size_t nlen = strlen(n);
+		char *p;
+
+		vlen = lgetxattr(j->path, n, NULL, 0);
+		if (vlen == -1 && errno == ENODATA)
+			continue;	// removed since it was listed
+		if (vlen == -1)
+			goto fail;
+		if (used + 8 + nlen + vlen > ENCR_ARC_MAX_XATTRS) {
+			errno = E2BIG;
+			goto fail;
+		}
+		p = realloc(blob, used + 8 + nlen + vlen);
+		if (p == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		blob = p;
+		vlen = lgetxattr(j->path, n, blob + used + 8 + nlen, vlen);
+		if (vlen == -1)
+			goto fail;
+		blob[used] = nlen & 0xff;
+		blob[used + 1] = (nlen >> 8) & 0xff;
+		blob[used + 2] = blob[used + 3] = 0;
+		blob[used + 4] = vlen & 0xff;
+		blob[used + 5] = (vlen >> 8) & 0xff;
+		blob[used + 6] = (vlen >> 16) & 0xff;
+		blob[used + 7] = (vlen >> 24) & 0xff;
+		memcpy(blob + used + 8, n, nlen);
+		used += 8 + nlen + vlen;
+	}
+	free(names);
+	j->xattrs = blob;
+	j->e.xattr_len = used;
+	return 0;
+fail:
+	len = -errno;
+	free(names);
+	free(blob);
+	return len;
+}
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, off + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+// The data of a run, from its first byte of data to its last
+static int read_run(struct export_job *j)
+{
+	off_t end = j->off + j->len;
+	off_t data;
+	off_t hole;
+	ssize_t n;
+	int fd;
+
+	fd = open(j->path, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+	if (fd == -1 && errno == EPERM)
+		fd = open(j->path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	data = lseek(fd, j->off, SEEK_DATA);
+	if (data == -1 && errno == ENXIO)
+		data = end;		// a hole to the end of the file
+	else if (data == -1)
+		data = j->off;		// no SEEK_DATA: read it all
+	if (data < end) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole != -1 && hole < end) {
+			off_t more = lseek(fd, hole, SEEK_DATA);
+
+			if ((more == -1 && errno == ENXIO) || more >= end)
+				end = hole;
+		}
+		j->data = malloc(end - data);
+		if (j->data == NULL) {
+			close(fd);
+			return -ENOMEM;
+		}
+		throttle(end - data);
+		n = read_full(fd, j->data, end - data, data);
+		if (n < 0) {
+			close(fd);
+			return n;
+		}
+		j->e.offset = data;
+		j->e.size = n;
+	}
+	close(fd);
+	return 0;
+}
+
+static int read_job(struct export_job *j)
+{
+	char target[PATH_MAX];
+	ssize_t len;
+
+	switch (j->e.type) {
+	case ENCR_ARC_DATA:
+		return read_run(j);
+	case ENCR_ARC_LINK:
+		return 0;
+	case ENCR_ARC_SYMLINK:
+		len = readlink(j->path, target, sizeof(target) - 1);
+		if (len <= 0)
+			return len == 0 ? -EINVAL : -errno;
+		j->body = strndup(target, len);
+		if (j->body == NULL)
+			return -ENOMEM;
+		j->e.size = len;
+		break;
+	}
+	return read_xattrs(j);
+}
+
+static void *read_thread(void *data)
+{
+	struct export_job *j;
+
+	(void) data;
+	pthread_mutex_lock(&ex.lock);
+	for (;;) {
+		while (ex.next == ex.tail && !ex.walked)
+			pthread_cond_wait(&ex.work, &ex.lock);
+		if (ex.next == ex.tail)
+			break;
+		j = ex.jobs[ex.next++ % EXPORT_QUEUE];
+		j->state = JOB_READING;
+		pthread_mutex_unlock(&ex.lock);
+
+		j->err = read_job(j);
+
+		pthread_mutex_lock(&ex.lock);
+		j->state = JOB_READY;
+		pthread_cond_signal(&ex.ready);
+	}
+	pthread_mutex_unlock(&ex.lock);
+	return NULL;
+}
+
+static void write_full(const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(ex.out, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			perror("archive write error");
+			exit(EXIT_FAILURE);
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+static void out_flush(void)
+{
+	write_full(ex.outbuf, ex.outlen);
+	ex.outlen = 0;
+}
+
+// Small pieces are gathered, large ones written straight through
+static void out_put(const void *buf, size_t len)
+{
+	if (ex.outlen + len > EXPORT_OUTBUF || len >= EXPORT_OUTBUF / 2)
+		out_flush();
+	if (len >= EXPORT_OUTBUF / 2) {
+		write_full(buf, len);
+		return;
+	}
+	memcpy(ex.outbuf + ex.outlen, buf, len);
+	ex.outlen += len;
+}
+
+static void write_entry(const struct encr_arc_entry *e, const char *name,
+			const void *body, const void *xattrs)
+{
+	unsigned char hdr[ENCR_ARC_HDR_SIZE];
+
+	encr_arc_encode(e, hdr);
+	out_put(hdr, sizeof(hdr));
+	out_put(name, e->name_len);
+	out_put(body, encr_arc_body_len(e));
+	out_put(xattrs, e->xattr_len);
+}
+
+static void write_job(struct export_job *j)
+{
+	if (j->err != 0) {
+		fprintf(stderr, "%s: %s\n", j->path, strerror(-j->err));
+		__atomic_fetch_add(&ex.failed, 1, __ATOMIC_RELAXED);
+		// The entry is still needed for what follows it
+		if (j->e.type == ENCR_ARC_DATA)
+			return;
+		if (j->e.type == ENCR_ARC_SYMLINK && j->body == NULL)
+			return;
+		free(j->xattrs);
+		j->xattrs = NULL;
+		j->e.xattr_len = 0;
+	}
+	if (j->e.type == ENCR_ARC_DATA) {
+		if (j->e.size == 0)
+			return;		// all hole
+		write_entry(&j->e, "", j->data, NULL);
+		ex.entries++;
+		ex.bytes += j->e.size;
+		return;
+	}
+	write_entry(&j->e, j->name, j->body, j->xattrs);
+	ex.entries++;
+}
+
+static void write_all(void)
+{
+	struct encr_arc_entry end;
+	struct export_job *j;
+
+	out_put(ENCR_ARC_MAGIC, ENCR_ARC_MAGIC_SIZE);
+	pthread_mutex_lock(&ex.lock);
+	for (;;) {
+		while (!(ex.head < ex.tail && ex.jobs[ex.head % EXPORT_QUEUE]->
+			 state == JOB_READY) && !(ex.walked &&
+						  ex.head == ex.tail))
+			pthread_cond_wait(&ex.ready, &ex.lock);
+		if (ex.head == ex.tail)
+			break;
+		j = ex.jobs[ex.head % EXPORT_QUEUE];
+		pthread_mutex_unlock(&ex.lock);
+
+		write_job(j);
+		job_free(j);
+
+		pthread_mutex_lock(&ex.lock);
+		ex.head++;
+		pthread_cond_signal(&ex.space);
+	}
+	pthread_mutex_unlock(&ex.lock);
+
+	memset(&end, 0, sizeof(end));
+	end.type = ENCR_ARC_END;
+	end.offset = ex.entries;
+	end.size = ex.bytes;
+	write_entry(&end, "", NULL, NULL);
+	out_flush();
+}
+
+/* How many roots the mirror's .encfs/roots records, 1 if it has none;
+ * 0 for a root other than the first, or a roots file that is corrupt */
+static unsigned export_roots(const char *rootdir)
+{
+	char path[PATH_MAX];
+	unsigned count;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_ROOT_FILE);
+	if (access(path, F_OK) == 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_ROOTS_FILE);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 1;
+	if (fscanf(f, "%*s %*u id %*s %*s %u", &count) != 1)
+		count = 0;
+	fclose(f);
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t readers[MAXTHREADS];
+	pthread_t walker;
+	const char *out = NULL;
+	struct stat st;
+	double start;
+	double elapsed;
+	int nread = 4;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "j:r:o:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nread = atoi(optarg);
+			if (nread < 1 || nread > MAXTHREADS)
+				usage();
+			break;
+		case 'r':
+			ex.rate = atof(optarg) * 1024 * 1024;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	ex.rootdir = realpath(argv[optind], NULL);
+	if (ex.rootdir == NULL) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	ex.rootlen = strlen(ex.rootdir);
+	if (export_roots(ex.rootdir) != 1) {
+		fprintf(stderr, "encfs-export: %s is striped over several "
+			"roots, whose parts an archive cannot hold\n",
+			ex.rootdir);
+		return EXIT_FAILURE;
+	}
+	if (out != NULL) {
+		ex.out = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (ex.out == -1) {
+			perror(out);
+			return EXIT_FAILURE;
+		}
+	} else if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "encfs-export: not writing an archive to a "
+			"terminal; use -o or a pipe\n");
+		return EXIT_FAILURE;
+	} else {
+		ex.out = STDOUT_FILENO;
+	}
+	if (fstat(ex.out, &st) == 0 && S_ISREG(st.st_mode)) {
+		ex.out_dev = st.st_dev;
+		ex.out_ino = st.st_ino;
+	}
+	ex.jobs = calloc(EXPORT_QUEUE, sizeof(struct export_job *));
+	if (ex.jobs == NULL) {
+		perror("malloc error");
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.space, NULL);
+	pthread_cond_init(&ex.work, NULL);
+	pthread_cond_init(&ex.ready, NULL);
+
+	start = now();
+	if (pthread_create(&walker, NULL, walk_thread, NULL) != 0) {
+		perror("pthread_create error");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nread; i++)
+		if (pthread_create(&readers[i], NULL, read_thread, NULL) != 0) {
+			perror("pthread_create error");
+			return EXIT_FAILURE;
+		}
+	write_all();
+	pthread_join(walker, NULL);
+	for (i = 0; i < nread; i++)
+		pthread_join(readers[i], NULL);
+	if (out != NULL && (fsync(ex.out) != 0 || close(ex.out) != 0)) {
+		perror(out);
+		return EXIT_FAILURE;
+	}
+	elapsed = now() - start;
+
+	fprintf(stderr, "%lu entries, %lu files, %llu bytes of data exported "
+		"in %.1f s (%.1f MiB/s), %lu failed\n", ex.entries, ex.files,
+		ex.bytes, elapsed, elapsed > 0 ?
+		ex.bytes / elapsed / (1024 * 1024) : 0, ex.failed);
+	return ex.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,513 @@
+/* encfs-format.c
+ * On-disk format of the pa5-encfs encrypted mirror
+ *
+ * See encfs-format.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/crypto.h>
+
+#include "aes-crypt.h"
+#include "encfs-format.h"
+
+#define ENCR_CONFIG_MAGIC "pa5-encfs"
+#define ENCR_CHECK_LABEL "pa5-encfs mount key check"
+
+/* Header layout */
+#define HDR_VERSION 8		// u16, little endian
+#define HDR_CHUNK_SHIFT 10	// u8
+#define HDR_WIDTH 11		// u8, 0 unless striped
+#define HDR_FLAGS 12		// u32, little endian
+#define HDR_WRAP_IV 16
+#define HDR_WRAPPED 32
+#define HDR_WRAP_TAG (HDR_WRAPPED + 2 * ENCR_KEY_SIZE)
+#define HDR_AUTH_LEN HDR_WRAP_IV	// bytes covered by the tag besides the wrap
+#define HDR_SIZE (ENCR_HEADER_SIZE - ENCR_SIZE_FIELD)
+#define SIZE_LABEL "pa5-encfs size"
+#define DEDUP_LABEL "pa5-encfs chunk ref"
+
+static void encr_hex(char *out, const unsigned char *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+static int encr_unhex(unsigned char *out, const char *in, size_t len)
+{
+	unsigned v;
+	size_t i;
+
+	if (strlen(in) != 2 * len)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (sscanf(in + 2 * i, "%2x", &v) != 1)
+			return -1;
+		out[i] = v;
+	}
+	return 0;
+}
+
+int encr_config_read(const char *path, struct encr_config *cfg)
+{
+	FILE *f;
+	char key[32];
+	char val[128];
+	int seen = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+	memset(cfg, 0, sizeof(struct encr_config));
+	while (fscanf(f, "%31s %127s", key, val) == 2) {
+		if (!strcmp(key, ENCR_CONFIG_MAGIC)) {
+			cfg->version = atoi(val);
+			seen |= 1;
+		} else if (!strcmp(key, "iterations")) {
+			cfg->iterations = strtoul(val, NULL, 10);
+			seen |= 2;
+		} else if (!strcmp(key, "salt")) {
+			if (encr_unhex(cfg->salt, val, ENCR_SALT_SIZE) == 0)
+				seen |= 4;
+		} else if (!strcmp(key, "check")) {
+			if (encr_unhex(cfg->check, val, ENCR_TAG_SIZE) == 0)
+				seen |= 8;
+		}
+	}
+	fclose(f);
+
+	if (seen != 15 || cfg->version == 0 || cfg->iterations == 0)
+		return -EINVAL;
+	return 0;
+}
+
+int encr_config_write(const char *path, const struct encr_config *cfg)
+{
+	char tmp[4096];
+	char salt[2 * ENCR_SALT_SIZE + 1];
+	char check[2 * ENCR_TAG_SIZE + 1];
+	FILE *f;
+	int res = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	encr_hex(salt, cfg->salt, ENCR_SALT_SIZE);
+	encr_hex(check, cfg->check, ENCR_TAG_SIZE);
+
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return -errno;
+	fprintf(f, "%s %u\niterations %u\nsalt %s\ncheck %s\n",
+		ENCR_CONFIG_MAGIC, cfg->version, cfg->iterations, salt, check);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		res = -errno;
+	if (fclose(f) != 0 && res == 0)
+		res = -errno;
+	if (res == 0 && rename(tmp, path) == -1)
+		res = -errno;
+	if (res != 0)
+		unlink(tmp);
+	return res;
+}
+
+static int encr_config_check(const struct encr_keys *mk, unsigned char *check)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	if (!hmac_sha256(mk->mac, ENCR_KEY_SIZE,
+			 (const unsigned char *) ENCR_CHECK_LABEL,
+			 strlen(ENCR_CHECK_LABEL), NULL, 0, mac))
+		return -EIO;
+	memcpy(check, mac, ENCR_TAG_SIZE);
+	return 0;
+}
+
+static int encr_config_derive(const struct encr_config *cfg,
+			      const char *phrase, struct encr_keys *mk)
+{
+	unsigned char out[2 * ENCR_KEY_SIZE];
+
+	if (!derive_key(phrase, cfg->salt, ENCR_SALT_SIZE, cfg->iterations,
+			out, sizeof(out)))
+		return -EIO;
+	memcpy(mk->enc, out, ENCR_KEY_SIZE);
+	memcpy(mk->mac, out + ENCR_KEY_SIZE, ENCR_KEY_SIZE);
+	OPENSSL_cleanse(out, sizeof(out));
+	return 0;
+}
+
+int encr_config_init(struct encr_config *cfg, const char *phrase,
+		     struct encr_keys *mk)
+{
+	int res;
+
+	memset(cfg, 0, sizeof(struct encr_config));
+	cfg->version = ENCR_FORMAT_VERSION;
+	cfg->iterations = ENCR_DEFAULT_ITERATIONS;
+	if (!random_bytes(cfg->salt, ENCR_SALT_SIZE))
+		return -EIO;
+	res = encr_config_derive(cfg, phrase, mk);
+	if (res != 0)
+		return res;
+	return encr_config_check(mk, cfg->check);
+}
+
+int encr_config_unlock(const struct encr_config *cfg, const char *phrase,
+		       struct encr_keys *mk)
+{
+	unsigned char check[ENCR_TAG_SIZE];
+	int res;
+
+	res = encr_config_derive(cfg, phrase, mk);
+	if (res == 0)
+		res = encr_config_check(mk, check);
+	if (res != 0)
+		return res;
+	if (CRYPTO_memcmp(check, cfg->check, ENCR_TAG_SIZE) != 0) {
+		OPENSSL_cleanse(mk, sizeof(struct encr_keys));
+		return -EACCES;
+	}
+	return 0;
+}
+
+int encr_header_init(struct encr_header *h, unsigned chunk_shift)
+{
+	memset(h, 0, sizeof(struct encr_header));
+	h->version = ENCR_FORMAT_VERSION;
+	h->chunk_shift = chunk_shift;
+	if (!random_bytes(h->keys.enc, ENCR_KEY_SIZE) ||
+	    !random_bytes(h->keys.mac, ENCR_KEY_SIZE))
+		return -EIO;
+	return 0;
+}
+
+int encr_header_encode(const struct encr_header *h, const struct encr_keys *mk,
+		       unsigned char *buf)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	memset(buf, 0, HDR_SIZE);
+	memcpy(buf, ENCR_MAGIC, ENCR_MAGIC_LEN);
+	buf[HDR_VERSION] = h->version & 0xff;
+	buf[HDR_VERSION + 1] = (h->version >> 8) & 0xff;
+	buf[HDR_CHUNK_SHIFT] = h->chunk_shift;
+	buf[HDR_WIDTH] = h->flags & ENCR_FLAG_STRIPED ? h->width : 0;
+	buf[HDR_FLAGS] = h->flags & 0xff;
+	buf[HDR_FLAGS + 1] = (h->flags >> 8) & 0xff;
+	buf[HDR_FLAGS + 2] = (h->flags >> 16) & 0xff;
+	buf[HDR_FLAGS + 3] = (h->flags >> 24) & 0xff;
+
+	if (!random_bytes(buf + HDR_WRAP_IV, ENCR_IV_SIZE))
+		return -EIO;
+	memcpy(buf + HDR_WRAPPED, h->keys.enc, ENCR_KEY_SIZE);
+	memcpy(buf + HDR_WRAPPED + ENCR_KEY_SIZE, h->keys.mac, ENCR_KEY_SIZE);
+	if (!aes_ctr_crypt(mk->enc, buf + HDR_WRAP_IV, buf + HDR_WRAPPED,
+			   buf + HDR_WRAPPED, 2 * ENCR_KEY_SIZE))
+		return -EIO;
+	// Authenticates the plain fields along with the wrapped keys
+	if (!hmac_sha256(mk->mac, ENCR_KEY_SIZE, buf, HDR_AUTH_LEN,
+			 buf + HDR_WRAP_IV, HDR_WRAP_TAG - HDR_WRAP_IV, mac))
+		return -EIO;
+	memcpy(buf + HDR_WRAP_TAG, mac, ENCR_TAG_SIZE);
+	return 0;
+}
+
+int encr_header_peek(const unsigned char *buf, unsigned *chunk_shift)
+{
+	if (memcmp(buf, ENCR_MAGIC, ENCR_MAGIC_LEN) != 0)
+		return -EINVAL;
+	if (buf[HDR_CHUNK_SHIFT] < ENCR_MIN_CHUNK_SHIFT ||
+	    buf[HDR_CHUNK_SHIFT] > ENCR_MAX_CHUNK_SHIFT)
+		return -EINVAL;
+	*chunk_shift = buf[HDR_CHUNK_SHIFT];
+	return 0;
+}
+
+int encr_header_decode(struct encr_header *h, const struct encr_keys *mk,
+		       const unsigned char *buf)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char keys[2 * ENCR_KEY_SIZE];
+	int res;
+
+	memset(h, 0, sizeof(struct encr_header));
+	res = encr_header_peek(buf, &h->chunk_shift);
+	if (res != 0)
+		return res;
+	h->version = buf[HDR_VERSION] | (buf[HDR_VERSION + 1] << 8);
+	if (h->version == 0 || h->version > ENCR_FORMAT_VERSION)
+		return -EINVAL;
+	h->flags = encr_header_peek_flags(buf);
+	if (h->flags & ~ENCR_KNOWN_FLAGS)
+		return -EINVAL;
+	h->width = buf[HDR_WIDTH];
+	if ((h->flags & ENCR_FLAG_STRIPED) && h->width < 2)
+		return -EINVAL;
+
+	if (!hmac_sha256(mk->mac, ENCR_KEY_SIZE, buf, HDR_AUTH_LEN,
+			 buf + HDR_WRAP_IV, HDR_WRAP_TAG - HDR_WRAP_IV, mac))
+		return -EIO;
+	if (CRYPTO_memcmp(mac, buf + HDR_WRAP_TAG, ENCR_TAG_SIZE) != 0)
+		return -EBADMSG;
+	if (!aes_ctr_crypt(mk->enc, buf + HDR_WRAP_IV, buf + HDR_WRAPPED,
+			   keys, sizeof(keys)))
+		return -EIO;
+	memcpy(h->keys.enc, keys, ENCR_KEY_SIZE);
+	memcpy(h->keys.mac, keys + ENCR_KEY_SIZE, ENCR_KEY_SIZE);
+	OPENSSL_cleanse(keys, sizeof(keys));
+	return 0;
+}
+
+unsigned encr_header_peek_flags(const unsigned char *buf)
+{
+	return (unsigned) buf[HDR_FLAGS] |
+		((unsigned) buf[HDR_FLAGS + 1] << 8) |
+		((unsigned) buf[HDR_FLAGS + 2] << 16) |
+		((unsigned) buf[HDR_FLAGS + 3] << 24);
+}
+
+int encr_header_peek_size(const unsigned char *buf, off_t backing_size,
+			  off_t *plain)
+{
+	unsigned shift;
+	uint64_t size = 0;
+	int res;
+	int i;
+
+	res = encr_header_peek(buf, &shift);
+	if (res != 0)
+		return res;
+	if (!(encr_header_peek_flags(buf) & ENCR_SIZED_FLAGS)) {
+		*plain = encr_plain_size(backing_size, shift);
+		return 0;
+	}
+	for (i = 7; i >= 0; i--)
+		size = (size << 8) | buf[HDR_SIZE + i];
+	*plain = size;
+	return 0;
+}
+
+static int encr_size_tag(const struct encr_keys *k, const unsigned char *field,
+			 unsigned char *tag)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE, (const unsigned char *) SIZE_LABEL,
+			 strlen(SIZE_LABEL), field, 8, mac))
+		return -EIO;
+	memcpy(tag, mac, ENCR_SIZE_FIELD - 8);
+	return 0;
+}
+
+int encr_size_encode(const struct encr_keys *k, uint64_t size,
+		     unsigned char *field)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		field[i] = (size >> (8 * i)) & 0xff;
+	return encr_size_tag(k, field, field + 8);
+}
+
+int encr_size_decode(const struct encr_keys *k, const unsigned char *field,
+		     uint64_t *size)
+{
+	unsigned char tag[ENCR_SIZE_FIELD - 8];
+	int res;
+	int i;
+
+	res = encr_size_tag(k, field, tag);
+	if (res != 0)
+		return res;
+	if (CRYPTO_memcmp(tag, field + 8, sizeof(tag)) != 0)
+		return -EBADMSG;
+	*size = 0;
+	for (i = 7; i >= 0; i--)
+		*size = (*size << 8) | field[i];
+	return 0;
+}
+
+off_t encr_plain_size(off_t backing_size, unsigned chunk_shift)
+{
+	off_t rs = ((off_t) 1 << chunk_shift) + ENCR_CHUNK_OVERHEAD;
+	off_t full;
+	off_t rem;
+
+	if (backing_size <= ENCR_HEADER_SIZE)
+		return 0;
+	backing_size -= ENCR_HEADER_SIZE;
+	full = backing_size / rs;
+	rem = backing_size % rs;
+	return (full << chunk_shift) +
+		(rem > ENCR_CHUNK_OVERHEAD ? rem - ENCR_CHUNK_OVERHEAD : 0);
+}
+
+off_t encr_backing_size(off_t plain_size, unsigned chunk_shift)
+{
+	off_t rs = ((off_t) 1 << chunk_shift) + ENCR_CHUNK_OVERHEAD;
+	off_t rem = plain_size & (((off_t) 1 << chunk_shift) - 1);
+
+	return ENCR_HEADER_SIZE + (plain_size >> chunk_shift) * rs +
+		(rem ? rem + ENCR_CHUNK_OVERHEAD : 0);
+}
+
+off_t encr_record_offset(uint64_t chunk, unsigned chunk_shift)
+{
+	off_t rs = ((off_t) 1 << chunk_shift) + ENCR_CHUNK_OVERHEAD;
+
+	return ENCR_HEADER_SIZE + (off_t) chunk * rs;
+}
+
+size_t encr_cslot_size(unsigned chunk_shift)
+{
+	return ((size_t) 1 << chunk_shift) + ENCR_CHUNK_OVERHEAD + 1;
+}
+
+// A group is one index block followed by ENCR_CINDEX_GROUP slots
+static off_t encr_cgroup_offset(uint64_t chunk, unsigned chunk_shift)
+{
+	off_t gs = ENCR_CINDEX_GROUP * ENCR_CINDEX_ENTRY +
+		ENCR_CINDEX_GROUP * (off_t) encr_cslot_size(chunk_shift);
+
+	return ENCR_HEADER_SIZE + (off_t) (chunk / ENCR_CINDEX_GROUP) * gs;
+}
+
+off_t encr_cslot_offset(uint64_t chunk, unsigned chunk_shift)
+{
+	return encr_cgroup_offset(chunk, chunk_shift) +
+		ENCR_CINDEX_GROUP * ENCR_CINDEX_ENTRY +
+		(off_t) (chunk % ENCR_CINDEX_GROUP) * encr_cslot_size(chunk_shift);
+}
+
+off_t encr_cindex_offset(uint64_t chunk, unsigned chunk_shift)
+{
+	return encr_cgroup_offset(chunk, chunk_shift) +
+		(off_t) (chunk % ENCR_CINDEX_GROUP) * ENCR_CINDEX_ENTRY;
+}
+
+static int encr_chunk_tag(const struct encr_keys *k, uint64_t chunk,
+			  const unsigned char *rec, size_t len,
+			  unsigned char *tag)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char aad[8 + ENCR_IV_SIZE];
+	int i;
+
+	// Binds the record to its position so chunks cannot be swapped
+	for (i = 0; i < 8; i++)
+		aad[i] = (chunk >> (56 - 8 * i)) & 0xff;
+	memcpy(aad + 8, rec, ENCR_IV_SIZE);
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE, aad, sizeof(aad),
+			 rec + ENCR_IV_SIZE, len, mac))
+		return -EIO;
+	memcpy(tag, mac, ENCR_TAG_SIZE);
+	return 0;
+}
+
+int encr_chunk_seal(const struct encr_keys *k, uint64_t chunk,
+		    const unsigned char *plain, size_t len, unsigned char *rec)
+{
+	if (!random_bytes(rec, ENCR_IV_SIZE))
+		return -EIO;
+	if (!aes_ctr_crypt(k->enc, rec, plain, rec + ENCR_IV_SIZE, len))
+		return -EIO;
+	return encr_chunk_tag(k, chunk, rec, len, rec + ENCR_IV_SIZE + len);
+}
+
+static int encr_all_zero(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+int encr_chunk_open(const struct encr_keys *k, uint64_t chunk,
+		    const unsigned char *rec, size_t reclen,
+		    unsigned char *plain)
+{
+	unsigned char tag[ENCR_TAG_SIZE];
+	size_t len;
+	int res;
+
+	if (reclen == 0)
+		return 0;
+	if (reclen <= ENCR_CHUNK_OVERHEAD)
+		return -EBADMSG;
+	len = reclen - ENCR_CHUNK_OVERHEAD;
+
+	/* Only a record that is zeros through and through is a hole: one
+	 * with its IV and tag zeroed over real ciphertext is tampering. A
+	 * random IV is all zeros with no real chance, so that goes first */
+	if (encr_all_zero(rec, ENCR_IV_SIZE) && encr_all_zero(rec, reclen)) {
+		memset(plain, 0, len);
+		return len;
+	}
+
+	res = encr_chunk_tag(k, chunk, rec, len, tag);
+	if (res != 0)
+		return res;
+	if (CRYPTO_memcmp(tag, rec + ENCR_IV_SIZE + len, ENCR_TAG_SIZE) != 0)
+		return -EBADMSG;
+	if (!aes_ctr_crypt(k->enc, rec, rec + ENCR_IV_SIZE, plain, len))
+		return -EIO;
+	return len;
+}
+
+off_t encr_dedup_offset(uint64_t chunk)
+{
+	return ENCR_HEADER_SIZE + (off_t) chunk * ENCR_DEDUP_ENTRY;
+}
+
+static int encr_dedup_tag(const struct encr_keys *k, uint64_t chunk,
+			  const unsigned char *id, unsigned char *tag)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char aad[sizeof(DEDUP_LABEL) + 8];
+	int i;
+
+	memcpy(aad, DEDUP_LABEL, sizeof(DEDUP_LABEL));
+	for (i = 0; i < 8; i++)
+		aad[sizeof(DEDUP_LABEL) + i] = (chunk >> (56 - 8 * i)) & 0xff;
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE, aad, sizeof(aad),
+			 id, ENCR_CHUNK_ID_SIZE, mac))
+		return -EIO;
+	memcpy(tag, mac, ENCR_TAG_SIZE);
+	return 0;
+}
+
+int encr_dedup_seal(const struct encr_keys *k, uint64_t chunk,
+		    const unsigned char *id, unsigned char *ent)
+{
+	memcpy(ent, id, ENCR_CHUNK_ID_SIZE);
+	return encr_dedup_tag(k, chunk, id, ent + ENCR_CHUNK_ID_SIZE);
+}
+
+int encr_dedup_open(const struct encr_keys *k, uint64_t chunk,
+		    const unsigned char *ent, unsigned char *id)
+{
+	unsigned char tag[ENCR_TAG_SIZE];
+	int res;
+
+	if (encr_all_zero(ent, ENCR_DEDUP_ENTRY))
+		return 1;
+	res = encr_dedup_tag(k, chunk, ent, tag);
+	if (res != 0)
+		return res;
+	if (CRYPTO_memcmp(tag, ent + ENCR_CHUNK_ID_SIZE, ENCR_TAG_SIZE) != 0)
+		return -EBADMSG;
+	memcpy(id, ent, ENCR_CHUNK_ID_SIZE);
+	return 0;
+}
@@ -0,0 +1,263 @@
+/* encfs-format.h
+ * On-disk format of the pa5-encfs encrypted mirror
+ *
+ * Mirror root:
+ *   .encfs/config   salt, PBKDF2 iteration count and a check value for
+ *                   the mount key derived from the key phrase
+ *
+ * Encrypted file (marked with the user.pa5-encfs.encrypted = "true" xattr):
+ *   header          ENCR_HEADER_SIZE bytes: magic, version, chunk size and
+ *                   the file's random data keys wrapped by the mount key
+ *   chunk records   for each chunk of plaintext:
+ *                   IV (16) | AES-256-CTR ciphertext | HMAC-SHA256 tag (16)
+ *                   All records hold a full chunk except the last one.
+ *
+ * Compressed file (ENCR_FLAG_COMPRESSED in the header flags):
+ *   header          as above; its last 16 bytes hold the plaintext size
+ *                   and a tag over it under the file's MAC key
+ *   chunk groups    for every ENCR_CINDEX_GROUP chunks:
+ *                   index  the stored record length of each chunk, u32
+ *                          little endian, 0 for a chunk never written
+ *                   slots  one fixed slot of chunk size + ENCR_CHUNK_OVERHEAD
+ *                          + 1 bytes per chunk, holding a record whose
+ *                          plaintext is a codec byte followed by the chunk,
+ *                          compressed or raw (see encfs-compress.h); the
+ *                          unused tail of a slot is a hole
+ *   A chunk may decompress to less than a whole chunk; the rest is zeros.
+ *   Compressed lengths are visible in the index, as with any compression
+ *   before encryption.
+ *
+ * Deduplicated file (ENCR_FLAG_DEDUP; see encfs-store.h):
+ *   header          as for a compressed file, plaintext size included
+ *   chunk table     for each chunk: the chunk's id in the mirror's chunk
+ *                   store (32) | HMAC-SHA256 tag (16) over the chunk
+ *                   number and id under the file's MAC key, so references
+ *                   cannot be moved between chunks or files; all zeros
+ *                   for a chunk never written. ENCR_FLAG_COMPRESSED then
+ *                   means chunks the file adds to the store are compressed.
+ *
+ * Log-structured file (ENCR_FLAG_LOG; see encfs-log.h):
+ *   header          as for a compressed file, plaintext size included;
+ *                   nothing follows it, the chunk records (as in a
+ *                   compressed file's slots) are in the mirror's log
+ *
+ * Striped file (ENCR_FLAG_STRIPED; see encfs-roots.h):
+ *   header          as for a compressed file, plaintext size included,
+ *                   and the number of roots the file is striped over
+ *   chunk records   as in the plain format, but only those of the
+ *                   file's first stripe on each pass over the roots; the
+ *                   rest are in the file's parts on the other roots.
+ *                   Records never written are holes.
+ *
+ * Because every file has its own data keys, changing the key phrase only
+ * rewrites headers (see encfs-rekey), never file data.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_FORMAT_H
+#define ENCFS_FORMAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ENCR_XATTR_ENCRYPTED "user.pa5-encfs.encrypted"
+#define ENCR_META_DIR ".encfs"
+#define ENCR_CONFIG_FILE "config"
+
+#define ENCR_MAGIC "PA5ENCFS"
+#define ENCR_MAGIC_LEN 8
+#define ENCR_FORMAT_VERSION 1
+#define ENCR_HEADER_SIZE 128
+
+#define ENCR_KEY_SIZE 32
+#define ENCR_IV_SIZE 16
+#define ENCR_TAG_SIZE 16
+#define ENCR_CHUNK_OVERHEAD (ENCR_IV_SIZE + ENCR_TAG_SIZE)
+#define ENCR_DEFAULT_CHUNK_SHIFT 12
+#define ENCR_MIN_CHUNK_SHIFT 9
+#define ENCR_MAX_CHUNK_SHIFT 20
+
+#define ENCR_FLAG_COMPRESSED 0x1
+#define ENCR_FLAG_DEDUP 0x2
+#define ENCR_FLAG_LOG 0x4
+#define ENCR_FLAG_STRIPED 0x8
+#define ENCR_KNOWN_FLAGS (ENCR_FLAG_COMPRESSED | ENCR_FLAG_DEDUP | \
+			  ENCR_FLAG_LOG | ENCR_FLAG_STRIPED)
+/* Formats whose chunks are stored one by one, with the size in the header */
+#define ENCR_SIZED_FLAGS (ENCR_FLAG_COMPRESSED | ENCR_FLAG_DEDUP | \
+			  ENCR_FLAG_LOG | ENCR_FLAG_STRIPED)
+#define ENCR_SIZE_FIELD 16		// plaintext size field at the end of the header
+#define ENCR_CINDEX_GROUP 64		// chunks per index block
+#define ENCR_CINDEX_ENTRY 4
+#define ENCR_CHUNK_ID_SIZE 32
+#define ENCR_DEDUP_ENTRY (ENCR_CHUNK_ID_SIZE + ENCR_TAG_SIZE)
+
+#define ENCR_SALT_SIZE 16
+#define ENCR_DEFAULT_ITERATIONS 100000
+
+/* An encryption key plus the MAC key that authenticates what it encrypts */
+struct encr_keys {
+	unsigned char enc[ENCR_KEY_SIZE];
+	unsigned char mac[ENCR_KEY_SIZE];
+};
+
+/* Decoded file header */
+struct encr_header {
+	unsigned version;
+	unsigned chunk_shift;
+	unsigned flags;
+	unsigned width;			// roots a striped file is spread over
+	struct encr_keys keys;		// unwrapped data keys
+};
+
+/* Mount key parameters as stored in .encfs/config */
+struct encr_config {
+	unsigned version;
+	unsigned iterations;
+	unsigned char salt[ENCR_SALT_SIZE];
+	unsigned char check[ENCR_TAG_SIZE];
+};
+
+/* int encr_config_read(const char *path, struct encr_config *cfg)
+ * int encr_config_write(const char *path, const struct encr_config *cfg)
+ * Purpose: Load/store a config file; writes go to a temporary file that
+ *          is renamed over path, so a crash never leaves half a config
+ * Return: 0 on success, -errno on failure (-EINVAL for a corrupt file)
+ */
+extern int encr_config_read(const char *path, struct encr_config *cfg);
+extern int encr_config_write(const char *path, const struct encr_config *cfg);
+
+/* int encr_config_init(struct encr_config *cfg, const char *phrase, struct encr_keys *mk)
+ * Purpose: Pick a fresh salt and derive the mount key for phrase
+ * Return: 0 on success, -EIO on crypto failure
+ */
+extern int encr_config_init(struct encr_config *cfg, const char *phrase,
+			    struct encr_keys *mk);
+
+/* int encr_config_unlock(const struct encr_config *cfg, const char *phrase, struct encr_keys *mk)
+ * Purpose: Derive the mount key for phrase and check it against cfg
+ * Return: 0 on success, -EACCES for a wrong key phrase, -EIO on crypto failure
+ */
+extern int encr_config_unlock(const struct encr_config *cfg,
+			      const char *phrase, struct encr_keys *mk);
+
+/* int encr_header_init(struct encr_header *h, unsigned chunk_shift)
+ * Purpose: Fill in a header for a new file with freshly generated data keys
+ * Return: 0 on success, -EIO on crypto failure
+ */
+extern int encr_header_init(struct encr_header *h, unsigned chunk_shift);
+
+/* int encr_header_encode(const struct encr_header *h, const struct encr_keys *mk, unsigned char *buf)
+ * Purpose: Serialize h into ENCR_HEADER_SIZE bytes, wrapping its data
+ *          keys with the mount key mk
+ *          The size field at the end of buf is left as it is.
+ * Return: 0 on success, -EIO on crypto failure
+ */
+extern int encr_header_encode(const struct encr_header *h,
+			      const struct encr_keys *mk, unsigned char *buf);
+
+/* int encr_header_decode(struct encr_header *h, const struct encr_keys *mk, const unsigned char *buf)
+ * Purpose: Parse and authenticate ENCR_HEADER_SIZE bytes, unwrapping the
+ *          data keys with the mount key mk
+ * Return: 0 on success, -EINVAL if buf is not a header,
+ *         -EBADMSG if it was not written with mk or was tampered with
+ */
+extern int encr_header_decode(struct encr_header *h,
+			      const struct encr_keys *mk,
+			      const unsigned char *buf);
+
+/* int encr_header_peek(const unsigned char *buf, unsigned *chunk_shift)
+ * Purpose: Read the chunk size out of a header without any keys
+ * Return: 0 on success, -EINVAL if buf is not a header
+ */
+extern int encr_header_peek(const unsigned char *buf, unsigned *chunk_shift);
+
+/* unsigned encr_header_peek_flags(const unsigned char *buf)
+ * Purpose: Read the ENCR_FLAG_* bits out of a header without any keys
+ */
+extern unsigned encr_header_peek_flags(const unsigned char *buf);
+
+/* int encr_header_peek_size(const unsigned char *buf, off_t backing_size, off_t *plain)
+ * Purpose: Plaintext size of a file from its header and backing size,
+ *          without any keys; the size of a compressed file is not
+ *          authenticated here
+ * Return: 0 on success, -EINVAL if buf is not a header
+ */
+extern int encr_header_peek_size(const unsigned char *buf, off_t backing_size,
+				 off_t *plain);
+
+/* int encr_size_encode(const struct encr_keys *k, uint64_t size, unsigned char *field)
+ * int encr_size_decode(const struct encr_keys *k, const unsigned char *field, uint64_t *size)
+ * Purpose: Store/load the plaintext size of a compressed file in the
+ *          ENCR_SIZE_FIELD bytes at the end of its header
+ * Return: 0 on success, -EBADMSG if the field was tampered with,
+ *         -EIO on crypto failure
+ */
+extern int encr_size_encode(const struct encr_keys *k, uint64_t size,
+			    unsigned char *field);
+extern int encr_size_decode(const struct encr_keys *k,
+			    const unsigned char *field, uint64_t *size);
+
+/* off_t encr_plain_size(off_t backing_size, unsigned chunk_shift)
+ * off_t encr_backing_size(off_t plain_size, unsigned chunk_shift)
+ * Purpose: Convert between backing file size and plaintext size
+ */
+extern off_t encr_plain_size(off_t backing_size, unsigned chunk_shift);
+extern off_t encr_backing_size(off_t plain_size, unsigned chunk_shift);
+
+/* off_t encr_record_offset(uint64_t chunk, unsigned chunk_shift)
+ * Purpose: Backing file offset of the record for a chunk
+ */
+extern off_t encr_record_offset(uint64_t chunk, unsigned chunk_shift);
+
+/* size_t encr_cslot_size(unsigned chunk_shift)
+ * off_t encr_cslot_offset(uint64_t chunk, unsigned chunk_shift)
+ * off_t encr_cindex_offset(uint64_t chunk, unsigned chunk_shift)
+ * Purpose: Slot size, backing offset of a chunk's slot and of its index
+ *          entry in a compressed file
+ */
+extern size_t encr_cslot_size(unsigned chunk_shift);
+extern off_t encr_cslot_offset(uint64_t chunk, unsigned chunk_shift);
+extern off_t encr_cindex_offset(uint64_t chunk, unsigned chunk_shift);
+
+/* off_t encr_dedup_offset(uint64_t chunk)
+ * Purpose: Backing offset of a chunk's table entry in a deduplicated file
+ */
+extern off_t encr_dedup_offset(uint64_t chunk);
+
+/* int encr_dedup_seal(const struct encr_keys *k, uint64_t chunk, const unsigned char *id, unsigned char *ent)
+ * int encr_dedup_open(const struct encr_keys *k, uint64_t chunk, const unsigned char *ent, unsigned char *id)
+ * Purpose: Build/check the ENCR_DEDUP_ENTRY byte table entry referring
+ *          chunk to the store chunk id
+ * Return: 0 on success, 1 from encr_dedup_open() for a chunk never written,
+ *         -EBADMSG if the entry was tampered with, -EIO on crypto failure
+ */
+extern int encr_dedup_seal(const struct encr_keys *k, uint64_t chunk,
+			   const unsigned char *id, unsigned char *ent);
+extern int encr_dedup_open(const struct encr_keys *k, uint64_t chunk,
+			   const unsigned char *ent, unsigned char *id);
+
+/* int encr_chunk_seal(const struct encr_keys *k, uint64_t chunk, const unsigned char *plain, size_t len, unsigned char *rec)
+ * Purpose: Encrypt and authenticate len (<= chunk size) bytes of plaintext
+ *          into a len + ENCR_CHUNK_OVERHEAD byte record
+ * Return: 0 on success, -EIO on crypto failure
+ */
+extern int encr_chunk_seal(const struct encr_keys *k, uint64_t chunk,
+			   const unsigned char *plain, size_t len,
+			   unsigned char *rec);
+
+/* int encr_chunk_open(const struct encr_keys *k, uint64_t chunk, const unsigned char *rec, size_t reclen, unsigned char *plain)
+ * Purpose: Authenticate and decrypt a record read back from the file
+ *          A record that is all zeros, IV, ciphertext and tag alike, is a
+ *          hole left by truncate() or a sparse write and decrypts to
+ *          zeros; anything else must authenticate.
+ * Return: Plaintext length, -EBADMSG if authentication fails
+ *         or -EIO on crypto failure
+ */
+extern int encr_chunk_open(const struct encr_keys *k, uint64_t chunk,
+			   const unsigned char *rec, size_t reclen,
+			   unsigned char *plain);
+
+#endif
@@ -0,0 +1,617 @@
+/* encfs-import.c
+ * Restore a pa5-encfs mirror from an encfs-export archive
+ *
+ * Reads an archive stream (see encfs-archive.h) and recreates the mirror
+ * it was taken from in a new or empty directory: files with their data,
+ * holes and xattrs, directories, symlinks, hard links, fifos and device
+ * nodes, with their modes and modification times, and their owners when
+ * run as root. Nothing is decrypted, so no key phrase is needed; the
+ * restored mirror mounts with the one the original did. The main thread
+ * parses the stream in order and creates everything in it; the data of
+ * files goes to -j threads that write it while the stream is still being
+ * read, so a restore runs at the speed of the slower of the archive and
+ * the target disk. Directories get their modes and times last, so that
+ * read-only ones can still be filled. Symlinks are made just before that,
+ * once nothing else is left to create, and only in real directories, so
+ * that an archive cannot point one out of the mirror and then write
+ * through it.
+ *
+ * Usage: encfs-import [-j threads] [-i archive] <Mirror Directory>
+ *   -i  read from archive (standard input by default)
+ *
+ * Exits 1 if anything could not be restored, or the archive is damaged
+ * or cut short.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-archive.h"
+
+#define MAXTHREADS 256
+#define IMPORT_QUEUE 64			// DATA entries waiting to be written
+#define IMPORT_INBUF (4 * 1024 * 1024)	// archive bytes per read
+
+// A file being restored, shared by the writes of its data
+struct import_file {
+	char *path;
+	int fd;
+	unsigned refs;			// writes not yet done, plus the parser
+	struct timespec mtime;
+};
+
+// One DATA entry, from the parser to a writer
+struct import_write {
+	struct import_file *f;
+	unsigned char *data;
+	size_t len;
+	off_t off;
+};
+
+// A directory, to get its mode and times once it is filled
+struct import_dir {
+	char *path;
+	struct encr_arc_entry e;
+};
+
+// A symlink, to make once everything else is in place
+struct import_link {
+	char *path;
+	char *target;
+	unsigned char *x;		// its xattrs
+	struct encr_arc_entry e;
+};
+
+// Bounded queue between the parser and the writers
+static struct {
+	struct import_write **items;
+	unsigned head;
+	unsigned count;
+	int done;			// no more puts
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+} q;
+
+static struct {
+	char rootdir[PATH_MAX];
+	FILE *in;
+	uint64_t at;			// archive bytes read
+	int owners;			// restore owners (running as root)
+	struct import_dir *dirs;
+	size_t ndirs;
+	struct import_link *links;
+	size_t nlinks;
+	struct import_file *file;	// the last FILE
+	unsigned long entries;
+	unsigned long files;
+	unsigned long failed;
+	unsigned long long bytes;
+} im;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-import [-j threads] [-i archive] "
+		"<Mirror Directory>\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *path, int err)
+{
+	fprintf(stderr, "%s: %s\n", path, strerror(err));
+	__atomic_fetch_add(&im.failed, 1, __ATOMIC_RELAXED);
+}
+
+// The stream cannot be followed past a bad header, so this ends the run
+static void damaged(const char *why)
+{
+	fprintf(stderr, "encfs-import: archive %s at byte %llu\n", why,
+		(unsigned long long) im.at);
+	exit(EXIT_FAILURE);
+}
+
+static void in_read(void *buf, size_t len)
+{
+	if (len > 0 && fread(buf, 1, len, im.in) != len) {
+		if (ferror(im.in)) {
+			perror("archive read error");
+			exit(EXIT_FAILURE);
+		}
+		damaged("cut short");
+	}
+	im.at += len;
+}
+
+static void queue_put(struct import_write *w)
+{
+	pthread_mutex_lock(&q.lock);
+	while (q.count == IMPORT_QUEUE)
+		pthread_cond_wait(&q.nonfull, &q.lock);
+	q.items[(q.head + q.count++) % IMPORT_QUEUE] = w;
+	pthread_cond_signal(&q.nonempty);
+	pthread_mutex_unlock(&q.lock);
+}
+
+// NULL once the queue is finished and empty
+static struct import_write *queue_get(void)
+{
+	struct import_write *w = NULL;
+
+	pthread_mutex_lock(&q.lock);
+	while (q.count == 0 && !q.done)
+		pthread_cond_wait(&q.nonempty, &q.lock);
+	if (q.count > 0) {
+		w = q.items[q.head];
+		q.head = (q.head + 1) % IMPORT_QUEUE;
+		q.count--;
+		pthread_cond_signal(&q.nonfull);
+	}
+	pthread_mutex_unlock(&q.lock);
+	return w;
+}
+
+static void queue_finish(void)
+{
+	pthread_mutex_lock(&q.lock);
+	q.done = 1;
+	pthread_cond_broadcast(&q.nonempty);
+	pthread_mutex_unlock(&q.lock);
+}
+
+// The last reference sets the file's time, once its data is all in
+static void file_put(struct import_file *f)
+{
+	struct timespec times[2];
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1] = f->mtime;
+	if (futimens(f->fd, times) != 0)
+		fail(f->path, errno);
+	if (close(f->fd) != 0)
+		fail(f->path, errno);
+	free(f->path);
+	free(f);
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len,
+		      off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -errno;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static void *write_thread(void *data)
+{
+	struct import_write *w;
+	int res;
+
+	(void) data;
+	while ((w = queue_get()) != NULL) {
+		res = write_full(w->f->fd, w->data, w->len, w->off);
+		if (res != 0)
+			fail(w->f->path, -res);
+		file_put(w->f);
+		free(w->data);
+		free(w);
+	}
+	return NULL;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Set the xattrs of an entry on path, or on fd if it is not -1
+static void set_xattrs(const char *path, int fd, const unsigned char *x,
+		       size_t len)
+{
+	char name[XATTR_NAME_MAX + 1];
+	uint32_t nlen;
+	uint32_t vlen;
+	int res;
+
+	while (len > 0) {
+		if (len < 8)
+			damaged("has a bad xattr list");
+		nlen = get_le32(x);
+		vlen = get_le32(x + 4);
+		if (nlen == 0 || nlen > XATTR_NAME_MAX || len - 8 < nlen ||
+		    len - 8 - nlen < vlen)
+			damaged("has a bad xattr list");
+		memcpy(name, x + 8, nlen);
+		name[nlen] = '\0';
+		if (fd != -1)
+			res = fsetxattr(fd, name, x + 8 + nlen, vlen, 0);
+		else
+			res = lsetxattr(path, name, x + 8 + nlen, vlen, 0);
+		// Only user xattrs are the mirror's; others may need privilege
+		if (res != 0 && strncmp(name, "user.", 5) == 0)
+			fail(path, errno);
+		else if (res != 0)
+			fprintf(stderr, "%s: %s not restored: %s\n", path,
+				name, strerror(errno));
+		x += 8 + nlen + vlen;
+		len -= 8 + nlen + vlen;
+	}
+}
+
+// Owner, mode and time of anything but a file, by path
+static void set_attrs(const char *path, const struct encr_arc_entry *e,
+		      int is_link)
+{
+	struct timespec times[2];
+
+	if (im.owners && lchown(path, e->uid, e->gid) != 0)
+		fail(path, errno);
+	if (!is_link && chmod(path, e->mode & 07777) != 0)
+		fail(path, errno);
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = e->mtime_sec;
+	times[1].tv_nsec = e->mtime_nsec;
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0)
+		fail(path, errno);
+}
+
+static void import_dir(const char *path, const struct encr_arc_entry *e,
+		       const unsigned char *x)
+{
+	struct import_dir *d;
+
+	// Kept open to the owner until everything in it is restored
+	if (strcmp(path, im.rootdir) != 0 && mkdir(path, 0700) != 0) {
+		fail(path, errno);
+		return;
+	}
+	set_xattrs(path, -1, x, e->xattr_len);
+	d = realloc(im.dirs, (im.ndirs + 1) * sizeof(*d));
+	if (d == NULL || (d[im.ndirs].path = strdup(path)) == NULL) {
+		perror("malloc error");
+		exit(EXIT_FAILURE);
+	}
+	d[im.ndirs].e = *e;
+	im.dirs = d;
+	im.ndirs++;
+}
+
+// Kept back, since a later entry under it would be written through it
+static void import_symlink(const char *path, const char *target,
+			   const struct encr_arc_entry *e, unsigned char *x)
+{
+	struct import_link *l;
+
+	l = realloc(im.links, (im.nlinks + 1) * sizeof(*l));
+	if (l == NULL || (l[im.nlinks].path = strdup(path)) == NULL ||
+	    (l[im.nlinks].target = strdup(target)) == NULL) {
+		perror("malloc error");
+		exit(EXIT_FAILURE);
+	}
+	l[im.nlinks].x = x;
+	l[im.nlinks].e = *e;
+	im.links = l;
+	im.nlinks++;
+}
+
+/* Whether every directory between the root and path is a real one, not
+ * a symlink made earlier; names are checked to have no "." or ".." parts,
+ * so each prefix is looked up through real directories only */
+static int import_parents_ok(const char *path)
+{
+	char prefix[2 * PATH_MAX];
+	const char *slash = path + strlen(im.rootdir);
+	struct stat st;
+
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		memcpy(prefix, path, slash - path);
+		prefix[slash - path] = '\0';
+		if (lstat(prefix, &st) != 0 || !S_ISDIR(st.st_mode))
+			return 0;
+	}
+	return 1;
+}
+
+static void import_symlinks(void)
+{
+	struct import_link *l;
+	size_t i;
+
+	for (i = 0; i < im.nlinks; i++) {
+		l = &im.links[i];
+		if (!import_parents_ok(l->path))
+			fail(l->path, ELOOP);
+		else if (symlink(l->target, l->path) != 0)
+			fail(l->path, errno);
+		else {
+			set_xattrs(l->path, -1, l->x, l->e.xattr_len);
+			set_attrs(l->path, &l->e, 1);
+		}
+		free(l->path);
+		free(l->target);
+		free(l->x);
+	}
+	free(im.links);
+}
+
+static void import_file(const char *path, const struct encr_arc_entry *e,
+			const unsigned char *x)
+{
+	struct import_file *f;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd == -1) {
+		fail(path, errno);
+		return;
+	}
+	// Sized first, so what has no DATA stays a hole
+	if (ftruncate(fd, e->size) != 0)
+		fail(path, errno);
+	set_xattrs(path, fd, x, e->xattr_len);
+	if (im.owners && fchown(fd, e->uid, e->gid) != 0)
+		fail(path, errno);
+	if (fchmod(fd, e->mode & 07777) != 0)
+		fail(path, errno);
+	f = calloc(1, sizeof(struct import_file));
+	if (f == NULL || (f->path = strdup(path)) == NULL) {
+		perror("malloc error");
+		exit(EXIT_FAILURE);
+	}
+	f->fd = fd;
+	f->refs = 1;
+	f->mtime.tv_sec = e->mtime_sec;
+	f->mtime.tv_nsec = e->mtime_nsec;
+	im.file = f;
+	im.files++;
+}
+
+static void import_data(const struct encr_arc_entry *e)
+{
+	struct import_write *w;
+
+	w = malloc(sizeof(struct import_write));
+	if (w == NULL || (w->data = malloc(e->size ? e->size : 1)) == NULL) {
+		perror("malloc error");
+		exit(EXIT_FAILURE);
+	}
+	in_read(w->data, e->size);
+	im.bytes += e->size;
+	if (im.file == NULL) {
+		free(w->data);		// its file could not be created
+		free(w);
+		return;
+	}
+	w->f = im.file;
+	w->len = e->size;
+	w->off = e->offset;
+	__atomic_add_fetch(&im.file->refs, 1, __ATOMIC_ACQ_REL);
+	queue_put(w);
+}
+
+// Read and restore the entry at the head of the stream; 1 after END
+static int import_entry(void)
+{
+	unsigned char hdr[ENCR_ARC_HDR_SIZE];
+	struct encr_arc_entry e;
+	char name[PATH_MAX];
+	char body[PATH_MAX];
+	char path[2 * PATH_MAX];
+	char target[2 * PATH_MAX];
+	unsigned char *x = NULL;
+
+	in_read(hdr, sizeof(hdr));
+	if (encr_arc_decode(hdr, &e) != 0)
+		damaged("has a bad header");
+	if (e.type == ENCR_ARC_END) {
+		if (e.offset != im.entries || e.size != im.bytes)
+			damaged("does not add up");
+		return 1;
+	}
+	im.entries++;
+	if (e.type == ENCR_ARC_DATA) {
+		import_data(&e);
+		return 0;
+	}
+
+	// Everything else starts a new entry and ends the last file
+	if (im.file != NULL) {
+		file_put(im.file);
+		im.file = NULL;
+	}
+	in_read(name, e.name_len);
+	if (!encr_arc_name_ok(name, e.name_len))
+		damaged("has a name outside the mirror");
+	name[e.name_len] = '\0';
+	if (e.type == ENCR_ARC_SYMLINK || e.type == ENCR_ARC_LINK) {
+		in_read(body, e.size);
+		body[e.size] = '\0';
+		if (e.type == ENCR_ARC_LINK &&
+		    !encr_arc_name_ok(body, e.size))
+			damaged("has a link outside the mirror");
+	}
+	if (e.xattr_len > 0) {
+		x = malloc(e.xattr_len);
+		if (x == NULL) {
+			perror("malloc error");
+			exit(EXIT_FAILURE);
+		}
+		in_read(x, e.xattr_len);
+	}
+	if (strcmp(name, ".") == 0)
+		snprintf(path, sizeof(path), "%s", im.rootdir);
+	else
+		snprintf(path, sizeof(path), "%s/%s", im.rootdir, name);
+
+	switch (e.type) {
+	case ENCR_ARC_DIR:
+		import_dir(path, &e, x);
+		break;
+	case ENCR_ARC_FILE:
+		import_file(path, &e, x);
+		break;
+	case ENCR_ARC_SYMLINK:
+		import_symlink(path, body, &e, x);
+		x = NULL;
+		break;
+	case ENCR_ARC_LINK:
+		snprintf(target, sizeof(target), "%s/%s", im.rootdir, body);
+		if (link(target, path) != 0)
+			fail(path, errno);
+		break;
+	case ENCR_ARC_NODE:
+		if (mknod(path, e.mode, e.offset) != 0) {
+			fail(path, errno);
+			break;
+		}
+		set_xattrs(path, -1, x, e.xattr_len);
+		set_attrs(path, &e, 0);
+		break;
+	}
+	free(x);
+	return 0;
+}
+
+// An existing target must be an empty directory
+static int target_ok(const char *dir)
+{
+	struct dirent *d;
+	DIR *dp;
+	int res = 0;
+
+	if (mkdir(dir, 0700) == 0)
+		return 0;
+	if (errno != EEXIST)
+		return -errno;
+	dp = opendir(dir);
+	if (dp == NULL)
+		return -errno;
+	while (res == 0 && (d = readdir(dp)) != NULL)
+		if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+			res = -ENOTEMPTY;
+	closedir(dp);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t writers[MAXTHREADS];
+	char magic[ENCR_ARC_MAGIC_SIZE];
+	const char *in = NULL;
+	double start;
+	double elapsed;
+	int nwrite = 4;
+	int opt;
+	int res;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "j:i:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nwrite = atoi(optarg);
+			if (nwrite < 1 || nwrite > MAXTHREADS)
+				usage();
+			break;
+		case 'i':
+			in = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	im.in = in != NULL ? fopen(in, "r") : stdin;
+	if (im.in == NULL) {
+		perror(in);
+		return EXIT_FAILURE;
+	}
+	setvbuf(im.in, NULL, _IOFBF, IMPORT_INBUF);
+	res = target_ok(argv[optind]);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (realpath(argv[optind], im.rootdir) == NULL) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	im.owners = geteuid() == 0;
+	umask(0);
+
+	q.items = calloc(IMPORT_QUEUE, sizeof(struct import_write *));
+	if (q.items == NULL) {
+		perror("malloc error");
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.nonempty, NULL);
+	pthread_cond_init(&q.nonfull, NULL);
+
+	start = now();
+	in_read(magic, sizeof(magic));
+	if (memcmp(magic, ENCR_ARC_MAGIC, ENCR_ARC_MAGIC_SIZE) != 0)
+		damaged("is not an encfs-export archive");
+	for (i = 0; i < (size_t) nwrite; i++)
+		if (pthread_create(&writers[i], NULL, write_thread, NULL) != 0) {
+			perror("pthread_create error");
+			return EXIT_FAILURE;
+		}
+	while (import_entry() == 0)
+		;
+	if (im.file != NULL)
+		file_put(im.file);
+	queue_finish();
+	for (i = 0; i < (size_t) nwrite; i++)
+		pthread_join(writers[i], NULL);
+	import_symlinks();
+
+	// Deepest first, so no directory's time is changed after it is set
+	for (i = im.ndirs; i-- > 0;) {
+		set_attrs(im.dirs[i].path, &im.dirs[i].e, 0);
+		free(im.dirs[i].path);
+	}
+	free(im.dirs);
+	elapsed = now() - start;
+
+	fprintf(stderr, "%lu entries, %lu files, %llu bytes of data imported "
+		"in %.1f s (%.1f MiB/s), %lu failed\n", im.entries, im.files,
+		im.bytes, elapsed, elapsed > 0 ?
+		im.bytes / elapsed / (1024 * 1024) : 0, im.failed);
+	return im.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1818 @@
+/* encfs-io.c
+ * Chunked encrypted file I/O for pa5-encfs
+ *
+ * See encfs-io.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "encfs-io.h"
+#include "encfs-compress.h"
+#include "encfs-store.h"
+#include "encfs-log.h"
+#include "encfs-direct.h"
+#include "encfs-changes.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+
+#define ENCR_CHUNK(in) ((size_t) 1 << (in)->chunk_shift)
+#define ENCR_COMPRESSED(in) ((in)->hdr.flags & ENCR_FLAG_COMPRESSED)
+#define ENCR_DEDUP(in) ((in)->hdr.flags & ENCR_FLAG_DEDUP)
+#define ENCR_LOG(in) ((in)->hdr.flags & ENCR_FLAG_LOG)
+#define ENCR_SIZED(in) ((in)->hdr.flags & ENCR_SIZED_FLAGS)
+#define ENCR_STRIPED(in) ((in)->hdr.flags & ENCR_FLAG_STRIPED)
+/* Dedup table entries read per pread when walking a whole table */
+#define ENCR_DEDUP_BATCH 256
+/* Large enough for any record, compressed files' one byte longer */
+#define ENCR_RECBUF(in) encr_cslot_size((in)->chunk_shift)
+#define ENCR_SIZE_OFFSET (ENCR_HEADER_SIZE - ENCR_SIZE_FIELD)
+/* Bytes of records a large read of a file in the plain format fetches
+ * per pread */
+#define ENCR_READ_BATCH (1024 * 1024)
+
+static ssize_t encr_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pread(fd, (char *) buf + done, len - done, off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t encr_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pwrite(fd, (const char *) buf + done, len - done,
+			     off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+/* Backing I/O of an encrypted file, bounced through aligned buffers if
+ * its handles may be O_DIRECT */
+static ssize_t encr_io_raw_pread(struct encr_inode *in, int fd, void *buf,
+				 size_t len, off_t off)
+{
+	if (in->direct)
+		return encr_dio_pread(fd, buf, len, off);
+	return encr_pread_full(fd, buf, len, off);
+}
+
+static ssize_t encr_io_raw_pwrite(struct encr_inode *in, int fd,
+				  const void *buf, size_t len, off_t off)
+{
+	if (in->direct)
+		return encr_dio_pwrite(fd, buf, len, off);
+	return encr_pwrite_full(fd, buf, len, off);
+}
+
+/* The same through the cache tier, if the file is in it (see
+ * encfs-tier.h); a striped file's parts never are */
+static ssize_t encr_io_pread(struct encr_inode *in, int fd, void *buf,
+			     size_t len, off_t off)
+{
+	if (in->tfile != NULL && !ENCR_STRIPED(in))
+		return encr_tier_pread(in, fd, buf, len, off);
+	return encr_io_raw_pread(in, fd, buf, len, off);
+}
+
+static ssize_t encr_io_pwrite(struct encr_inode *in, int fd, const void *buf,
+			      size_t len, off_t off)
+{
+	if (in->tfile != NULL && !ENCR_STRIPED(in))
+		return encr_tier_pwrite(in, fd, buf, len, off);
+	return encr_io_raw_pwrite(in, fd, buf, len, off);
+}
+
+// and ftruncate() of its backing file likewise
+static int encr_io_ftruncate(struct encr_inode *in, int fd, off_t size)
+{
+	if (in->tfile != NULL && !ENCR_STRIPED(in))
+		return encr_tier_truncate(in, fd, size);
+	return ftruncate(fd, size) == -1 ? -errno : 0;
+}
+
+static int encr_backing_stat(int fd, off_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	*size = st.st_size;
+	return 0;
+}
+
+/* Plaintext size of an encrypted file, with any stripe held */
+static int encr_io_size(struct encr_inode *in, int fd, off_t *psz)
+{
+	off_t bsz;
+	int res;
+
+	if (ENCR_SIZED(in)) {
+		*psz = in->psize;
+		return 0;
+	}
+	res = encr_backing_stat(fd, &bsz);
+	if (res == 0)
+		*psz = encr_plain_size(bsz, in->chunk_shift);
+	return res;
+}
+
+/* Record a sized file's new plaintext size, with every stripe held */
+static int encr_io_set_psize(struct encr_inode *in, int fd, off_t size)
+{
+	unsigned char field[ENCR_SIZE_FIELD];
+	ssize_t n;
+	int res;
+
+	res = encr_size_encode(&in->hdr.keys, size, field);
+	if (res != 0)
+		return res;
+	n = encr_io_pwrite(in, fd, field, sizeof(field), ENCR_SIZE_OFFSET);
+	if (n < 0)
+		return n;
+	in->psize = size;
+	return 0;
+}
+
+int encr_io_open(struct encr_inode *in, int fd, const struct encr_keys *mk,
+		 struct encr_store *store, struct encr_log *log,
+		 struct encr_roots *roots, int encrypted, unsigned chunk_shift,
+		 unsigned flags, int direct)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	uint64_t psize = 0;
+	off_t size;
+	ssize_t n;
+	int res = 0;
+
+	pthread_mutex_lock(&in->lock);
+	if (in->loaded)
+		goto out;
+	in->store = store;
+	in->log = log;
+	in->roots = roots;
+	in->direct = encrypted && direct;
+
+	if (!encrypted) {
+		in->encrypted = 0;
+		in->loaded = 1;
+		goto out;
+	}
+
+	res = encr_backing_stat(fd, &size);
+	if (res != 0)
+		goto out;
+
+	if (size == 0) {
+		res = encr_header_init(&hdr, chunk_shift);
+		hdr.flags = flags;
+		// Striped over every root there is now
+		hdr.width = encr_roots_count(roots);
+		if (hdr.width < 2)
+			hdr.flags &= ~ENCR_FLAG_STRIPED;
+		if (res == 0)
+			res = encr_header_encode(&hdr, mk, buf);
+		if (res == 0 && (flags & ENCR_SIZED_FLAGS))
+			res = encr_size_encode(&hdr.keys, 0,
+					       buf + ENCR_SIZE_OFFSET);
+		if (res == 0) {
+			n = encr_io_pwrite(in, fd, buf, sizeof(buf), 0);
+			res = n < 0 ? (int) n : 0;
+		}
+	} else {
+		n = encr_io_pread(in, fd, buf, sizeof(buf), 0);
+		if (n < 0)
+			res = n;
+		else if (n != sizeof(buf))
+			res = -EIO;
+		else if (encr_header_decode(&hdr, mk, buf) != 0)
+			res = -EIO;
+		else if ((hdr.flags & ENCR_SIZED_FLAGS) &&
+			 encr_size_decode(&hdr.keys, buf + ENCR_SIZE_OFFSET,
+					  &psize) != 0)
+			res = -EIO;
+	}
+	if (res == 0 && (hdr.flags & ENCR_FLAG_LOG))
+		res = encr_log_fid(&hdr.keys, &in->lfid);
+	if (res == 0 && (hdr.flags & ENCR_FLAG_STRIPED))
+		res = encr_parts_attach(in, &hdr);
+
+	if (res == 0) {
+		in->hdr = hdr;
+		in->psize = psize;
+		__atomic_store_n(&in->chunk_shift, hdr.chunk_shift,
+				 __ATOMIC_RELEASE);
+		in->encrypted = 1;
+		in->loaded = 1;
+		encr_tier_attach(in, fd);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+out:
+	pthread_mutex_unlock(&in->lock);
+	return res;
+}
+
+int encr_io_set_chunk(struct encr_inode *in, int fd,
+		      const struct encr_keys *mk, unsigned chunk_shift)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	off_t size;
+	ssize_t n;
+	int res;
+
+	encr_inode_wrlock_all(in);
+	res = encr_backing_stat(fd, &size);
+	// Nothing but the header, so no record depends on the chunk size
+	if (res == 0 && (!in->encrypted || size != ENCR_HEADER_SIZE ||
+			 (ENCR_SIZED(in) && in->psize != 0)))
+		res = -EBUSY;
+	if (res != 0 || in->chunk_shift == chunk_shift)
+		goto out;
+
+	n = encr_io_pread(in, fd, buf, sizeof(buf), 0);
+	res = n < 0 ? (int) n : n != sizeof(buf) ? -EIO : 0;
+	hdr = in->hdr;
+	hdr.chunk_shift = chunk_shift;
+	// The size field at the end is kept as it is
+	if (res == 0)
+		res = encr_header_encode(&hdr, mk, buf);
+	if (res == 0) {
+		n = encr_io_pwrite(in, fd, buf, sizeof(buf), 0);
+		res = n < 0 ? (int) n : 0;
+	}
+	if (res == 0) {
+		pthread_mutex_lock(&in->lock);
+		in->hdr.chunk_shift = chunk_shift;
+		__atomic_store_n(&in->chunk_shift, chunk_shift,
+				 __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&in->lock);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+out:
+	encr_inode_unlock_all(in);
+	return res;
+}
+
+int encr_io_fstat(struct encr_inode *in, int fd, struct stat *st)
+{
+	uint64_t set;
+	int res = 0;
+
+	// Any stripe keeps the file's format from changing under us
+	set = encr_range_rdlock(in, 0, 0);
+	if (fstat(fd, st) == -1)
+		res = -errno;
+	else if (in->encrypted && S_ISREG(st->st_mode))
+		st->st_size = ENCR_SIZED(in) ? in->psize :
+			encr_plain_size(st->st_size, in->chunk_shift);
+	encr_range_unlock(in, set);
+	return res;
+}
+
+/* encr_io_load() for a compressed file: look the record's length up in
+ * the index and read only that much of the slot */
+static int encr_io_cload(struct encr_inode *in, int fd, uint64_t c, off_t psz,
+			 unsigned char *plain, unsigned char *rec)
+{
+	size_t cs = ENCR_CHUNK(in);
+	off_t start = (off_t) c << in->chunk_shift;
+	unsigned char ent[ENCR_CINDEX_ENTRY];
+	uint32_t reclen;
+	size_t len;
+	ssize_t n;
+	int res;
+
+	memset(plain, 0, cs);
+	if (start >= psz)
+		return 0;
+	len = psz - start < (off_t) cs ? (size_t) (psz - start) : cs;
+
+	n = encr_io_pread(in, fd, ent, sizeof(ent),
+			  encr_cindex_offset(c, in->chunk_shift));
+	if (n < 0)
+		return n;
+	if (n != sizeof(ent))
+		return len;	// a hole at the end of the file
+	reclen = ent[0] | (ent[1] << 8) | (ent[2] << 16) |
+		((uint32_t) ent[3] << 24);
+	if (reclen == 0)
+		return len;
+	if (reclen <= ENCR_CHUNK_OVERHEAD || reclen > ENCR_RECBUF(in))
+		return -EIO;
+
+	n = encr_io_pread(in, fd, rec, reclen,
+			  encr_cslot_offset(c, in->chunk_shift));
+	if (n < 0)
+		return n;
+	if ((size_t) n != reclen)
+		return -EIO;
+	res = encr_chunk_unpack(&in->hdr.keys, c, rec, reclen, plain, cs);
+	// Nothing is ever stored past the plaintext size
+	if (res < 0 || (size_t) res > len)
+		return -EIO;
+	return len;
+}
+
+/* Seal chunk c of a compressed file into its slot and index entry, then
+ * give back the part of the slot the record does not use */
+static int encr_io_cstore(struct encr_inode *in, int fd, uint64_t c,
+			  const unsigned char *plain, size_t len,
+			  unsigned char *rec, unsigned char *scratch)
+{
+	size_t slot = ENCR_RECBUF(in);
+	off_t soff = encr_cslot_offset(c, in->chunk_shift);
+	unsigned char ent[ENCR_CINDEX_ENTRY];
+	ssize_t reclen;
+	ssize_t n;
+
+	reclen = encr_chunk_pack(&in->hdr.keys, c, plain, len, 1, rec, scratch);
+	if (reclen < 0)
+		return reclen;
+	n = encr_io_pwrite(in, fd, rec, reclen, soff);
+	if (n < 0)
+		return n;
+	ent[0] = reclen & 0xff;
+	ent[1] = (reclen >> 8) & 0xff;
+	ent[2] = (reclen >> 16) & 0xff;
+	ent[3] = (reclen >> 24) & 0xff;
+	n = encr_io_pwrite(in, fd, ent, sizeof(ent),
+			   encr_cindex_offset(c, in->chunk_shift));
+	if (n < 0)
+		return n;
+	// Best effort; filesystems without hole punching just keep the bytes
+	if (slot - reclen >= 4096)
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  soff + reclen, slot - reclen);
+	return 0;
+}
+
+/* encr_io_load() for a deduplicated file: follow the chunk's table entry
+ * into the store */
+static int encr_io_dload(struct encr_inode *in, int fd, uint64_t c, off_t psz,
+			 unsigned char *plain)
+{
+	size_t cs = ENCR_CHUNK(in);
+	off_t start = (off_t) c << in->chunk_shift;
+	unsigned char ent[ENCR_DEDUP_ENTRY];
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	size_t len;
+	ssize_t n;
+	int res;
+
+	memset(plain, 0, cs);
+	if (start >= psz)
+		return 0;
+	len = psz - start < (off_t) cs ? (size_t) (psz - start) : cs;
+
+	n = encr_io_pread(in, fd, ent, sizeof(ent), encr_dedup_offset(c));
+	if (n < 0)
+		return n;
+	if (n != sizeof(ent))
+		return len;	// past the end of the table
+	res = encr_dedup_open(&in->hdr.keys, c, ent, id);
+	if (res == 1)
+		return len;
+	if (res != 0 || in->store == NULL)
+		return -EIO;
+	res = encr_store_get(in->store, id, plain, cs);
+	if (res < 0)
+		return res;
+	if ((size_t) res > len)
+		return -EIO;
+	return len;
+}
+
+/* Point chunk c of a deduplicated file at the stored copy of plain,
+ * dropping the reference it had before */
+static int encr_io_dstore(struct encr_inode *in, int fd, uint64_t c,
+			  const unsigned char *plain, size_t len)
+{
+	unsigned char ent[ENCR_DEDUP_ENTRY];
+	unsigned char old[ENCR_CHUNK_ID_SIZE];
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	int had;
+	ssize_t n;
+	int res;
+
+	if (in->store == NULL)
+		return -EIO;
+	n = encr_io_pread(in, fd, ent, sizeof(ent), encr_dedup_offset(c));
+	if (n < 0)
+		return n;
+	had = n == sizeof(ent) && encr_dedup_open(&in->hdr.keys, c, ent,
+						   old) == 0;
+
+	res = encr_store_put(in->store, plain, len, ENCR_COMPRESSED(in) != 0,
+			     id);
+	if (res == 0)
+		res = encr_dedup_seal(&in->hdr.keys, c, id, ent);
+	if (res != 0)
+		return res;
+	n = encr_io_pwrite(in, fd, ent, sizeof(ent), encr_dedup_offset(c));
+	if (n < 0) {
+		encr_store_unref(in->store, id);
+		return n;
+	}
+	if (had)
+		encr_store_unref(in->store, old);
+	return 0;
+}
+
+/* encr_io_load() for a log-structured file: the record is wherever the
+ * log last put the chunk */
+static int encr_io_lload(struct encr_inode *in, uint64_t c, off_t psz,
+			 unsigned char *plain, unsigned char *rec)
+{
+	size_t cs = ENCR_CHUNK(in);
+	off_t start = (off_t) c << in->chunk_shift;
+	size_t len;
+	ssize_t n;
+	int res;
+
+	memset(plain, 0, cs);
+	if (start >= psz)
+		return 0;
+	len = psz - start < (off_t) cs ? (size_t) (psz - start) : cs;
+
+	if (in->log == NULL)
+		return -EIO;
+	n = encr_log_get(in->log, in->lfid, c, rec, ENCR_RECBUF(in));
+	if (n < 0)
+		return n;
+	if (n == 0)
+		return len;	// never written
+	res = encr_chunk_unpack(&in->hdr.keys, c, rec, n, plain, cs);
+	if (res < 0 || (size_t) res > len)
+		return -EIO;
+	return len;
+}
+
+/* Append chunk c of a log-structured file to the log, compressed if the
+ * file is */
+static int encr_io_lstore(struct encr_inode *in, uint64_t c,
+			  const unsigned char *plain, size_t len,
+			  unsigned char *rec, unsigned char *scratch)
+{
+	ssize_t reclen;
+
+	if (in->log == NULL)
+		return -EIO;
+	reclen = encr_chunk_pack(&in->hdr.keys, c, plain, len,
+				 ENCR_COMPRESSED(in) != 0, rec, scratch);
+	if (reclen < 0)
+		return reclen;
+	return encr_log_put(in->log, in->lfid, c, rec, reclen);
+}
+
+/* encr_io_load() for a striped file: the record is in the part on the
+ * root its stripe went to, and one past the end of a part, or in a part
+ * never created, is a hole */
+static int encr_io_sload(struct encr_inode *in, int fd, uint64_t c, off_t psz,
+			 unsigned char *plain, unsigned char *rec)
+{
+	size_t cs = ENCR_CHUNK(in);
+	off_t start = (off_t) c << in->chunk_shift;
+	uint64_t local;
+	unsigned root;
+	size_t len;
+	ssize_t n;
+	int pfd;
+	int res;
+
+	memset(plain, 0, cs);
+	if (start >= psz)
+		return 0;
+	len = psz - start < (off_t) cs ? (size_t) (psz - start) : cs;
+
+	encr_stripe_locate(c, in->chunk_shift, in->hdr.width, &root, &local);
+	pfd = root == 0 ? fd : encr_part_fd(in, root, 0);
+	if (pfd == -ENOENT)
+		return len;
+	if (pfd < 0)
+		return pfd;
+	n = encr_io_pread(in, pfd, rec, len + ENCR_CHUNK_OVERHEAD,
+			  encr_record_offset(local, in->chunk_shift));
+	if (n < 0)
+		return n;
+	if (n == 0)
+		return len;
+	if ((size_t) n != len + ENCR_CHUNK_OVERHEAD)
+		return -EIO;
+	res = encr_chunk_open(&in->hdr.keys, c, rec, n, plain);
+	if (res < 0)
+		return -EIO;
+	return res;
+}
+
+/* Seal chunk c of a striped file into its root's part, creating the part
+ * if this is the first record on that root */
+static int encr_io_sstore(struct encr_inode *in, int fd, uint64_t c,
+			  const unsigned char *plain, size_t len,
+			  unsigned char *rec)
+{
+	uint64_t local;
+	unsigned root;
+	ssize_t n;
+	int pfd;
+	int res;
+
+	encr_stripe_locate(c, in->chunk_shift, in->hdr.width, &root, &local);
+	pfd = root == 0 ? fd : encr_part_fd(in, root, 1);
+	if (pfd < 0)
+		return pfd;
+	res = encr_chunk_seal(&in->hdr.keys, c, plain, len, rec);
+	if (res != 0)
+		return res;
+	n = encr_io_pwrite(in, pfd, rec, len + ENCR_CHUNK_OVERHEAD,
+			   encr_record_offset(local, in->chunk_shift));
+	return n < 0 ? (int) n : 0;
+}
+
+/* Store len bytes of plain as chunk c of a sized file, scratch being
+ * len + 1 bytes */
+static int encr_io_store_one(struct encr_inode *in, int fd, uint64_t c,
+			     const unsigned char *plain, size_t len,
+			     unsigned char *rec, unsigned char *scratch)
+{
+	if (ENCR_DEDUP(in))
+		return encr_io_dstore(in, fd, c, plain, len);
+	if (ENCR_LOG(in))
+		return encr_io_lstore(in, c, plain, len, rec, scratch);
+	return encr_io_cstore(in, fd, c, plain, len, rec, scratch);
+}
+
+/* Decrypt chunk c of a file whose plaintext is psz bytes long into plain,
+ * zero filling the rest of the chunk. Returns the chunk's plaintext
+ * length (0 past EOF) or -errno. */
+static int encr_io_load(struct encr_inode *in, int fd, uint64_t c, off_t psz,
+			unsigned char *plain, unsigned char *rec)
+{
+	size_t cs = ENCR_CHUNK(in);
+	off_t start = (off_t) c << in->chunk_shift;
+	size_t len;
+	ssize_t n;
+	int res;
+
+	if (ENCR_DEDUP(in))
+		return encr_io_dload(in, fd, c, psz, plain);
+	if (ENCR_LOG(in))
+		return encr_io_lload(in, c, psz, plain, rec);
+	if (ENCR_STRIPED(in))
+		return encr_io_sload(in, fd, c, psz, plain, rec);
+	if (ENCR_COMPRESSED(in))
+		return encr_io_cload(in, fd, c, psz, plain, rec);
+
+	memset(plain, 0, cs);
+	if (start >= psz)
+		return 0;
+	len = psz - start < (off_t) cs ? (size_t) (psz - start) : cs;
+
+	n = encr_io_pread(in, fd, rec, len + ENCR_CHUNK_OVERHEAD,
+			  encr_record_offset(c, in->chunk_shift));
+	if (n < 0)
+		return n;
+	if ((size_t) n != len + ENCR_CHUNK_OVERHEAD)
+		return -EIO;
+	res = encr_chunk_open(&in->hdr.keys, c, rec, n, plain);
+	if (res < 0)
+		return -EIO;
+	return res;
+}
+
+/* Re-encrypt the first len bytes of plain as chunk c */
+static int encr_io_store(struct encr_inode *in, int fd, uint64_t c,
+			 const unsigned char *plain, size_t len,
+			 unsigned char *rec)
+{
+	unsigned char *scratch;
+	ssize_t n;
+	int res;
+
+	if (ENCR_STRIPED(in))
+		return encr_io_sstore(in, fd, c, plain, len, rec);
+	if (ENCR_SIZED(in)) {
+		scratch = malloc(len + 1);
+		if (scratch == NULL)
+			return -ENOMEM;
+		res = encr_io_store_one(in, fd, c, plain, len, rec, scratch);
+		free(scratch);
+		return res;
+	}
+
+	res = encr_chunk_seal(&in->hdr.keys, c, plain, len, rec);
+	if (res != 0)
+		return res;
+	n = encr_io_pwrite(in, fd, rec, len + ENCR_CHUNK_OVERHEAD,
+			   encr_record_offset(c, in->chunk_shift));
+	return n < 0 ? (int) n : 0;
+}
+
+/* Grow a partial last chunk to newlen bytes of plaintext, as needed
+ * before anything is written past it */
+static int encr_io_pad_last(struct encr_inode *in, int fd, off_t psz,
+			    size_t newlen)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t c = (uint64_t) psz >> in->chunk_shift;
+	unsigned char *plain;
+	unsigned char *rec;
+	int res;
+
+	if ((psz & (cs - 1)) == 0)
+		return 0;
+
+	plain = malloc(cs);
+	rec = malloc(ENCR_RECBUF(in));
+	if (plain == NULL || rec == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	res = encr_io_load(in, fd, c, psz, plain, rec);
+	if (res >= 0)
+		res = encr_io_store(in, fd, c, plain, newlen, rec);
+out:
+	free(plain);
+	free(rec);
+	return res;
+}
+
+/* encr_io_read_locked() of a file in the plain format, whose records
+ * lie back to back: a run of them is fetched with one pread, and whole
+ * chunks are decrypted straight into buf */
+static ssize_t encr_io_read_run(struct encr_inode *in, int fd, char *buf,
+				size_t size, off_t off, off_t psz)
+{
+	size_t cs = ENCR_CHUNK(in);
+	size_t rs = cs + ENCR_CHUNK_OVERHEAD;
+	uint64_t first = (uint64_t) off >> in->chunk_shift;
+	uint64_t last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	uint64_t batch = ENCR_READ_BATCH / rs ? ENCR_READ_BATCH / rs : 1;
+	unsigned char *plain = NULL;
+	unsigned char *recs = NULL;
+	size_t done = 0;
+	uint64_t c, k, n;
+	ssize_t res;
+
+	if (batch > last - first + 1)
+		batch = last - first + 1;
+	plain = malloc(cs);
+	recs = malloc(batch * rs);
+	if (plain == NULL || recs == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (c = first; c <= last; c += n) {
+		off_t lstart;
+		size_t total;
+
+		n = last - c + 1 < batch ? last - c + 1 : batch;
+		// Only the file's last record can be short
+		lstart = (off_t) (c + n - 1) << in->chunk_shift;
+		total = (n - 1) * rs + (psz - lstart < (off_t) cs ?
+					(size_t) (psz - lstart) : cs) +
+			ENCR_CHUNK_OVERHEAD;
+		res = encr_io_pread(in, fd, recs, total,
+				    encr_record_offset(c, in->chunk_shift));
+		if (res < 0)
+			goto out;
+		if ((size_t) res != total) {
+			res = -EIO;
+			goto out;
+		}
+
+		for (k = c; k < c + n; k++) {
+			off_t start = (off_t) k << in->chunk_shift;
+			size_t len = psz - start < (off_t) cs ?
+				(size_t) (psz - start) : cs;
+			size_t skip = off + done - start;
+			size_t m = len - skip;
+			unsigned char *rec = recs + (k - c) * rs;
+
+			if (m > size - done)
+				m = size - done;
+			if (skip == 0 && m == len) {
+				res = encr_chunk_open(&in->hdr.keys, k, rec,
+						      len + ENCR_CHUNK_OVERHEAD,
+						      (unsigned char *) buf + done);
+			} else {
+				res = encr_chunk_open(&in->hdr.keys, k, rec,
+						      len + ENCR_CHUNK_OVERHEAD,
+						      plain);
+				if (res >= 0)
+					memcpy(buf + done, plain + skip, m);
+			}
+			if (res < 0) {
+				res = -EIO;
+				goto out;
+			}
+			done += m;
+		}
+	}
+	res = done;
+out:
+	free(plain);
+	free(recs);
+	return res;
+}
+
+/* Records of a run of chunks of a striped file, grouped by root: those
+ * on one root lie back to back in its part, and go to or from one
+ * stretch of a buffer for the whole run */
+struct encr_io_runs {
+	uint64_t lo[ENCR_MAX_ROOTS];	// first of the run's chunks on the root
+	uint64_t cnt[ENCR_MAX_ROOTS];
+	uint64_t base[ENCR_MAX_ROOTS];	// records in the buffer before its own
+};
+
+static void encr_io_runs(struct encr_inode *in, uint64_t c, uint64_t n,
+			 struct encr_io_runs *r)
+{
+	unsigned width = in->hdr.width;
+	uint64_t local, k, b;
+	unsigned root;
+
+	memset(r->cnt, 0, width * sizeof(r->cnt[0]));
+	for (k = c; k < c + n; k++) {
+		encr_stripe_locate(k, in->chunk_shift, width, &root, &local);
+		if (r->cnt[root]++ == 0)
+			r->lo[root] = local;
+	}
+	for (root = 0, b = 0; root < width; root++) {
+		r->base[root] = b;
+		b += r->cnt[root];
+	}
+}
+
+// Record k of a run in its buffer
+static size_t encr_io_run_slot(struct encr_inode *in,
+			       const struct encr_io_runs *r, uint64_t k)
+{
+	uint64_t local;
+	unsigned root;
+
+	encr_stripe_locate(k, in->chunk_shift, in->hdr.width, &root, &local);
+	return r->base[root] + (local - r->lo[root]);
+}
+
+/* encr_io_read_locked() of a striped file: each batch of chunks costs
+ * one pread per root it touches, and the roots after the first are told
+ * what is coming before the first is waited on, so the disks read in
+ * parallel */
+static ssize_t encr_io_sread_run(struct encr_inode *in, int fd, char *buf,
+				 size_t size, off_t off, off_t psz)
+{
+	size_t cs = ENCR_CHUNK(in);
+	size_t rs = cs + ENCR_CHUNK_OVERHEAD;
+	unsigned width = in->hdr.width;
+	uint64_t first = (uint64_t) off >> in->chunk_shift;
+	uint64_t last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	uint64_t batch = ENCR_READ_BATCH / rs ? ENCR_READ_BATCH / rs : 1;
+	struct encr_io_runs runs;
+	int pfds[ENCR_MAX_ROOTS];
+	unsigned char *plain = NULL;
+	unsigned char *recs = NULL;
+	size_t done = 0;
+	uint64_t c, k, n;
+	unsigned root;
+	int used;
+	ssize_t res;
+
+	if (batch > last - first + 1)
+		batch = last - first + 1;
+	plain = malloc(cs);
+	recs = malloc(batch * rs);
+	if (plain == NULL || recs == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (c = first; c <= last; c += n) {
+		n = last - c + 1 < batch ? last - c + 1 : batch;
+		encr_io_runs(in, c, n, &runs);
+		for (root = 0, used = 0; root < width; root++) {
+			pfds[root] = -1;
+			if (runs.cnt[root] == 0)
+				continue;
+			res = root == 0 ? fd : encr_part_fd(in, root, 0);
+			if (res < 0 && res != -ENOENT)
+				goto out;
+			pfds[root] = res;
+			if (res >= 0 && used++ > 0 && !in->direct)
+				posix_fadvise(res, encr_record_offset(
+						      runs.lo[root],
+						      in->chunk_shift),
+					      runs.cnt[root] * rs,
+					      POSIX_FADV_WILLNEED);
+		}
+		// Whatever a part does not reach is holes
+		for (root = 0; root < width; root++) {
+			unsigned char *run = recs + runs.base[root] * rs;
+			size_t want = runs.cnt[root] * rs;
+
+			if (want == 0)
+				continue;
+			res = 0;
+			if (pfds[root] >= 0)
+				res = encr_io_pread(in, pfds[root], run, want,
+						    encr_record_offset(
+							    runs.lo[root],
+							    in->chunk_shift));
+			if (res < 0)
+				goto out;
+			memset(run + res, 0, want - res);
+		}
+
+		for (k = c; k < c + n; k++) {
+			off_t start = (off_t) k << in->chunk_shift;
+			size_t len = psz - start < (off_t) cs ?
+				(size_t) (psz - start) : cs;
+			size_t skip = off + done - start;
+			size_t m = len - skip;
+			unsigned char *rec = recs +
+				encr_io_run_slot(in, &runs, k) * rs;
+
+			if (m > size - done)
+				m = size - done;
+			if (skip == 0 && m == len) {
+				res = encr_chunk_open(&in->hdr.keys, k, rec,
+						      len + ENCR_CHUNK_OVERHEAD,
+						      (unsigned char *) buf + done);
+			} else {
+				res = encr_chunk_open(&in->hdr.keys, k, rec,
+						      len + ENCR_CHUNK_OVERHEAD,
+						      plain);
+				if (res >= 0)
+					memcpy(buf + done, plain + skip, m);
+			}
+			if (res < 0) {
+				res = -EIO;
+				goto out;
+			}
+			done += m;
+		}
+	}
+	res = done;
+out:
+	free(plain);
+	free(recs);
+	return res;
+}
+
+ssize_t encr_io_read_locked(struct encr_inode *in, int fd, char *buf,
+			    size_t size, off_t off)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t first, last, c;
+	unsigned char *plain = NULL;
+	unsigned char *rec = NULL;
+	size_t done = 0;
+	off_t psz;
+	ssize_t res;
+
+	if (!in->encrypted) {
+		res = pread(fd, buf, size, off);
+		return res == -1 ? -errno : res;
+	}
+
+	if (size == 0)
+		return 0;
+
+	res = encr_io_size(in, fd, &psz);
+	if (res != 0)
+		return res;
+	if (off >= psz)
+		return 0;
+	if ((off_t) size > psz - off)
+		size = psz - off;
+	if (!ENCR_SIZED(in))
+		return encr_io_read_run(in, fd, buf, size, off, psz);
+	if (ENCR_STRIPED(in))
+		return encr_io_sread_run(in, fd, buf, size, off, psz);
+
+	plain = malloc(cs);
+	rec = malloc(ENCR_RECBUF(in));
+	if (plain == NULL || rec == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	first = (uint64_t) off >> in->chunk_shift;
+	last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	for (c = first; c <= last; c++) {
+		off_t start = (off_t) c << in->chunk_shift;
+		size_t skip = off + done - start;
+		size_t n = cs - skip;
+
+		res = encr_io_load(in, fd, c, psz, plain, rec);
+		if (res < 0)
+			goto out;
+		if (n > size - done)
+			n = size - done;
+		memcpy(buf + done, plain + skip, n);
+		done += n;
+	}
+	res = done;
+out:
+	free(plain);
+	free(rec);
+	return res;
+}
+
+ssize_t encr_io_read(struct encr_inode *in, int fd, char *buf, size_t size,
+		     off_t off)
+{
+	uint64_t set;
+	ssize_t res;
+
+	set = encr_range_rdlock(in, off, size);
+	res = encr_io_read_locked(in, fd, buf, size, off);
+	encr_range_unlock(in, set);
+	return res;
+}
+
+/* encr_io_seal_write() for a compressed or deduplicated file, one chunk
+ * at a time since each is stored on its own */
+static ssize_t encr_io_seal_each(struct encr_inode *in, int fd,
+				   const char *buf, size_t size, off_t off,
+				   off_t psz)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t first = (uint64_t) off >> in->chunk_shift;
+	uint64_t last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	off_t end = off + (off_t) size > psz ? off + (off_t) size : psz;
+	unsigned char *plain = malloc(cs);
+	unsigned char *rec = malloc(ENCR_RECBUF(in));
+	unsigned char *scratch = malloc(cs + 1);
+	uint64_t c;
+	ssize_t res = 0;
+
+	if (plain == NULL || rec == NULL || scratch == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (c = first; c <= last; c++) {
+		off_t start = (off_t) c << in->chunk_shift;
+		size_t skip = start < off ? (size_t) (off - start) : 0;
+		size_t len = end - start < (off_t) cs ? (size_t) (end - start) : cs;
+		size_t n = len - skip;
+
+		if (start + (off_t) skip + (off_t) n > off + (off_t) size)
+			n = off + size - start - skip;
+		// Only the first and last chunks can be partially overwritten
+		if (skip != 0 || n < len) {
+			res = encr_io_load(in, fd, c, psz, plain, rec);
+			if (res < 0)
+				goto out;
+		}
+		memcpy(plain + skip, buf + (start + skip - off), n);
+		res = encr_io_store_one(in, fd, c, plain, len, rec, scratch);
+		if (res != 0)
+			goto out;
+	}
+
+	res = end > psz ? encr_io_set_psize(in, fd, end) : 0;
+	if (res == 0)
+		res = size;
+out:
+	free(plain);
+	free(rec);
+	free(scratch);
+	return res;
+}
+
+/* Encrypted write with the covering locks held and psz the current
+ * plaintext size. Chunks the write covers whole are sealed straight from
+ * buf, and all touched chunks go out in a single pwrite. */
+static ssize_t encr_io_seal_write(struct encr_inode *in, int fd,
+				  const char *buf, size_t size, off_t off,
+				  off_t psz)
+{
+	size_t cs = ENCR_CHUNK(in);
+	size_t rs = cs + ENCR_CHUNK_OVERHEAD;
+	uint64_t first = (uint64_t) off >> in->chunk_shift;
+	uint64_t last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	uint64_t nchunks = last - first + 1;
+	off_t fstart = (off_t) first << in->chunk_shift;
+	off_t lstart = (off_t) last << in->chunk_shift;
+	off_t end = off + (off_t) size > psz ? off + (off_t) size : psz;
+	/* Only the first and last chunks can be partially overwritten */
+	int fpart = (off & (cs - 1)) != 0 || size < cs;
+	int lpart = last != first && ((off + size) & (cs - 1)) != 0;
+	unsigned char *plain = NULL;
+	unsigned char *recs = NULL;
+	const unsigned char *src;
+	size_t reclen = 0;
+	uint64_t c;
+	ssize_t res;
+
+	/* A partial last chunk before the write has to be filled out to
+	 * a whole one first, or its record would be the wrong length */
+	if (psz < fstart) {
+		res = encr_io_pad_last(in, fd, psz, cs);
+		if (res != 0)
+			return res;
+	}
+
+	plain = malloc(2 * cs);
+	recs = malloc(nchunks * rs);
+	if (plain == NULL || recs == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	if (fpart) {
+		size_t n = cs - (off - fstart);
+
+		res = encr_io_load(in, fd, first, psz, plain, recs);
+		if (res < 0)
+			goto out;
+		memcpy(plain + (off - fstart), buf, n < size ? n : size);
+	}
+	if (lpart) {
+		res = encr_io_load(in, fd, last, psz, plain + cs, recs);
+		if (res < 0)
+			goto out;
+		memcpy(plain + cs, buf + (lstart - off), off + size - lstart);
+	}
+
+	for (c = first; c <= last; c++) {
+		off_t start = (off_t) c << in->chunk_shift;
+		size_t len = end - start < (off_t) cs ? (size_t) (end - start) : cs;
+
+		if (c == first && fpart)
+			src = plain;
+		else if (c == last && lpart)
+			src = plain + cs;
+		else
+			src = (const unsigned char *) buf + (start - off);
+		res = encr_chunk_seal(&in->hdr.keys, c, src, len,
+				      recs + reclen);
+		if (res != 0)
+			goto out;
+		reclen += len + ENCR_CHUNK_OVERHEAD;
+	}
+
+	res = encr_io_pwrite(in, fd, recs, reclen,
+			     encr_record_offset(first, in->chunk_shift));
+	if (res >= 0)
+		res = size;
+out:
+	free(plain);
+	free(recs);
+	return res;
+}
+
+/* encr_io_seal_write() for a striped file: the records are sealed into
+ * one buffer grouped by root (see encr_io_runs()) and written with one
+ * pwrite per root, the size last */
+static ssize_t encr_io_sseal_write(struct encr_inode *in, int fd,
+				   const char *buf, size_t size, off_t off,
+				   off_t psz)
+{
+	size_t cs = ENCR_CHUNK(in);
+	size_t rs = cs + ENCR_CHUNK_OVERHEAD;
+	unsigned width = in->hdr.width;
+	uint64_t first = (uint64_t) off >> in->chunk_shift;
+	uint64_t last = ((uint64_t) off + size - 1) >> in->chunk_shift;
+	off_t fstart = (off_t) first << in->chunk_shift;
+	off_t lstart = (off_t) last << in->chunk_shift;
+	off_t end = off + (off_t) size > psz ? off + (off_t) size : psz;
+	int fpart = (off & (cs - 1)) != 0 || size < cs;
+	int lpart = last != first && ((off + size) & (cs - 1)) != 0;
+	size_t runlen[ENCR_MAX_ROOTS];
+	struct encr_io_runs runs;
+	unsigned char *plain = NULL;
+	unsigned char *recs = NULL;
+	const unsigned char *src;
+	unsigned root;
+	uint64_t local;
+	uint64_t c;
+	ssize_t res;
+
+	if (psz < fstart) {
+		res = encr_io_pad_last(in, fd, psz, cs);
+		if (res != 0)
+			return res;
+	}
+
+	plain = malloc(2 * cs);
+	recs = malloc((last - first + 1) * rs);
+	if (plain == NULL || recs == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	if (fpart) {
+		size_t n = cs - (off - fstart);
+
+		res = encr_io_load(in, fd, first, psz, plain, recs);
+		if (res < 0)
+			goto out;
+		memcpy(plain + (off - fstart), buf, n < size ? n : size);
+	}
+	if (lpart) {
+		res = encr_io_load(in, fd, last, psz, plain + cs, recs);
+		if (res < 0)
+			goto out;
+		memcpy(plain + cs, buf + (lstart - off), off + size - lstart);
+	}
+
+	encr_io_runs(in, first, last - first + 1, &runs);
+	memset(runlen, 0, sizeof(runlen));
+	for (c = first; c <= last; c++) {
+		off_t start = (off_t) c << in->chunk_shift;
+		size_t len = end - start < (off_t) cs ? (size_t) (end - start) : cs;
+
+		if (c == first && fpart)
+			src = plain;
+		else if (c == last && lpart)
+			src = plain + cs;
+		else
+			src = (const unsigned char *) buf + (start - off);
+		res = encr_chunk_seal(&in->hdr.keys, c, src, len, recs +
+				      encr_io_run_slot(in, &runs, c) * rs);
+		if (res != 0)
+			goto out;
+		// Only the file's last record, last on its root, is short
+		encr_stripe_locate(c, in->chunk_shift, width, &root, &local);
+		runlen[root] = (local - runs.lo[root]) * rs + len +
+			ENCR_CHUNK_OVERHEAD;
+	}
+
+	for (root = 0; root < width; root++) {
+		if (runs.cnt[root] == 0)
+			continue;
+		res = root == 0 ? fd : encr_part_fd(in, root, 1);
+		if (res < 0)
+			goto out;
+		res = encr_io_pwrite(in, res, recs + runs.base[root] * rs,
+				     runlen[root],
+				     encr_record_offset(runs.lo[root],
+							in->chunk_shift));
+		if (res < 0)
+			goto out;
+	}
+	res = end > psz ? encr_io_set_psize(in, fd, end) : 0;
+	if (res == 0)
+		res = size;
+out:
+	free(plain);
+	free(recs);
+	return res;
+}
+
+ssize_t encr_io_write_locked(struct encr_inode *in, int fd, const char *buf,
+			     size_t size, off_t off)
+{
+	off_t psz;
+	ssize_t res;
+
+	if (!in->encrypted) {
+		res = pwrite(fd, buf, size, off);
+		if (res == -1)
+			return -errno;
+	} else {
+		if (size == 0)
+			return 0;
+		res = encr_io_size(in, fd, &psz);
+		if (res == 0 && ENCR_STRIPED(in))
+			res = encr_io_sseal_write(in, fd, buf, size, off, psz);
+		else if (res == 0 && ENCR_SIZED(in))
+			res = encr_io_seal_each(in, fd, buf, size, off, psz);
+		else if (res == 0)
+			res = encr_io_seal_write(in, fd, buf, size, off, psz);
+	}
+	if (res > 0) {
+		__atomic_add_fetch(&in->wgen, 1, __ATOMIC_RELEASE);
+		encr_changes_mark(in, off, res);
+	}
+	return res;
+}
+
+ssize_t encr_io_write(struct encr_inode *in, int fd, const char *buf,
+		      size_t size, off_t off)
+{
+	off_t psz;
+	uint64_t set;
+	ssize_t res;
+
+	/* Writes that stay inside whole chunks only need their own range.
+	 * Anything touching the last chunk changes the size or the last
+	 * record's length, and takes the whole file. Compressed and
+	 * deduplicated chunks are stored on their own, so there only a
+	 * change of size does. */
+	set = encr_range_wrlock(in, off, size);
+	if (!in->encrypted) {
+		res = encr_io_write_locked(in, fd, buf, size, off);
+		encr_range_unlock(in, set);
+		return res;
+	}
+	res = encr_io_size(in, fd, &psz);
+	if (res == 0 && !ENCR_SIZED(in))
+		psz &= ~(off_t) (ENCR_CHUNK(in) - 1);
+	if (res == 0 && off + (off_t) size <= psz) {
+		res = encr_io_write_locked(in, fd, buf, size, off);
+		encr_range_unlock(in, set);
+		return res;
+	}
+	encr_range_unlock(in, set);
+	if (res != 0)
+		return res;
+
+	encr_inode_wrlock_all(in);
+	res = encr_io_write_locked(in, fd, buf, size, off);
+	encr_inode_unlock_all(in);
+	return res;
+}
+
+/* encr_io_truncate() for a compressed file, every stripe held */
+static int encr_io_ctruncate(struct encr_inode *in, int fd, off_t psz,
+			     off_t size)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t keep = ((uint64_t) size + cs - 1) >> in->chunk_shift;
+	unsigned char zero[ENCR_CINDEX_GROUP * ENCR_CINDEX_ENTRY];
+	unsigned char *plain = NULL;
+	unsigned char *rec = NULL;
+	off_t bend;
+	ssize_t n;
+	int res = 0;
+
+	/* Growing only moves the size: the old last chunk decompresses
+	 * short and chunks never written are zeros */
+	if (size > psz)
+		return encr_io_set_psize(in, fd, size);
+
+	if ((size & (cs - 1)) != 0) {
+		plain = malloc(cs);
+		rec = malloc(ENCR_RECBUF(in));
+		if (plain == NULL || rec == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		res = encr_io_cload(in, fd, keep - 1, psz, plain, rec);
+		if (res >= 0)
+			res = encr_io_store(in, fd, keep - 1, plain,
+					    size & (cs - 1), rec);
+		if (res != 0)
+			goto out;
+	}
+
+	// Chunks past the end must read back as zeros if the file regrows
+	if (keep % ENCR_CINDEX_GROUP != 0) {
+		memset(zero, 0, sizeof(zero));
+		n = encr_io_pwrite(in, fd, zero, (ENCR_CINDEX_GROUP -
+				      keep % ENCR_CINDEX_GROUP) *
+				   ENCR_CINDEX_ENTRY,
+				   encr_cindex_offset(keep, in->chunk_shift));
+		if (n < 0) {
+			res = n;
+			goto out;
+		}
+	}
+	bend = keep == 0 ? ENCR_HEADER_SIZE :
+		encr_cslot_offset(keep - 1, in->chunk_shift) + ENCR_RECBUF(in);
+	res = encr_io_ftruncate(in, fd, bend);
+	if (res == 0)
+		res = encr_io_set_psize(in, fd, size);
+out:
+	free(plain);
+	free(rec);
+	return res;
+}
+
+/* encr_io_truncate() for a log-structured file, every stripe held */
+static int encr_io_ltruncate(struct encr_inode *in, int fd, off_t psz,
+			     off_t size)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t keep = ((uint64_t) size + cs - 1) >> in->chunk_shift;
+	unsigned char *plain = NULL;
+	unsigned char *rec = NULL;
+	int res = 0;
+
+	// As for a compressed file, growing only moves the size
+	if (size > psz)
+		return encr_io_set_psize(in, fd, size);
+	if (in->log == NULL)
+		return -EIO;
+
+	if ((size & (cs - 1)) != 0) {
+		plain = malloc(cs);
+		rec = malloc(ENCR_RECBUF(in));
+		if (plain == NULL || rec == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		res = encr_io_lload(in, keep - 1, psz, plain, rec);
+		if (res >= 0)
+			res = encr_io_store(in, fd, keep - 1, plain,
+					    size & (cs - 1), rec);
+		if (res != 0)
+			goto out;
+	}
+	// Chunks past the end must read back as zeros if the file regrows
+	res = encr_log_trim(in->log, in->lfid, keep);
+	if (res == 0)
+		res = encr_io_set_psize(in, fd, size);
+out:
+	free(plain);
+	free(rec);
+	return res;
+}
+
+/* encr_io_truncate() for a striped file, every stripe held. The chunk
+ * cut into is stored again at its new length and each root's part cut
+ * back to the records it still holds, a part left with none being
+ * removed. */
+static int encr_io_struncate(struct encr_inode *in, int fd, off_t psz,
+			     off_t size)
+{
+	size_t cs = ENCR_CHUNK(in);
+	size_t rs = cs + ENCR_CHUNK_OVERHEAD;
+	size_t tail = size & (cs - 1);
+	uint64_t keep = ((uint64_t) size + cs - 1) >> in->chunk_shift;
+	unsigned char *plain = NULL;
+	unsigned char *rec = NULL;
+	uint64_t n, local;
+	unsigned root, lroot = 0;
+	off_t bend, bsz;
+	int res = 0;
+
+	if (size > psz) {
+		// As for the plain format, but the size is in the header
+		off_t lstart = psz & ~(off_t) (cs - 1);
+
+		res = encr_io_pad_last(in, fd, psz,
+				       size - lstart < (off_t) cs ?
+				       (size_t) (size - lstart) : cs);
+		return res == 0 ? encr_io_set_psize(in, fd, size) : res;
+	}
+
+	if (tail != 0) {
+		plain = malloc(cs);
+		rec = malloc(ENCR_RECBUF(in));
+		if (plain == NULL || rec == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		res = encr_io_sload(in, fd, keep - 1, psz, plain, rec);
+		if (res >= 0)
+			res = encr_io_sstore(in, fd, keep - 1, plain, tail, rec);
+		if (res != 0)
+			goto out;
+		encr_stripe_locate(keep - 1, in->chunk_shift, in->hdr.width,
+				   &lroot, &local);
+	}
+	res = encr_io_set_psize(in, fd, size);
+
+	for (root = 0; root < in->hdr.width && res == 0; root++) {
+		n = encr_stripe_chunks(keep, in->chunk_shift, in->hdr.width,
+				       root);
+		bend = n == 0 ? 0 : encr_record_offset(n - 1, in->chunk_shift) +
+			(tail != 0 && root == lroot ?
+			 tail + ENCR_CHUNK_OVERHEAD : rs);
+		if (root != 0) {
+			res = encr_part_cut(in, root, bend);
+			continue;
+		}
+		if (bend < ENCR_HEADER_SIZE)
+			bend = ENCR_HEADER_SIZE;
+		res = encr_backing_stat(fd, &bsz);
+		if (res == 0 && bsz > bend && ftruncate(fd, bend) == -1)
+			res = -errno;
+	}
+out:
+	free(plain);
+	free(rec);
+	return res;
+}
+
+/* Drop the store references of table entries [from, to) of a
+ * deduplicated file, last first, cutting the table back as it goes so a
+ * crash leaks references rather than leaving the table pointing at
+ * chunks already freed */
+static int encr_io_drop_tail(struct encr_store *s, const struct encr_keys *k,
+			     int fd, int direct, uint64_t from, uint64_t to,
+			     int cut)
+{
+	unsigned char *ents;
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	uint64_t b, c;
+	ssize_t n;
+	int res = 0;
+
+	ents = malloc(ENCR_DEDUP_BATCH * ENCR_DEDUP_ENTRY);
+	if (ents == NULL)
+		return -ENOMEM;
+	while (to > from) {
+		b = to - from > ENCR_DEDUP_BATCH ? to - ENCR_DEDUP_BATCH : from;
+		n = direct ? encr_dio_pread(fd, ents, (to - b) * ENCR_DEDUP_ENTRY,
+					    encr_dedup_offset(b)) :
+			encr_pread_full(fd, ents, (to - b) * ENCR_DEDUP_ENTRY,
+					encr_dedup_offset(b));
+		if (n < 0) {
+			res = n;
+			break;
+		}
+		if (cut && ftruncate(fd, encr_dedup_offset(b)) == -1) {
+			res = -errno;
+			break;
+		}
+		for (c = b; c < to && (c - b + 1) * ENCR_DEDUP_ENTRY <=
+			     (uint64_t) n; c++)
+			if (encr_dedup_open(k, c, ents + (c - b) *
+					    ENCR_DEDUP_ENTRY, id) == 0)
+				encr_store_unref(s, id);
+		to = b;
+	}
+	free(ents);
+	return res;
+}
+
+/* encr_io_truncate() for a deduplicated file, every stripe held */
+static int encr_io_dtruncate(struct encr_inode *in, int fd, off_t psz,
+			     off_t size)
+{
+	size_t cs = ENCR_CHUNK(in);
+	uint64_t keep = ((uint64_t) size + cs - 1) >> in->chunk_shift;
+	uint64_t had = ((uint64_t) psz + cs - 1) >> in->chunk_shift;
+	unsigned char *plain;
+	int res;
+
+	if (size > psz)
+		return encr_io_set_psize(in, fd, size);
+	if (in->store == NULL)
+		return -EIO;
+
+	if ((size & (cs - 1)) != 0) {
+		plain = malloc(cs);
+		if (plain == NULL)
+			return -ENOMEM;
+		res = encr_io_dload(in, fd, keep - 1, psz, plain);
+		if (res >= 0)
+			res = encr_io_dstore(in, fd, keep - 1, plain,
+					     size & (cs - 1));
+		free(plain);
+		if (res != 0)
+			return res;
+	}
+	// The table is cut back behind the cache's back
+	encr_tier_forget(in);
+	res = encr_io_drop_tail(in->store, &in->hdr.keys, fd, in->direct, keep,
+				had, 1);
+	if (res == 0)
+		res = encr_io_ftruncate(in, fd, encr_dedup_offset(keep));
+	if (res == 0)
+		res = encr_io_set_psize(in, fd, size);
+	return res;
+}
+
+/* Take (or with undo, give back) a store reference for each of the first
+ * n table entries of a deduplicated file; on failure the ones already
+ * taken are given back */
+static int encr_io_ref_table(struct encr_inode *in, int fd, uint64_t n,
+			     int undo)
+{
+	unsigned char *ents;
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	uint64_t b, c, end;
+	ssize_t got;
+	int res = 0;
+
+	ents = malloc(ENCR_DEDUP_BATCH * ENCR_DEDUP_ENTRY);
+	if (ents == NULL)
+		return -ENOMEM;
+	for (b = 0; b < n && res == 0; b += ENCR_DEDUP_BATCH) {
+		end = n - b < ENCR_DEDUP_BATCH ? n : b + ENCR_DEDUP_BATCH;
+		got = encr_io_pread(in, fd, ents, (end - b) * ENCR_DEDUP_ENTRY,
+				    encr_dedup_offset(b));
+		if (got < 0) {
+			res = got;
+			break;
+		}
+		for (c = b; c < end && (c - b + 1) * ENCR_DEDUP_ENTRY <=
+			     (uint64_t) got; c++) {
+			if (encr_dedup_open(&in->hdr.keys, c, ents + (c - b) *
+					    ENCR_DEDUP_ENTRY, id) != 0)
+				continue;
+			if (undo) {
+				encr_store_unref(in->store, id);
+			} else {
+				res = encr_store_ref(in->store, id);
+				if (res != 0) {
+					encr_io_ref_table(in, fd, c, 1);
+					break;
+				}
+			}
+		}
+	}
+	free(ents);
+	return res;
+}
+
+/* Make dfd a copy of the size bytes of sfd, going around the cache:
+ * what src has there is written back first and what dst had is dropped */
+static int encr_io_copy_backing(struct encr_inode *src, int sfd,
+				struct encr_inode *dst, int dfd, off_t size)
+{
+	loff_t soff = 0;
+	loff_t doff = 0;
+	char *buf;
+	ssize_t n;
+	int res;
+
+	res = encr_tier_flush(src);
+	if (res != 0)
+		return res;
+	encr_tier_forget(dst);
+	if (ftruncate(dfd, 0) == -1) {
+		res = -errno;
+		goto out;
+	}
+	if (ioctl(dfd, FICLONE, sfd) == 0)
+		goto out;
+	while (soff < size) {
+		n = copy_file_range(sfd, &soff, dfd, &doff, size - soff, 0);
+		if (n <= 0)
+			break;
+	}
+	if (soff == size)
+		goto out;
+
+	// Not between these filesystems (or not with O_DIRECT); copy the rest
+	buf = malloc(ENCR_COPY_BATCH);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	while (doff < size) {
+		n = encr_io_raw_pread(src, sfd, buf, size - doff < ENCR_COPY_BATCH ?
+				      (size_t) (size - doff) : ENCR_COPY_BATCH,
+				      doff);
+		if (n <= 0) {
+			res = n < 0 ? (int) n : -EIO;
+			break;
+		}
+		n = encr_io_raw_pwrite(dst, dfd, buf, n, doff);
+		if (n < 0) {
+			res = n;
+			break;
+		}
+		doff += n;
+	}
+	free(buf);
+out:
+	// Picks up the size the copy left
+	encr_tier_forget(dst);
+	return res;
+}
+
+/* encr_io_copy() of a whole encrypted file into an empty one, every
+ * stripe of both held. Returns the bytes copied, or 0 if dst was not
+ * empty or the copy would be short after all. */
+static ssize_t encr_io_clone(struct encr_inode *src, int sfd,
+			     struct encr_inode *dst, int dfd, size_t len)
+{
+	uint64_t nents = 0;
+	off_t psz, dsz, bsz;
+	ssize_t res;
+
+	res = encr_io_size(src, sfd, &psz);
+	if (res == 0)
+		res = encr_io_size(dst, dfd, &dsz);
+	if (res == 0)
+		res = encr_backing_stat(sfd, &bsz);
+	if (res != 0)
+		return res;
+	if (dsz != 0 || (off_t) len < psz || (ENCR_DEDUP(src) && !src->store))
+		return 0;
+	// The copy would share the original's place in the log, or its parts
+	if (ENCR_LOG(src) || ENCR_STRIPED(src))
+		return 0;
+
+	/* References first: a crash before the table is copied leaks
+	 * them, rather than leaving the copy pointing at freed chunks */
+	if (ENCR_DEDUP(src) && bsz > ENCR_HEADER_SIZE) {
+		nents = (bsz - ENCR_HEADER_SIZE) / ENCR_DEDUP_ENTRY;
+		res = encr_io_ref_table(src, sfd, nents, 0);
+		if (res != 0)
+			return res;
+	}
+	res = encr_io_copy_backing(src, sfd, dst, dfd, bsz);
+	if (res != 0) {
+		if (nents)
+			encr_io_ref_table(src, sfd, nents, 1);
+		return res;
+	}
+
+	dst->hdr = src->hdr;
+	dst->psize = src->psize;
+	dst->store = src->store;
+	__atomic_store_n(&dst->chunk_shift, src->chunk_shift, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&dst->wgen, 1, __ATOMIC_RELEASE);
+	encr_changes_mark(dst, 0, psz);
+	return psz;
+}
+
+ssize_t encr_io_copy(struct encr_inode *src, int sfd, off_t soff,
+		     struct encr_inode *dst, int dfd, off_t doff, size_t len)
+{
+	struct encr_inode *a = src < dst ? src : dst;
+	struct encr_inode *b = src < dst ? dst : src;
+	size_t done = 0;
+	char *buf;
+	ssize_t n;
+	ssize_t res = 0;
+
+	// Batches would overwrite source bytes before they were read
+	if (src == dst && (soff <= doff ? (size_t) (doff - soff) < len :
+			   (size_t) (soff - doff) < len))
+		return -EINVAL;
+	if (src != dst && src->encrypted && dst->encrypted && soff == 0 &&
+	    doff == 0 && len > 0) {
+		encr_inode_wrlock_all(a);
+		encr_inode_wrlock_all(b);
+		n = encr_io_clone(src, sfd, dst, dfd, len);
+		encr_inode_unlock_all(b);
+		encr_inode_unlock_all(a);
+		if (n != 0)
+			return n;
+	}
+
+	buf = malloc(len < ENCR_COPY_BATCH ? len : ENCR_COPY_BATCH);
+	if (buf == NULL && len > 0)
+		return -ENOMEM;
+	while (done < len) {
+		n = encr_io_read(src, sfd, buf, len - done < ENCR_COPY_BATCH ?
+				 len - done : ENCR_COPY_BATCH, soff + done);
+		if (n <= 0) {
+			res = n;
+			break;
+		}
+		res = encr_io_write(dst, dfd, buf, n, doff + done);
+		if (res < 0)
+			break;
+		done += n;
+	}
+	free(buf);
+	return done > 0 ? (ssize_t) done : res;
+}
+
+int encr_io_drop_refs(struct encr_store *store, struct encr_log *log,
+		      struct encr_roots *roots, const struct encr_keys *mk,
+		      int fd)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	uint64_t fid;
+	unsigned flags;
+	off_t size;
+	ssize_t n;
+	int direct;
+	int res;
+
+	// The fd may be a handle's, opened O_DIRECT
+	direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+	n = direct ? encr_dio_pread(fd, buf, sizeof(buf), 0) :
+		encr_pread_full(fd, buf, sizeof(buf), 0);
+	if (n != sizeof(buf) || encr_header_peek(buf, &hdr.chunk_shift) != 0)
+		return 0;
+	flags = encr_header_peek_flags(buf);
+	if (flags & ENCR_FLAG_LOG) {
+		if (log == NULL || encr_header_decode(&hdr, mk, buf) != 0)
+			return -EIO;
+		res = encr_log_fid(&hdr.keys, &fid);
+		if (res == 0)
+			res = encr_log_trim(log, fid, 0);
+		memset(&hdr, 0, sizeof(hdr));
+		return res;
+	}
+	if (flags & ENCR_FLAG_STRIPED) {
+		if (roots == NULL || encr_header_decode(&hdr, mk, buf) != 0)
+			return -EIO;
+		res = encr_parts_remove(roots, &hdr.keys, hdr.width);
+		memset(&hdr, 0, sizeof(hdr));
+		return res;
+	}
+	if (!(flags & ENCR_FLAG_DEDUP))
+		return 0;
+	if (store == NULL || encr_header_decode(&hdr, mk, buf) != 0)
+		return -EIO;
+	res = encr_backing_stat(fd, &size);
+	if (res == 0 && size > ENCR_HEADER_SIZE)
+		res = encr_io_drop_tail(store, &hdr.keys, fd, direct, 0,
+					(size - ENCR_HEADER_SIZE) /
+					ENCR_DEDUP_ENTRY, 0);
+	memset(&hdr, 0, sizeof(hdr));
+	return res;
+}
+
+int encr_io_truncate(struct encr_inode *in, int fd, off_t size)
+{
+	size_t cs;
+	unsigned char *plain = NULL;
+	unsigned char *rec = NULL;
+	off_t psz = size;
+	int res;
+
+	encr_inode_wrlock_all(in);
+	cs = ENCR_CHUNK(in);
+	if (!in->encrypted) {
+		res = ftruncate(fd, size) == -1 ? -errno : 0;
+		goto out;
+	}
+
+	res = encr_io_size(in, fd, &psz);
+	if (res != 0 || psz == size)
+		goto out;
+	if (ENCR_DEDUP(in)) {
+		res = encr_io_dtruncate(in, fd, psz, size);
+		goto out;
+	}
+	if (ENCR_LOG(in)) {
+		res = encr_io_ltruncate(in, fd, psz, size);
+		goto out;
+	}
+	if (ENCR_STRIPED(in)) {
+		res = encr_io_struncate(in, fd, psz, size);
+		goto out;
+	}
+	if (ENCR_COMPRESSED(in)) {
+		res = encr_io_ctruncate(in, fd, psz, size);
+		goto out;
+	}
+
+	if (size > psz) {
+		/* Grow the old last chunk; everything after it reads back
+		 * as all-zero hole records */
+		off_t lstart = psz & ~(off_t) (cs - 1);
+
+		res = encr_io_pad_last(in, fd, psz,
+				       size - lstart < (off_t) cs ?
+				       (size_t) (size - lstart) : cs);
+	} else if ((size & (cs - 1)) != 0) {
+		uint64_t c = (uint64_t) size >> in->chunk_shift;
+
+		plain = malloc(cs);
+		rec = malloc(ENCR_RECBUF(in));
+		if (plain == NULL || rec == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		res = encr_io_load(in, fd, c, psz, plain, rec);
+		if (res >= 0)
+			res = encr_io_store(in, fd, c, plain, size & (cs - 1),
+					    rec);
+	}
+	if (res == 0)
+		res = encr_io_ftruncate(in, fd,
+					encr_backing_size(size, in->chunk_shift));
+out:
+	if (res == 0)
+		__atomic_add_fetch(&in->wgen, 1, __ATOMIC_RELEASE);
+	// Both the bytes cut off and the zeros grown count as changed
+	if (res == 0 && in->encrypted)
+		encr_changes_mark(in, size < psz ? size : psz,
+				  size < psz ? psz - size : size - psz);
+	encr_inode_unlock_all(in);
+	free(plain);
+	free(rec);
+	return res;
+}
@@ -0,0 +1,121 @@
+/* encfs-io.h
+ * Chunked encrypted file I/O for pa5-encfs
+ *
+ * Turns plaintext reads, writes and truncates on an open backing file
+ * into whole-chunk record I/O (see encfs-format.h), taking the inode's
+ * chunk range locks (see encfs-lock.h) around every operation. Files
+ * that are not encrypted are passed straight through.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_IO_H
+#define ENCFS_IO_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "encfs-format.h"
+#include "encfs-lock.h"
+
+/* Largest read, write or readahead request the mount may be set up for;
+ * every path handles one in a single pass */
+#define ENCR_MAX_REQUEST (1024 * 1024)
+#define ENCR_MIN_REQUEST 4096
+#define ENCR_DEFAULT_MAX_WRITE (128 * 1024)
+#define ENCR_COPY_BATCH (1024 * 1024)
+
+/* int encr_io_open(struct encr_inode *in, int fd, const struct encr_keys *mk, struct encr_store *store, struct encr_log *log, struct encr_roots *roots, int encrypted, unsigned chunk_shift, unsigned flags, int direct)
+ * Purpose: Fill in the inode's format state on the first open of an inode
+ *          An encrypted file with no header yet (a create that was
+ *          interrupted, or a brand new file) gets one now.
+ * Args: struct encr_inode *in      : Inode being opened
+ *       int fd                     : Backing file, opened O_RDWR if possible
+ *       const struct encr_keys *mk : Mount key
+ *       struct encr_store *store   : Chunk store, NULL if the mirror has none
+ *       struct encr_log *log       : Log, NULL if the mirror has none
+ *       struct encr_roots *roots   : Other roots, NULL if the mirror has none
+ *       int encrypted              : Whether the file carries the encrypted marker
+ *       unsigned chunk_shift       : Chunk size for a header written now
+ *       unsigned flags             : ENCR_FLAG_* for a header written now;
+ *                                    ENCR_FLAG_STRIPED stripes the file
+ *                                    over every root there is
+ *       int direct                 : Whether handles of an encrypted file
+ *                                    may be O_DIRECT (see encfs-direct.h)
+ * Return: 0 on success, -errno on failure (-EIO for a bad header)
+ */
+extern int encr_io_open(struct encr_inode *in, int fd,
+			const struct encr_keys *mk, struct encr_store *store,
+			struct encr_log *log, struct encr_roots *roots,
+			int encrypted, unsigned chunk_shift, unsigned flags,
+			int direct);
+
+/* int encr_io_set_chunk(struct encr_inode *in, int fd, const struct encr_keys *mk, unsigned chunk_shift)
+ * Purpose: Give an encrypted file that holds no data yet another chunk
+ *          size, rewriting its header in place
+ * Return: 0 on success, -EBUSY if the file already holds data or is not
+ *         encrypted, -errno on failure
+ */
+extern int encr_io_set_chunk(struct encr_inode *in, int fd,
+			     const struct encr_keys *mk, unsigned chunk_shift);
+
+/* ssize_t encr_io_read(struct encr_inode *in, int fd, char *buf, size_t size, off_t off)
+ * ssize_t encr_io_write(struct encr_inode *in, int fd, const char *buf, size_t size, off_t off)
+ * Purpose: pread()/pwrite() of plaintext
+ * Return: Bytes transferred, or -errno (-EIO when a chunk fails authentication)
+ */
+extern ssize_t encr_io_read(struct encr_inode *in, int fd, char *buf,
+			    size_t size, off_t off);
+extern ssize_t encr_io_write(struct encr_inode *in, int fd, const char *buf,
+			     size_t size, off_t off);
+
+/* ssize_t encr_io_read_locked(struct encr_inode *in, int fd, char *buf, size_t size, off_t off)
+ * ssize_t encr_io_write_locked(struct encr_inode *in, int fd, const char *buf, size_t size, off_t off)
+ * Purpose: The same for a caller that already holds encr_inode_wrlock_all()
+ */
+extern ssize_t encr_io_read_locked(struct encr_inode *in, int fd, char *buf,
+				   size_t size, off_t off);
+extern ssize_t encr_io_write_locked(struct encr_inode *in, int fd,
+				    const char *buf, size_t size, off_t off);
+
+/* int encr_io_truncate(struct encr_inode *in, int fd, off_t size)
+ * Purpose: ftruncate() to a plaintext size
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_io_truncate(struct encr_inode *in, int fd, off_t size);
+
+/* int encr_io_fstat(struct encr_inode *in, int fd, struct stat *st)
+ * Purpose: fstat() reporting the plaintext size
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_io_fstat(struct encr_inode *in, int fd, struct stat *st);
+
+/* ssize_t encr_io_copy(struct encr_inode *src, int sfd, off_t soff, struct encr_inode *dst, int dfd, off_t doff, size_t len)
+ * Purpose: copy_file_range() between two open files of the mount
+ *          Copying all of an encrypted file into an empty encrypted one
+ *          gives the copy the source's header, and with it its data keys,
+ *          and copies the backing file as it is: reflinked where the
+ *          backing filesystem can, copy_file_range()d or read and written
+ *          otherwise, and chunks in the store just gain a reference. Any
+ *          other copy is decrypted and re-encrypted ENCR_COPY_BATCH bytes
+ *          at a time.
+ * Return: Bytes copied (short at the source's end), or -errno; -EINVAL
+ *         for overlapping ranges of one file, as copy_file_range() gives
+ */
+extern ssize_t encr_io_copy(struct encr_inode *src, int sfd, off_t soff,
+			    struct encr_inode *dst, int dfd, off_t doff,
+			    size_t len);
+
+/* int encr_io_drop_refs(struct encr_store *store, struct encr_log *log, struct encr_roots *roots, const struct encr_keys *mk, int fd)
+ * Purpose: Give back the store references of a deduplicated file, drop
+ *          the chunks of a log-structured one or remove the parts of a
+ *          striped one, that has just lost its last link and handle;
+ *          other files are left alone
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_io_drop_refs(struct encr_store *store, struct encr_log *log,
+			     struct encr_roots *roots,
+			     const struct encr_keys *mk, int fd);
+
+#endif
@@ -0,0 +1,90 @@
+/* encfs-ioctl.h
+ * ioctl()s understood by files of a pa5-encfs mount
+ *
+ * FUSE 2 has no copy_file_range() request, so a copy inside the mount is
+ * asked for with an ioctl on the destination instead (see encfs-cp). The
+ * source is named by its path from the root of the mount, as ioctls
+ * cannot pass a file descriptor through FUSE.
+ *
+ * A file's chunk size can be read and changed the same way (see
+ * encfs-rechunk), the parts of it changed since a generation listed
+ * (see encfs-changes.h and encfs-changed), and the number of mirror
+ * roots it is striped over read (see encfs-rebalance).
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_IOCTL_H
+#define ENCFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define ENCR_IOC_MAGIC 'E'
+#define ENCR_IOC_PATH_MAX 4096
+
+struct encr_copy_range {
+	char src[ENCR_IOC_PATH_MAX];	// e.g. "/dir/file", NUL terminated
+	int64_t src_off;
+	int64_t dst_off;
+	uint64_t len;
+	uint64_t copied;		// set on return
+};
+
+/* copy_file_range(src, &src_off, <this file>, &dst_off, len, 0) */
+#define ENCR_IOC_COPY_RANGE _IOWR(ENCR_IOC_MAGIC, 1, struct encr_copy_range)
+
+struct encr_chunk_info {
+	uint32_t chunk_size;		// bytes, 0 for a file not encrypted
+	uint32_t target;		// what a rewrite would give it
+};
+
+/* This file's chunk size, and the one the migrator or encfs-rechunk would
+ * rewrite it to (see encfs-chunk.h) */
+#define ENCR_IOC_GET_CHUNK _IOR(ENCR_IOC_MAGIC, 2, struct encr_chunk_info)
+
+/* Rewrite this file with chunk_size byte chunks now: 0 for its target,
+ * ENCR_CHUNK_BY_SIZE for the one its size picks; both fields are set as
+ * for ENCR_IOC_GET_CHUNK on return */
+#define ENCR_IOC_SET_CHUNK _IOWR(ENCR_IOC_MAGIC, 3, struct encr_chunk_info)
+#define ENCR_CHUNK_BY_SIZE 1
+
+#define ENCR_CHANGES_RANGES 60
+#define ENCR_CHANGES_CLOSE 0x1		// end the current generation first
+
+struct encr_changes_query {
+	uint64_t map;			// in: the map since came with, 0 for
+					// none; out: this file's map
+	uint32_t since;			// in: list what changed after it
+	uint32_t flags;			// in: ENCR_CHANGES_*
+	uint32_t generation;		// out: what to pass as since next time
+	uint32_t region_shift;		// out: log2 of the bytes per region
+	uint64_t size;			// out: plaintext size of the file
+	uint64_t start;			// in: first region to look at; out:
+					// where to go on, or size in regions
+	uint32_t count;			// out: ranges filled in
+	uint32_t all;			// out: since is not from this map, so
+					// everything is listed as changed
+	uint64_t ranges[ENCR_CHANGES_RANGES][2];	// out: [first, end)
+};
+
+/* The regions of this file changed since a generation, up to
+ * ENCR_CHANGES_RANGES runs of them from start on; call again from the
+ * returned start until it reaches the file's size, passing
+ * ENCR_CHANGES_CLOSE on the first call only */
+#define ENCR_IOC_CHANGES _IOWR(ENCR_IOC_MAGIC, 4, struct encr_changes_query)
+
+struct encr_stripe_info {
+	uint32_t width;			// roots the file is striped over: 0
+					// for a file not encrypted, 1 for
+					// one not striped
+	uint32_t roots;			// roots the mount has
+};
+
+/* How many roots this file is spread over, and how many it would be if
+ * rewritten (see encfs-roots.h and encfs-rebalance); ENCR_IOC_SET_CHUNK
+ * with the file's own chunk size rewrites it over all of them */
+#define ENCR_IOC_GET_STRIPE _IOR(ENCR_IOC_MAGIC, 5, struct encr_stripe_info)
+
+#endif
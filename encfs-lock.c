@@ -0,0 +1,207 @@
+/* encfs-lock.c
+ * Open inode table and per-inode byte-range locking for pa5-encfs
+ *
+ * See encfs-lock.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "encfs-lock.h"
+#include "encfs-changes.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+
+static size_t encr_ihash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev << 32) ^ (uint64_t) ino;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (size_t) (h >> 32) % ENCR_ITABLE_BUCKETS;
+}
+
+struct encr_itable *encr_itable_new(void)
+{
+	struct encr_itable *t = calloc(1, sizeof(struct encr_itable));
+
+	if (t == NULL)
+		return NULL;
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+void encr_itable_free(struct encr_itable *t)
+{
+	if (t == NULL)
+		return;
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+static struct encr_inode *encr_inode_find(struct encr_itable *t,
+					  dev_t dev, ino_t ino)
+{
+	struct encr_inode *in;
+
+	for (in = t->buckets[encr_ihash(dev, ino)]; in != NULL; in = in->next)
+		if (in->dev == dev && in->ino == ino)
+			return in;
+	return NULL;
+}
+
+struct encr_inode *encr_inode_get(struct encr_itable *t, dev_t dev, ino_t ino)
+{
+	struct encr_inode *in;
+	size_t b;
+	int i;
+
+	pthread_mutex_lock(&t->lock);
+	in = encr_inode_find(t, dev, ino);
+	if (in == NULL) {
+		in = calloc(1, sizeof(struct encr_inode));
+		if (in == NULL) {
+			pthread_mutex_unlock(&t->lock);
+			return NULL;
+		}
+		in->dev = dev;
+		in->ino = ino;
+		in->chunk_shift = ENCR_DEFAULT_CHUNK_SHIFT;
+		in->changes = t->changes;
+		in->tier = t->tier;
+		for (i = 0; i < ENCR_LOCK_STRIPES; i++)
+			pthread_rwlock_init(&in->stripes[i], NULL);
+		pthread_mutex_init(&in->lock, NULL);
+		encr_sync_init(&in->sync);
+		b = encr_ihash(dev, ino);
+		in->next = t->buckets[b];
+		t->buckets[b] = in;
+	}
+	in->refcount++;
+	pthread_mutex_unlock(&t->lock);
+
+	return in;
+}
+
+struct encr_inode *encr_inode_lookup(struct encr_itable *t,
+				     dev_t dev, ino_t ino)
+{
+	struct encr_inode *in;
+
+	pthread_mutex_lock(&t->lock);
+	in = encr_inode_find(t, dev, ino);
+	if (in != NULL)
+		in->refcount++;
+	pthread_mutex_unlock(&t->lock);
+
+	return in;
+}
+
+int encr_inode_put(struct encr_itable *t, struct encr_inode *in)
+{
+	struct encr_inode **pp;
+	int i;
+
+	pthread_mutex_lock(&t->lock);
+	if (--in->refcount > 0) {
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	for (pp = &t->buckets[encr_ihash(in->dev, in->ino)]; *pp != in;
+	     pp = &(*pp)->next)
+		;
+	*pp = in->next;
+	pthread_mutex_unlock(&t->lock);
+
+	encr_tier_detach(in);
+	for (i = 0; i < ENCR_LOCK_STRIPES; i++)
+		pthread_rwlock_destroy(&in->stripes[i]);
+	pthread_mutex_destroy(&in->lock);
+	encr_sync_destroy(&in->sync);
+	encr_changes_drop(in);
+	encr_parts_drop(in);
+	memset(&in->hdr, 0, sizeof(in->hdr));
+	free(in);
+	return 1;
+}
+
+// Bit i of the result is set when stripe i covers part of the range
+static uint64_t encr_range_stripes(unsigned shift, off_t off, size_t len)
+{
+	uint64_t first = (uint64_t) off >> shift;
+	uint64_t last = first;
+	uint64_t mask = 0;
+	uint64_t c;
+
+	if (len > 0)
+		last = ((uint64_t) off + len - 1) >> shift;
+	if (last - first + 1 >= ENCR_LOCK_STRIPES)
+		return ~(uint64_t) 0;
+	for (c = first; c <= last; c++)
+		mask |= (uint64_t) 1 << (c % ENCR_LOCK_STRIPES);
+	return mask;
+}
+
+static uint64_t encr_range_lock(struct encr_inode *in, off_t off, size_t len,
+				int write)
+{
+	unsigned shift;
+	uint64_t mask;
+	int i;
+
+	for (;;) {
+		shift = __atomic_load_n(&in->chunk_shift, __ATOMIC_ACQUIRE);
+		mask = encr_range_stripes(shift, off, len);
+		for (i = 0; i < ENCR_LOCK_STRIPES; i++) {
+			if (!(mask & ((uint64_t) 1 << i)))
+				continue;
+			if (write)
+				pthread_rwlock_wrlock(&in->stripes[i]);
+			else
+				pthread_rwlock_rdlock(&in->stripes[i]);
+		}
+		// Changing the chunk size takes every stripe, so once we hold
+		// one it cannot change under us
+		if (__atomic_load_n(&in->chunk_shift, __ATOMIC_ACQUIRE) == shift)
+			return mask;
+		encr_range_unlock(in, mask);
+	}
+}
+
+uint64_t encr_range_rdlock(struct encr_inode *in, off_t off, size_t len)
+{
+	return encr_range_lock(in, off, len, 0);
+}
+
+uint64_t encr_range_wrlock(struct encr_inode *in, off_t off, size_t len)
+{
+	return encr_range_lock(in, off, len, 1);
+}
+
+void encr_range_unlock(struct encr_inode *in, uint64_t set)
+{
+	int i;
+
+	for (i = ENCR_LOCK_STRIPES - 1; i >= 0; i--)
+		if (set & ((uint64_t) 1 << i))
+			pthread_rwlock_unlock(&in->stripes[i]);
+}
+
+void encr_inode_wrlock_all(struct encr_inode *in)
+{
+	int i;
+
+	for (i = 0; i < ENCR_LOCK_STRIPES; i++)
+		pthread_rwlock_wrlock(&in->stripes[i]);
+}
+
+void encr_inode_unlock_all(struct encr_inode *in)
+{
+	int i;
+
+	for (i = ENCR_LOCK_STRIPES - 1; i >= 0; i--)
+		pthread_rwlock_unlock(&in->stripes[i]);
+}
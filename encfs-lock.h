@@ -0,0 +1,139 @@
+/* encfs-lock.h
+ * Open inode table and per-inode byte-range locking for pa5-encfs
+ *
+ * Every backing inode with at least one open handle gets one
+ * struct encr_inode, shared by all of its handles and hard links.
+ * Byte ranges are locked by chunk: each chunk maps onto one of
+ * ENCR_LOCK_STRIPES reader/writer locks, so readers never block each
+ * other, writers to different chunks run in parallel, and only
+ * updates touching the same chunk (or two chunks that hash onto the
+ * same stripe) serialize.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_LOCK_H
+#define ENCFS_LOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "encfs-format.h"
+#include "encfs-sync.h"
+
+#define ENCR_LOCK_STRIPES 64
+#define ENCR_ITABLE_BUCKETS 1024
+
+struct encr_store;
+struct encr_log;
+struct encr_roots;
+struct encr_parts;
+struct encr_changes;
+struct encr_cmap;
+struct encr_tier;
+struct encr_tier_file;
+
+struct encr_inode {
+	struct encr_inode *next;
+	dev_t dev;
+	ino_t ino;
+	int refcount;
+	unsigned chunk_shift;		// lock granularity, the file's chunk size;
+					// only changes with every stripe held
+	pthread_rwlock_t stripes[ENCR_LOCK_STRIPES];
+	pthread_mutex_t lock;		// guards the fields below
+	int loaded;			// set once the first open has filled them in
+	int encrypted;
+	struct encr_header hdr;		// valid if encrypted
+	struct encr_store *store;	// chunk store, for deduplicated files
+	struct encr_log *log;		// mirror's log, for log-structured files
+	uint64_t lfid;			// and the id the log knows the file by
+	off_t psize;			// plaintext size if compressed; read with
+					// any stripe held, changed with all of them
+	unsigned long wgen;		// bumped by every write and truncate
+	int direct;			// backing I/O aligned for O_DIRECT
+	int rewriting;			// being rewritten by the migrator
+	// writes since the last look at them (see encfs-chunk.h); counted
+	// with atomics and without the lock, as they are only a hint
+	unsigned long wseq;		// starting where the one before ended
+	unsigned long wrand;		// starting anywhere else
+	unsigned long long wrand_bytes;
+	off_t wnext;
+	struct encr_roots *roots;	// mount's other roots, for striped files
+	struct encr_parts *parts;	// a striped file's parts (see
+					// encfs-roots.h), swapped by the
+					// migrator with every stripe held
+	struct encr_changes *changes;	// the table's, see below
+	struct encr_cmap *cmap;		// the file's change map, once loaded;
+					// has its own lock (see encfs-changes.h)
+	struct encr_tier *tier;		// the table's, see below
+	struct encr_tier_file *tfile;	// the file in it, once attached (see
+					// encfs-tier.h)
+	struct encr_sync sync;		// fsync() state, see encfs-sync.h
+};
+
+struct encr_itable {
+	pthread_mutex_t lock;
+	struct encr_inode *buckets[ENCR_ITABLE_BUCKETS];
+	struct encr_changes *changes;	// change tracking, NULL if off; set
+					// before the first inode is got
+	struct encr_tier *tier;		// cache tier, NULL if none; likewise
+};
+
+/* struct encr_itable *encr_itable_new(void)
+ * Purpose: Allocate an empty open inode table
+ * Return: New table, or NULL on allocation failure
+ */
+extern struct encr_itable *encr_itable_new(void);
+
+/* void encr_itable_free(struct encr_itable *t)
+ * Purpose: Free a table; every inode must already have been put
+ */
+extern void encr_itable_free(struct encr_itable *t);
+
+/* struct encr_inode *encr_inode_get(struct encr_itable *t, dev_t dev, ino_t ino)
+ * Purpose: Take a reference on the inode (dev, ino), creating it if needed
+ * Return: Referenced inode, or NULL on allocation failure
+ */
+extern struct encr_inode *encr_inode_get(struct encr_itable *t,
+					 dev_t dev, ino_t ino);
+
+/* struct encr_inode *encr_inode_lookup(struct encr_itable *t, dev_t dev, ino_t ino)
+ * Purpose: Take a reference on (dev, ino) only if it is already open
+ * Return: Referenced inode, or NULL if no handle has it open
+ */
+extern struct encr_inode *encr_inode_lookup(struct encr_itable *t,
+					    dev_t dev, ino_t ino);
+
+/* int encr_inode_put(struct encr_itable *t, struct encr_inode *in)
+ * Purpose: Drop a reference taken by encr_inode_get()/encr_inode_lookup()
+ * Return: 1 if that was the last reference and in is gone, 0 otherwise
+ */
+extern int encr_inode_put(struct encr_itable *t, struct encr_inode *in);
+
+/* uint64_t encr_range_rdlock(struct encr_inode *in, off_t off, size_t len)
+ * uint64_t encr_range_wrlock(struct encr_inode *in, off_t off, size_t len)
+ * void encr_range_unlock(struct encr_inode *in, uint64_t set)
+ * Purpose: Lock every chunk overlapping [off, off + len), and unlock the
+ *          stripe set the lock call returned
+ *          Stripes are always taken in ascending order, so any mix of
+ *          range locks is deadlock free. len == 0 locks the chunk at off.
+ *          If the file's chunk size changes while waiting, the lock is
+ *          retaken for the new chunk boundaries.
+ */
+extern uint64_t encr_range_rdlock(struct encr_inode *in, off_t off,
+				  size_t len);
+extern uint64_t encr_range_wrlock(struct encr_inode *in, off_t off,
+				  size_t len);
+extern void encr_range_unlock(struct encr_inode *in, uint64_t set);
+
+/* void encr_inode_wrlock_all(struct encr_inode *in)
+ * void encr_inode_unlock_all(struct encr_inode *in)
+ * Purpose: Exclusive access to the whole file (truncate, size changes)
+ */
+extern void encr_inode_wrlock_all(struct encr_inode *in);
+extern void encr_inode_unlock_all(struct encr_inode *in);
+
+#endif
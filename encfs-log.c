@@ -0,0 +1,1376 @@
+/* encfs-log.c
+ * Log-structured chunk storage for pa5-encfs
+ *
+ * See encfs-log.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+
+#include "aes-crypt.h"
+#include "encfs-log.h"
+#include "encfs-sched.h"
+
+/* Record header layout, all little endian:
+ *   0  magic       4
+ *   4  type        u8, then 3 zero bytes
+ *   8  len         u32, bytes of chunk record after the header
+ *   12 moved seg   u32, where a move record's chunk was copied from
+ *   16 file id     u64
+ *   24 chunk       u64, the first chunk dropped for a trim record
+ *   32 moved off   u64
+ *   40 tag         16, over bytes 0-39, the record's segment (u32) and
+ *                  offset (u64) and the last 16 bytes of the chunk record
+ */
+#define LOG_MAGIC "ELR1"
+#define LOG_HDR 56
+#define LOG_TAGGED 40
+#define LOG_PUT 1
+#define LOG_MOVE 2
+#define LOG_TRIM 3
+#define LOG_PAGE 256			// index entries per page
+#define LOG_MIN_BUCKETS 256
+#define LOG_CLEAN_BATCH 4		// segments per cleaner pass
+#define LOG_FID_LABEL "pa5-encfs log file"
+
+/* Checkpoint layout, all little endian:
+ *   magic (8) | replay from segment (u32) | 0 (u32) | and offset (u64) |
+ *   number of files (u64)
+ *   per file: id (u64) | number of entries (u64) |
+ *             per entry: chunk (u64) | segment (u32) | length (u32) |
+ *                        offset (u64)
+ *   tag (16) over everything before it
+ */
+#define CKPT_MAGIC "ENCRLOG1"
+#define CKPT_HDR 32
+#define CKPT_FILE 16
+#define CKPT_ENT 24
+
+struct log_loc {
+	uint64_t off;			// of the record header
+	uint32_t seg;			// 0 for a chunk never written
+	uint32_t len;			// of the chunk record
+};
+
+struct log_file {
+	struct log_file *next;
+	uint64_t fid;
+	uint64_t n;			// no chunks from here on
+	uint64_t npages;
+	struct log_loc **pages;		// LOG_PAGE entries each, or NULL
+};
+
+struct log_seg {
+	int fd;
+	uint64_t tail;			// bytes appended or reserved
+	uint64_t live;			// bytes of chunk records still indexed
+	int dirty;			// appended to since the last sync
+};
+
+/* A record being appended, or found by a scan */
+struct log_rec {
+	unsigned type;
+	uint32_t len;
+	uint64_t fid;
+	uint64_t chunk;
+	struct log_loc orig;		// where a move came from
+	struct log_loc at;		// where the record is
+	const unsigned char *payload;
+};
+
+struct encr_log {
+	int dirfd;
+	struct encr_keys keys;
+	pthread_mutex_t ckpt_lock;	// one checkpoint or cleaner pass at a time
+	pthread_rwlock_t segs_lock;	// segs[] and segment fds; taken before lock
+	struct log_seg **segs;		// by segment number
+	uint32_t nsegs;			// room in segs[]
+	uint32_t first;			// lowest segment, 0 if none
+	uint32_t last;			// highest segment number ever used
+	pthread_mutex_t lock;		// guards everything below
+	uint32_t active;		// segment appended to, 0 until the first append
+	int dir_dirty;			// segments created since the last sync
+	unsigned inflight;		// appends between reserving and indexing
+	int holding;			// appends wait for a checkpoint snapshot
+	pthread_cond_t idle;
+	struct log_file **buckets;
+	size_t nbuckets;
+	size_t nfiles;
+	uint64_t appended;		// bytes appended (or replayed) since mount
+	uint64_t ckpt_appended;		// appended at the last checkpoint
+	uint32_t ckpt_seg;		// where the last checkpoint's replay starts
+	uint64_t ckpt_off;
+	pthread_cond_t wake;		// for the cleaner
+	struct encr_sched *sched;	// lets the cleaner in, NULL for none
+	int stop;
+	int running;
+	pthread_t cleaner;
+	int rdonly;			// opened with ENCR_LOG_RDONLY
+};
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((uint64_t) get_u32(p + 4) << 32);
+}
+
+static ssize_t log_pread(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pread(fd, (char *) buf + done, len - done, off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t log_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pwrite(fd, (const char *) buf + done, len - done,
+			     off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+static size_t rec_size(size_t len)
+{
+	return (LOG_HDR + len + ENCR_LOG_ALIGN - 1) &
+		~(size_t) (ENCR_LOG_ALIGN - 1);
+}
+
+int encr_log_fid(const struct encr_keys *k, uint64_t *fid)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE,
+			 (const unsigned char *) LOG_FID_LABEL,
+			 strlen(LOG_FID_LABEL), NULL, 0, mac))
+		return -EIO;
+	*fid = get_u64(mac);
+	return 0;
+}
+
+/* Index */
+
+static struct log_file *file_find(struct encr_log *l, uint64_t fid)
+{
+	struct log_file *f;
+
+	for (f = l->buckets[fid % l->nbuckets]; f != NULL; f = f->next)
+		if (f->fid == fid)
+			return f;
+	return NULL;
+}
+
+static void index_grow(struct encr_log *l)
+{
+	size_t nb = l->nbuckets * 2;
+	struct log_file **b = calloc(nb, sizeof(struct log_file *));
+	struct log_file *f;
+	size_t i;
+
+	// Chains just get longer if there is no memory for more buckets
+	if (b == NULL)
+		return;
+	for (i = 0; i < l->nbuckets; i++) {
+		while ((f = l->buckets[i]) != NULL) {
+			l->buckets[i] = f->next;
+			f->next = b[f->fid % nb];
+			b[f->fid % nb] = f;
+		}
+	}
+	free(l->buckets);
+	l->buckets = b;
+	l->nbuckets = nb;
+}
+
+static struct log_file *file_get(struct encr_log *l, uint64_t fid)
+{
+	struct log_file *f = file_find(l, fid);
+
+	if (f != NULL)
+		return f;
+	f = calloc(1, sizeof(struct log_file));
+	if (f == NULL)
+		return NULL;
+	if (l->nfiles >= 2 * l->nbuckets)
+		index_grow(l);
+	f->fid = fid;
+	f->next = l->buckets[fid % l->nbuckets];
+	l->buckets[fid % l->nbuckets] = f;
+	l->nfiles++;
+	return f;
+}
+
+static void file_free(struct encr_log *l, struct log_file *f)
+{
+	struct log_file **pp;
+	uint64_t p;
+
+	for (pp = &l->buckets[f->fid % l->nbuckets]; *pp != f;
+	     pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	l->nfiles--;
+	for (p = 0; p < f->npages; p++)
+		free(f->pages[p]);
+	free(f->pages);
+	free(f);
+}
+
+static struct log_loc *loc_slot(struct log_file *f, uint64_t c, int create)
+{
+	uint64_t p = c / LOG_PAGE;
+	struct log_loc **pages;
+	uint64_t np;
+
+	if (p >= f->npages) {
+		if (!create)
+			return NULL;
+		np = f->npages * 2 > p + 1 ? f->npages * 2 : p + 1;
+		pages = realloc(f->pages, np * sizeof(struct log_loc *));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + f->npages, 0,
+		       (np - f->npages) * sizeof(struct log_loc *));
+		f->pages = pages;
+		f->npages = np;
+	}
+	if (f->pages[p] == NULL) {
+		if (!create)
+			return NULL;
+		f->pages[p] = calloc(LOG_PAGE, sizeof(struct log_loc));
+		if (f->pages[p] == NULL)
+			return NULL;
+	}
+	return &f->pages[p][c % LOG_PAGE];
+}
+
+// Where a chunk is, with lock held; 0 if it was never written
+static int loc_get(struct encr_log *l, uint64_t fid, uint64_t c,
+		   struct log_loc *loc)
+{
+	struct log_file *f = file_find(l, fid);
+	struct log_loc *slot = f != NULL ? loc_slot(f, c, 0) : NULL;
+
+	if (slot == NULL || slot->seg == 0)
+		return 0;
+	*loc = *slot;
+	return 1;
+}
+
+// Point a chunk at a record, moving the live bytes with it
+static int loc_set(struct encr_log *l, uint64_t fid, uint64_t c,
+		   const struct log_loc *to)
+{
+	struct log_file *f = file_get(l, fid);
+	struct log_loc *slot = f != NULL ? loc_slot(f, c, 1) : NULL;
+
+	if (slot == NULL)
+		return -ENOMEM;
+	if (slot->seg != 0)
+		l->segs[slot->seg]->live -= slot->len;
+	*slot = *to;
+	l->segs[to->seg]->live += to->len;
+	if (c >= f->n)
+		f->n = c + 1;
+	return 0;
+}
+
+static void loc_trim(struct encr_log *l, uint64_t fid, uint64_t from)
+{
+	struct log_file *f = file_find(l, fid);
+	struct log_loc *slot;
+	uint64_t p, i;
+
+	if (f == NULL)
+		return;
+	for (p = from / LOG_PAGE; p < f->npages; p++) {
+		if (f->pages[p] == NULL)
+			continue;
+		i = p == from / LOG_PAGE ? from % LOG_PAGE : 0;
+		for (; i < LOG_PAGE; i++) {
+			slot = &f->pages[p][i];
+			if (slot->seg != 0)
+				l->segs[slot->seg]->live -= slot->len;
+			memset(slot, 0, sizeof(*slot));
+		}
+		if (p * LOG_PAGE >= from) {
+			free(f->pages[p]);
+			f->pages[p] = NULL;
+		}
+	}
+	if (from == 0)
+		file_free(l, f);
+	else if (f->n > from)
+		f->n = from;
+}
+
+/* Segments */
+
+static void seg_name(uint32_t n, char *name, size_t size)
+{
+	snprintf(name, size, "%08x", n);
+}
+
+// Segment n, NULL if there is none
+static struct log_seg *seg_at(const struct encr_log *l, uint32_t n)
+{
+	return n < l->nsegs ? l->segs[n] : NULL;
+}
+
+// Add segment n, with segs_lock held for writing (or before any thread runs)
+static int seg_add(struct encr_log *l, uint32_t n, int fd, uint64_t tail)
+{
+	struct log_seg **segs;
+	struct log_seg *s;
+	uint32_t ns;
+
+	if (n >= l->nsegs) {
+		ns = l->nsegs * 2 > n + 1 ? l->nsegs * 2 : n + 1;
+		segs = realloc(l->segs, ns * sizeof(struct log_seg *));
+		if (segs == NULL)
+			return -ENOMEM;
+		memset(segs + l->nsegs, 0,
+		       (ns - l->nsegs) * sizeof(struct log_seg *));
+		l->segs = segs;
+		l->nsegs = ns;
+	}
+	s = calloc(1, sizeof(struct log_seg));
+	if (s == NULL)
+		return -ENOMEM;
+	s->fd = fd;
+	s->tail = tail;
+	l->segs[n] = s;
+	if (l->first == 0 || n < l->first)
+		l->first = n;
+	if (n > l->last)
+		l->last = n;
+	return 0;
+}
+
+// Start a new segment, unless someone already has since seen was active
+static int log_roll(struct encr_log *l, uint32_t seen)
+{
+	char name[16];
+	uint32_t n;
+	int fd;
+	int res = 0;
+
+	pthread_rwlock_wrlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	if (l->active == seen) {
+		n = l->last + 1;
+		seg_name(n, name, sizeof(name));
+		fd = openat(l->dirfd, name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1) {
+			res = -errno;
+		} else {
+			res = seg_add(l, n, fd, 0);
+			if (res != 0) {
+				close(fd);
+				unlinkat(l->dirfd, name, 0);
+			} else {
+				l->active = n;
+				l->dir_dirty = 1;
+			}
+		}
+		// A full segment may have left another to clean
+		pthread_cond_signal(&l->wake);
+	}
+	pthread_mutex_unlock(&l->lock);
+	pthread_rwlock_unlock(&l->segs_lock);
+	return res;
+}
+
+// Segment n has nothing live left in it; remove it
+static void log_remove(struct encr_log *l, uint32_t n)
+{
+	struct log_seg *s;
+	char name[16];
+
+	pthread_rwlock_wrlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	s = l->segs[n];
+	if (s != NULL && s->live == 0 && n != l->active) {
+		l->segs[n] = NULL;
+		// Numbers are never reused, so replay never misses a segment
+		while (l->first <= l->last && seg_at(l, l->first) == NULL)
+			l->first++;
+		if (l->first > l->last)
+			l->first = 0;
+	} else {
+		s = NULL;
+	}
+	pthread_mutex_unlock(&l->lock);
+	pthread_rwlock_unlock(&l->segs_lock);
+
+	if (s == NULL)
+		return;
+	close(s->fd);
+	free(s);
+	seg_name(n, name, sizeof(name));
+	unlinkat(l->dirfd, name, 0);
+}
+
+/* Records */
+
+static int rec_tag(const struct encr_log *l, const unsigned char *hdr,
+		   const struct log_loc *at, const unsigned char *payload,
+		   size_t len, unsigned char *tag)
+{
+	unsigned char msg[LOG_TAGGED + 12 + ENCR_TAG_SIZE];
+	unsigned char mac[AES_CRYPT_MACLEN];
+	size_t tl = len < ENCR_TAG_SIZE ? len : ENCR_TAG_SIZE;
+
+	memcpy(msg, hdr, LOG_TAGGED);
+	put_u32(msg + LOG_TAGGED, at->seg);
+	put_u64(msg + LOG_TAGGED + 4, at->off);
+	memcpy(msg + LOG_TAGGED + 12, payload + len - tl, tl);
+	if (!hmac_sha256(l->keys.mac, ENCR_KEY_SIZE, msg,
+			 LOG_TAGGED + 12 + tl, NULL, 0, mac))
+		return -EIO;
+	memcpy(tag, mac, ENCR_TAG_SIZE);
+	return 0;
+}
+
+// Header (all but the tag) and payload of r into buf
+static void rec_encode(unsigned char *buf, const struct log_rec *r)
+{
+	memcpy(buf, LOG_MAGIC, 4);
+	buf[4] = r->type;
+	put_u32(buf + 8, r->len);
+	put_u32(buf + 12, r->orig.seg);
+	put_u64(buf + 16, r->fid);
+	put_u64(buf + 24, r->chunk);
+	put_u64(buf + 32, r->orig.off);
+	memcpy(buf + LOG_HDR, r->payload, r->len);
+}
+
+// Parse the record at (seg, off), avail bytes of which are in buf
+static int rec_decode(const struct encr_log *l, const unsigned char *buf,
+		      size_t avail, uint32_t seg, uint64_t off,
+		      struct log_rec *r)
+{
+	unsigned char tag[ENCR_TAG_SIZE];
+
+	if (avail < LOG_HDR || memcmp(buf, LOG_MAGIC, 4) != 0)
+		return -1;
+	r->type = buf[4];
+	r->len = get_u32(buf + 8);
+	if (r->type < LOG_PUT || r->type > LOG_TRIM ||
+	    (r->type == LOG_TRIM) != (r->len == 0) ||
+	    r->len > encr_cslot_size(ENCR_MAX_CHUNK_SHIFT) ||
+	    r->len > avail - LOG_HDR)
+		return -1;
+	r->orig.seg = get_u32(buf + 12);
+	r->fid = get_u64(buf + 16);
+	r->chunk = get_u64(buf + 24);
+	r->orig.off = get_u64(buf + 32);
+	r->orig.len = r->len;
+	r->at.seg = seg;
+	r->at.off = off;
+	r->at.len = r->len;
+	r->payload = buf + LOG_HDR;
+	if (rec_tag(l, buf, &r->at, r->payload, r->len, tag) != 0 ||
+	    CRYPTO_memcmp(tag, buf + LOG_TAGGED, ENCR_TAG_SIZE) != 0)
+		return -1;
+	return 0;
+}
+
+// Bring the index up to date with r, with lock held
+static int log_apply(struct encr_log *l, const struct log_rec *r)
+{
+	struct log_loc cur;
+
+	switch (r->type) {
+	case LOG_PUT:
+		return loc_set(l, r->fid, r->chunk, &r->at);
+	case LOG_MOVE:
+		// Rewritten or trimmed since the cleaner copied it
+		if (!loc_get(l, r->fid, r->chunk, &cur) ||
+		    cur.seg != r->orig.seg || cur.off != r->orig.off)
+			return 0;
+		return loc_set(l, r->fid, r->chunk, &r->at);
+	case LOG_TRIM:
+		loc_trim(l, r->fid, r->chunk);
+		return 0;
+	}
+	return 0;
+}
+
+/* Append r to the active segment and index it. Space is reserved under
+ * the lock and written outside it, so appends from many threads go out
+ * in parallel, still back to back on disk. */
+static int log_append(struct encr_log *l, struct log_rec *r)
+{
+	size_t total = rec_size(r->len);
+	unsigned char *buf = calloc(1, total);
+	struct log_seg *s;
+	uint32_t seen;
+	ssize_t n;
+	int res;
+
+	if (l->rdonly) {
+		free(buf);
+		return -EROFS;
+	}
+	if (buf == NULL)
+		return -ENOMEM;
+	rec_encode(buf, r);
+	for (;;) {
+		pthread_rwlock_rdlock(&l->segs_lock);
+		pthread_mutex_lock(&l->lock);
+		while (l->holding)
+			pthread_cond_wait(&l->idle, &l->lock);
+		seen = l->active;
+		if (seen != 0 &&
+		    l->segs[seen]->tail + total <= ENCR_LOG_SEGMENT_SIZE)
+			break;
+		pthread_mutex_unlock(&l->lock);
+		pthread_rwlock_unlock(&l->segs_lock);
+		res = log_roll(l, seen);
+		if (res != 0) {
+			free(buf);
+			return res;
+		}
+	}
+	s = l->segs[seen];
+	r->at.seg = seen;
+	r->at.off = s->tail;
+	r->at.len = r->len;
+	s->tail += total;
+	l->inflight++;
+	pthread_mutex_unlock(&l->lock);
+
+	res = rec_tag(l, buf, &r->at, buf + LOG_HDR, r->len, buf + LOG_TAGGED);
+	if (res == 0) {
+		n = log_pwrite(s->fd, buf, total, r->at.off);
+		if (n < 0)
+			res = n;
+	}
+
+	pthread_mutex_lock(&l->lock);
+	if (res == 0) {
+		s->dirty = 1;
+		l->appended += total;
+		res = log_apply(l, r);
+		if (l->appended - l->ckpt_appended >= ENCR_LOG_CHECKPOINT_BYTES)
+			pthread_cond_signal(&l->wake);
+	}
+	if (--l->inflight == 0)
+		pthread_cond_broadcast(&l->idle);
+	pthread_mutex_unlock(&l->lock);
+	pthread_rwlock_unlock(&l->segs_lock);
+	free(buf);
+	return res;
+}
+
+/* Call fn on every valid record of segment n from offset from on. Space
+ * a torn record was written to is skipped an alignment block at a time,
+ * so the records after it are still found. */
+static int log_scan(struct encr_log *l, uint32_t n, uint64_t from,
+		    int (*fn)(struct encr_log *, struct log_rec *, void *),
+		    void *arg)
+{
+	unsigned char *buf;
+	struct log_rec r;
+	uint64_t size;
+	size_t pos;
+	ssize_t got;
+	int res = 0;
+
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	size = l->segs[n]->tail;
+	pthread_mutex_unlock(&l->lock);
+	if (size <= from) {
+		pthread_rwlock_unlock(&l->segs_lock);
+		return 0;
+	}
+	buf = malloc(size - from);
+	got = buf == NULL ? -ENOMEM :
+		log_pread(l->segs[n]->fd, buf, size - from, from);
+	pthread_rwlock_unlock(&l->segs_lock);
+	if (got < 0) {
+		free(buf);
+		return got;
+	}
+
+	for (pos = 0; pos + LOG_HDR <= (size_t) got; ) {
+		if (rec_decode(l, buf + pos, got - pos, n, from + pos,
+			       &r) != 0) {
+			pos += ENCR_LOG_ALIGN;
+			continue;
+		}
+		res = fn(l, &r, arg);
+		if (res != 0)
+			break;
+		pos += rec_size(r.len);
+	}
+	free(buf);
+	return res;
+}
+
+ssize_t encr_log_get(struct encr_log *l, uint64_t fid, uint64_t chunk,
+		     unsigned char *rec, size_t size)
+{
+	struct log_loc loc;
+	ssize_t n;
+	int found;
+
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	found = loc_get(l, fid, chunk, &loc);
+	pthread_mutex_unlock(&l->lock);
+	if (!found) {
+		n = 0;
+	} else if (loc.len > size) {
+		n = -EIO;
+	} else {
+		n = log_pread(l->segs[loc.seg]->fd, rec, loc.len,
+			      loc.off + LOG_HDR);
+		if (n >= 0 && (size_t) n != loc.len)
+			n = -EIO;
+	}
+	pthread_rwlock_unlock(&l->segs_lock);
+	return n;
+}
+
+ssize_t encr_log_verify(struct encr_log *l, uint64_t fid, uint64_t chunk,
+			unsigned char *rec, size_t size)
+{
+	unsigned char *buf;
+	struct log_loc loc;
+	struct log_rec r;
+	ssize_t n;
+	int found;
+
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	found = loc_get(l, fid, chunk, &loc);
+	pthread_mutex_unlock(&l->lock);
+	if (!found) {
+		pthread_rwlock_unlock(&l->segs_lock);
+		return 0;
+	}
+	buf = loc.len > size ? NULL : malloc(LOG_HDR + loc.len);
+	if (buf == NULL) {
+		pthread_rwlock_unlock(&l->segs_lock);
+		return loc.len > size ? -EIO : -ENOMEM;
+	}
+	n = log_pread(l->segs[loc.seg]->fd, buf, LOG_HDR + loc.len, loc.off);
+	pthread_rwlock_unlock(&l->segs_lock);
+	if (n >= 0 && ((size_t) n != LOG_HDR + loc.len ||
+		       rec_decode(l, buf, n, loc.seg, loc.off, &r) != 0 ||
+		       r.type == LOG_TRIM || r.fid != fid || r.chunk != chunk ||
+		       r.len != loc.len))
+		n = -EBADMSG;
+	if (n >= 0) {
+		memcpy(rec, r.payload, r.len);
+		n = r.len;
+	}
+	free(buf);
+	return n;
+}
+
+int encr_log_put(struct encr_log *l, uint64_t fid, uint64_t chunk,
+		 const unsigned char *rec, size_t len)
+{
+	struct log_rec r;
+
+	memset(&r, 0, sizeof(r));
+	r.type = LOG_PUT;
+	r.len = len;
+	r.fid = fid;
+	r.chunk = chunk;
+	r.payload = rec;
+	return log_append(l, &r);
+}
+
+int encr_log_trim(struct encr_log *l, uint64_t fid, uint64_t from)
+{
+	struct log_file *f;
+	struct log_rec r;
+	int has;
+
+	pthread_mutex_lock(&l->lock);
+	f = file_find(l, fid);
+	has = f != NULL && (f->n > from || from == 0);
+	pthread_mutex_unlock(&l->lock);
+	if (!has)
+		return 0;
+
+	memset(&r, 0, sizeof(r));
+	r.type = LOG_TRIM;
+	r.fid = fid;
+	r.chunk = from;
+	r.payload = (const unsigned char *) "";
+	return log_append(l, &r);
+}
+
+int encr_log_sync(struct encr_log *l)
+{
+	uint32_t *list = NULL;
+	size_t cnt = 0;
+	size_t i;
+	uint32_t n;
+	int dir;
+	int res = 0;
+
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	if (l->last != 0)
+		list = malloc((l->last - l->first + 1) * sizeof(uint32_t));
+	if (l->last != 0 && list == NULL) {
+		pthread_mutex_unlock(&l->lock);
+		pthread_rwlock_unlock(&l->segs_lock);
+		return -ENOMEM;
+	}
+	for (n = l->first; n != 0 && n <= l->last; n++) {
+		if (seg_at(l, n) != NULL && l->segs[n]->dirty) {
+			l->segs[n]->dirty = 0;
+			list[cnt++] = n;
+		}
+	}
+	dir = l->dir_dirty;
+	l->dir_dirty = 0;
+	pthread_mutex_unlock(&l->lock);
+
+	for (i = 0; i < cnt; i++) {
+		if (fdatasync(l->segs[list[i]]->fd) == -1) {
+			res = -errno;
+			pthread_mutex_lock(&l->lock);
+			l->segs[list[i]]->dirty = 1;
+			pthread_mutex_unlock(&l->lock);
+		}
+	}
+	// New segments have to be found again after a crash
+	if (dir && fsync(l->dirfd) == -1) {
+		res = -errno;
+		pthread_mutex_lock(&l->lock);
+		l->dir_dirty = 1;
+		pthread_mutex_unlock(&l->lock);
+	}
+	pthread_rwlock_unlock(&l->segs_lock);
+	free(list);
+	return res;
+}
+
+/* Checkpoints */
+
+// Serialize the index and where replay would start, with lock held
+static int ckpt_encode(struct encr_log *l, unsigned char **bufp,
+		       size_t *lenp, uint32_t *segp, uint64_t *offp)
+{
+	struct log_file *f;
+	struct log_loc *slot;
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char *buf;
+	uint64_t nents = 0;
+	uint64_t k, p, i;
+	size_t len, pos, cnt;
+	size_t b;
+
+	for (b = 0; b < l->nbuckets; b++)
+		for (f = l->buckets[b]; f != NULL; f = f->next)
+			for (p = 0; p < f->npages; p++)
+				for (i = 0; f->pages[p] && i < LOG_PAGE; i++)
+					nents += f->pages[p][i].seg != 0;
+	len = CKPT_HDR + l->nfiles * CKPT_FILE + nents * CKPT_ENT +
+		ENCR_TAG_SIZE;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	if (l->active != 0) {
+		*segp = l->active;
+		*offp = l->segs[l->active]->tail;
+	} else {
+		*segp = l->last + 1;
+		*offp = 0;
+	}
+	memcpy(buf, CKPT_MAGIC, 8);
+	put_u32(buf + 8, *segp);
+	put_u32(buf + 12, 0);
+	put_u64(buf + 16, *offp);
+	put_u64(buf + 24, l->nfiles);
+	pos = CKPT_HDR;
+	for (b = 0; b < l->nbuckets; b++) {
+		for (f = l->buckets[b]; f != NULL; f = f->next) {
+			put_u64(buf + pos, f->fid);
+			cnt = pos + 8;
+			pos += CKPT_FILE;
+			k = 0;
+			for (p = 0; p < f->npages; p++) {
+				for (i = 0; f->pages[p] && i < LOG_PAGE; i++) {
+					slot = &f->pages[p][i];
+					if (slot->seg == 0)
+						continue;
+					put_u64(buf + pos, p * LOG_PAGE + i);
+					put_u32(buf + pos + 8, slot->seg);
+					put_u32(buf + pos + 12, slot->len);
+					put_u64(buf + pos + 16, slot->off);
+					pos += CKPT_ENT;
+					k++;
+				}
+			}
+			put_u64(buf + cnt, k);
+		}
+	}
+	if (!hmac_sha256(l->keys.mac, ENCR_KEY_SIZE, buf, pos, NULL, 0, mac)) {
+		free(buf);
+		return -EIO;
+	}
+	memcpy(buf + pos, mac, ENCR_TAG_SIZE);
+	*bufp = buf;
+	*lenp = len;
+	return 0;
+}
+
+static int ckpt_write(struct encr_log *l, const unsigned char *buf,
+		      size_t len)
+{
+	char tmp[32];
+	ssize_t n;
+	int fd;
+	int res = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", ENCR_LOG_CHECKPOINT);
+	fd = openat(l->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+	n = log_pwrite(fd, buf, len, 0);
+	if (n < 0)
+		res = n;
+	else if (fsync(fd) == -1)
+		res = -errno;
+	close(fd);
+	if (res == 0 && renameat(l->dirfd, tmp, l->dirfd,
+				 ENCR_LOG_CHECKPOINT) == -1)
+		res = -errno;
+	if (res == 0 && fsync(l->dirfd) == -1)
+		res = -errno;
+	if (res != 0)
+		unlinkat(l->dirfd, tmp, 0);
+	return res;
+}
+
+/* Write a checkpoint of the index as it stands, with ckpt_lock held.
+ * Appends are held off only while the index is copied; the records it
+ * points at are synced before the checkpoint replaces the last one. */
+static int log_checkpoint(struct encr_log *l)
+{
+	unsigned char *buf;
+	uint64_t appended;
+	uint64_t off;
+	uint32_t seg;
+	size_t len;
+	int res;
+
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	l->holding = 1;
+	while (l->inflight > 0)
+		pthread_cond_wait(&l->idle, &l->lock);
+	res = ckpt_encode(l, &buf, &len, &seg, &off);
+	appended = l->appended;
+	l->holding = 0;
+	pthread_cond_broadcast(&l->idle);
+	pthread_mutex_unlock(&l->lock);
+	pthread_rwlock_unlock(&l->segs_lock);
+	if (res != 0)
+		return res;
+
+	res = encr_log_sync(l);
+	if (res == 0)
+		res = ckpt_write(l, buf, len);
+	free(buf);
+	if (res == 0) {
+		pthread_mutex_lock(&l->lock);
+		l->ckpt_appended = appended;
+		l->ckpt_seg = seg;
+		l->ckpt_off = off;
+		pthread_mutex_unlock(&l->lock);
+	}
+	return res;
+}
+
+// Load the checkpoint, if there is one, into an empty index
+static int ckpt_load(struct encr_log *l)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char *buf;
+	struct log_loc loc;
+	struct stat st;
+	uint64_t nfiles, fid, k, c;
+	size_t pos, end;
+	ssize_t n;
+	int fd;
+	int res = 0;
+
+	l->ckpt_seg = l->first;
+	l->ckpt_off = 0;
+	fd = openat(l->dirfd, ENCR_LOG_CHECKPOINT, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	if (st.st_size < CKPT_HDR + ENCR_TAG_SIZE) {
+		close(fd);
+		return -EIO;
+	}
+	buf = malloc(st.st_size);
+	n = buf == NULL ? -ENOMEM : log_pread(fd, buf, st.st_size, 0);
+	close(fd);
+	if (n != st.st_size) {
+		free(buf);
+		return n < 0 ? (int) n : -EIO;
+	}
+
+	end = st.st_size - ENCR_TAG_SIZE;
+	if (!hmac_sha256(l->keys.mac, ENCR_KEY_SIZE, buf, end, NULL, 0, mac) ||
+	    CRYPTO_memcmp(mac, buf + end, ENCR_TAG_SIZE) != 0 ||
+	    memcmp(buf, CKPT_MAGIC, 8) != 0) {
+		free(buf);
+		return -EIO;
+	}
+	l->ckpt_seg = get_u32(buf + 8);
+	l->ckpt_off = get_u64(buf + 16);
+	nfiles = get_u64(buf + 24);
+	pos = CKPT_HDR;
+	while (nfiles-- > 0 && res == 0) {
+		if (end - pos < CKPT_FILE) {
+			res = -EIO;
+			break;
+		}
+		fid = get_u64(buf + pos);
+		k = get_u64(buf + pos + 8);
+		pos += CKPT_FILE;
+		if (k > (end - pos) / CKPT_ENT) {
+			res = -EIO;
+			break;
+		}
+		for (; k > 0 && res == 0; k--, pos += CKPT_ENT) {
+			c = get_u64(buf + pos);
+			loc.seg = get_u32(buf + pos + 8);
+			loc.len = get_u32(buf + pos + 12);
+			loc.off = get_u64(buf + pos + 16);
+			if (seg_at(l, loc.seg) == NULL ||
+			    loc.off + LOG_HDR + loc.len > l->segs[loc.seg]->tail)
+				res = -EIO;
+			else
+				res = loc_set(l, fid, c, &loc);
+		}
+	}
+	free(buf);
+	return res;
+}
+
+static int replay_one(struct encr_log *l, struct log_rec *r, void *arg)
+{
+	(void) arg;
+	l->appended += rec_size(r->len);
+	return log_apply(l, r);
+}
+
+// Bring the checkpointed index up to date with the records after it
+static int log_replay(struct encr_log *l)
+{
+	uint32_t n;
+	int res;
+
+	for (n = l->ckpt_seg; n != 0 && n <= l->last; n++) {
+		if (seg_at(l, n) == NULL)
+			continue;
+		res = log_scan(l, n, n == l->ckpt_seg ? l->ckpt_off : 0,
+			       replay_one, NULL);
+		if (res != 0)
+			return res;
+	}
+	return 0;
+}
+
+/* Cleaner */
+
+static int clean_one(struct encr_log *l, struct log_rec *r, void *arg)
+{
+	struct log_loc cur;
+	struct log_rec m;
+	int live;
+
+	(void) arg;
+	if (r->type == LOG_TRIM)
+		return 0;
+	pthread_mutex_lock(&l->lock);
+	live = loc_get(l, r->fid, r->chunk, &cur) &&
+		cur.seg == r->at.seg && cur.off == r->at.off;
+	pthread_mutex_unlock(&l->lock);
+	if (!live)
+		return 0;
+
+	m = *r;
+	m.type = LOG_MOVE;
+	m.orig = r->at;
+	return log_append(l, &m);
+}
+
+/* One cleaner pass: copy what is live in the emptiest segments forward,
+ * checkpoint so nothing needs them for replay, and remove them */
+static int log_clean(struct encr_log *l)
+{
+	uint32_t victims[LOG_CLEAN_BATCH];
+	struct log_seg *s;
+	size_t nv = 0;
+	size_t i, worst;
+	uint32_t n, end;
+	int gate;
+	int res = 0;
+
+	pthread_mutex_lock(&l->ckpt_lock);
+	pthread_rwlock_rdlock(&l->segs_lock);
+	pthread_mutex_lock(&l->lock);
+	end = l->active != 0 ? l->active : l->last + 1;
+	for (n = l->first; n != 0 && n < end; n++) {
+		s = seg_at(l, n);
+		if (s == NULL || s->live * 100 > s->tail * ENCR_LOG_CLEAN_LIVE)
+			continue;
+		if (nv < LOG_CLEAN_BATCH) {
+			victims[nv++] = n;
+			continue;
+		}
+		for (worst = 0, i = 1; i < nv; i++)
+			if (l->segs[victims[i]]->live >
+			    l->segs[victims[worst]]->live)
+				worst = i;
+		if (s->live < l->segs[victims[worst]]->live)
+			victims[worst] = n;
+	}
+	// Appends reserved in them before they filled up have to land first
+	if (nv > 0) {
+		l->holding = 1;
+		while (l->inflight > 0)
+			pthread_cond_wait(&l->idle, &l->lock);
+		l->holding = 0;
+		pthread_cond_broadcast(&l->idle);
+	}
+	pthread_mutex_unlock(&l->lock);
+	pthread_rwlock_unlock(&l->segs_lock);
+
+	for (i = 0; i < nv && res == 0; i++) {
+		gate = encr_sched_enter(l->sched, ENCR_SCHED_BACKGROUND,
+					ENCR_LOG_SEGMENT_SIZE);
+		res = log_scan(l, victims[i], 0, clean_one, NULL);
+		encr_sched_leave(l->sched, gate);
+	}
+	if (nv > 0 && res == 0)
+		res = log_checkpoint(l);
+	for (i = 0; i < nv && res == 0; i++)
+		log_remove(l, victims[i]);
+	pthread_mutex_unlock(&l->ckpt_lock);
+	return res;
+}
+
+static void *log_cleaner(void *data)
+{
+	struct encr_log *l = data;
+	struct timespec ts;
+	int ckpt;
+
+	pthread_mutex_lock(&l->lock);
+	while (!l->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ENCR_LOG_CLEAN_INTERVAL;
+		pthread_cond_timedwait(&l->wake, &l->lock, &ts);
+		if (l->stop)
+			break;
+		ckpt = l->appended - l->ckpt_appended >=
+			ENCR_LOG_CHECKPOINT_BYTES;
+		pthread_mutex_unlock(&l->lock);
+
+		log_clean(l);
+		if (ckpt) {
+			pthread_mutex_lock(&l->ckpt_lock);
+			log_checkpoint(l);
+			pthread_mutex_unlock(&l->ckpt_lock);
+		}
+		pthread_mutex_lock(&l->lock);
+	}
+	pthread_mutex_unlock(&l->lock);
+	return NULL;
+}
+
+int encr_log_start(struct encr_log *l, struct encr_sched *sched)
+{
+	int res;
+
+	l->sched = sched;
+	res = pthread_create(&l->cleaner, NULL, log_cleaner, l);
+	if (res != 0)
+		return -res;
+	l->running = 1;
+	return 0;
+}
+
+/* Opening */
+
+// Set up a log with fresh keys, wrapped by the mount key
+static int log_create_key(int dirfd, const struct encr_keys *mk)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	char tmp[32];
+	int fd;
+	int res;
+
+	res = encr_header_init(&hdr, ENCR_DEFAULT_CHUNK_SHIFT);
+	memset(buf, 0, sizeof(buf));
+	if (res == 0)
+		res = encr_header_encode(&hdr, mk, buf);
+	memset(&hdr, 0, sizeof(hdr));
+	if (res != 0)
+		return res;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", ENCR_LOG_KEY);
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) == -1)
+		res = errno ? -errno : -EIO;
+	close(fd);
+	if (res == 0 && renameat(dirfd, tmp, dirfd, ENCR_LOG_KEY) == -1)
+		res = -errno;
+	return res;
+}
+
+static int log_read_key(struct encr_log *l, const struct encr_keys *mk,
+			int create)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	int fd;
+	int res;
+
+	fd = openat(l->dirfd, ENCR_LOG_KEY, O_RDONLY);
+	if (fd == -1 && errno == ENOENT && create) {
+		res = log_create_key(l->dirfd, mk);
+		if (res != 0)
+			return res;
+		fd = openat(l->dirfd, ENCR_LOG_KEY, O_RDONLY);
+	}
+	if (fd == -1)
+		return -errno;
+	res = pread(fd, buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -EIO;
+	close(fd);
+	if (res == 0 && encr_header_decode(&hdr, mk, buf) != 0)
+		res = -EIO;
+	if (res == 0)
+		l->keys = hdr.keys;
+	memset(&hdr, 0, sizeof(hdr));
+	return res;
+}
+
+// Open every segment in the log directory
+static int log_load_segments(struct encr_log *l)
+{
+	struct dirent *de;
+	struct stat st;
+	char *end;
+	DIR *d;
+	unsigned long n;
+	int fd;
+	int res = 0;
+
+	fd = dup(l->dirfd);
+	d = fd == -1 ? NULL : fdopendir(fd);
+	if (d == NULL) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		return res;
+	}
+	while (res == 0 && (de = readdir(d)) != NULL) {
+		if (strlen(de->d_name) != 8)
+			continue;
+		n = strtoul(de->d_name, &end, 16);
+		if (*end != '\0' || n == 0 || n > UINT32_MAX - 1)
+			continue;
+		fd = openat(l->dirfd, de->d_name,
+			    l->rdonly ? O_RDONLY : O_RDWR);
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			res = -errno;
+			if (fd != -1)
+				close(fd);
+			break;
+		}
+		res = seg_add(l, n, fd, st.st_size);
+		if (res != 0)
+			close(fd);
+	}
+	closedir(d);
+	return res;
+}
+
+static void log_free(struct encr_log *l)
+{
+	struct log_file *f;
+	uint32_t n;
+	size_t b;
+
+	for (n = l->first; n != 0 && n <= l->last; n++) {
+		if (seg_at(l, n) != NULL) {
+			close(l->segs[n]->fd);
+			free(l->segs[n]);
+		}
+	}
+	free(l->segs);
+	for (b = 0; l->buckets != NULL && b < l->nbuckets; b++)
+		while ((f = l->buckets[b]) != NULL)
+			file_free(l, f);
+	free(l->buckets);
+	pthread_cond_destroy(&l->wake);
+	pthread_cond_destroy(&l->idle);
+	pthread_mutex_destroy(&l->lock);
+	pthread_rwlock_destroy(&l->segs_lock);
+	pthread_mutex_destroy(&l->ckpt_lock);
+	if (l->dirfd != -1)
+		close(l->dirfd);
+	OPENSSL_cleanse(l, sizeof(struct encr_log));
+	free(l);
+}
+
+int encr_log_open(const char *rootdir, const struct encr_keys *mk,
+		  int flags, struct encr_log **lp)
+{
+	int create = (flags & ENCR_LOG_CREATE) != 0;
+	char path[PATH_MAX];
+	char tmp[32];
+	struct encr_log *l;
+	int res;
+
+	*lp = NULL;
+	snprintf(path, sizeof(path), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_LOG_DIR);
+	if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+
+	l = calloc(1, sizeof(struct encr_log));
+	if (l == NULL)
+		return -ENOMEM;
+	pthread_mutex_init(&l->ckpt_lock, NULL);
+	pthread_rwlock_init(&l->segs_lock, NULL);
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->idle, NULL);
+	pthread_cond_init(&l->wake, NULL);
+	l->rdonly = (flags & ENCR_LOG_RDONLY) != 0;
+	l->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (l->dirfd == -1) {
+		res = errno == ENOENT && !create ? 0 : -errno;
+		log_free(l);
+		return res;
+	}
+	l->nbuckets = LOG_MIN_BUCKETS;
+	l->buckets = calloc(l->nbuckets, sizeof(struct log_file *));
+	if (l->buckets == NULL) {
+		log_free(l);
+		return -ENOMEM;
+	}
+
+	res = log_read_key(l, mk, create);
+	if (res == 0)
+		res = log_load_segments(l);
+	if (res == 0)
+		res = ckpt_load(l);
+	if (res == 0)
+		res = log_replay(l);
+	// Segments the checkpoint replays from may all have been removed
+	if (res == 0 && l->ckpt_seg > l->last + 1)
+		l->last = l->ckpt_seg - 1;
+	if (res != 0) {
+		log_free(l);
+		return res;
+	}
+	// Left by a checkpoint that never finished
+	snprintf(tmp, sizeof(tmp), "%s.new", ENCR_LOG_CHECKPOINT);
+	if (!l->rdonly)
+		unlinkat(l->dirfd, tmp, 0);
+	*lp = l;
+	return 0;
+}
+
+void encr_log_close(struct encr_log *l)
+{
+	if (l == NULL)
+		return;
+	if (l->running) {
+		pthread_mutex_lock(&l->lock);
+		l->stop = 1;
+		pthread_cond_signal(&l->wake);
+		pthread_mutex_unlock(&l->lock);
+		pthread_join(l->cleaner, NULL);
+	}
+	// The next mount then has nothing to replay
+	pthread_mutex_lock(&l->ckpt_lock);
+	if (!l->rdonly && l->appended != l->ckpt_appended)
+		log_checkpoint(l);
+	pthread_mutex_unlock(&l->ckpt_lock);
+	log_free(l);
+}
@@ -0,0 +1,138 @@
+/* encfs-log.h
+ * Log-structured chunk storage for pa5-encfs
+ *
+ * Files created while the mirror is mounted with -o log keep only their
+ * header in the mirror. Every chunk written to them is appended to the
+ * mirror's log, a series of segment files, so random writes reach the
+ * backing disk as sequential ones:
+ *
+ *   .encfs/log/key          a file header (see encfs-format.h) whose MAC
+ *                           key authenticates log records and checkpoints;
+ *                           rewrapped by encfs-rekey
+ *   .encfs/log/<segment>    up to ENCR_LOG_SEGMENT_SIZE bytes of records,
+ *                           named by their number (8 hex digits)
+ *   .encfs/log/checkpoint   the chunk index at some point of the log, and
+ *                           where in the log that point is
+ *
+ * A record starts on an ENCR_LOG_ALIGN boundary with a header naming
+ * the file (by an id derived from its data keys), the chunk and the kind
+ * of record, and authenticating them together with the record's place
+ * in the log and the tag of the chunk record it carries, if any:
+ *
+ *   put      a new version of a chunk: its record as in encfs-compress.h
+ *   move     a chunk copied forward by the cleaner; only takes effect if
+ *            the chunk was still where it was copied from
+ *   trim     drops every chunk of the file from the given one on
+ *            (truncate, or from 0 when the file is deleted)
+ *
+ * The index (file, chunk) -> (segment, offset, length) is kept in memory.
+ * Mounting loads the last checkpoint and replays the records after it;
+ * a torn record only costs the alignment blocks it covers, so records
+ * past it that were synced are still found. A checkpoint is written once
+ * ENCR_LOG_CHECKPOINT_BYTES have been appended since the last one, by
+ * the cleaner before it removes segments, and at unmount.
+ *
+ * The cleaner runs in the background and picks the segments in which at
+ * most ENCR_LOG_CLEAN_LIVE percent of the bytes are still in use, copies
+ * those forward and removes the segments.
+ *
+ * The log belongs to the mirror: files of the log format must be copied
+ * with their mirror's .encfs, and a backing file copied outside the mount
+ * shares its chunks with the original.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_LOG_H
+#define ENCFS_LOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+#define ENCR_LOG_DIR "log"
+#define ENCR_LOG_KEY "key"
+#define ENCR_LOG_CHECKPOINT "checkpoint"
+#define ENCR_LOG_SEGMENT_SIZE (32 << 20)
+#define ENCR_LOG_ALIGN 64
+#define ENCR_LOG_CHECKPOINT_BYTES (256 << 20)
+#define ENCR_LOG_CLEAN_LIVE 50		// percent
+#define ENCR_LOG_CLEAN_INTERVAL 5	// seconds between cleaner passes
+
+// Flags for encr_log_open()
+#define ENCR_LOG_CREATE 1		// set the log up if the mirror has none
+#define ENCR_LOG_RDONLY 2		// never write; appends fail with -EROFS
+
+struct encr_log;
+struct encr_sched;
+
+/* int encr_log_open(const char *rootdir, const struct encr_keys *mk, int flags, struct encr_log **lp)
+ * Purpose: Open the mirror's log and rebuild its index
+ * Args: int flags          : ENCR_LOG_CREATE, ENCR_LOG_RDONLY or 0
+ *       struct encr_log **lp : Set to the log, or to NULL if there is
+ *                              none and ENCR_LOG_CREATE is not given
+ * Return: 0 on success, -errno on failure (-EIO for a bad key file or
+ *         checkpoint)
+ */
+extern int encr_log_open(const char *rootdir, const struct encr_keys *mk,
+			 int flags, struct encr_log **lp);
+
+/* int encr_log_start(struct encr_log *l, struct encr_sched *sched)
+ * Purpose: Start the cleaner thread, which goes through sched (see
+ *          encfs-sched.h) segment by segment; sched may be NULL
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_log_start(struct encr_log *l, struct encr_sched *sched);
+
+/* void encr_log_close(struct encr_log *l)
+ * Purpose: Stop the cleaner, write a checkpoint and free the log;
+ *          l may be NULL
+ */
+extern void encr_log_close(struct encr_log *l);
+
+/* int encr_log_fid(const struct encr_keys *k, uint64_t *fid)
+ * Purpose: The id the log knows a file by, from its data keys
+ * Return: 0 on success, -EIO on crypto failure
+ */
+extern int encr_log_fid(const struct encr_keys *k, uint64_t *fid);
+
+/* ssize_t encr_log_get(struct encr_log *l, uint64_t fid, uint64_t chunk, unsigned char *rec, size_t size)
+ * Purpose: Read the record of a chunk into rec, which has room for size
+ * Return: Record length, 0 for a chunk never written, or -errno
+ */
+extern ssize_t encr_log_get(struct encr_log *l, uint64_t fid, uint64_t chunk,
+			    unsigned char *rec, size_t size);
+
+/* ssize_t encr_log_verify(struct encr_log *l, uint64_t fid, uint64_t chunk, unsigned char *rec, size_t size)
+ * Purpose: encr_log_get(), also checking the log record's tag under the
+ *          log key, which replay did but reads do not (for encfs-scrub)
+ * Return: Record length, 0 for a chunk never written, -EBADMSG for a
+ *         record that fails its tag, or -errno
+ */
+extern ssize_t encr_log_verify(struct encr_log *l, uint64_t fid,
+			       uint64_t chunk, unsigned char *rec,
+			       size_t size);
+
+/* int encr_log_put(struct encr_log *l, uint64_t fid, uint64_t chunk, const unsigned char *rec, size_t len)
+ * Purpose: Append a new record for a chunk
+ *          Callers serialize updates of one chunk, as the range locks do.
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_log_put(struct encr_log *l, uint64_t fid, uint64_t chunk,
+			const unsigned char *rec, size_t len);
+
+/* int encr_log_trim(struct encr_log *l, uint64_t fid, uint64_t from)
+ * Purpose: Drop chunks from on of a file, all of them if from is 0
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_log_trim(struct encr_log *l, uint64_t fid, uint64_t from);
+
+/* int encr_log_sync(struct encr_log *l)
+ * Purpose: Make every record appended so far durable
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_log_sync(struct encr_log *l);
+
+#endif
@@ -0,0 +1,234 @@
+/* encfs-loop.c
+ * Multithreaded FUSE event loop with a bounded worker pool
+ *
+ * Derived from fuse_loop_mt.c in fuse-2.8.7
+ * Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define FUSE_USE_VERSION 28
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "encfs-loop.h"
+
+struct encr_worker {
+	struct encr_worker *prev;
+	struct encr_worker *next;
+	pthread_t thread_id;
+	size_t bufsize;
+	char *buf;
+	struct encr_mt *mt;
+};
+
+struct encr_mt {
+	pthread_mutex_t lock;
+	int numworker;
+	int numavail;
+	int maxworker;
+	int maxavail;
+	struct fuse_session *se;
+	struct fuse_chan *prevch;
+	struct encr_worker main;
+	sem_t finish;
+	int exit;
+	int error;
+};
+
+static void list_add_worker(struct encr_worker *w, struct encr_worker *next)
+{
+	struct encr_worker *prev = next->prev;
+	w->next = next;
+	w->prev = prev;
+	prev->next = w;
+	next->prev = w;
+}
+
+static void list_del_worker(struct encr_worker *w)
+{
+	struct encr_worker *prev = w->prev;
+	struct encr_worker *next = w->next;
+	prev->next = next;
+	next->prev = prev;
+}
+
+static int encr_start_thread(struct encr_mt *mt);
+
+static void *encr_do_work(void *data)
+{
+	struct encr_worker *w = (struct encr_worker *) data;
+	struct encr_mt *mt = w->mt;
+
+	while (!fuse_session_exited(mt->se)) {
+		struct fuse_chan *ch = mt->prevch;
+		int res;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0) {
+				fuse_session_exit(mt->se);
+				mt->error = -1;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&mt->lock);
+		if (mt->exit) {
+			pthread_mutex_unlock(&mt->lock);
+			return NULL;
+		}
+
+		// Only grow the pool while we are under the cap; once there,
+		// requests queue in the kernel until a worker frees up.
+		mt->numavail--;
+		if (mt->numavail == 0 && mt->numworker < mt->maxworker)
+			encr_start_thread(mt);
+		pthread_mutex_unlock(&mt->lock);
+
+		fuse_session_process(mt->se, w->buf, res, ch);
+
+		pthread_mutex_lock(&mt->lock);
+		mt->numavail++;
+		if (mt->numavail > mt->maxavail) {
+			if (mt->exit) {
+				pthread_mutex_unlock(&mt->lock);
+				return NULL;
+			}
+			list_del_worker(w);
+			mt->numavail--;
+			mt->numworker--;
+			pthread_mutex_unlock(&mt->lock);
+
+			pthread_detach(w->thread_id);
+			free(w->buf);
+			free(w);
+			return NULL;
+		}
+		pthread_mutex_unlock(&mt->lock);
+	}
+
+	sem_post(&mt->finish);
+	return NULL;
+}
+
+static int encr_start_thread(struct encr_mt *mt)
+{
+	sigset_t oldset;
+	sigset_t newset;
+	int res;
+	struct encr_worker *w = malloc(sizeof(struct encr_worker));
+	if (!w) {
+		fprintf(stderr, "encr_start_thread: cannot allocate worker\n");
+		return -1;
+	}
+	memset(w, 0, sizeof(struct encr_worker));
+	w->bufsize = fuse_chan_bufsize(mt->prevch);
+	w->buf = malloc(w->bufsize);
+	w->mt = mt;
+	if (!w->buf) {
+		fprintf(stderr, "encr_start_thread: cannot allocate read buffer\n");
+		free(w);
+		return -1;
+	}
+
+	/* Disallow signal reception in worker threads */
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGHUP);
+	sigaddset(&newset, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	res = pthread_create(&w->thread_id, NULL, encr_do_work, w);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (res != 0) {
+		fprintf(stderr, "encr_start_thread: error creating thread: %s\n",
+			strerror(res));
+		free(w->buf);
+		free(w);
+		return -1;
+	}
+	list_add_worker(w, &mt->main);
+	mt->numavail++;
+	mt->numworker++;
+
+	return 0;
+}
+
+static void encr_join_worker(struct encr_mt *mt, struct encr_worker *w)
+{
+	pthread_join(w->thread_id, NULL);
+	pthread_mutex_lock(&mt->lock);
+	list_del_worker(w);
+	pthread_mutex_unlock(&mt->lock);
+	free(w->buf);
+	free(w);
+}
+
+int encr_loop_mt(struct fuse *f, unsigned max_threads, unsigned max_idle)
+{
+	int err;
+	struct encr_mt mt;
+	struct encr_worker *w;
+
+	if (max_threads == 0)
+		max_threads = 1;
+	// Workers only start more of their kind when one takes a request,
+	// so one must always stay behind to take the next
+	if (max_idle == 0)
+		max_idle = 1;
+	if (max_idle > max_threads)
+		max_idle = max_threads;
+
+	memset(&mt, 0, sizeof(struct encr_mt));
+	mt.se = fuse_get_session(f);
+	mt.prevch = fuse_session_next_chan(mt.se, NULL);
+	mt.error = 0;
+	mt.numworker = 0;
+	mt.numavail = 0;
+	mt.maxworker = max_threads;
+	mt.maxavail = max_idle;
+	mt.main.thread_id = pthread_self();
+	mt.main.prev = mt.main.next = &mt.main;
+	sem_init(&mt.finish, 0, 0);
+	pthread_mutex_init(&mt.lock, NULL);
+
+	pthread_mutex_lock(&mt.lock);
+	err = encr_start_thread(&mt);
+	pthread_mutex_unlock(&mt.lock);
+	if (!err) {
+		/* sem_wait() is interruptible */
+		while (!fuse_session_exited(mt.se))
+			sem_wait(&mt.finish);
+
+		pthread_mutex_lock(&mt.lock);
+		for (w = mt.main.next; w != &mt.main; w = w->next)
+			pthread_cancel(w->thread_id);
+		mt.exit = 1;
+		pthread_mutex_unlock(&mt.lock);
+
+		while (mt.main.next != &mt.main)
+			encr_join_worker(&mt, mt.main.next);
+
+		err = mt.error;
+	}
+
+	pthread_mutex_destroy(&mt.lock);
+	sem_destroy(&mt.finish);
+	fuse_session_reset(mt.se);
+	return err;
+}
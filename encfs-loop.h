@@ -0,0 +1,34 @@
+/* encfs-loop.h
+ * Multithreaded FUSE event loop with a bounded worker pool
+ *
+ * Derived from fuse_loop_mt.c in fuse-2.8.7
+ * Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+ *
+ * The stock fuse_loop_mt() spawns a new worker whenever every existing
+ * worker is busy and keeps up to 10 of them idle, with no upper bound.
+ * This version lets the caller cap both numbers.
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#ifndef ENCFS_LOOP_H
+#define ENCFS_LOOP_H
+
+#include <fuse.h>
+
+#define ENCR_DEFAULT_MAX_THREADS 16
+#define ENCR_DEFAULT_MAX_IDLE_THREADS 10
+
+/* int encr_loop_mt(struct fuse *f, unsigned max_threads, unsigned max_idle)
+ * Purpose: Serve requests for f until the session exits
+ * Args: struct fuse *f        : Filesystem returned by fuse_setup()
+ *       unsigned max_threads  : Upper bound on concurrently running workers
+ *       unsigned max_idle     : Workers above this many idle ones exit;
+ *                               0 is taken as 1
+ * Return: 0 on clean exit, -1 on channel error
+ */
+extern int encr_loop_mt(struct fuse *f, unsigned max_threads,
+			unsigned max_idle);
+
+#endif
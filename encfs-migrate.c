@@ -0,0 +1,789 @@
+/* encfs-migrate.c
+ * Background migration of a mounted mirror to the current format
+ *
+ * See encfs-migrate.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "encfs-migrate.h"
+#include "encfs-io.h"
+#include "encfs-pack.h"
+#include "encfs-chunk.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+#include "encfs-sched.h"
+
+#define MIGRATE_BATCH (64 * 1024)
+#define MIGRATE_RETRIES 3		// unlocked passes before holding the file
+#define MIGRATE_STATUS_INTERVAL 5	// seconds
+
+struct encr_migrate {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		// signalled on stop
+	int stop;
+	char *rootdir;
+	int dirfd;			// .encfs/migrate
+	const struct encr_keys *mk;
+	struct encr_store *store;
+	struct encr_log *log;
+	struct encr_roots *roots;
+	struct encr_itable *itable;
+	struct encr_xcache *xcache;
+	const struct encr_chunks *chunks;
+	unsigned flags;
+	int direct;			// the mount's handles may be O_DIRECT
+	unsigned rate;
+	unsigned cpu;
+	struct encr_sched *sched;	// lets batches in, NULL for none
+	int oneshot;			// one file for encr_migrate_file()
+	char *buf;
+
+	// budget accounting since the thread started
+	struct timespec start;
+	unsigned long long budget_bytes;
+	time_t last_status;
+
+	// progress
+	unsigned long scanned;
+	unsigned long migrated;
+	unsigned long busy;		// retried because of writes
+	unsigned long failed;
+	unsigned long long bytes;
+};
+
+// nftw() has no user pointer; there is only ever one migrator
+static struct encr_migrate *migrate_cur;
+
+// Open (and with create, make) .encfs/migrate
+static int migrate_dir_open(const char *rootdir, int create)
+{
+	int rootfd, metafd, fd;
+
+	rootfd = open(rootdir, O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1)
+		return -errno;
+	metafd = openat(rootfd, ENCR_META_DIR, O_RDONLY | O_DIRECTORY);
+	close(rootfd);
+	if (metafd == -1)
+		return -errno;
+	if (create && mkdirat(metafd, ENCR_MIGRATE_DIR, 0700) == -1 &&
+	    errno != EEXIST) {
+		fd = -errno;
+		close(metafd);
+		return fd;
+	}
+	fd = openat(metafd, ENCR_MIGRATE_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		fd = -errno;
+	close(metafd);
+	return fd;
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static int migrate_stopped(struct encr_migrate *m)
+{
+	int stop;
+
+	pthread_mutex_lock(&m->lock);
+	stop = m->stop;
+	pthread_mutex_unlock(&m->lock);
+	return stop;
+}
+
+// Sleep for up to secs, returning early (nonzero) if asked to stop
+static int migrate_sleep(struct encr_migrate *m, double secs)
+{
+	struct timespec until;
+	int stop;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += (time_t) secs;
+	until.tv_nsec += (long) ((secs - (time_t) secs) * 1e9);
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	while (!m->stop &&
+	       pthread_cond_timedwait(&m->cond, &m->lock, &until) != ETIMEDOUT)
+		;
+	stop = m->stop;
+	pthread_mutex_unlock(&m->lock);
+	return stop;
+}
+
+static void migrate_status(struct encr_migrate *m, const char *state)
+{
+	FILE *f;
+	int fd;
+
+	fd = openat(m->dirfd, ENCR_MIGRATE_STATUS ".tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		return;
+	}
+	fprintf(f, "state %s\nscanned %lu\nmigrated %lu\nretried %lu\n"
+		"failed %lu\nbytes %llu\n", state, m->scanned, m->migrated,
+		m->busy, m->failed, m->bytes);
+	if (fclose(f) == 0)
+		renameat(m->dirfd, ENCR_MIGRATE_STATUS ".tmp",
+			 m->dirfd, ENCR_MIGRATE_STATUS);
+	m->last_status = time(NULL);
+}
+
+/* Account for n bytes moved and sleep long enough to stay within the
+ * I/O and CPU budgets. Returns nonzero if asked to stop. */
+static int migrate_throttle(struct encr_migrate *m, size_t n)
+{
+	struct timespec now;
+	struct timespec cpu;
+	double elapsed;
+	double want = 0;
+
+	if (m->oneshot)
+		return 0;
+	m->budget_bytes += n;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ts_diff(&now, &m->start);
+
+	if (m->rate > 0)
+		want = (double) m->budget_bytes / (m->rate * 1024.0);
+	if (m->cpu > 0 &&
+	    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) {
+		double cpu_want = (cpu.tv_sec + cpu.tv_nsec / 1e9) * 100.0 /
+			m->cpu;
+
+		if (cpu_want > want)
+			want = cpu_want;
+	}
+
+	if (time(NULL) - m->last_status >= MIGRATE_STATUS_INTERVAL)
+		migrate_status(m, "running");
+	if (want > elapsed)
+		return migrate_sleep(m, want - elapsed);
+	return migrate_stopped(m);
+}
+
+/* Whether a file opened as in needs rewriting to chunk_shift, and if so
+ * claim it. Returns 1 to go ahead, 0 if it is fine as it is, -EBUSY if
+ * someone else is rewriting it, -EOPNOTSUPP if it cannot be. */
+static int migrate_needed(struct encr_migrate *m, struct encr_inode *in,
+			  unsigned chunk_shift)
+{
+	int need;
+
+	pthread_mutex_lock(&in->lock);
+	need = !in->encrypted ||
+		in->chunk_shift != chunk_shift ||
+		in->hdr.flags != m->flags ||
+		in->hdr.version != ENCR_FORMAT_VERSION ||
+		((m->flags & ENCR_FLAG_STRIPED) &&
+		 in->hdr.width != encr_roots_count(m->roots));
+	// Deduplicated and log-structured files keep their chunks elsewhere
+	if (need && in->encrypted &&
+	    (in->hdr.flags & (ENCR_FLAG_DEDUP | ENCR_FLAG_LOG)))
+		need = m->oneshot ? -EOPNOTSUPP : 0;
+	if (need == 1 && in->rewriting)
+		need = -EBUSY;
+	if (need == 1)
+		in->rewriting = 1;
+	pthread_mutex_unlock(&in->lock);
+	return need;
+}
+
+/* Copy the plaintext of in into the new copy. With locked set the caller
+ * holds the whole file and no throttling is done, nor waiting in the
+ * scheduler with the mount's writers held back. */
+static int migrate_copy(struct encr_migrate *m, struct encr_inode *in, int fd,
+			struct encr_inode *tin, int tfd, int locked)
+{
+	struct encr_sched *sched = locked ? NULL : m->sched;
+	off_t off = 0;
+	ssize_t n;
+	uint64_t set;
+	int gate;
+	int res;
+
+	res = encr_io_truncate(tin, tfd, 0);
+	while (res == 0) {
+		gate = encr_sched_enter(sched, ENCR_SCHED_BACKGROUND,
+					MIGRATE_BATCH);
+		if (locked) {
+			n = encr_io_read_locked(in, fd, m->buf, MIGRATE_BATCH,
+						off);
+		} else {
+			set = encr_range_rdlock(in, off, MIGRATE_BATCH);
+			n = encr_io_read_locked(in, fd, m->buf, MIGRATE_BATCH,
+						off);
+			encr_range_unlock(in, set);
+		}
+		if (n > 0)
+			n = encr_io_write(tin, tfd, m->buf, n, off);
+		encr_sched_leave(sched, gate);
+		if (n <= 0)
+			return n;
+		off += n;
+		if (!locked && migrate_throttle(m, n))
+			return -EINTR;
+	}
+	return res;
+}
+
+// Zero [off, off + len) of fd, as a hole if the filesystem can
+static int zero_range(int fd, off_t off, off_t len, char *buf)
+{
+	size_t n;
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len) == 0)
+		return 0;
+	memset(buf, 0, MIGRATE_BATCH);
+	while (len > 0) {
+		n = len < MIGRATE_BATCH ? (size_t) len : MIGRATE_BATCH;
+		if (pwrite(fd, buf, n, off) != (ssize_t) n)
+			return errno ? -errno : -EIO;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy from over to, keeping the holes of compressed files as holes */
+static int copy_fd(int from, int to, char *buf)
+{
+	struct stat st;
+	off_t off = 0;
+	off_t data, hole;
+	ssize_t n;
+	int res;
+
+	if (fstat(from, &st) == -1)
+		return -errno;
+	while (off < st.st_size) {
+		data = lseek(from, off, SEEK_DATA);
+		if (data == -1)
+			data = errno == ENXIO ? st.st_size : off;
+		hole = lseek(from, data, SEEK_HOLE);
+		if (hole == -1 || hole > st.st_size)
+			hole = st.st_size;
+		if (data > off) {
+			res = zero_range(to, off, data - off, buf);
+			if (res != 0)
+				return res;
+		}
+		for (off = data; off < hole; off += n) {
+			n = pread(from, buf, hole - off < MIGRATE_BATCH ?
+				  hole - off : MIGRATE_BATCH, off);
+			if (n <= 0)
+				return n < 0 ? -errno : -EIO;
+			if (pwrite(to, buf, n, off) != n)
+				return errno ? -errno : -EIO;
+		}
+	}
+	if (ftruncate(to, st.st_size) == -1)
+		return -errno;
+	return 0;
+}
+
+// Put the new copy in place of the original, every stripe of in held
+static int migrate_commit(struct encr_migrate *m, struct encr_inode *in,
+			  int fd, struct encr_inode *tin, int tfd,
+			  const char *tmp, const char *commit)
+{
+	unsigned char hbuf[ENCR_HEADER_SIZE];
+	struct encr_header old;
+	struct encr_parts *parts;
+	struct statvfs vfs;
+	struct stat tst;
+	struct stat st;
+	int res;
+
+	if (fstat(tfd, &tst) == -1 || fstat(fd, &st) == -1)
+		return -errno;
+	// Running out of space halfway through would leave the original
+	// unreadable until the next mount finishes the job
+	if (fstatvfs(fd, &vfs) == 0 && tst.st_size > st.st_size &&
+	    (unsigned long long) vfs.f_bavail * vfs.f_frsize <
+	    (unsigned long long) (tst.st_size - st.st_size))
+		return -ENOSPC;
+
+	// Whatever of the copy is only in the cache tier goes out first
+	res = encr_tier_flush(tin);
+	if (res != 0)
+		return res;
+	// The copy-back overwrites the header the old parts are named by
+	if (in->hdr.flags & ENCR_FLAG_STRIPED) {
+		res = encr_header_encode(&in->hdr, m->mk, hbuf);
+		if (res == 0 && fsetxattr(tfd, ENCR_XATTR_MIGRATE_OLD, hbuf,
+					  sizeof(hbuf), 0) == -1)
+			res = -errno;
+		if (res != 0)
+			return res;
+	}
+	if (fsync(tfd) == -1 ||
+	    renameat(m->dirfd, tmp, m->dirfd, commit) == -1)
+		return -errno;
+
+	res = copy_fd(tfd, fd, m->buf);
+	encr_tier_forget(in);
+	if (res == 0 &&
+	    fsetxattr(fd, ENCR_XATTR_ENCRYPTED, "true", 4, 0) == -1)
+		res = -errno;
+	if (res == 0 && fsync(fd) == -1)
+		res = -errno;
+	if (res != 0) {
+		// The journal stays behind for encr_migrate_recover()
+		fprintf(stderr, "pa5-encfs: migrating inode %lu failed halfway: "
+			"%s; it is finished on the next mount\n",
+			(unsigned long) st.st_ino, strerror(-res));
+		return res;
+	}
+
+	/* The new copy's parts are named after its data keys, so they now
+	 * belong to the original as they are; the old ones go with tin */
+	pthread_mutex_lock(&in->lock);
+	old = in->hdr;
+	in->hdr = tin->hdr;
+	in->psize = tin->psize;
+	in->encrypted = 1;
+	__atomic_store_n(&in->chunk_shift, tin->chunk_shift, __ATOMIC_RELEASE);
+	parts = in->parts;
+	in->parts = tin->parts;
+	tin->parts = parts;
+	pthread_mutex_unlock(&in->lock);
+
+	unlinkat(m->dirfd, commit, 0);
+	if (old.flags & ENCR_FLAG_STRIPED)
+		encr_parts_remove(m->roots, &old.keys, old.width);
+	memset(&old, 0, sizeof(old));
+	encr_xcache_set(m->xcache, &st, ENCR_XATTR_ENCRYPTED, "true", 4);
+	// Whatever chunk size was asked for has been dealt with
+	if (fremovexattr(fd, ENCR_XATTR_CHUNK_WANT) == 0)
+		encr_xcache_remove(m->xcache, &st, ENCR_XATTR_CHUNK_WANT);
+	return 0;
+}
+
+/* Rewrite fpath to chunk_shift, or with chunk_shift 0 to the chunk size
+ * the policy has for it */
+static int migrate_file(struct encr_migrate *m, const char *fpath,
+			unsigned chunk_shift)
+{
+	const char *rel = fpath + strlen(m->rootdir);
+	char tmp[64];
+	char commit[64];
+	char val[8];
+	struct encr_inode *in = NULL;
+	struct encr_inode *tin = NULL;
+	struct stat st;
+	struct stat tst;
+	unsigned long gen;
+	ssize_t len;
+	int fd, tfd = -1;
+	int claimed = 0;
+	int attempt;
+	int res;
+
+	fd = open(fpath, O_RDWR | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	len = fgetxattr(fd, ENCR_XATTR_ENCRYPTED, val, sizeof(val));
+	in = encr_inode_get(m->itable, st.st_dev, st.st_ino);
+	if (in == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	res = encr_io_open(in, fd, m->mk, m->store, m->log, m->roots,
+			   len == 4 && !memcmp(val, "true", 4),
+			   encr_chunks_new(m->chunks, rel), m->flags, m->direct);
+	if (res != 0)
+		goto out;
+	if (chunk_shift == 0)
+		chunk_shift = encr_chunks_target(m->chunks, rel, fd,
+				__atomic_load_n(&in->chunk_shift,
+						__ATOMIC_ACQUIRE));
+	res = migrate_needed(m, in, chunk_shift);
+	if (res <= 0)
+		goto out;
+	claimed = 1;
+	res = 0;
+
+	snprintf(tmp, sizeof(tmp), "%lu-%lu.tmp",
+		 (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+	snprintf(commit, sizeof(commit), "%lu-%lu.commit",
+		 (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+	tfd = openat(m->dirfd, tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tfd == -1 || fstat(tfd, &tst) == -1) {
+		res = -errno;
+		goto out;
+	}
+	// Recorded for recovery, relative to the mirror root
+	if (fsetxattr(tfd, ENCR_XATTR_MIGRATE_PATH, rel, strlen(rel),
+		      0) == -1) {
+		res = -errno;
+		goto out;
+	}
+	tin = encr_inode_get(m->itable, tst.st_dev, tst.st_ino);
+	if (tin == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	res = encr_io_open(tin, tfd, m->mk, m->store, m->log, m->roots, 1,
+			   chunk_shift, m->flags, 0);
+
+	for (attempt = 0; res == 0; attempt++) {
+		gen = __atomic_load_n(&in->wgen, __ATOMIC_ACQUIRE);
+		if (attempt < MIGRATE_RETRIES)
+			res = migrate_copy(m, in, fd, tin, tfd, 0);
+		if (res != 0)
+			break;
+
+		encr_inode_wrlock_all(in);
+		if (attempt >= MIGRATE_RETRIES) {
+			res = migrate_copy(m, in, fd, tin, tfd, 1);
+		} else if (__atomic_load_n(&in->wgen, __ATOMIC_ACQUIRE) != gen) {
+			encr_inode_unlock_all(in);
+			m->busy++;
+			continue;
+		}
+		if (res == 0)
+			res = migrate_commit(m, in, fd, tin, tfd, tmp, commit);
+		encr_inode_unlock_all(in);
+		if (res == 0) {
+			m->migrated++;
+			m->bytes += st.st_size;
+		}
+		break;
+	}
+
+out:
+	// A copy past its commit is the journal's until recovery
+	if (res != 0 && tfd != -1 && unlinkat(m->dirfd, tmp, 0) == 0 &&
+	    tin != NULL && (tin->hdr.flags & ENCR_FLAG_STRIPED))
+		encr_parts_remove(m->roots, &tin->hdr.keys, tin->hdr.width);
+	if (tin)
+		encr_inode_put(m->itable, tin);
+	if (tfd != -1)
+		close(tfd);
+	if (claimed) {
+		pthread_mutex_lock(&in->lock);
+		in->rewriting = 0;
+		pthread_mutex_unlock(&in->lock);
+	}
+	if (in)
+		encr_inode_put(m->itable, in);
+	close(fd);
+	return res;
+}
+
+static int migrate_visit(const char *fpath, const struct stat *st, int type,
+			 struct FTW *ftw)
+{
+	struct encr_migrate *m = migrate_cur;
+	char meta[PATH_MAX];
+	int res;
+
+	if (migrate_stopped(m))
+		return FTW_STOP;
+	if (type == FTW_D) {
+		snprintf(meta, sizeof(meta), "%s/%s", m->rootdir, ENCR_META_DIR);
+		return strcmp(fpath, meta) == 0 ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	}
+	// Packs have a format of their own
+	if (type != FTW_F || !S_ISREG(st->st_mode) ||
+	    encr_pack_hidden(fpath + ftw->base))
+		return FTW_CONTINUE;
+
+	m->scanned++;
+	res = migrate_file(m, fpath, 0);
+	if (res != 0 && res != -EINTR && res != -ENOENT && res != -EBUSY) {
+		m->failed++;
+		fprintf(stderr, "pa5-encfs: cannot migrate %s: %s\n", fpath,
+			strerror(-res));
+	}
+	return migrate_stopped(m) ? FTW_STOP : FTW_CONTINUE;
+}
+
+static void *migrate_thread(void *data)
+{
+	struct encr_migrate *m = data;
+
+	clock_gettime(CLOCK_MONOTONIC, &m->start);
+	migrate_status(m, "running");
+	nftw(m->rootdir, migrate_visit, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+	migrate_status(m, migrate_stopped(m) ? "stopped" : "done");
+	return NULL;
+}
+
+static struct encr_migrate *migrate_new(const char *rootdir,
+					const struct encr_keys *mk,
+					struct encr_store *store,
+					struct encr_log *log,
+					struct encr_roots *roots,
+					struct encr_itable *itable,
+					struct encr_xcache *xcache,
+					const struct encr_chunks *chunks,
+					unsigned flags, int direct)
+{
+	struct encr_migrate *m;
+	int metafd;
+
+	m = calloc(1, sizeof(struct encr_migrate));
+	if (m == NULL)
+		return NULL;
+	m->dirfd = -1;
+	m->rootdir = strdup(rootdir);
+	m->buf = malloc(MIGRATE_BATCH);
+	if (m->rootdir == NULL || m->buf == NULL)
+		goto err;
+	metafd = migrate_dir_open(rootdir, 1);
+	if (metafd < 0)
+		goto err;
+	m->dirfd = metafd;
+	m->mk = mk;
+	m->store = store;
+	m->log = log;
+	m->roots = roots;
+	m->itable = itable;
+	m->xcache = xcache;
+	m->chunks = chunks;
+	m->flags = flags;
+	m->direct = direct;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	return m;
+err:
+	free(m->buf);
+	free(m->rootdir);
+	free(m);
+	return NULL;
+}
+
+static void migrate_free(struct encr_migrate *m)
+{
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->lock);
+	close(m->dirfd);
+	free(m->buf);
+	free(m->rootdir);
+	free(m);
+}
+
+struct encr_migrate *encr_migrate_start(const char *rootdir,
+					const struct encr_keys *mk,
+					struct encr_store *store,
+					struct encr_log *log,
+					struct encr_roots *roots,
+					struct encr_itable *itable,
+					struct encr_xcache *xcache,
+					const struct encr_chunks *chunks,
+					unsigned flags, int direct,
+					unsigned rate, unsigned cpu,
+					struct encr_sched *sched)
+{
+	struct encr_migrate *m;
+
+	if (migrate_cur != NULL)
+		return NULL;
+	m = migrate_new(rootdir, mk, store, log, roots, itable, xcache, chunks,
+			flags, direct);
+	if (m == NULL)
+		return NULL;
+	m->rate = rate;
+	m->cpu = cpu > 100 ? 100 : cpu;
+	m->sched = sched;
+
+	migrate_cur = m;
+	if (pthread_create(&m->tid, NULL, migrate_thread, m) != 0) {
+		migrate_cur = NULL;
+		migrate_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+int encr_migrate_file(const char *rootdir, const struct encr_keys *mk,
+		      struct encr_store *store, struct encr_log *log,
+		      struct encr_roots *roots, struct encr_itable *itable,
+		      struct encr_xcache *xcache,
+		      const struct encr_chunks *chunks, const char *fpath,
+		      unsigned chunk_shift, unsigned flags, int direct)
+{
+	struct encr_migrate *m;
+	int res;
+
+	m = migrate_new(rootdir, mk, store, log, roots, itable, xcache, chunks,
+			flags, direct);
+	if (m == NULL)
+		return -ENOMEM;
+	m->oneshot = 1;
+	res = migrate_file(m, fpath, chunk_shift);
+	migrate_free(m);
+	return res;
+}
+
+void encr_migrate_stop(struct encr_migrate *m)
+{
+	if (m == NULL)
+		return;
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->tid, NULL);
+
+	migrate_cur = NULL;
+	migrate_free(m);
+}
+
+// Remove the parts of the striped original a journal replaced
+static void migrate_recover_parts(int jfd, const struct encr_keys *mk,
+				  struct encr_roots *roots)
+{
+	unsigned char hbuf[ENCR_HEADER_SIZE];
+	struct encr_header old;
+
+	if (fgetxattr(jfd, ENCR_XATTR_MIGRATE_OLD, hbuf, sizeof(hbuf)) !=
+	    sizeof(hbuf))
+		return;
+	if (encr_header_decode(&old, mk, hbuf) == 0 &&
+	    (old.flags & ENCR_FLAG_STRIPED) && roots != NULL)
+		encr_parts_remove(roots, &old.keys, old.width);
+	memset(&old, 0, sizeof(old));
+}
+
+// Redo the copy-back of one journaled file
+static int migrate_recover_one(const char *rootdir, int dirfd,
+			       const char *name, const struct encr_keys *mk,
+			       struct encr_roots *roots, char *buf)
+{
+	char rel[PATH_MAX];
+	char *fpath;
+	unsigned long dev, ino;
+	struct stat st;
+	ssize_t len;
+	int jfd, fd;
+	int res;
+
+	if (sscanf(name, "%lu-%lu.commit", &dev, &ino) != 2)
+		return 0;
+	jfd = openat(dirfd, name, O_RDONLY);
+	if (jfd == -1)
+		return -errno;
+	len = fgetxattr(jfd, ENCR_XATTR_MIGRATE_PATH, rel, sizeof(rel) - 1);
+	if (len < 0) {
+		res = -errno;
+		close(jfd);
+		return res;
+	}
+	rel[len] = '\0';
+	fpath = malloc(strlen(rootdir) + len + 1);
+	if (fpath == NULL) {
+		close(jfd);
+		return -ENOMEM;
+	}
+	strcpy(fpath, rootdir);
+	strcat(fpath, rel);
+
+	fd = open(fpath, O_RDWR | O_NOFOLLOW);
+	if (fd == -1 || fstat(fd, &st) == -1 ||
+	    st.st_dev != (dev_t) dev || st.st_ino != (ino_t) ino) {
+		fprintf(stderr, "pa5-encfs: migration journal %s no longer "
+			"matches %s; left in place\n", name, fpath);
+		if (fd != -1)
+			close(fd);
+		close(jfd);
+		free(fpath);
+		return -ESTALE;
+	}
+
+	res = copy_fd(jfd, fd, buf);
+	if (res == 0 &&
+	    fsetxattr(fd, ENCR_XATTR_ENCRYPTED, "true", 4, 0) == -1)
+		res = -errno;
+	if (res == 0 && fsync(fd) == -1)
+		res = -errno;
+	if (res == 0) {
+		migrate_recover_parts(jfd, mk, roots);
+		unlinkat(dirfd, name, 0);
+	}
+	close(fd);
+	close(jfd);
+	free(fpath);
+	return res;
+}
+
+int encr_migrate_recover(const char *rootdir, const struct encr_keys *mk,
+			 struct encr_roots *roots)
+{
+	struct dirent *de;
+	size_t len;
+	char *buf;
+	DIR *dp;
+	int dirfd;
+	int res = 0;
+	int r;
+
+	dirfd = migrate_dir_open(rootdir, 0);
+	if (dirfd < 0)
+		return dirfd == -ENOENT ? 0 : dirfd;
+	dp = fdopendir(dirfd);
+	if (dp == NULL) {
+		close(dirfd);
+		return -errno;
+	}
+	buf = malloc(MIGRATE_BATCH);
+	if (buf == NULL) {
+		closedir(dp);
+		return -ENOMEM;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		len = strlen(de->d_name);
+		if (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0) {
+			// Never committed; the original is still intact
+			unlinkat(dirfd, de->d_name, 0);
+		} else if (len > 7 &&
+			   strcmp(de->d_name + len - 7, ".commit") == 0) {
+			r = migrate_recover_one(rootdir, dirfd, de->d_name, mk,
+						roots, buf);
+			if (r != 0 && res == 0)
+				res = r;
+		}
+	}
+	free(buf);
+	closedir(dp);
+	return res;
+}
@@ -0,0 +1,116 @@
+/* encfs-migrate.h
+ * Background migration of a mounted mirror to the current format
+ *
+ * With -o migrate, pa5-encfs runs one extra thread that walks the
+ * mirror and rewrites every regular file that is still plaintext, or
+ * encrypted with a compression setting or format version other than
+ * the current one, or a chunk size other than the one the chunk policy
+ * has for it (see encfs-chunk.h). A file is copied chunk by chunk into
+ * .encfs/migrate/<dev>-<ino>.tmp under its ordinary range locks, so
+ * reads and writes through the mount carry on against the old copy.
+ * If the file was written meanwhile the copy is redone; the last retry
+ * holds the whole file. The new copy is then journaled (renamed to
+ * .commit) and copied back over the original inode with every stripe
+ * held, so open handles, hard links and xattrs survive, and the
+ * handles switch to the new format atomically.
+ *
+ * Deduplicated and log-structured files are left as they are; their
+ * chunks already live in the chunk store or the log. So are the packs
+ * of small files (see encfs-pack.h).
+ *
+ * A striped file is also rewritten once the mirror has more roots than
+ * it is striped over (see encfs-roots.h). Its new copy has parts of its
+ * own; the old parts are removed after the commit, by recovery if the
+ * mount stops between the two (the journal keeps the original's header
+ * for it), while the parts of a copy abandoned by a mount that stopped
+ * are left behind on the other roots.
+ *
+ * The thread stays within an I/O rate and a share of one CPU, and
+ * rewrites .encfs/migrate/status as it goes.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_MIGRATE_H
+#define ENCFS_MIGRATE_H
+
+#include "encfs-format.h"
+#include "encfs-lock.h"
+#include "encfs-cache.h"
+#include "encfs-chunk.h"
+
+#define ENCR_MIGRATE_DIR "migrate"
+#define ENCR_MIGRATE_STATUS "status"
+#define ENCR_XATTR_MIGRATE_PATH "user.pa5-encfs.migrate-path"
+#define ENCR_XATTR_MIGRATE_OLD "user.pa5-encfs.migrate-old"	// header
+#define ENCR_DEFAULT_MIGRATE_RATE 10240	// KiB/s
+#define ENCR_DEFAULT_MIGRATE_CPU 25	// percent of one CPU
+
+struct encr_migrate;
+struct encr_sched;
+
+/* struct encr_migrate *encr_migrate_start(const char *rootdir, const struct encr_keys *mk, struct encr_store *store, struct encr_log *log, struct encr_roots *roots, struct encr_itable *itable, struct encr_xcache *xcache, const struct encr_chunks *chunks, unsigned flags, int direct, unsigned rate, unsigned cpu, struct encr_sched *sched)
+ * Purpose: Start the migration thread
+ * Args: const char *rootdir         : Mirror root
+ *       const struct encr_keys *mk  : Mount key
+ *       struct encr_store *store    : Chunk store, NULL if the mirror has none
+ *       struct encr_log *log        : Log, NULL if the mirror has none
+ *       struct encr_roots *roots    : Other roots, NULL if the mirror has none
+ *       struct encr_itable *itable  : Open inode table shared with the mount
+ *       struct encr_xcache *xcache  : Xattr cache to keep up to date
+ *       const struct encr_chunks *chunks : Chunk sizes files are migrated to
+ *       unsigned flags              : ENCR_FLAG_* files are migrated to
+ *       int direct                  : Whether the mount's handles may be O_DIRECT
+ *       unsigned rate               : I/O budget in KiB/s, 0 for unlimited
+ *       unsigned cpu                : CPU budget in percent, 0 for unlimited
+ *       struct encr_sched *sched    : Scheduler each batch goes through
+ *                                     (see encfs-sched.h), or NULL
+ * Return: Migrator handle, or NULL on failure
+ */
+extern struct encr_migrate *encr_migrate_start(const char *rootdir,
+					       const struct encr_keys *mk,
+					       struct encr_store *store,
+					       struct encr_log *log,
+					       struct encr_roots *roots,
+					       struct encr_itable *itable,
+					       struct encr_xcache *xcache,
+					       const struct encr_chunks *chunks,
+					       unsigned flags, int direct,
+					       unsigned rate, unsigned cpu,
+					       struct encr_sched *sched);
+
+/* int encr_migrate_file(const char *rootdir, const struct encr_keys *mk, struct encr_store *store, struct encr_log *log, struct encr_roots *roots, struct encr_itable *itable, struct encr_xcache *xcache, const struct encr_chunks *chunks, const char *fpath, unsigned chunk_shift, unsigned flags, int direct)
+ * Purpose: Rewrite the one file fpath now, as the migration thread
+ *          would but without its budgets, to chunk_shift and flags;
+ *          chunk_shift 0 means the size chunks has for it
+ * Return: 0 on success or if it needed nothing, -EOPNOTSUPP for a
+ *         deduplicated or log-structured file, -EBUSY if the migration
+ *         thread is rewriting it, -errno on failure
+ */
+extern int encr_migrate_file(const char *rootdir, const struct encr_keys *mk,
+			     struct encr_store *store, struct encr_log *log,
+			     struct encr_roots *roots,
+			     struct encr_itable *itable,
+			     struct encr_xcache *xcache,
+			     const struct encr_chunks *chunks, const char *fpath,
+			     unsigned chunk_shift, unsigned flags, int direct);
+
+/* void encr_migrate_stop(struct encr_migrate *m)
+ * Purpose: Stop the thread, abandoning the file it is copying, and free m
+ */
+extern void encr_migrate_stop(struct encr_migrate *m);
+
+/* int encr_migrate_recover(const char *rootdir, const struct encr_keys *mk, struct encr_roots *roots)
+ * Purpose: Finish copy-backs interrupted by a crash, with the parts of
+ *          the striped files they replace, and remove abandoned copies;
+ *          must run before the mirror is mounted
+ * Args: const struct encr_keys *mk  : Mount key
+ *       struct encr_roots *roots    : Other roots, NULL if the mirror has none
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_migrate_recover(const char *rootdir,
+				const struct encr_keys *mk,
+				struct encr_roots *roots);
+
+#endif
@@ -0,0 +1,2166 @@
+/*
+ * 
+ * Encrypted Filesystem Mirror 
+ * written by Anne Gatchell
+ * 
+ * 
+ * 
+ * Modified from:
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  Minor modifications and note by Andy Sayler (2012) <www.andysayler.com>
+
+  Source: fuse-2.8.7.tar.gz examples directory
+  http://sourceforge.net/projects/fuse/files/fuse-2.X/
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+
+  gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
+
+  Note: Each open() keeps its backing file descriptor in fi->fh
+        (struct encr_file) until release(). Handles on the same backing
+        inode share a struct encr_inode whose chunk range locks let
+        disjoint reads and writes proceed concurrently (see encfs-lock.h).
+
+        New regular files are stored encrypted in the chunked format of
+        encfs-format.h and marked with the user.pa5-encfs.encrypted
+        xattr; files already in the mirror without it stay plaintext.
+        The mirror's own metadata lives in /.encfs, hidden from the mount.
+
+        With -o pack, small idle files move into their directory's pack
+        (see encfs-pack.h); calls that would change one move it back out.
+
+        With -o roots, file data is striped over further mirror roots
+        (see encfs-roots.h); the tree itself stays in the mirror.
+
+        With -o cache_dir, backing file blocks are kept in a cache on a
+        faster local disk as well (see encfs-tier.h).
+
+        With -o io_sched, the callbacks that move file data wait their
+        turn in a scheduler before they take any lock, by class and by
+        the caller's uid (see encfs-sched.h).
+
+        The callbacks and the setup of the state they share are a library
+        (see encfs-ops.h), so they can be driven without a mount;
+        pa5-encfs.c mounts them.
+
+*/
+#include "params.h"
+#include "encfs-ops.h"
+
+#define FUSE_USE_VERSION 28
+#define HAVE_SETXATTR
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef linux
+/* For pread()/pwrite() and dirfd() */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <limits.h>
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+#include "encfs-loop.h"
+#include "encfs-lock.h"
+#include "encfs-cache.h"
+#include "encfs-format.h"
+#include "encfs-io.h"
+#include "encfs-migrate.h"
+#include "encfs-store.h"
+#include "encfs-log.h"
+#include "encfs-pack.h"
+#include "encfs-chunk.h"
+#include "encfs-changes.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+#include "encfs-sched.h"
+#include "encfs-direct.h"
+#include "encfs-ioctl.h"
+#include "encfs-trace.h"
+
+struct encr_state *encr_ops_data;
+
+// Per-open state kept in fi->fh between open() and release()
+struct encr_file {
+	int fd;				// -1 for a packed file
+	struct encr_inode *inode;
+	char *data;			// a packed file's contents, read-only
+	struct stat st;			// and its attributes
+	off_t next;			// where the last read ended
+	off_t run;			// bytes read in a row up to there
+};
+#define ENCR_FILE(fi) ((struct encr_file *) (uintptr_t) (fi)->fh)
+
+
+// Report errors to logfile and give -errno to caller
+static int encr_error(char *str)
+{
+    int ret = -errno;
+    fprintf(stderr, "%s",str);
+    return ret;
+}
+//  All the paths I see are relative to the root of the mounted
+//  filesystem.  In order to get to the underlying filesystem, I need to
+//  have the mountpoint.  I'll save it away early on in main(), and then
+//  whenever I need a path for something I'll call this to construct
+//  it.
+static void encr_fullpath(char fpath[PATH_MAX], const char *path)
+{
+    // Truncates ridiculously long paths instead of overrunning fpath;
+    // the backing call then fails with ENOENT/ENAMETOOLONG.
+    snprintf(fpath, PATH_MAX, "%s%s", ENCR_DATA->rootdir, path);
+}
+
+// The metadata directory is not part of the mirrored tree, nor are packs
+static int encr_hidden(const char *path)
+{
+	size_t len = strlen(ENCR_META_DIR);
+
+	if (ENCR_DATA->packs != NULL &&
+	    encr_pack_hidden(strrchr(path, '/') + 1))
+		return 1;
+	return path[0] == '/' && strncmp(path + 1, ENCR_META_DIR, len) == 0 &&
+	       (path[len + 1] == '\0' || path[len + 1] == '/');
+}
+
+// Whether a backing file carries the encrypted marker
+static int encr_is_encrypted(const char *fpath, const struct stat *st)
+{
+	char val[8];
+	int res;
+
+	if (!S_ISREG(st->st_mode))
+		return 0;
+	res = encr_xcache_getxattr(ENCR_DATA->xcache, st, fpath,
+				   ENCR_XATTR_ENCRYPTED, val, sizeof(val));
+	return res == 4 && memcmp(val, "true", 4) == 0;
+}
+
+static int encr_mark_encrypted(int fd, const struct stat *st)
+{
+	if (fsetxattr(fd, ENCR_XATTR_ENCRYPTED, "true", 4, 0) == -1)
+		return -errno;
+	encr_xcache_set(ENCR_DATA->xcache, st, ENCR_XATTR_ENCRYPTED, "true", 4);
+	return 0;
+}
+
+// Regular files are opened read-write whenever possible, since partial
+// chunk writes have to read the rest of the chunk back, and a plaintext
+// file may be migrated to the encrypted format while it is open
+static int encr_open_backing(const char *fpath, int flags, mode_t mode,
+			     int regular)
+{
+	int fd;
+
+	if (!regular || (flags & O_ACCMODE) == O_RDWR)
+		return open(fpath, flags, mode);
+	fd = open(fpath, (flags & ~O_ACCMODE) | O_RDWR, mode);
+	if (fd == -1)
+		fd = open(fpath, flags, mode);
+	return fd;
+}
+
+/* Plaintext size of an encrypted file that may not be open, from its
+ * header; name is relative to dirfd, which may be AT_FDCWD */
+static off_t encr_peek_plain_size(int dirfd, const char *name,
+				  const struct stat *st)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	off_t size = encr_plain_size(st->st_size, ENCR_DEFAULT_CHUNK_SHIFT);
+	struct encr_inode *inode;
+	int fd;
+
+	inode = encr_inode_lookup(ENCR_DATA->itable, st->st_dev, st->st_ino);
+	if (inode) {
+		int loaded;
+		uint64_t set;
+
+		pthread_mutex_lock(&inode->lock);
+		loaded = inode->loaded && inode->encrypted;
+		pthread_mutex_unlock(&inode->lock);
+		if (loaded) {
+			// Any stripe keeps the format and size from changing
+			set = encr_range_rdlock(inode, 0, 0);
+			size = inode->hdr.flags & ENCR_SIZED_FLAGS ?
+				inode->psize :
+				encr_plain_size(st->st_size, inode->chunk_shift);
+			encr_range_unlock(inode, set);
+		}
+		encr_inode_put(ENCR_DATA->itable, inode);
+		if (loaded)
+			return size;
+	}
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return size;
+	if (pread(fd, buf, sizeof(buf), 0) == sizeof(buf))
+		encr_header_peek_size(buf, st->st_size, &size);
+	close(fd);
+	return size;
+}
+
+/* lstat() of the backing file, left in the attribute cache unless it
+ * was invalidated since gen; it is name in the directory open as dirfd,
+ * which may be AT_FDCWD, and fpath in full. Encrypted files report their
+ * plaintext size. */
+static int encr_lstat_gen(const char *path, const char *fpath, int dirfd,
+			  const char *name, struct stat *stbuf,
+			  unsigned long gen)
+{
+	int res;
+	int tries;
+
+	// A file moved out of its pack between the two lookups is looked
+	// up again where it went
+	for (tries = 0; tries < 2; tries++) {
+		res = fstatat(dirfd, name, stbuf, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			res = -errno;
+		else if (stbuf->st_size > 0 && encr_is_encrypted(fpath, stbuf))
+			stbuf->st_size = encr_peek_plain_size(dirfd, name,
+							      stbuf);
+		if (res != -ENOENT || ENCR_DATA->packs == NULL)
+			break;
+		res = encr_pack_stat(ENCR_DATA->packs, path, stbuf);
+		if (res != -ENOENT)
+			break;
+	}
+
+	encr_acache_put(ENCR_DATA->acache, path, stbuf, res, gen);
+	return res;
+}
+
+// The same, answered from the attribute cache if possible
+static int encr_lstat_at(const char *path, const char *fpath, int dirfd,
+			 const char *name, struct stat *stbuf)
+{
+	int res;
+
+	res = encr_acache_get(ENCR_DATA->acache, path, stbuf);
+	if (res != 0)
+		return res < 0 ? res : 0;
+	return encr_lstat_gen(path, fpath, dirfd, name, stbuf,
+			      encr_acache_generation(ENCR_DATA->acache));
+}
+
+//Updated to fullpath
+static int encr_lstat(const char *path, const char *fpath, struct stat *stbuf)
+{
+	return encr_lstat_at(path, fpath, AT_FDCWD, fpath, stbuf);
+}
+
+/* Move a packed file out to a backing file of its own, for a call that
+ * is about to change it; 0 if it did, -1 with errno set otherwise
+ * (ENOENT if path is not packed either) */
+static int encr_unpack(const char *path)
+{
+	int res = -ENOENT;
+
+	if (ENCR_DATA->packs != NULL)
+		res = encr_pack_out(ENCR_DATA->packs, path);
+	if (res != 0) {
+		errno = -res;
+		return -1;
+	}
+	return 0;
+}
+
+static int encr_getattr(const char *path, struct stat *stbuf)
+{
+	char fpath[PATH_MAX];
+	
+	if (encr_hidden(path))
+		return -ENOENT;
+	encr_fullpath(fpath, path);
+
+	return encr_lstat(path, fpath, stbuf);
+}
+// Whether path names a packed file, which new names must not shadow
+static int encr_packed(const char *path)
+{
+	struct stat st;
+
+	return ENCR_DATA->packs != NULL &&
+	       encr_pack_stat(ENCR_DATA->packs, path, &st) == 0;
+}
+
+// access() of a packed file, from its mode bits
+static int encr_access_packed(const struct stat *st, int mask)
+{
+	mode_t bits;
+
+	if (mask == F_OK)
+		return 0;
+	if (st->st_uid == geteuid())
+		bits = st->st_mode >> 6;
+	else if (st->st_gid == getegid())
+		bits = st->st_mode >> 3;
+	else
+		bits = st->st_mode;
+	return (bits & mask & 7) == (mask & 7) ? 0 : -EACCES;
+}
+
+//Updated to fullpath
+static int encr_access(const char *path, int mask)
+{
+	int res;
+	char fpath[PATH_MAX];
+	struct stat st;
+	
+	encr_fullpath(fpath, path);
+
+	res = access(fpath, mask);
+	if (res == -1 && errno == ENOENT && ENCR_DATA->packs != NULL &&
+	    encr_lstat(path, fpath, &st) == 0 && ENCR_PACKED(&st))
+		return encr_access_packed(&st, mask);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+//Updated to fullpath
+static int encr_readlink(const char *path, char *buf, size_t size)
+{
+	int res;
+	char fpath[PATH_MAX];
+	
+	encr_fullpath(fpath, path);
+	res = readlink(fpath, buf, size - 1);
+	if (res == -1)
+		return -errno;
+
+	buf[res] = '\0';
+	return 0;
+}
+
+
+struct encr_fill {
+	void *buf;
+	fuse_fill_dir_t filler;
+	const char *path;		// of the directory
+	struct encr_alisting *listing;
+};
+
+// path/name into child; 0, or -1 if it does not fit
+static int encr_child_path(char child[PATH_MAX], const char *path,
+			   const char *name)
+{
+	return snprintf(child, PATH_MAX, "%s/%s",
+			strcmp(path, "/") == 0 ? "" : path, name) >=
+		PATH_MAX ? -1 : 0;
+}
+
+// Packed files come with their attributes, which the lookups after a
+// listing are then answered from
+static int encr_fill_packed(void *arg, const char *name,
+			    const struct stat *st)
+{
+	struct encr_fill *f = arg;
+	char child[PATH_MAX];
+
+	if (encr_acache_prefill(f->listing) &&
+	    encr_child_path(child, f->path, name) == 0)
+		encr_acache_put(ENCR_DATA->acache, child, st, 0,
+				f->listing->gen);
+	return f->filler(f->buf, name, st, 0) != 0 ? -ENOMEM : 0;
+}
+
+static int encr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	int retstat = 0;
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	const struct stat *stp;
+	struct encr_alisting listing;
+	char child[PATH_MAX];
+	char cpath[PATH_MAX];
+	
+	//Get rid of unused parameter warnings
+	char fpath[PATH_MAX];
+	encr_fullpath(fpath, path);
+	off_t warn_relief = offset;
+	offset = warn_relief;
+
+	// once again, no need for fullpath -- but note that I need to cast fi->fh
+	//I do not understand this
+	dp = (DIR *) (uintptr_t) fi->fh;
+
+	// Every directory contains at least two entries: . and ..  If my
+    // first call to the system readdir() returns NULL I've got an
+    // error; near as I can tell, that's the only condition under
+    // which I can get an error from readdir()
+    de = readdir(dp);
+    if (de == 0) {
+		retstat = encr_error("encr_readdir readdir");
+		return retstat;
+    }
+    
+    // This will copy the entire directory into the buffer.  The loop exits
+    // when either the system readdir() returns NULL, or filler()
+    // returns something non-zero.  The first case just means I've
+    // read the whole directory; the second means the buffer is full.
+    // Entries go with their attributes, stat()ed relative to the open
+    // directory and left in the attribute cache, so the lookup the
+    // kernel sends for each one after the listing (FUSE 2.8 has no
+    // readdirplus) does not go back to the mirror. In a directory too
+    // large for the cache to keep them all, only the first are: the
+    // rest get their type, which is all the kernel takes from a listing,
+    // and no header is read for them.
+    encr_acache_listing(ENCR_DATA->acache, &listing);
+    do {
+		//log_msg("calling filler with name %s\n", de->d_name);
+		if (strcmp(path, "/") == 0 && strcmp(de->d_name, ENCR_META_DIR) == 0)
+			continue;
+		if (ENCR_DATA->packs != NULL && encr_pack_hidden(de->d_name))
+			continue;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = de->d_ino;
+		st.st_mode = de->d_type << 12;
+		stp = &st;
+		if (strcmp(de->d_name, ".") != 0 &&
+		    strcmp(de->d_name, "..") != 0 &&
+		    encr_child_path(child, path, de->d_name) == 0 &&
+		    encr_acache_get(ENCR_DATA->acache, child, &st) == 0 &&
+		    encr_acache_prefill(&listing) &&
+		    encr_child_path(cpath, fpath, de->d_name) == 0 &&
+		    encr_lstat_gen(child, cpath, dirfd(dp), de->d_name, &st,
+				   listing.gen) != 0)
+			stp = NULL;
+		if (filler(buf, de->d_name, stp, 0) != 0) {
+			//log_msg("    ERROR bb_readdir filler:  buffer full");
+			return -ENOMEM;
+		}
+    } while ((de = readdir(dp)) != NULL);
+
+	// Then the files packed away in the directory
+	if (ENCR_DATA->packs != NULL) {
+		struct encr_fill f = { buf, filler, path, &listing };
+
+		retstat = encr_pack_list(ENCR_DATA->packs, path,
+					 encr_fill_packed, &f);
+	}
+    
+    return retstat;
+}
+//Updated to fullpath
+static int encr_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+	char fpath[PATH_MAX];
+    
+    if (encr_hidden(path))
+		return -EPERM;
+	if (encr_packed(path))
+		return -EEXIST;
+    encr_fullpath(fpath, path);
+
+	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
+	   is more portable */
+	if (S_ISREG(mode)) {
+		// The header is written by the first open()
+		struct stat st;
+		int fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+
+		res = fd;
+		if (fd >= 0) {
+			if (fstat(fd, &st) == 0 && encr_mark_encrypted(fd, &st) != 0) {
+				res = encr_error("encr_mknod fsetxattr\n");
+				close(fd);
+				unlink(fpath);
+				return res;
+			}
+			res = close(fd);
+		}
+	} else if (S_ISFIFO(mode)){
+		res = mkfifo(fpath, mode);
+	} else{
+		res = mknod(fpath, mode, rdev);
+	}
+	if (res == -1)
+		return -errno;
+
+	encr_acache_inval(ENCR_DATA->acache, path);
+	return 0;
+}
+//Updated to fullpath
+static int encr_mkdir(const char *path, mode_t mode)
+{
+	int res;
+	char fpath[PATH_MAX];
+    
+    if (encr_hidden(path))
+		return -EPERM;
+	if (encr_packed(path))
+		return -EEXIST;
+    encr_fullpath(fpath, path);
+	res = mkdir(fpath, mode);
+	if (res == -1)
+		return -errno;
+
+	encr_acache_inval(ENCR_DATA->acache, path);
+	return 0;
+}
+
+/* Deduplicated, log-structured and striped files hold chunks in the
+ * store, the log or their parts until their last link and their last
+ * open handle are both gone. A
+ * file about to lose its last link is held open through the unlink, and
+ * whoever then drops the last reference to its inode gives the chunks
+ * back, and removes its change map. */
+static struct encr_inode *encr_doomed(const char *fpath, int *fd)
+{
+	struct encr_inode *inode;
+	struct stat st;
+
+	if (ENCR_DATA->store == NULL && ENCR_DATA->logstore == NULL &&
+	    ENCR_DATA->rootset == NULL && ENCR_DATA->changes == NULL)
+		return NULL;
+	*fd = open(fpath, O_RDONLY);
+	if (*fd == -1)
+		return NULL;
+	inode = fstat(*fd, &st) == 0 ?
+		encr_inode_get(ENCR_DATA->itable, st.st_dev, st.st_ino) : NULL;
+	if (inode == NULL)
+		close(*fd);
+	return inode;
+}
+
+// Drop a reference to an inode, then close fd, the file it was taken for
+static void encr_reap(struct encr_inode *inode, int fd)
+{
+	struct stat st;
+
+	if (encr_inode_put(ENCR_DATA->itable, inode) &&
+	    fstat(fd, &st) == 0 && st.st_nlink == 0) {
+		if (ENCR_DATA->store != NULL || ENCR_DATA->logstore != NULL ||
+		    ENCR_DATA->rootset != NULL)
+			encr_io_drop_refs(ENCR_DATA->store, ENCR_DATA->logstore,
+					  ENCR_DATA->rootset, ENCR_DATA->mkey,
+					  fd);
+		encr_changes_forget(ENCR_DATA->changes, ENCR_DATA->mkey, fd);
+	}
+	close(fd);
+}
+
+//Updated to fullpath
+static int encr_unlink(const char *path)
+{
+	int res;
+	int gone;
+	int gate;
+	char fpath[PATH_MAX];
+	struct stat st;
+	struct encr_inode *inode = NULL;
+	int fd = -1;
+    
+    encr_fullpath(fpath, path);
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_lstat(path, fpath, &st);
+	if (res == 0 && ENCR_PACKED(&st)) {
+		res = encr_pack_drop(ENCR_DATA->packs, path);
+		encr_pack_leave(ENCR_DATA->packs, gate);
+		encr_acache_inval(ENCR_DATA->acache, path);
+		return res;
+	}
+	gone = res == 0 && st.st_nlink <= 1;
+	if (gone && S_ISREG(st.st_mode))
+		inode = encr_doomed(fpath, &fd);
+	res = unlink(fpath);
+	if (res == -1)
+		res = -errno;
+	if (inode)
+		encr_reap(inode, fd);
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+
+	// Its inode number is free for reuse, so drop its cached xattrs
+	if (gone)
+		encr_xcache_inval(ENCR_DATA->xcache, &st);
+
+	encr_acache_inval(ENCR_DATA->acache, path);
+	return 0;
+}
+//Updated to full path
+static int encr_rmdir(const char *path)
+{
+	int res;
+	char fpath[PATH_MAX];
+	struct stat st;
+	struct encr_packs *packs = ENCR_DATA->packs;
+    
+    encr_fullpath(fpath, path);
+	if (packs != NULL && lstat(fpath, &st) == -1)
+		return -errno;
+	res = rmdir(fpath);
+	if (res == -1)
+		res = -errno;
+	// A pack with nothing left in it does not keep its directory
+	if (res == -ENOTEMPTY && packs != NULL) {
+		res = encr_pack_rmdir(packs, path);
+		if (res == 0 && rmdir(fpath) == -1)
+			res = -errno;
+	}
+	if (res != 0)
+		return res;
+
+	if (packs != NULL)
+		encr_pack_forget(packs, &st);
+	encr_acache_inval(ENCR_DATA->acache, path);
+	return 0;
+}
+//Updated to full path
+/** Create a symbolic link */
+// The parameters here are a little bit confusing, but do correspond
+// to the symlink() system call.  The 'path' is where the link points,
+// while the 'link' is the link itself.  So we need to leave the path
+// unaltered, but insert the link into the mounted directory.
+static int encr_symlink(const char *from, const char *to)
+{
+	int res;
+	char fto[PATH_MAX];
+    
+    if (encr_hidden(to))
+		return -EPERM;
+	if (encr_packed(to))
+		return -EEXIST;
+    encr_fullpath(fto, to);
+
+	//retstat = symlink(path, flink);
+	res = symlink(from, fto);
+	if (res == -1)
+		return -errno;
+
+	encr_acache_inval(ENCR_DATA->acache, to);
+	return 0;
+}
+//Updated to full path
+static int encr_rename(const char *from, const char *to)
+{
+	int res;
+	int had;
+	int replaced;
+	int gate;
+	struct stat st;
+	struct stat oldst;
+	char fpath[PATH_MAX];
+    char fnewpath[PATH_MAX];
+	struct encr_inode *inode = NULL;
+	int fd = -1;
+	struct encr_packs *packs = ENCR_DATA->packs;
+    
+    if (encr_hidden(to))
+		return -EPERM;
+    encr_fullpath(fpath, from);
+    encr_fullpath(fnewpath, to);
+	
+	gate = encr_pack_enter(packs);
+	had = encr_lstat(to, fnewpath, &oldst) == 0;
+	replaced = had && oldst.st_nlink <= 1;
+	if (replaced && S_ISREG(oldst.st_mode))
+		inode = encr_doomed(fnewpath, &fd);
+	res = rename(fpath,fnewpath);
+	if (res == -1 && errno == ENOENT && encr_unpack(from) == 0)
+		res = rename(fpath, fnewpath);
+	if (res == -1)
+		res = -errno;
+	if (inode)
+		encr_reap(inode, fd);
+	// The file now under the name replaced a packed one
+	if (res == 0 && had && ENCR_PACKED(&oldst))
+		encr_pack_drop(packs, to);
+	encr_pack_leave(packs, gate);
+	if (res != 0)
+		return res;
+
+	if (replaced)
+		encr_xcache_inval(ENCR_DATA->xcache, &oldst);
+	if (had && S_ISDIR(oldst.st_mode) && packs != NULL)
+		encr_pack_forget(packs, &oldst);
+
+	// Every cached path below a renamed directory is now wrong
+	if (lstat(fnewpath, &st) == -1 || S_ISDIR(st.st_mode)) {
+		encr_acache_inval_all(ENCR_DATA->acache);
+	} else {
+		encr_acache_inval(ENCR_DATA->acache, from);
+		encr_acache_inval(ENCR_DATA->acache, to);
+	}
+	return 0;
+}
+//Updated to full path
+static int encr_link(const char *from, const char *to)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+    char fnewpath[PATH_MAX];
+    
+    if (encr_hidden(to))
+		return -EPERM;
+	if (encr_packed(to))
+		return -EEXIST;
+    encr_fullpath(fpath, from);
+    encr_fullpath(fnewpath, to);
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = link(fpath, fnewpath);
+	if (res == -1 && errno == ENOENT && encr_unpack(from) == 0)
+		res = link(fpath, fnewpath);
+	if (res == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+
+	// The link count changed under every name of this inode
+	encr_acache_inval_all(ENCR_DATA->acache);
+	return 0;
+}
+//Updated to full path
+static int encr_chmod(const char *path, mode_t mode)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+   
+    encr_fullpath(fpath, path);
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = chmod(fpath, mode);
+	if (res == -1 && errno == ENOENT && encr_unpack(path) == 0)
+		res = chmod(fpath, mode);
+	if (res == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+//Updated to full path
+static int encr_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+
+    encr_fullpath(fpath, path);
+    
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = lchown(fpath, uid, gid);
+	if (res == -1 && errno == ENOENT && encr_unpack(path) == 0)
+		res = lchown(fpath, uid, gid);
+	if (res == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+/* Open a regular file that may have no handle, through its inode, so the
+ * caller is serialized against handles (and the migrator) and knows the
+ * file's format; a packed file is moved out first. Drop both with
+ * encr_inode_put() and close(). */
+static int encr_open_inode(const char *path, const char *fpath, int flags,
+			   int *fdp, struct encr_inode **inodep)
+{
+	int res;
+	struct stat st;
+	int fd;
+	struct encr_inode *inode;
+
+	res = encr_lstat(path, fpath, &st);
+	if (res != 0)
+		return res;
+	if (!S_ISREG(st.st_mode))
+		return S_ISDIR(st.st_mode) ? -EISDIR : -EINVAL;
+	fd = encr_open_backing(fpath, flags, 0, 1);
+	if (fd == -1 && errno == ENOENT && encr_unpack(path) == 0)
+		fd = encr_open_backing(fpath, flags, 0, 1);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	inode = encr_inode_get(ENCR_DATA->itable, st.st_dev, st.st_ino);
+	if (inode == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	res = encr_io_open(inode, fd, ENCR_DATA->mkey, ENCR_DATA->store,
+			   ENCR_DATA->logstore, ENCR_DATA->rootset,
+			   encr_is_encrypted(fpath, &st),
+			   encr_chunks_new(ENCR_DATA->chunks, path),
+			   ENCR_DATA->file_flags, ENCR_DATA->direct_backing);
+	if (res != 0) {
+		encr_inode_put(ENCR_DATA->itable, inode);
+		close(fd);
+		return res;
+	}
+	*fdp = fd;
+	*inodep = inode;
+	return 0;
+}
+
+/* A file about to grow to size while still empty, if its chunk size is
+ * auto, gets the chunk size for that size now (see encfs-chunk.h) */
+static void encr_chunk_hint(const char *path, struct encr_inode *inode,
+			    int fd, off_t size)
+{
+	unsigned shift = encr_chunks_for_size(size);
+
+	if (size > 0 && inode->encrypted &&
+	    __atomic_load_n(&inode->chunk_shift, __ATOMIC_ACQUIRE) != shift &&
+	    encr_chunks_auto(ENCR_DATA->chunks, path))
+		encr_io_set_chunk(inode, fd, ENCR_DATA->mkey, shift);
+}
+
+/* At release: leave the chunk size the writes through an auto file ask
+ * for on it, for the migrator and encfs-rechunk */
+static void encr_chunk_review(const char *path, struct encr_file *of)
+{
+	struct stat st;
+	unsigned want;
+	char val[16];
+	int len;
+
+	if (!of->inode->encrypted ||
+	    encr_io_fstat(of->inode, of->fd, &st) != 0)
+		return;
+	want = encr_chunks_observed(of->inode, st.st_size);
+	if (want == 0 ||
+	    want == __atomic_load_n(&of->inode->chunk_shift, __ATOMIC_ACQUIRE) ||
+	    !encr_chunks_auto(ENCR_DATA->chunks, path))
+		return;
+	len = snprintf(val, sizeof(val), "%u", 1U << want);
+	if (fsetxattr(of->fd, ENCR_XATTR_CHUNK_WANT, val, len, 0) == 0)
+		encr_xcache_set(ENCR_DATA->xcache, &st, ENCR_XATTR_CHUNK_WANT,
+				val, len);
+}
+
+//Updated to full path
+static int encr_truncate(const char *path, off_t size)
+{
+	int res;
+	int gate;
+	int turn;
+	char fpath[PATH_MAX];
+	int fd;
+	struct encr_inode *inode;
+    
+    encr_fullpath(fpath, path);
+
+	turn = encr_sched_enter(ENCR_DATA->sched, ENCR_SCHED_DATA, 0);
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_open_inode(path, fpath, O_WRONLY, &fd, &inode);
+	if (res == 0) {
+		encr_chunk_hint(path, inode, fd, size);
+		res = encr_io_truncate(inode, fd, size);
+		encr_acache_inval_attr(ENCR_DATA->acache, path);
+		encr_inode_put(ENCR_DATA->itable, inode);
+		close(fd);
+	}
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	encr_sched_leave(ENCR_DATA->sched, turn);
+
+	return res;
+}
+
+static int encr_ftruncate(const char *path, off_t size,
+			  struct fuse_file_info *fi)
+{
+	int res;
+	int turn;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	if (of->fd == -1)
+		return -EBADF;
+	turn = encr_sched_enter(ENCR_DATA->sched, ENCR_SCHED_DATA, 0);
+	encr_chunk_hint(path, of->inode, of->fd, size);
+	res = encr_io_truncate(of->inode, of->fd, size);
+	encr_sched_leave(ENCR_DATA->sched, turn);
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+
+	return res;
+}
+//Updated to full path
+static int encr_utimens(const char *path, const struct timespec ts[2])
+{
+	int res;
+	int gate;
+	struct timeval tv[2];
+	char fpath[PATH_MAX];
+    
+    encr_fullpath(fpath, path);
+
+	tv[0].tv_sec = ts[0].tv_sec;
+	tv[0].tv_usec = ts[0].tv_nsec / 1000;
+	tv[1].tv_sec = ts[1].tv_sec;
+	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = utimes(fpath, tv);
+	if (res == -1 && errno == ENOENT && encr_unpack(path) == 0)
+		res = utimes(fpath, tv);
+	if (res == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+// Wrap a freshly opened backing fd in an encr_file and hang it off fi
+static int encr_file_attach(const char *path, int fd, const struct stat *st,
+			    int encrypted, struct fuse_file_info *fi)
+{
+	struct encr_file *of;
+	int res;
+
+	of = malloc(sizeof(struct encr_file));
+	if (of == NULL)
+		return -ENOMEM;
+	of->fd = fd;
+	of->data = NULL;
+	of->next = 0;
+	of->run = 0;
+	of->inode = encr_inode_get(ENCR_DATA->itable, st->st_dev, st->st_ino);
+	if (of->inode == NULL) {
+		free(of);
+		return -ENOMEM;
+	}
+	res = encr_io_open(of->inode, fd, ENCR_DATA->mkey, ENCR_DATA->store,
+			   ENCR_DATA->logstore, ENCR_DATA->rootset, encrypted,
+			   encr_chunks_new(ENCR_DATA->chunks, path),
+			   ENCR_DATA->file_flags, ENCR_DATA->direct_backing);
+	if (res != 0) {
+		encr_inode_put(ENCR_DATA->itable, of->inode);
+		free(of);
+		return res;
+	}
+	/* Only once the inode does aligned I/O; where the filesystem has no
+	 * O_DIRECT the handle just stays buffered */
+	if (of->inode->direct)
+		encr_dio_enable(fd);
+	fi->fh = (uintptr_t) of;
+
+	return 0;
+}
+
+/* Open a packed file for reading: its contents are read whole into the
+ * handle, which has no backing fd */
+static int encr_open_packed(const char *path, struct fuse_file_info *fi)
+{
+	struct encr_file *of;
+	int res;
+
+	of = malloc(sizeof(struct encr_file));
+	if (of == NULL)
+		return -ENOMEM;
+	res = encr_pack_read(ENCR_DATA->packs, path, &of->data, &of->st);
+	if (res != 0) {
+		free(of);
+		return res;
+	}
+	of->fd = -1;
+	of->inode = NULL;
+	fi->fh = (uintptr_t) of;
+	return 0;
+}
+
+// encr_open(), under a pack gate
+static int encr_open_file(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+	int res;
+	int flags;
+	int encrypted;
+	char fpath[PATH_MAX];
+	struct stat st;
+    
+    encr_fullpath(fpath, path);
+
+	res = encr_lstat(path, fpath, &st);
+	if (res != 0)
+		return res;
+	// Read-only opens read from the pack; others move the file out
+	if (ENCR_PACKED(&st)) {
+		res = -ENOENT;
+		if ((fi->flags & O_ACCMODE) == O_RDONLY && !(fi->flags & O_TRUNC))
+			res = encr_open_packed(path, fi);
+		if (res != -ENOENT)
+			return res;
+		encr_unpack(path);
+		res = encr_lstat(path, fpath, &st);
+		if (res != 0)
+			return res;
+	}
+	encrypted = encr_is_encrypted(fpath, &st);
+
+	// The kernel already supplies the end-of-file offset for O_APPEND
+	// writes; pwrite() on an O_APPEND fd would ignore it. O_TRUNC
+	// would take the header of an encrypted file with it, so it is
+	// done under the inode's locks below.
+	flags = fi->flags & ~(O_APPEND | O_TRUNC);
+	fd = encr_open_backing(fpath, flags, 0, S_ISREG(st.st_mode));
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	res = encr_file_attach(path, fd, &st, encrypted, fi);
+	if (res != 0) {
+		close(fd);
+		return res;
+	}
+	if (fi->flags & O_TRUNC) {
+		struct encr_file *of = ENCR_FILE(fi);
+
+		res = encr_io_truncate(of->inode, fd, 0);
+		if (res != 0) {
+			close(fd);
+			encr_inode_put(ENCR_DATA->itable, of->inode);
+			free(of);
+			return res;
+		}
+	}
+	if (fi->flags & O_TRUNC)
+		encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+
+//Updated to full path
+static int encr_open(const char *path, struct fuse_file_info *fi)
+{
+	int gate;
+	int res;
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_open_file(path, fi);
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	return res;
+}
+
+/* The scheduler class of a read: one carrying on a run of sequential
+ * reads on the handle is most likely the kernel reading ahead. Reads
+ * the kernel has in flight together may arrive a request out of order,
+ * so one starting within its own size of where the last ended counts;
+ * concurrent ones may race here, which only misjudges a read. */
+static int encr_read_class(struct encr_file *of, size_t size, off_t offset)
+{
+	off_t next = __atomic_load_n(&of->next, __ATOMIC_RELAXED);
+	off_t run = __atomic_load_n(&of->run, __ATOMIC_RELAXED);
+
+	if (offset < next - (off_t) size || offset > next + (off_t) size)
+		run = 0;
+	run += size;
+	__atomic_store_n(&of->run, run, __ATOMIC_RELAXED);
+	__atomic_store_n(&of->next, offset + (off_t) size, __ATOMIC_RELAXED);
+	return run > ENCR_SCHED_SEQ_RUN ? ENCR_SCHED_READAHEAD :
+		ENCR_SCHED_DATA;
+}
+
+static int encr_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	int res;
+	int turn;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	(void) path;
+	if (of->fd == -1) {
+		if (offset >= of->st.st_size)
+			return 0;
+		if (size > (size_t) (of->st.st_size - offset))
+			size = of->st.st_size - offset;
+		memcpy(buf, of->data + offset, size);
+		return size;
+	}
+	turn = ENCR_DATA->sched == NULL ? ENCR_SCHED_META :
+		encr_sched_enter(ENCR_DATA->sched,
+				 encr_read_class(of, size, offset), size);
+	res = encr_io_read(of->inode, of->fd, buf, size, offset);
+	encr_sched_leave(ENCR_DATA->sched, turn);
+
+	return res;
+}
+
+static int encr_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+	int turn;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	if (of->fd == -1)
+		return -EBADF;
+	turn = encr_sched_enter(ENCR_DATA->sched, ENCR_SCHED_DATA, size);
+	res = encr_io_write(of->inode, of->fd, buf, size, offset);
+	encr_sched_leave(ENCR_DATA->sched, turn);
+	if (res > 0 && of->inode->encrypted)
+		encr_chunks_note(of->inode, offset, res);
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+
+	return res;
+}
+
+// ENCR_IOC_COPY_RANGE: copy_file_range() from another file into this one
+static int encr_copy_range(const char *path, struct encr_copy_range *cr,
+			   struct fuse_file_info *fi)
+{
+	int res;
+	int gate;
+	int turn;
+	char spath[PATH_MAX];
+	ssize_t n;
+	int sfd;
+	struct encr_inode *src;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	cr->src[sizeof(cr->src) - 1] = '\0';
+	if (cr->src[0] != '/' || encr_hidden(cr->src))
+		return -ENOENT;
+	if (cr->src_off < 0 || cr->dst_off < 0)
+		return -EINVAL;
+	if (of->fd == -1)
+		return -EBADF;
+	encr_fullpath(spath, cr->src);
+
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_open_inode(cr->src, spath, O_RDONLY, &sfd, &src);
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+	turn = encr_sched_enter(ENCR_DATA->sched, ENCR_SCHED_DATA,
+				cr->len > SSIZE_MAX ? SSIZE_MAX : cr->len);
+	n = encr_io_copy(src, sfd, cr->src_off, of->inode, of->fd,
+			 cr->dst_off, cr->len > SSIZE_MAX ? SSIZE_MAX : cr->len);
+	encr_sched_leave(ENCR_DATA->sched, turn);
+	encr_inode_put(ENCR_DATA->itable, src);
+	close(sfd);
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	if (n < 0)
+		return n;
+	cr->copied = n;
+	return 0;
+}
+
+/* ENCR_IOC_GET_CHUNK and ENCR_IOC_SET_CHUNK: a file's chunk size, and
+ * rewriting it to another one (see encfs-chunk.h) */
+static int encr_chunk_ioctl(const char *path, int set,
+			    struct encr_chunk_info *ci,
+			    struct fuse_file_info *fi)
+{
+	int res;
+	char fpath[PATH_MAX];
+	struct stat st;
+	unsigned shift = 0;
+	int encrypted;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	// A packed file is served from its pack and has no chunks
+	if (of->fd == -1)
+		return -EBADF;
+	if (set) {
+		if (ci->chunk_size == ENCR_CHUNK_BY_SIZE) {
+			res = encr_io_fstat(of->inode, of->fd, &st);
+			if (res != 0)
+				return res;
+			shift = encr_chunks_for_size(st.st_size);
+		} else if (ci->chunk_size != 0) {
+			shift = encr_chunk_shift(ci->chunk_size);
+			if (shift == 0)
+				return -EINVAL;
+		}
+		encr_fullpath(fpath, path);
+		res = encr_migrate_file(ENCR_DATA->rootdir, ENCR_DATA->mkey,
+					ENCR_DATA->store, ENCR_DATA->logstore,
+					ENCR_DATA->rootset, ENCR_DATA->itable,
+					ENCR_DATA->xcache, ENCR_DATA->chunks,
+					fpath, shift,
+					ENCR_DATA->file_flags &
+					~(ENCR_FLAG_DEDUP | ENCR_FLAG_LOG),
+					ENCR_DATA->direct_backing);
+		if (res != 0)
+			return res;
+		encr_acache_inval_attr(ENCR_DATA->acache, path);
+	}
+
+	pthread_mutex_lock(&of->inode->lock);
+	encrypted = of->inode->encrypted;
+	shift = of->inode->chunk_shift;
+	pthread_mutex_unlock(&of->inode->lock);
+	ci->chunk_size = encrypted ? 1U << shift : 0;
+	ci->target = 1U << encr_chunks_target(ENCR_DATA->chunks, path, of->fd,
+					      shift);
+	return 0;
+}
+
+// ENCR_IOC_CHANGES: what changed in a file since a generation
+static int encr_changes_ioctl(struct encr_changes_query *q,
+			      struct fuse_file_info *fi)
+{
+	int res;
+	struct stat st;
+	struct encr_file *of = ENCR_FILE(fi);
+
+	// Packed files are not tracked
+	if (of->fd == -1)
+		return -EOPNOTSUPP;
+	res = encr_io_fstat(of->inode, of->fd, &st);
+	if (res != 0)
+		return res;
+	return encr_changes_query(of->inode, st.st_size, q);
+}
+
+// ENCR_IOC_GET_STRIPE: how many roots a file is striped over
+static int encr_stripe_ioctl(struct encr_stripe_info *si,
+			     struct fuse_file_info *fi)
+{
+	struct encr_file *of = ENCR_FILE(fi);
+
+	// A packed file has no data of its own
+	if (of->fd == -1)
+		return -EBADF;
+	pthread_mutex_lock(&of->inode->lock);
+	si->width = !of->inode->encrypted ? 0 :
+		of->inode->hdr.flags & ENCR_FLAG_STRIPED ?
+		of->inode->hdr.width : 1;
+	pthread_mutex_unlock(&of->inode->lock);
+	si->roots = encr_roots_count(ENCR_DATA->rootset);
+	return 0;
+}
+
+static int encr_ioctl(const char *path, int cmd, void *arg,
+		      struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void) arg;
+	if (flags & FUSE_IOCTL_COMPAT)
+		return -ENOSYS;
+	switch ((unsigned int) cmd) {
+	case ENCR_IOC_COPY_RANGE:
+		return encr_copy_range(path, data, fi);
+	case ENCR_IOC_GET_CHUNK:
+		return encr_chunk_ioctl(path, 0, data, fi);
+	case ENCR_IOC_SET_CHUNK:
+		return encr_chunk_ioctl(path, 1, data, fi);
+	case ENCR_IOC_CHANGES:
+		return encr_changes_ioctl(data, fi);
+	case ENCR_IOC_GET_STRIPE:
+		return encr_stripe_ioctl(data, fi);
+	}
+	return -ENOTTY;
+}
+
+static int encr_fgetattr(const char *path, struct stat *stbuf,
+			 struct fuse_file_info *fi)
+{
+	struct encr_file *of = ENCR_FILE(fi);
+
+	(void) path;
+	if (of->fd == -1) {
+		*stbuf = of->st;
+		return 0;
+	}
+
+	return encr_io_fstat(of->inode, of->fd, stbuf);
+}
+//Updated to full path
+static int encr_statfs(const char *path, struct statvfs *stbuf)
+{
+	int res;
+	char fpath[PATH_MAX];
+    
+    encr_fullpath(fpath, path);
+
+	res = statvfs(fpath, stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+//Updated to full path
+static int encr_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+
+    char fpath[PATH_MAX];
+    
+    encr_fullpath(fpath, path);
+
+    int fd;
+    int res;
+    int flags;
+    int created = 1;
+    int encrypted = 1;
+    struct stat st;
+
+    if (encr_hidden(path))
+	return -EPERM;
+    // An existing packed file is opened as a backing file would be
+    if (encr_packed(path)) {
+	if (fi->flags & O_EXCL)
+	    return -EEXIST;
+	if (encr_unpack(path) == -1 && errno != ENOENT)
+	    return -errno;
+    }
+    flags = fi->flags & ~(O_APPEND | O_TRUNC | O_CREAT | O_EXCL);
+    fd = encr_open_backing(fpath, flags | O_CREAT | O_EXCL, mode, 1);
+    // Lost a race with another creator: use the file as it is
+    if (fd == -1 && errno == EEXIST && !(fi->flags & O_EXCL)) {
+	created = 0;
+	fd = encr_open_backing(fpath, flags, 0, 1);
+    }
+    if(fd == -1)
+	return -errno;
+
+    if (fstat(fd, &st) == -1) {
+	res = -errno;
+	close(fd);
+	return res;
+    }
+    res = 0;
+    if (created)
+	res = encr_mark_encrypted(fd, &st);
+    else
+	encrypted = encr_is_encrypted(fpath, &st);
+
+    encr_acache_inval(ENCR_DATA->acache, path);
+    if(res == 0)
+	res = encr_file_attach(path, fd, &st, encrypted, fi);
+    if(res != 0) {
+	close(fd);
+	if (created)
+	    unlink(fpath);
+	return res;
+    }
+    if (!created && (fi->flags & O_TRUNC)) {
+	struct encr_file *of = ENCR_FILE(fi);
+
+	res = encr_io_truncate(of->inode, fd, 0);
+	if (res != 0) {
+	    close(fd);
+	    encr_inode_put(ENCR_DATA->itable, of->inode);
+	    free(of);
+	}
+    }
+
+    return res;
+}
+
+
+static int encr_release(const char *path, struct fuse_file_info *fi)
+{
+	struct encr_file *of = ENCR_FILE(fi);
+
+	if (of->fd == -1) {
+		free(of->data);
+	} else {
+		encr_chunk_review(path, of);
+		encr_reap(of->inode, of->fd);
+	}
+	free(of);
+	return 0;
+}
+
+static int encr_fsync(const char *path, int isdatasync,
+		     struct fuse_file_info *fi)
+{
+	struct encr_file *of = ENCR_FILE(fi);
+
+	(void) path;
+	if (of->fd == -1)
+		return 0;
+	// Not through the scheduler: this mostly sleeps in the group commit
+	// and the disk flush, and would hold a slot from others all along
+	return encr_sync_file(of->inode, of->fd, isdatasync);
+}
+
+/** Open directory
+ *
+ * This method should check if the open operation is permitted for
+ * this  directory
+ *
+ * Introduced in version 2.3
+ */
+int encr_opendir(const char *path, struct fuse_file_info *fi)
+{
+    DIR *dp;
+    int retstat = 0;
+    char fpath[PATH_MAX];
+    
+    encr_fullpath(fpath, path);
+    
+    dp = opendir(fpath);
+    if (dp == NULL)
+		return encr_error("encr_opendir opendir\n");
+    
+    fi->fh = (intptr_t) dp;
+    
+    //log_fi(fi);
+    
+    return retstat;
+}
+
+/** Release directory
+ *
+ * Each open directory handle owns its own DIR stream, so concurrent
+ * listings of one directory never share a read position.
+ */
+static int encr_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	closedir((DIR *) (uintptr_t) fi->fh);
+	return 0;
+}
+
+
+/** Synchronize directory contents
+ *
+ * Makes entries created, renamed or removed in the directory durable,
+ * as fsync() of the backing directory would.
+ */
+static int encr_fsyncdir(const char *path, int isdatasync,
+			 struct fuse_file_info *fi)
+{
+	int fd = dirfd((DIR *) (uintptr_t) fi->fh);
+	int res;
+
+	(void) path;
+	res = isdatasync ? fdatasync(fd) : fsync(fd);
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+
+#ifdef HAVE_SETXATTR
+// Reply to getxattr() or listxattr() with len bytes of val (none if NULL)
+static int encr_xattr_copy(const char *val, size_t len, char *buf,
+			   size_t size)
+{
+	if (val == NULL)
+		return -ENODATA;
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(buf, val, len);
+	return len;
+}
+
+// All four xattr calls go through the per-inode xattr cache, which is
+// filled with one llistxattr() and kept current by set/remove below.
+// ENCR_XATTR_SIZE_HINT: the size a file will grow to, never stored
+static int encr_size_hint(const char *path, const char *value, size_t size)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+	char num[32];
+	char *end;
+	long long hint;
+	int fd;
+	struct encr_inode *inode;
+
+	if (size == 0 || size >= sizeof(num))
+		return -EINVAL;
+	memcpy(num, value, size);
+	num[size] = '\0';
+	hint = strtoll(num, &end, 10);
+	if (*end != '\0' || hint < 0)
+		return -EINVAL;
+
+	encr_fullpath(fpath, path);
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_open_inode(path, fpath, O_RDWR, &fd, &inode);
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+	encr_chunk_hint(path, inode, fd, hint);
+	encr_inode_put(ENCR_DATA->itable, inode);
+	close(fd);
+	return 0;
+}
+
+static int encr_setxattr(const char *path, const char *name, const char *value,
+			size_t size, int flags)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+	struct stat st;
+    
+    // The marker is ours; flipping it would misread the file
+    if (strcmp(name, ENCR_XATTR_ENCRYPTED) == 0)
+		return -EPERM;
+    if (strcmp(name, ENCR_XATTR_SIZE_HINT) == 0)
+		return encr_size_hint(path, value, size);
+    encr_fullpath(fpath, path);
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_lstat(path, fpath, &st);
+	if (res == 0 && ENCR_PACKED(&st) && encr_unpack(path) == 0)
+		res = encr_lstat(path, fpath, &st);
+	if (res == 0 && lsetxattr(fpath, name, value, size, flags) == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+	encr_xcache_set(ENCR_DATA->xcache, &st, name, value, size);
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+
+static int encr_getxattr(const char *path, const char *name, char *value,
+			size_t size)
+{
+	int res;
+	char fpath[PATH_MAX];
+	struct stat st;
+    
+    encr_fullpath(fpath, path);
+	res = encr_lstat(path, fpath, &st);
+	if (res != 0)
+		return res;
+	// Packed files have no xattrs but the marker
+	if (ENCR_PACKED(&st))
+		return encr_xattr_copy(strcmp(name, ENCR_XATTR_ENCRYPTED) == 0 ?
+				       "true" : NULL, 4, value, size);
+	return encr_xcache_getxattr(ENCR_DATA->xcache, &st, fpath, name,
+				    value, size);
+}
+
+static int encr_listxattr(const char *path, char *list, size_t size)
+{
+	int res;
+	char fpath[PATH_MAX];
+	struct stat st;
+    
+    encr_fullpath(fpath, path);
+	res = encr_lstat(path, fpath, &st);
+	if (res != 0)
+		return res;
+	if (ENCR_PACKED(&st))
+		return encr_xattr_copy(ENCR_XATTR_ENCRYPTED,
+				       sizeof(ENCR_XATTR_ENCRYPTED), list, size);
+	return encr_xcache_listxattr(ENCR_DATA->xcache, &st, fpath, list, size);
+}
+
+static int encr_removexattr(const char *path, const char *name)
+{
+	int res;
+	int gate;
+	char fpath[PATH_MAX];
+	struct stat st;
+    
+    if (strcmp(name, ENCR_XATTR_ENCRYPTED) == 0)
+		return -EPERM;
+    encr_fullpath(fpath, path);
+	gate = encr_pack_enter(ENCR_DATA->packs);
+	res = encr_lstat(path, fpath, &st);
+	if (res == 0 && ENCR_PACKED(&st) && encr_unpack(path) == 0)
+		res = encr_lstat(path, fpath, &st);
+	if (res == 0 && lremovexattr(fpath, name) == -1)
+		res = -errno;
+	encr_pack_leave(ENCR_DATA->packs, gate);
+	if (res != 0)
+		return res;
+	encr_xcache_remove(ENCR_DATA->xcache, &st, name);
+	encr_acache_inval_attr(ENCR_DATA->acache, path);
+	return 0;
+}
+#endif /* HAVE_SETXATTR */
+
+
+
+struct fuse_operations encr_oper = {
+	.getattr	= encr_getattr,
+	.access		= encr_access,
+	.readlink	= encr_readlink,
+	.readdir	= encr_readdir,
+	.mknod		= encr_mknod,
+	.mkdir		= encr_mkdir,
+	.symlink	= encr_symlink,
+	.unlink		= encr_unlink,
+	.rmdir		= encr_rmdir,
+	.rename		= encr_rename,
+	.link		= encr_link,
+	.chmod		= encr_chmod,
+	.chown		= encr_chown,
+	.truncate	= encr_truncate,
+	.ftruncate	= encr_ftruncate,
+	.fgetattr	= encr_fgetattr,
+	.utimens	= encr_utimens,
+	.open		= encr_open,
+	.read		= encr_read,
+	.write		= encr_write,
+	.statfs		= encr_statfs,
+	.create     = encr_create,
+	.release	= encr_release,
+	.fsync		= encr_fsync,
+	.opendir	= encr_opendir,
+	.releasedir	= encr_releasedir,
+	.fsyncdir	= encr_fsyncdir,
+	.ioctl		= encr_ioctl,
+#ifdef HAVE_SETXATTR
+	.setxattr	= encr_setxattr,
+	.getxattr	= encr_getxattr,
+	.listxattr	= encr_listxattr,
+	.removexattr	= encr_removexattr,
+#endif
+};
+
+/* With -o trace=FILE the mount is served through the wrappers below, which
+ * log each call to ENCR_DATA->trace around the real one; an untraced mount
+ * uses encr_oper directly and pays nothing. Path ids are looked up before
+ * the clock starts, so they are not part of the logged latency. */
+#define ENCR_TRACED(o, p, p2, of, sz, a, call)				\
+	do {								\
+		struct encr_trace *t_ = ENCR_DATA->trace;		\
+		struct encr_trace_rec r_ = { .op = (o), .off = (of),	\
+					     .size = (sz), .arg = (a) };\
+									\
+		r_.path = encr_trace_path(t_, (p));			\
+		r_.path2 = encr_trace_path(t_, (p2));			\
+		r_.start_ns = encr_trace_now(t_);			\
+		r_.result = (call);					\
+		r_.end_ns = encr_trace_now(t_);				\
+		encr_trace_log(t_, &r_);				\
+		return r_.result;					\
+	} while (0)
+
+static int encr_t_getattr(const char *path, struct stat *stbuf)
+{
+	ENCR_TRACED(ENCR_OP_GETATTR, path, NULL, 0, 0, 0,
+		    encr_getattr(path, stbuf));
+}
+
+static int encr_t_access(const char *path, int mask)
+{
+	ENCR_TRACED(ENCR_OP_ACCESS, path, NULL, 0, 0, mask,
+		    encr_access(path, mask));
+}
+
+static int encr_t_readlink(const char *path, char *buf, size_t size)
+{
+	ENCR_TRACED(ENCR_OP_READLINK, path, NULL, 0, size, 0,
+		    encr_readlink(path, buf, size));
+}
+
+static int encr_t_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_READDIR, path, NULL, offset, 0, 0,
+		    encr_readdir(path, buf, filler, offset, fi));
+}
+
+static int encr_t_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	ENCR_TRACED(ENCR_OP_MKNOD, path, NULL, 0, rdev, mode,
+		    encr_mknod(path, mode, rdev));
+}
+
+static int encr_t_mkdir(const char *path, mode_t mode)
+{
+	ENCR_TRACED(ENCR_OP_MKDIR, path, NULL, 0, 0, mode,
+		    encr_mkdir(path, mode));
+}
+
+static int encr_t_symlink(const char *from, const char *to)
+{
+	ENCR_TRACED(ENCR_OP_SYMLINK, to, from, 0, 0, 0,
+		    encr_symlink(from, to));
+}
+
+static int encr_t_unlink(const char *path)
+{
+	ENCR_TRACED(ENCR_OP_UNLINK, path, NULL, 0, 0, 0, encr_unlink(path));
+}
+
+static int encr_t_rmdir(const char *path)
+{
+	ENCR_TRACED(ENCR_OP_RMDIR, path, NULL, 0, 0, 0, encr_rmdir(path));
+}
+
+static int encr_t_rename(const char *from, const char *to)
+{
+	ENCR_TRACED(ENCR_OP_RENAME, from, to, 0, 0, 0, encr_rename(from, to));
+}
+
+static int encr_t_link(const char *from, const char *to)
+{
+	ENCR_TRACED(ENCR_OP_LINK, from, to, 0, 0, 0, encr_link(from, to));
+}
+
+static int encr_t_chmod(const char *path, mode_t mode)
+{
+	ENCR_TRACED(ENCR_OP_CHMOD, path, NULL, 0, 0, mode,
+		    encr_chmod(path, mode));
+}
+
+static int encr_t_chown(const char *path, uid_t uid, gid_t gid)
+{
+	ENCR_TRACED(ENCR_OP_CHOWN, path, NULL, 0, gid, uid,
+		    encr_chown(path, uid, gid));
+}
+
+static int encr_t_truncate(const char *path, off_t size)
+{
+	ENCR_TRACED(ENCR_OP_TRUNCATE, path, NULL, size, 0, 0,
+		    encr_truncate(path, size));
+}
+
+static int encr_t_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_FTRUNCATE, path, NULL, size, 0, 0,
+		    encr_ftruncate(path, size, fi));
+}
+
+static int encr_t_fgetattr(const char *path, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_FGETATTR, path, NULL, 0, 0, 0,
+		    encr_fgetattr(path, stbuf, fi));
+}
+
+static int encr_t_utimens(const char *path, const struct timespec ts[2])
+{
+	ENCR_TRACED(ENCR_OP_UTIMENS, path, NULL,
+		    ts[0].tv_sec * 1000000000LL + ts[0].tv_nsec,
+		    ts[1].tv_sec * 1000000000LL + ts[1].tv_nsec, 0,
+		    encr_utimens(path, ts));
+}
+
+static int encr_t_open(const char *path, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_OPEN, path, NULL, 0, 0, fi->flags,
+		    encr_open(path, fi));
+}
+
+static int encr_t_read(const char *path, char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_READ, path, NULL, offset, size, 0,
+		    encr_read(path, buf, size, offset, fi));
+}
+
+static int encr_t_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_WRITE, path, NULL, offset, size, 0,
+		    encr_write(path, buf, size, offset, fi));
+}
+
+static int encr_t_statfs(const char *path, struct statvfs *stbuf)
+{
+	ENCR_TRACED(ENCR_OP_STATFS, path, NULL, 0, 0, 0,
+		    encr_statfs(path, stbuf));
+}
+
+static int encr_t_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_CREATE, path, NULL, 0, fi->flags, mode,
+		    encr_create(path, mode, fi));
+}
+
+static int encr_t_release(const char *path, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_RELEASE, path, NULL, 0, 0, fi->flags,
+		    encr_release(path, fi));
+}
+
+static int encr_t_fsync(const char *path, int isdatasync,
+			struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_FSYNC, path, NULL, 0, 0, isdatasync,
+		    encr_fsync(path, isdatasync, fi));
+}
+
+static int encr_t_opendir(const char *path, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_OPENDIR, path, NULL, 0, 0, 0,
+		    encr_opendir(path, fi));
+}
+
+static int encr_t_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_RELEASEDIR, path, NULL, 0, 0, 0,
+		    encr_releasedir(path, fi));
+}
+
+static int encr_t_fsyncdir(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	ENCR_TRACED(ENCR_OP_FSYNCDIR, path, NULL, 0, 0, isdatasync,
+		    encr_fsyncdir(path, isdatasync, fi));
+}
+
+static int encr_t_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	ENCR_TRACED(ENCR_OP_IOCTL, path, NULL, 0, 0, cmd,
+		    encr_ioctl(path, cmd, arg, fi, flags, data));
+}
+
+#ifdef HAVE_SETXATTR
+static int encr_t_setxattr(const char *path, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	ENCR_TRACED(ENCR_OP_SETXATTR, path, name, 0, size, flags,
+		    encr_setxattr(path, name, value, size, flags));
+}
+
+static int encr_t_getxattr(const char *path, const char *name, char *value,
+			   size_t size)
+{
+	ENCR_TRACED(ENCR_OP_GETXATTR, path, name, 0, size, 0,
+		    encr_getxattr(path, name, value, size));
+}
+
+static int encr_t_listxattr(const char *path, char *list, size_t size)
+{
+	ENCR_TRACED(ENCR_OP_LISTXATTR, path, NULL, 0, size, 0,
+		    encr_listxattr(path, list, size));
+}
+
+static int encr_t_removexattr(const char *path, const char *name)
+{
+	ENCR_TRACED(ENCR_OP_REMOVEXATTR, path, name, 0, 0, 0,
+		    encr_removexattr(path, name));
+}
+#endif /* HAVE_SETXATTR */
+
+struct fuse_operations encr_trace_oper = {
+	.getattr	= encr_t_getattr,
+	.access		= encr_t_access,
+	.readlink	= encr_t_readlink,
+	.readdir	= encr_t_readdir,
+	.mknod		= encr_t_mknod,
+	.mkdir		= encr_t_mkdir,
+	.symlink	= encr_t_symlink,
+	.unlink		= encr_t_unlink,
+	.rmdir		= encr_t_rmdir,
+	.rename		= encr_t_rename,
+	.link		= encr_t_link,
+	.chmod		= encr_t_chmod,
+	.chown		= encr_t_chown,
+	.truncate	= encr_t_truncate,
+	.ftruncate	= encr_t_ftruncate,
+	.fgetattr	= encr_t_fgetattr,
+	.utimens	= encr_t_utimens,
+	.open		= encr_t_open,
+	.read		= encr_t_read,
+	.write		= encr_t_write,
+	.statfs		= encr_t_statfs,
+	.create		= encr_t_create,
+	.release	= encr_t_release,
+	.fsync		= encr_t_fsync,
+	.opendir	= encr_t_opendir,
+	.releasedir	= encr_t_releasedir,
+	.fsyncdir	= encr_t_fsyncdir,
+	.ioctl		= encr_t_ioctl,
+#ifdef HAVE_SETXATTR
+	.setxattr	= encr_t_setxattr,
+	.getxattr	= encr_t_getxattr,
+	.listxattr	= encr_t_listxattr,
+	.removexattr	= encr_t_removexattr,
+#endif
+};
+
+/* Setting up */
+
+void encr_ops_bind(struct encr_state *encr_data)
+{
+	encr_ops_data = encr_data;
+}
+
+void encr_ops_defaults(struct encr_state *encr_data)
+{
+	memset(encr_data, 0, sizeof(struct encr_state));
+	encr_data->max_threads = ENCR_DEFAULT_MAX_THREADS;
+	encr_data->max_idle_threads = ENCR_DEFAULT_MAX_IDLE_THREADS;
+	encr_data->entry_timeout = ENCR_DEFAULT_ENTRY_TIMEOUT;
+	encr_data->attr_timeout = ENCR_DEFAULT_ATTR_TIMEOUT;
+	encr_data->negative_timeout = ENCR_DEFAULT_NEGATIVE_TIMEOUT;
+	encr_data->max_write = ENCR_DEFAULT_MAX_WRITE;
+	encr_data->attr_cache_size = ENCR_DEFAULT_ACACHE_SIZE;
+	encr_data->xattr_cache_size = ENCR_DEFAULT_XCACHE_SIZE;
+	encr_data->chunk_size = 1 << ENCR_DEFAULT_CHUNK_SHIFT;
+	encr_data->migrate_rate = ENCR_DEFAULT_MIGRATE_RATE;
+	encr_data->migrate_cpu = ENCR_DEFAULT_MIGRATE_CPU;
+	encr_data->trace_size = ENCR_DEFAULT_TRACE_SIZE;
+	encr_data->pack_max = ENCR_DEFAULT_PACK_MAX;
+	encr_data->cache_size = ENCR_DEFAULT_CACHE_SIZE;
+}
+
+int encr_ops_check(struct encr_state *encr_data)
+{
+	for (encr_data->chunk_shift = ENCR_MIN_CHUNK_SHIFT;
+	     encr_data->chunk_shift < ENCR_MAX_CHUNK_SHIFT &&
+	     (1U << encr_data->chunk_shift) != encr_data->chunk_size;
+	     encr_data->chunk_shift++)
+		;
+	if ((1U << encr_data->chunk_shift) != encr_data->chunk_size)
+		return -EINVAL;
+	if (encr_data->dedup && encr_data->log)
+		return -EINVAL;
+	if (encr_data->pack_max == 0 || encr_data->pack_max > ENCR_PACK_LIMIT)
+		return -EINVAL;
+	if (encr_data->cache_size < ENCR_TIER_MIN_SIZE ||
+	    (encr_data->cache_writeback && (encr_data->cache_dir == NULL ||
+					    encr_data->cache_dir[0] == '\0')))
+		return -EINVAL;
+	// Only files in the plain format are striped
+	if (encr_data->roots != NULL && encr_data->roots[0] != '\0' &&
+	    (encr_data->compress || encr_data->dedup || encr_data->log))
+		return -EINVAL;
+	encr_data->file_flags = (encr_data->compress ? ENCR_FLAG_COMPRESSED : 0) |
+		(encr_data->dedup ? ENCR_FLAG_DEDUP : 0) |
+		(encr_data->log ? ENCR_FLAG_LOG : 0) |
+		(encr_data->roots != NULL && encr_data->roots[0] != '\0' ?
+		 ENCR_FLAG_STRIPED : 0);
+	return 0;
+}
+
+static int encr_mount_key(struct encr_state *encr_data)
+{
+	char dir[PATH_MAX];
+	char cpath[PATH_MAX];
+	struct encr_config cfg;
+	int res;
+
+	encr_data->mkey = malloc(sizeof(struct encr_keys));
+	if (encr_data->mkey == NULL)
+		return -ENOMEM;
+	snprintf(dir, sizeof(dir), "%s/%s", encr_data->rootdir, ENCR_META_DIR);
+	snprintf(cpath, sizeof(cpath), "%s/%s/%s", encr_data->rootdir,
+		 ENCR_META_DIR, ENCR_CONFIG_FILE);
+
+	res = encr_config_read(cpath, &cfg);
+	if (res == -ENOENT) {
+		if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+			return -errno;
+		res = encr_config_init(&cfg, encr_data->key_phrase,
+				       encr_data->mkey);
+		if (res == 0)
+			res = encr_config_write(cpath, &cfg);
+		return res;
+	}
+	if (res != 0)
+		return res;
+	return encr_config_unlock(&cfg, encr_data->key_phrase, encr_data->mkey);
+}
+
+int encr_ops_open(struct encr_state *encr_data)
+{
+	int res;
+
+	encr_data->itable = encr_itable_new();
+	encr_data->acache = encr_acache_new(encr_data->attr_timeout,
+					    encr_data->negative_timeout,
+					    encr_data->attr_cache_size);
+	encr_data->xcache = encr_xcache_new(encr_data->attr_timeout,
+					    encr_data->xattr_cache_size);
+	if (encr_data->itable == NULL || encr_data->acache == NULL ||
+	    encr_data->xcache == NULL) {
+		fprintf(stderr, "Cannot allocate the caches\n");
+		res = -ENOMEM;
+		goto fail;
+	}
+
+	res = encr_chunks_open(encr_data->rootdir, encr_data->chunk_shift,
+			       encr_data->chunk_auto, &encr_data->chunks);
+	if (res != 0) {
+		fprintf(stderr, "Cannot read the chunk policy: %s\n",
+			strerror(-res));
+		goto fail;
+	}
+
+	res = encr_mount_key(encr_data);
+	if (res == -EACCES) {
+		fprintf(stderr, "Wrong key phrase for %s\n", encr_data->rootdir);
+		goto fail;
+	} else if (res != 0) {
+		fprintf(stderr, "Cannot set up the mount key: %s\n", strerror(-res));
+		goto fail;
+	}
+
+	res = encr_changes_open(encr_data->rootdir, encr_data->track_changes,
+				&encr_data->changes);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the change maps: %s\n",
+			strerror(-res));
+		goto fail;
+	}
+	encr_data->itable->changes = encr_data->changes;
+
+	res = encr_roots_open(encr_data->rootdir, encr_data->roots, 1,
+			      &encr_data->rootset);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the roots: %s\n", strerror(-res));
+		goto fail;
+	}
+
+	res = encr_tier_open(encr_data->cache_dir, encr_data->rootdir,
+			     encr_data->cache_size, encr_data->cache_writeback,
+			     &encr_data->tier);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the cache directory %s: %s\n",
+			encr_data->cache_dir, strerror(-res));
+		goto fail;
+	}
+	encr_data->itable->tier = encr_data->tier;
+
+	if (encr_data->io_sched) {
+		res = encr_sched_open(encr_data->io_slots,
+				      encr_data->io_weights,
+				      encr_data->io_user_rate,
+				      encr_data->io_readahead_rate,
+				      encr_data->io_background_rate,
+				      encr_data->caller_uid, &encr_data->sched);
+		if (res != 0) {
+			fprintf(stderr, "Cannot set up the I/O scheduler: %s\n",
+				strerror(-res));
+			goto fail;
+		}
+	}
+
+	// Opened whenever there is one, so deduplicated and log-structured
+	// files stay readable
+	res = encr_store_open(encr_data->rootdir, encr_data->mkey,
+			      encr_data->dedup, &encr_data->store);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the chunk store: %s\n",
+			strerror(-res));
+		goto fail;
+	}
+	res = encr_log_open(encr_data->rootdir, encr_data->mkey,
+			    encr_data->log ? ENCR_LOG_CREATE : 0,
+			    &encr_data->logstore);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the log: %s\n", strerror(-res));
+		goto fail;
+	}
+	// Likewise the packs, so packed files stay readable without -o pack
+	res = encr_packs_open(encr_data->rootdir, encr_data->mkey,
+			      encr_data->store, encr_data->logstore,
+			      encr_data->rootset, encr_data->itable,
+			      encr_data->acache,
+			      encr_data->xcache, encr_data->chunk_shift,
+			      encr_data->file_flags, encr_data->direct_backing,
+			      encr_data->pack ? encr_data->pack_max : 0,
+			      &encr_data->packs);
+	if (res != 0) {
+		fprintf(stderr, "Cannot open the packs: %s\n", strerror(-res));
+		goto fail;
+	}
+
+	res = encr_migrate_recover(encr_data->rootdir, encr_data->mkey,
+				   encr_data->rootset);
+	if (res != 0)
+		fprintf(stderr, "Unfinished migrations left in %s/%s/%s: %s\n",
+			encr_data->rootdir, ENCR_META_DIR, ENCR_MIGRATE_DIR,
+			strerror(-res));
+	return 0;
+
+fail:
+	encr_ops_close(encr_data);
+	return res;
+}
+
+void encr_ops_start(struct encr_state *encr_data)
+{
+	if (encr_data->logstore != NULL &&
+	    encr_log_start(encr_data->logstore, encr_data->sched) != 0)
+		fprintf(stderr, "Cannot start the log cleaner\n");
+	if (encr_data->migrate) {
+		encr_data->migrator = encr_migrate_start(encr_data->rootdir,
+				encr_data->mkey, encr_data->store,
+				encr_data->logstore, encr_data->rootset,
+				encr_data->itable, encr_data->xcache,
+				encr_data->chunks,
+				encr_data->file_flags &
+				~(ENCR_FLAG_DEDUP | ENCR_FLAG_LOG),
+				encr_data->direct_backing,
+				encr_data->migrate_rate, encr_data->migrate_cpu,
+				encr_data->sched);
+		if (encr_data->migrator == NULL)
+			fprintf(stderr, "Cannot start the migration thread\n");
+	}
+	if (encr_data->packs != NULL &&
+	    encr_packs_start(encr_data->packs, encr_data->sched) != 0)
+		fprintf(stderr, "Cannot start the packer thread\n");
+	if (encr_data->tier != NULL &&
+	    encr_tier_start(encr_data->tier, encr_data->sched) != 0)
+		fprintf(stderr, "Cannot start the cache flusher\n");
+}
+
+void encr_ops_stop(struct encr_state *encr_data)
+{
+	encr_migrate_stop(encr_data->migrator);
+	encr_data->migrator = NULL;
+}
+
+void encr_ops_close(struct encr_state *encr_data)
+{
+	encr_ops_stop(encr_data);
+	encr_packs_close(encr_data->packs);
+	encr_log_close(encr_data->logstore);
+	encr_store_close(encr_data->store);
+	encr_xcache_free(encr_data->xcache);
+	encr_acache_free(encr_data->acache);
+	encr_itable_free(encr_data->itable);
+	// Every inode is put by now, so every cached block is clean
+	encr_tier_close(encr_data->tier);
+	encr_chunks_close(encr_data->chunks);
+	encr_changes_close(encr_data->changes);
+	encr_roots_close(encr_data->rootset);
+	// Last, as every background thread goes through it
+	encr_sched_close(encr_data->sched);
+	if (encr_data->mkey != NULL)
+		memset(encr_data->mkey, 0, sizeof(struct encr_keys));
+	free(encr_data->mkey);
+	encr_data->packs = NULL;
+	encr_data->logstore = NULL;
+	encr_data->store = NULL;
+	encr_data->xcache = NULL;
+	encr_data->acache = NULL;
+	encr_data->itable = NULL;
+	encr_data->chunks = NULL;
+	encr_data->changes = NULL;
+	encr_data->rootset = NULL;
+	encr_data->tier = NULL;
+	encr_data->sched = NULL;
+	encr_data->mkey = NULL;
+}
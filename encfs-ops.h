@@ -0,0 +1,78 @@
+/* encfs-ops.h
+ * The filesystem callbacks of pa5-encfs, as a library
+ *
+ * encfs-ops.c holds every fuse callback and the setup of the state they
+ * share (struct encr_state, see params.h). pa5-encfs mounts them; anything
+ * else, such as encfs-bench, can link encfs-ops.o without libfuse and call
+ * the members of encr_oper directly on a mirror directory:
+ *
+ *   encr_ops_defaults(s);  set rootdir, key_phrase and any options
+ *   encr_ops_check(s);     encr_ops_bind(s);     encr_ops_open(s);
+ *   encr_ops_start(s);     ... encr_oper.getattr(...) ...
+ *   encr_ops_close(s);
+ *
+ * The callbacks find the state through ENCR_DATA, the one bound by
+ * encr_ops_bind(), not through fuse_get_context(); callers outside a
+ * mount run as whoever they are, with no caller uid, gid or pid to check
+ * against. Paths are mount paths, starting with '/'.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_OPS_H
+#define ENCFS_OPS_H
+
+struct fuse_operations;
+struct encr_state;
+
+/* The callbacks; encr_trace_oper logs each call to the state's trace
+ * before passing it on to encr_oper */
+extern struct fuse_operations encr_oper;
+extern struct fuse_operations encr_trace_oper;
+
+/* void encr_ops_bind(struct encr_state *s)
+ * Purpose: Make s the state every callback works on
+ */
+extern void encr_ops_bind(struct encr_state *s);
+
+/* void encr_ops_defaults(struct encr_state *s)
+ * Purpose: Clear s and set every option to its default
+ */
+extern void encr_ops_defaults(struct encr_state *s);
+
+/* int encr_ops_check(struct encr_state *s)
+ * Purpose: Check the storage options of s and work out chunk_shift and
+ *          file_flags from them
+ * Return: 0 on success, -EINVAL if they are out of range or conflict
+ */
+extern int encr_ops_check(struct encr_state *s);
+
+/* int encr_ops_open(struct encr_state *s)
+ * Purpose: Unlock the mirror s->rootdir with s->key_phrase, creating
+ *          its key on first use, and open its caches, chunk store, log
+ *          and packs; say what failed on stderr
+ * Return: 0 on success, -errno on failure with everything closed again
+ */
+extern int encr_ops_open(struct encr_state *s);
+
+/* void encr_ops_start(struct encr_state *s)
+ * Purpose: Start the background threads the options ask for: the log
+ *          cleaner, the migrator and the packer; any that cannot start
+ *          is reported on stderr and left off
+ */
+extern void encr_ops_start(struct encr_state *s);
+
+/* void encr_ops_stop(struct encr_state *s)
+ * Purpose: Stop the migrator, the one background thread that needs the
+ *          rest of the state to outlive it
+ */
+extern void encr_ops_stop(struct encr_state *s);
+
+/* void encr_ops_close(struct encr_state *s)
+ * Purpose: Stop everything encr_ops_open() and encr_ops_start() set up,
+ *          free it and wipe the key; the options in s are kept
+ */
+extern void encr_ops_close(struct encr_state *s);
+
+#endif
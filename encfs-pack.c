@@ -0,0 +1,1712 @@
+/* encfs-pack.c
+ * Small-file packing for pa5-encfs
+ *
+ * See encfs-pack.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-pack.h"
+#include "encfs-io.h"
+#include "encfs-compress.h"
+#include "encfs-sched.h"
+
+#define PACK_PUT 1
+#define PACK_DEL 2
+#define PACK_OUT 3
+#define PACK_COMMIT 4
+
+#define PACK_FIXED 60			// record plaintext before the name
+#define PACK_PLAIN_MAX (PACK_FIXED + NAME_MAX + ENCR_PACK_LIMIT)
+#define PACK_REC_MAX (PACK_PLAIN_MAX + 1 + ENCR_CHUNK_OVERHEAD)
+#define PACK_MARK_MAX (PACK_FIXED + NAME_MAX)	// del, out and commit
+#define PACK_OUT_FILE ENCR_PACK_FILE "-out"	// a file being moved out
+#define PACK_NEW_FILE ENCR_PACK_FILE ".new"	// a pack being rewritten
+#define PACK_BUCKETS 1024
+#define PACK_MIN_GARBAGE 16384		// dead bytes worth a rewrite
+
+// A live packed file
+struct pack_ent {
+	struct pack_ent *next;
+	off_t off;			// its put record
+	uint32_t len;			// and that record's length, with len
+	off_t out;			// its last out record, 0 if none
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	struct timespec times[3];	// atime, mtime, ctime
+	char name[];
+};
+
+// A directory and its pack
+struct pack_dir {
+	struct pack_dir *next;		// hash chain
+	struct pack_dir *newer;		// unused directories, oldest first
+	struct pack_dir *older;
+	dev_t dev;
+	ino_t ino;
+	int refs;			// under encr_packs.lock, as is gone
+	int gone;			// removed; freed on the last put
+	int dirfd;
+	int garbage;			// worth rewriting, read without lock
+
+	pthread_mutex_t lock;		// guards everything below
+	int loaded;
+	int fd;				// the pack, -1 if there is none
+	struct encr_keys keys;
+	off_t tail;			// where the next record goes
+	off_t commit;			// end of the last commit record
+	uint64_t live;			// bytes of the records of live files
+	uint64_t dead;			// bytes of all the others
+	struct pack_ent **ents;
+	size_t nbuckets;
+	size_t count;
+};
+
+// A parsed record
+struct pack_rec {
+	int type;
+	const char *name;		// not terminated
+	size_t namelen;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	struct timespec times[3];
+	const unsigned char *data;
+};
+
+// A file the packer has read and is about to pack
+struct pack_cand {
+	char name[NAME_MAX + 1];
+	struct stat st;			// its backing file
+	char *data;
+	uint64_t size;
+	off_t off;			// its put record
+	uint32_t len;			// 0 if it has none
+};
+
+struct encr_packs {
+	char *rootdir;
+	const struct encr_keys *mk;
+	struct encr_store *store;
+	struct encr_log *log;
+	struct encr_roots *roots;
+	struct encr_itable *itable;
+	struct encr_acache *acache;
+	struct encr_xcache *xcache;
+	unsigned chunk_shift;
+	unsigned flags;
+	int direct;
+	unsigned max;
+	pthread_rwlock_t gates[ENCR_PACK_GATES];
+
+	pthread_mutex_t lock;		// guards the table and the unused list
+	struct pack_dir *dirs[PACK_BUCKETS];
+	struct pack_dir *oldest;
+	struct pack_dir *newest;
+	unsigned unused;
+
+	// packer thread
+	pthread_t tid;
+	int running;
+	pthread_mutex_t tlock;
+	pthread_cond_t cond;		// signalled on stop
+	int stop;
+	struct encr_sched *sched;	// lets batches in, NULL for none
+	time_t now;			// when the current pass started
+	unsigned char *rec;
+	unsigned char *plain;
+	unsigned char *scratch;
+	struct pack_cand *cands;
+};
+
+// nftw() has no user pointer; there is only ever one packer
+static struct encr_packs *pack_cur;
+
+// Each thread enters through a gate of its own choosing
+static __thread int pack_gate = -1;
+static unsigned pack_gate_next;
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((uint64_t) get_u32(p + 4) << 32);
+}
+
+static unsigned long pack_hash(const char *s, size_t len)
+{
+	unsigned long h = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) s[i]) * 16777619UL;
+	return h;
+}
+
+int encr_pack_hidden(const char *name)
+{
+	return strncmp(name, ENCR_PACK_FILE, strlen(ENCR_PACK_FILE)) == 0;
+}
+
+/* Gates */
+
+int encr_pack_enter(struct encr_packs *p)
+{
+	if (p == NULL)
+		return -1;
+	if (pack_gate < 0)
+		pack_gate = __atomic_fetch_add(&pack_gate_next, 1,
+					       __ATOMIC_RELAXED) %
+			ENCR_PACK_GATES;
+	pthread_rwlock_rdlock(&p->gates[pack_gate]);
+	return pack_gate;
+}
+
+void encr_pack_leave(struct encr_packs *p, int gate)
+{
+	if (p != NULL)
+		pthread_rwlock_unlock(&p->gates[gate]);
+}
+
+// Wait for every call inside a gate to finish and keep new ones out
+static void pack_gates_close(struct encr_packs *p)
+{
+	int i;
+
+	for (i = 0; i < ENCR_PACK_GATES; i++)
+		pthread_rwlock_wrlock(&p->gates[i]);
+}
+
+static void pack_gates_open(struct encr_packs *p)
+{
+	int i;
+
+	for (i = ENCR_PACK_GATES - 1; i >= 0; i--)
+		pthread_rwlock_unlock(&p->gates[i]);
+}
+
+/* Records */
+
+static size_t pack_encode(unsigned char *plain, int type, const char *name,
+			  size_t namelen, const struct stat *st,
+			  const void *data, uint64_t size)
+{
+	const struct timespec *t[3];
+	int i;
+
+	memset(plain, 0, PACK_FIXED);
+	plain[0] = type;
+	put_u16(plain + 2, namelen);
+	if (st != NULL) {
+		put_u32(plain + 4, st->st_mode);
+		put_u32(plain + 8, st->st_uid);
+		put_u32(plain + 12, st->st_gid);
+		put_u64(plain + 16, size);
+		t[0] = &st->st_atim;
+		t[1] = &st->st_mtim;
+		t[2] = &st->st_ctim;
+		for (i = 0; i < 3; i++) {
+			put_u64(plain + 24 + 12 * i, t[i]->tv_sec);
+			put_u32(plain + 32 + 12 * i, t[i]->tv_nsec);
+		}
+	}
+	if (namelen > 0)
+		memcpy(plain + PACK_FIXED, name, namelen);
+	if (size > 0)
+		memcpy(plain + PACK_FIXED + namelen, data, size);
+	return PACK_FIXED + namelen + size;
+}
+
+static int pack_parse(const unsigned char *plain, size_t len,
+		      struct pack_rec *r)
+{
+	int i;
+
+	if (len < PACK_FIXED)
+		return -EBADMSG;
+	r->type = plain[0];
+	r->namelen = get_u16(plain + 2);
+	r->mode = get_u32(plain + 4);
+	r->uid = get_u32(plain + 8);
+	r->gid = get_u32(plain + 12);
+	r->size = get_u64(plain + 16);
+	for (i = 0; i < 3; i++) {
+		r->times[i].tv_sec = (int64_t) get_u64(plain + 24 + 12 * i);
+		r->times[i].tv_nsec = get_u32(plain + 32 + 12 * i);
+	}
+	r->name = (const char *) plain + PACK_FIXED;
+	r->data = plain + PACK_FIXED + r->namelen;
+
+	switch (r->type) {
+	case PACK_PUT:
+		if (r->namelen == 0 || r->namelen > NAME_MAX ||
+		    len != PACK_FIXED + r->namelen + r->size)
+			return -EBADMSG;
+		return 0;
+	case PACK_DEL:
+	case PACK_OUT:
+		if (r->namelen == 0 || r->namelen > NAME_MAX ||
+		    len != PACK_FIXED + r->namelen)
+			return -EBADMSG;
+		return 0;
+	case PACK_COMMIT:
+		return len == PACK_FIXED && r->namelen == 0 ? 0 : -EBADMSG;
+	}
+	return -EBADMSG;
+}
+
+// Seal a record for offset off and write it there
+static ssize_t pack_seal(int fd, const struct encr_keys *k, off_t off,
+			 const unsigned char *plain, size_t len,
+			 unsigned char *rec, unsigned char *scratch)
+{
+	ssize_t n;
+
+	n = encr_chunk_pack(k, off, plain, len, 1, rec + 4, scratch);
+	if (n < 0)
+		return n;
+	put_u32(rec, n);
+	n += 4;
+	if (pwrite(fd, rec, n, off) != n)
+		return errno ? -errno : -EIO;
+	return n;
+}
+
+static ssize_t pack_append(struct pack_dir *d, const unsigned char *plain,
+			   size_t len, unsigned char *rec,
+			   unsigned char *scratch)
+{
+	ssize_t n;
+
+	n = pack_seal(d->fd, &d->keys, d->tail, plain, len, rec, scratch);
+	if (n > 0)
+		d->tail += n;
+	return n;
+}
+
+// Read and open the record at off; *reclen is set to its length with len
+static int pack_read_rec(struct pack_dir *d, off_t off, unsigned char *rec,
+			 unsigned char *plain, uint32_t *reclen)
+{
+	unsigned char lenbuf[4];
+	uint32_t len;
+	ssize_t n;
+
+	n = pread(d->fd, lenbuf, sizeof(lenbuf), off);
+	if (n != sizeof(lenbuf))
+		return n == -1 ? -EIO : -EBADMSG;
+	len = get_u32(lenbuf);
+	if (len <= ENCR_CHUNK_OVERHEAD || len > PACK_REC_MAX)
+		return -EBADMSG;
+	n = pread(d->fd, rec, len, off + 4);
+	if (n != (ssize_t) len)
+		return n == -1 ? -EIO : -EBADMSG;
+	*reclen = len + 4;
+	return encr_chunk_unpack(&d->keys, off, rec, len, plain,
+				 PACK_PLAIN_MAX);
+}
+
+/* Index */
+
+static struct pack_ent *pack_find(struct pack_dir *d, const char *name,
+				  size_t len)
+{
+	struct pack_ent *e;
+
+	if (d->nbuckets == 0)
+		return NULL;
+	for (e = d->ents[pack_hash(name, len) % d->nbuckets]; e != NULL;
+	     e = e->next)
+		if (strncmp(e->name, name, len) == 0 && e->name[len] == '\0')
+			return e;
+	return NULL;
+}
+
+static void pack_unlink_ent(struct pack_dir *d, struct pack_ent *e)
+{
+	struct pack_ent **pp;
+
+	pp = &d->ents[pack_hash(e->name, strlen(e->name)) % d->nbuckets];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	d->count--;
+	d->live -= e->len;
+	d->dead += e->len;
+	free(e);
+}
+
+static int pack_insert(struct pack_dir *d, const struct pack_rec *r,
+		       off_t off, uint32_t len)
+{
+	struct pack_ent **ents;
+	struct pack_ent *e, *next;
+	size_t n, i;
+
+	e = pack_find(d, r->name, r->namelen);
+	if (e != NULL)
+		pack_unlink_ent(d, e);
+
+	if (d->count >= d->nbuckets) {
+		n = d->nbuckets ? 2 * d->nbuckets : 16;
+		ents = calloc(n, sizeof(struct pack_ent *));
+		if (ents == NULL)
+			return -ENOMEM;
+		for (i = 0; i < d->nbuckets; i++) {
+			for (e = d->ents[i]; e != NULL; e = next) {
+				next = e->next;
+				e->next = ents[pack_hash(e->name,
+						strlen(e->name)) % n];
+				ents[pack_hash(e->name, strlen(e->name)) % n] = e;
+			}
+		}
+		free(d->ents);
+		d->ents = ents;
+		d->nbuckets = n;
+	}
+
+	e = malloc(sizeof(struct pack_ent) + r->namelen + 1);
+	if (e == NULL)
+		return -ENOMEM;
+	memcpy(e->name, r->name, r->namelen);
+	e->name[r->namelen] = '\0';
+	e->off = off;
+	e->len = len;
+	e->out = 0;
+	e->mode = r->mode;
+	e->uid = r->uid;
+	e->gid = r->gid;
+	e->size = r->size;
+	memcpy(e->times, r->times, sizeof(e->times));
+	i = pack_hash(e->name, r->namelen) % d->nbuckets;
+	e->next = d->ents[i];
+	d->ents[i] = e;
+	d->count++;
+	d->live += len;
+	return 0;
+}
+
+// Bring the index up to date with the record at off
+static int pack_apply(struct pack_dir *d, const struct pack_rec *r, off_t off,
+		      uint32_t len)
+{
+	struct pack_ent *e = NULL;
+
+	if (r->type == PACK_PUT)
+		return pack_insert(d, r, off, len);
+	if (r->type != PACK_COMMIT)
+		e = pack_find(d, r->name, r->namelen);
+	d->dead += len;
+	if (r->type == PACK_DEL && e != NULL)
+		pack_unlink_ent(d, e);
+	else if (r->type == PACK_OUT && e != NULL)
+		e->out = off;
+	else if (r->type == PACK_COMMIT)
+		d->commit = off + len;
+	return 0;
+}
+
+static void pack_account(struct pack_dir *d)
+{
+	int garbage = d->fd != -1 &&
+		(d->count == 0 ||
+		 (d->dead > d->live && d->dead >= PACK_MIN_GARBAGE));
+
+	__atomic_store_n(&d->garbage, garbage, __ATOMIC_RELAXED);
+}
+
+// Append a del, out or commit record and apply it
+static int pack_mark(struct pack_dir *d, int type, const char *name)
+{
+	unsigned char plain[PACK_MARK_MAX];
+	unsigned char scratch[PACK_MARK_MAX + 1];
+	unsigned char rec[4 + PACK_MARK_MAX + 1 + ENCR_CHUNK_OVERHEAD];
+	struct pack_rec r;
+	size_t len;
+	off_t off = d->tail;
+	ssize_t n;
+
+	len = pack_encode(plain, type, name, name ? strlen(name) : 0, NULL,
+			  NULL, 0);
+	n = pack_append(d, plain, len, rec, scratch);
+	if (n < 0)
+		return n;
+	pack_parse(plain, len, &r);
+	pack_apply(d, &r, off, n);
+	pack_account(d);
+	return 0;
+}
+
+static void pack_stat(const struct pack_dir *d, const struct pack_ent *e,
+		      struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = d->dev;
+	st->st_ino = 0;
+	st->st_mode = e->mode;
+	st->st_nlink = 1;
+	st->st_uid = e->uid;
+	st->st_gid = e->gid;
+	st->st_size = e->size;
+	st->st_blksize = 4096;
+	st->st_blocks = (e->size + 511) / 512;
+	st->st_atim = e->times[0];
+	st->st_mtim = e->times[1];
+	st->st_ctim = e->times[2];
+}
+
+/* Loading */
+
+static void pack_unload(struct pack_dir *d)
+{
+	struct pack_ent *e, *next;
+	size_t i;
+
+	for (i = 0; i < d->nbuckets; i++) {
+		for (e = d->ents[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(d->ents);
+	d->ents = NULL;
+	d->nbuckets = 0;
+	d->count = 0;
+	if (d->fd != -1)
+		close(d->fd);
+	d->fd = -1;
+	memset(&d->keys, 0, sizeof(d->keys));
+	d->live = 0;
+	d->dead = 0;
+	d->loaded = 0;
+}
+
+// A new pack, or a rewritten one, with fresh keys
+static int pack_new_file(struct encr_packs *p, struct pack_dir *d,
+			 const char *name, struct encr_keys *keys)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	int fd;
+	int res;
+
+	res = encr_header_init(&hdr, ENCR_DEFAULT_CHUNK_SHIFT);
+	memset(buf, 0, sizeof(buf));
+	if (res == 0)
+		res = encr_header_encode(&hdr, p->mk, buf);
+	if (res == 0)
+		*keys = hdr.keys;
+	memset(&hdr, 0, sizeof(hdr));
+	if (res != 0)
+		return res;
+
+	unlinkat(d->dirfd, name, 0);
+	fd = openat(d->dirfd, name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+		    0600);
+	if (fd == -1)
+		return -errno;
+	// Marked like any other encrypted file, so encfs-rekey finds it
+	if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    fsetxattr(fd, ENCR_XATTR_ENCRYPTED, "true", 4, 0) == -1) {
+		res = errno ? -errno : -EIO;
+		close(fd);
+		unlinkat(d->dirfd, name, 0);
+		return res;
+	}
+	return fd;
+}
+
+static int pack_create(struct encr_packs *p, struct pack_dir *d)
+{
+	int fd;
+
+	fd = pack_new_file(p, d, ENCR_PACK_FILE, &d->keys);
+	if (fd < 0)
+		return fd;
+	// The pack has to outlive the backing files removed for it
+	if (fsync(fd) == -1 || fsync(d->dirfd) == -1) {
+		fd = -errno;
+		unlinkat(d->dirfd, ENCR_PACK_FILE, 0);
+		return fd;
+	}
+	d->fd = fd;
+	d->tail = ENCR_HEADER_SIZE;
+	d->commit = ENCR_HEADER_SIZE;
+	d->live = 0;
+	d->dead = 0;
+	return 0;
+}
+
+/* Drop the puts and outs after the last commit whose backing file
+ * exists after all, and commit */
+static int pack_settle(struct pack_dir *d)
+{
+	struct pack_ent *e, *next;
+	struct stat st;
+	size_t i;
+	int unsure = 0;
+	int res;
+
+	for (i = 0; i < d->nbuckets; i++) {
+		for (e = d->ents[i]; e != NULL; e = next) {
+			next = e->next;
+			if (e->off < d->commit && e->out < d->commit)
+				continue;
+			unsure = 1;
+			if (fstatat(d->dirfd, e->name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+			res = pack_mark(d, PACK_DEL, e->name);
+			if (res != 0)
+				return res;
+		}
+	}
+	if (!unsure)
+		return 0;
+	res = pack_mark(d, PACK_COMMIT, NULL);
+	if (res == 0 && fdatasync(d->fd) == -1)
+		res = -errno;
+	return res;
+}
+
+static int pack_load(struct encr_packs *p, struct pack_dir *d)
+{
+	unsigned char hbuf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	struct pack_rec r;
+	struct stat st;
+	unsigned char *rec, *plain;
+	uint32_t reclen;
+	off_t off;
+	int len;
+	int res;
+
+	if (d->loaded)
+		return 0;
+	d->fd = openat(d->dirfd, ENCR_PACK_FILE, O_RDWR | O_NOFOLLOW);
+	if (d->fd == -1) {
+		if (errno != ENOENT)
+			return -errno;
+		d->loaded = 1;
+		pack_account(d);
+		return 0;
+	}
+	if (fstat(d->fd, &st) == -1 ||
+	    pread(d->fd, hbuf, sizeof(hbuf), 0) != sizeof(hbuf) ||
+	    encr_header_decode(&hdr, p->mk, hbuf) != 0) {
+		pack_unload(d);
+		return -EIO;
+	}
+	d->keys = hdr.keys;
+	memset(&hdr, 0, sizeof(hdr));
+
+	rec = malloc(PACK_REC_MAX);
+	plain = malloc(PACK_PLAIN_MAX);
+	if (rec == NULL || plain == NULL) {
+		free(rec);
+		free(plain);
+		pack_unload(d);
+		return -ENOMEM;
+	}
+	res = 0;
+	d->commit = ENCR_HEADER_SIZE;
+	for (off = ENCR_HEADER_SIZE; off < st.st_size; off += reclen) {
+		len = pack_read_rec(d, off, rec, plain, &reclen);
+		if (len == -EIO || len == -ENOMEM) {
+			res = len;
+			break;
+		}
+		if (len < 0 || pack_parse(plain, len, &r) != 0)
+			break;
+		res = pack_apply(d, &r, off, reclen);
+		if (res != 0)
+			break;
+	}
+	free(rec);
+	free(plain);
+
+	if (res == 0 && off < st.st_size) {
+		fprintf(stderr, "pa5-encfs: pack of directory inode %lu: "
+			"dropping %lld bytes from %lld that do not check out\n",
+			(unsigned long) d->ino,
+			(long long) (st.st_size - off), (long long) off);
+		if (ftruncate(d->fd, off) == -1)
+			res = -errno;
+	}
+	d->tail = off;
+	// Whatever was being moved out or rewritten did not make it
+	unlinkat(d->dirfd, PACK_OUT_FILE, 0);
+	unlinkat(d->dirfd, PACK_NEW_FILE, 0);
+	if (res == 0)
+		res = pack_settle(d);
+	if (res != 0) {
+		pack_unload(d);
+		return res;
+	}
+	d->loaded = 1;
+	pack_account(d);
+	return 0;
+}
+
+/* Directory table */
+
+static void pack_dir_free(struct pack_dir *d)
+{
+	pack_unload(d);
+	close(d->dirfd);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+static unsigned pack_dir_bucket(dev_t dev, ino_t ino)
+{
+	return ((unsigned long) dev * 31 + (unsigned long) ino) % PACK_BUCKETS;
+}
+
+static struct pack_dir *pack_dir_find(struct encr_packs *p, dev_t dev,
+				      ino_t ino)
+{
+	struct pack_dir *d;
+
+	for (d = p->dirs[pack_dir_bucket(dev, ino)]; d != NULL; d = d->next)
+		if (d->dev == dev && d->ino == ino)
+			return d;
+	return NULL;
+}
+
+static void pack_dir_unhash(struct encr_packs *p, struct pack_dir *d)
+{
+	struct pack_dir **pp = &p->dirs[pack_dir_bucket(d->dev, d->ino)];
+
+	while (*pp != d)
+		pp = &(*pp)->next;
+	*pp = d->next;
+}
+
+static void pack_lru_remove(struct encr_packs *p, struct pack_dir *d)
+{
+	if (d->older)
+		d->older->newer = d->newer;
+	else
+		p->oldest = d->newer;
+	if (d->newer)
+		d->newer->older = d->older;
+	else
+		p->newest = d->older;
+	d->older = d->newer = NULL;
+	p->unused--;
+}
+
+// Take a reference, under p->lock
+static void pack_dir_ref(struct encr_packs *p, struct pack_dir *d)
+{
+	if (d->refs++ == 0)
+		pack_lru_remove(p, d);
+}
+
+// The directory at dpath (a backing path), referenced
+static int pack_dir_get(struct encr_packs *p, const char *dpath,
+			struct pack_dir **dp)
+{
+	struct pack_dir *d, *old;
+	struct stat st;
+	int fd;
+
+	if (lstat(dpath, &st) == -1)
+		return errno == ENOTDIR ? -ENOENT : -errno;
+	if (!S_ISDIR(st.st_mode))
+		return -ENOENT;
+	pthread_mutex_lock(&p->lock);
+	d = pack_dir_find(p, st.st_dev, st.st_ino);
+	if (d != NULL) {
+		pack_dir_ref(p, d);
+		pthread_mutex_unlock(&p->lock);
+		*dp = d;
+		return 0;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	fd = open(dpath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return errno == ENOTDIR ? -ENOENT : -errno;
+	d = calloc(1, sizeof(struct pack_dir));
+	if (d == NULL || fstat(fd, &st) == -1) {
+		free(d);
+		close(fd);
+		return -ENOMEM;
+	}
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->dirfd = fd;
+	d->fd = -1;
+	d->refs = 1;
+	pthread_mutex_init(&d->lock, NULL);
+
+	pthread_mutex_lock(&p->lock);
+	old = pack_dir_find(p, d->dev, d->ino);
+	if (old != NULL) {
+		pack_dir_ref(p, old);
+	} else {
+		d->next = p->dirs[pack_dir_bucket(d->dev, d->ino)];
+		p->dirs[pack_dir_bucket(d->dev, d->ino)] = d;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (old != NULL) {
+		pack_dir_free(d);
+		d = old;
+	}
+	*dp = d;
+	return 0;
+}
+
+static void pack_dir_put(struct encr_packs *p, struct pack_dir *d)
+{
+	struct pack_dir *evict = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (--d->refs > 0) {
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+	if (d->gone) {
+		pthread_mutex_unlock(&p->lock);
+		pack_dir_free(d);
+		return;
+	}
+	d->older = p->newest;
+	d->newer = NULL;
+	if (p->newest)
+		p->newest->newer = d;
+	else
+		p->oldest = d;
+	p->newest = d;
+	p->unused++;
+	if (p->unused > ENCR_PACK_CACHE) {
+		evict = p->oldest;
+		pack_lru_remove(p, evict);
+		pack_dir_unhash(p, evict);
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (evict != NULL)
+		pack_dir_free(evict);
+}
+
+// Split a path into its directory's backing path and its last component
+static int pack_split(struct encr_packs *p, const char *path,
+		      char dpath[PATH_MAX], const char **name)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (slash == NULL || slash[1] == '\0' || strlen(slash + 1) > NAME_MAX ||
+	    encr_pack_hidden(slash + 1))
+		return -ENOENT;
+	if (snprintf(dpath, PATH_MAX, "%s%.*s", p->rootdir,
+		     (int) (slash - path), path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	*name = slash + 1;
+	return 0;
+}
+
+/* Get and lock the loaded directory of path, and find its entry; the
+ * caller unlocks and puts *dp */
+static int pack_lookup(struct encr_packs *p, const char *path,
+		       struct pack_dir **dp, struct pack_ent **ep)
+{
+	char dpath[PATH_MAX];
+	const char *name;
+	struct pack_dir *d;
+	int res;
+
+	res = pack_split(p, path, dpath, &name);
+	if (res == 0)
+		res = pack_dir_get(p, dpath, &d);
+	if (res != 0)
+		return res;
+	pthread_mutex_lock(&d->lock);
+	res = pack_load(p, d);
+	*ep = res == 0 ? pack_find(d, name, strlen(name)) : NULL;
+	if (res == 0 && *ep == NULL)
+		res = -ENOENT;
+	if (res != 0) {
+		pthread_mutex_unlock(&d->lock);
+		pack_dir_put(p, d);
+		return res;
+	}
+	*dp = d;
+	return 0;
+}
+
+static void pack_lookup_done(struct encr_packs *p, struct pack_dir *d)
+{
+	pthread_mutex_unlock(&d->lock);
+	pack_dir_put(p, d);
+}
+
+/* Calls from the mount */
+
+int encr_pack_stat(struct encr_packs *p, const char *path, struct stat *st)
+{
+	struct pack_dir *d;
+	struct pack_ent *e;
+	int res;
+
+	res = pack_lookup(p, path, &d, &e);
+	if (res != 0)
+		return res;
+	pack_stat(d, e, st);
+	pack_lookup_done(p, d);
+	return 0;
+}
+
+int encr_pack_list(struct encr_packs *p, const char *path,
+		   int (*fn)(void *arg, const char *name,
+			     const struct stat *st), void *arg)
+{
+	char dpath[PATH_MAX];
+	struct pack_dir *d;
+	struct pack_ent *e;
+	struct stat st;
+	size_t i;
+	int res;
+
+	if (snprintf(dpath, sizeof(dpath), "%s%s", p->rootdir, path) >=
+	    (int) sizeof(dpath))
+		return -ENAMETOOLONG;
+	res = pack_dir_get(p, dpath, &d);
+	if (res != 0)
+		return res;
+	pthread_mutex_lock(&d->lock);
+	res = pack_load(p, d);
+	for (i = 0; res == 0 && i < d->nbuckets; i++)
+		for (e = d->ents[i]; res == 0 && e != NULL; e = e->next) {
+			pack_stat(d, e, &st);
+			res = fn(arg, e->name, &st);
+		}
+	pack_lookup_done(p, d);
+	return res;
+}
+
+// Read the put record of e into plain and parse it
+static int pack_read_ent(struct pack_dir *d, const struct pack_ent *e,
+			 unsigned char *rec, unsigned char *plain,
+			 struct pack_rec *r)
+{
+	uint32_t reclen;
+	int len;
+
+	len = pack_read_rec(d, e->off, rec, plain, &reclen);
+	if (len < 0)
+		return len == -EBADMSG ? -EIO : len;
+	if (pack_parse(plain, len, r) != 0 || r->type != PACK_PUT ||
+	    r->size != e->size)
+		return -EIO;
+	return 0;
+}
+
+int encr_pack_read(struct encr_packs *p, const char *path, char **data,
+		   struct stat *st)
+{
+	struct pack_dir *d;
+	struct pack_ent *e;
+	struct pack_rec r;
+	unsigned char *rec, *plain;
+	int res;
+
+	rec = malloc(PACK_REC_MAX);
+	plain = malloc(PACK_PLAIN_MAX);
+	res = rec && plain ? pack_lookup(p, path, &d, &e) : -ENOMEM;
+	if (res == 0) {
+		res = pack_read_ent(d, e, rec, plain, &r);
+		*data = res == 0 ? malloc(r.size + 1) : NULL;
+		if (res == 0 && *data == NULL)
+			res = -ENOMEM;
+		if (res == 0) {
+			memcpy(*data, r.data, r.size);
+			pack_stat(d, e, st);
+		}
+		pack_lookup_done(p, d);
+	}
+	free(rec);
+	free(plain);
+	return res;
+}
+
+int encr_pack_drop(struct encr_packs *p, const char *path)
+{
+	struct pack_dir *d;
+	struct pack_ent *e;
+	int res;
+
+	res = pack_lookup(p, path, &d, &e);
+	if (res != 0)
+		return res;
+	res = pack_mark(d, PACK_DEL, e->name);
+	pack_lookup_done(p, d);
+	return res;
+}
+
+/* Write r out to a new backing file in d, under its name; whatever goes
+ * wrong, the file is still packed */
+static int pack_write_out(struct encr_packs *p, struct pack_dir *d,
+			  const char *name, const struct pack_rec *r)
+{
+	struct encr_inode *in;
+	struct timespec ts[2];
+	struct stat st;
+	ssize_t n;
+	int fd;
+	int res;
+
+	unlinkat(d->dirfd, PACK_OUT_FILE, 0);
+	fd = openat(d->dirfd, PACK_OUT_FILE,
+		    O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1 ||
+	    fsetxattr(fd, ENCR_XATTR_ENCRYPTED, "true", 4, 0) == -1) {
+		res = -errno;
+		close(fd);
+		unlinkat(d->dirfd, PACK_OUT_FILE, 0);
+		return res;
+	}
+	encr_xcache_set(p->xcache, &st, ENCR_XATTR_ENCRYPTED, "true", 4);
+
+	in = encr_inode_get(p->itable, st.st_dev, st.st_ino);
+	res = in ? encr_io_open(in, fd, p->mk, p->store, p->log, p->roots, 1,
+				p->chunk_shift, p->flags, p->direct) : -ENOMEM;
+	if (res == 0 && r->size > 0) {
+		n = encr_io_write(in, fd, (const char *) r->data, r->size, 0);
+		res = n < 0 ? n : (uint64_t) n == r->size ? 0 : -EIO;
+	}
+	if (res == 0)
+		res = encr_sync_file(in, fd, 0);
+	if (in)
+		encr_inode_put(p->itable, in);
+
+	// Owner first: chown clears the set-id bits
+	if (res == 0 && fchown(fd, r->uid, r->gid) == -1 && errno != EPERM)
+		res = -errno;
+	if (res == 0 && fchmod(fd, r->mode & 07777) == -1)
+		res = -errno;
+	ts[0] = r->times[0];
+	ts[1] = r->times[1];
+	if (res == 0 && futimens(fd, ts) == -1)
+		res = -errno;
+	if (res == 0 && fsync(fd) == -1)
+		res = -errno;
+	if (res == 0 &&
+	    renameat(d->dirfd, PACK_OUT_FILE, d->dirfd, name) == -1)
+		res = -errno;
+	if (res != 0) {
+		unlinkat(d->dirfd, PACK_OUT_FILE, 0);
+		encr_io_drop_refs(p->store, p->log, p->roots, p->mk, fd);
+	}
+	close(fd);
+	return res;
+}
+
+int encr_pack_out(struct encr_packs *p, const char *path)
+{
+	struct pack_dir *d;
+	struct pack_ent *e;
+	struct pack_rec r;
+	unsigned char *rec, *plain;
+	char name[NAME_MAX + 1];
+	int res;
+
+	rec = malloc(PACK_REC_MAX);
+	plain = malloc(PACK_PLAIN_MAX);
+	res = rec && plain ? pack_lookup(p, path, &d, &e) : -ENOMEM;
+	if (res != 0) {
+		free(rec);
+		free(plain);
+		return res;
+	}
+	strcpy(name, e->name);
+
+	// Until the out record is down, a crash must not find the file twice
+	res = pack_read_ent(d, e, rec, plain, &r);
+	if (res == 0)
+		res = pack_mark(d, PACK_OUT, name);
+	if (res == 0 && fdatasync(d->fd) == -1)
+		res = -errno;
+	if (res == 0)
+		res = pack_write_out(p, d, name, &r);
+	if (res == 0 && fsync(d->dirfd) == -1)
+		res = -errno;
+	if (res == 0)
+		res = pack_mark(d, PACK_DEL, name);
+	pack_lookup_done(p, d);
+	free(rec);
+	free(plain);
+	encr_acache_inval(p->acache, path);
+	return res;
+}
+
+int encr_pack_rmdir(struct encr_packs *p, const char *path)
+{
+	char dpath[PATH_MAX];
+	struct pack_dir *d;
+	int res;
+
+	if (snprintf(dpath, sizeof(dpath), "%s%s", p->rootdir, path) >=
+	    (int) sizeof(dpath))
+		return -ENAMETOOLONG;
+	res = pack_dir_get(p, dpath, &d);
+	if (res != 0)
+		return res;
+	pthread_mutex_lock(&d->lock);
+	res = pack_load(p, d);
+	if (res == 0 && d->count > 0)
+		res = -ENOTEMPTY;
+	if (res == 0 && d->fd != -1) {
+		pack_unload(d);
+		d->loaded = 1;
+		if (unlinkat(d->dirfd, ENCR_PACK_FILE, 0) == -1 &&
+		    errno != ENOENT)
+			res = -errno;
+		pack_account(d);
+	}
+	pack_lookup_done(p, d);
+	return res;
+}
+
+void encr_pack_forget(struct encr_packs *p, const struct stat *st)
+{
+	struct pack_dir *d;
+
+	pthread_mutex_lock(&p->lock);
+	d = pack_dir_find(p, st->st_dev, st->st_ino);
+	if (d != NULL) {
+		pack_dir_unhash(p, d);
+		if (d->refs > 0) {
+			d->gone = 1;
+			d = NULL;
+		} else {
+			pack_lru_remove(p, d);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (d != NULL)
+		pack_dir_free(d);
+}
+
+/* Rewriting */
+
+// Rewrite d's pack with only its live files, or remove it if there are none
+static int pack_compact(struct encr_packs *p, struct pack_dir *d)
+{
+	struct encr_keys keys;
+	struct pack_ent *e;
+	struct pack_rec r;
+	uint32_t reclen;
+	off_t *offs;
+	off_t off;
+	ssize_t n = 0;
+	size_t i, j;
+	int len;
+	int fd;
+	int res = 0;
+
+	if (d->count == 0) {
+		pack_unload(d);
+		d->loaded = 1;
+		if (unlinkat(d->dirfd, ENCR_PACK_FILE, 0) == -1 &&
+		    errno != ENOENT)
+			res = -errno;
+		pack_account(d);
+		return res;
+	}
+
+	offs = malloc(d->count * sizeof(off_t));
+	if (offs == NULL)
+		return -ENOMEM;
+	fd = pack_new_file(p, d, PACK_NEW_FILE, &keys);
+	if (fd < 0) {
+		free(offs);
+		return fd;
+	}
+	off = ENCR_HEADER_SIZE;
+	for (i = 0, j = 0; res == 0 && i < d->nbuckets; i++) {
+		for (e = d->ents[i]; res == 0 && e != NULL; e = e->next) {
+			len = pack_read_rec(d, e->off, p->rec, p->plain,
+					    &reclen);
+			if (len < 0 || pack_parse(p->plain, len, &r) != 0 ||
+			    r.type != PACK_PUT) {
+				res = -EIO;
+				break;
+			}
+			n = pack_seal(fd, &keys, off, p->plain, len, p->rec,
+				      p->scratch);
+			if (n < 0) {
+				res = n;
+				break;
+			}
+			offs[j++] = off;
+			off += n;
+		}
+	}
+	if (res == 0) {
+		len = pack_encode(p->plain, PACK_COMMIT, NULL, 0, NULL, NULL, 0);
+		n = pack_seal(fd, &keys, off, p->plain, len, p->rec,
+			      p->scratch);
+		res = n < 0 ? n : 0;
+	}
+	if (res == 0 && (fsync(fd) == -1 ||
+			 renameat(d->dirfd, PACK_NEW_FILE, d->dirfd,
+				  ENCR_PACK_FILE) == -1 ||
+			 fsync(d->dirfd) == -1))
+		res = -errno;
+	if (res != 0) {
+		close(fd);
+		unlinkat(d->dirfd, PACK_NEW_FILE, 0);
+		free(offs);
+		return res;
+	}
+
+	close(d->fd);
+	d->fd = fd;
+	d->keys = keys;
+	memset(&keys, 0, sizeof(keys));
+	d->live = 0;
+	for (i = 0, j = 0; i < d->nbuckets; i++) {
+		for (e = d->ents[i]; e != NULL; e = e->next) {
+			e->off = offs[j];
+			e->len = (j + 1 < d->count ? offs[j + 1] : off) -
+				offs[j];
+			e->out = 0;
+			d->live += e->len;
+			j++;
+		}
+	}
+	d->tail = off + n;
+	d->commit = d->tail;
+	d->dead = n;
+	free(offs);
+	pack_account(d);
+	return 0;
+}
+
+/* The packer */
+
+static int pack_stopped(struct encr_packs *p)
+{
+	int stop;
+
+	pthread_mutex_lock(&p->tlock);
+	stop = p->stop;
+	pthread_mutex_unlock(&p->tlock);
+	return stop;
+}
+
+// Sleep for up to secs, returning early (nonzero) if asked to stop
+static int pack_sleep(struct encr_packs *p, time_t secs)
+{
+	struct timespec until;
+	int stop;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += secs;
+	pthread_mutex_lock(&p->tlock);
+	while (!p->stop &&
+	       pthread_cond_timedwait(&p->cond, &p->tlock, &until) != ETIMEDOUT)
+		;
+	stop = p->stop;
+	pthread_mutex_unlock(&p->tlock);
+	return stop;
+}
+
+/* Read name in directory dfd if it is worth packing: an encrypted file
+ * small enough, idle, with one link, no xattrs of its own and no handle */
+static int pack_candidate(struct encr_packs *p, int dfd, const char *name,
+			  const struct stat *st, struct pack_cand *c)
+{
+	unsigned char hbuf[ENCR_HEADER_SIZE];
+	char val[8];
+	struct encr_inode *in;
+	struct stat fst;
+	off_t size;
+	ssize_t n;
+	size_t got = 0;
+	int fd;
+	int res = -EAGAIN;
+
+	if (!S_ISREG(st->st_mode) || st->st_nlink != 1 ||
+	    st->st_size < ENCR_HEADER_SIZE ||
+	    st->st_mtime > p->now - ENCR_PACK_IDLE ||
+	    st->st_ctime > p->now - ENCR_PACK_IDLE)
+		return -EAGAIN;
+	fd = openat(dfd, name, O_RDWR | O_NOFOLLOW);
+	if (fd == -1)
+		return -EAGAIN;
+	if (fstat(fd, &fst) == -1 || fst.st_ino != st->st_ino ||
+	    fgetxattr(fd, ENCR_XATTR_ENCRYPTED, val, sizeof(val)) != 4 ||
+	    memcmp(val, "true", 4) != 0 ||
+	    flistxattr(fd, NULL, 0) != sizeof(ENCR_XATTR_ENCRYPTED) ||
+	    pread(fd, hbuf, sizeof(hbuf), 0) != sizeof(hbuf) ||
+	    encr_header_peek_size(hbuf, fst.st_size, &size) != 0 ||
+	    size > (off_t) p->max ||
+	    (encr_header_peek_flags(hbuf) & (ENCR_FLAG_DEDUP | ENCR_FLAG_LOG)))
+		goto out;
+	in = encr_inode_lookup(p->itable, fst.st_dev, fst.st_ino);
+	if (in != NULL) {
+		encr_inode_put(p->itable, in);
+		goto out;
+	}
+
+	in = encr_inode_get(p->itable, fst.st_dev, fst.st_ino);
+	if (in == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	res = encr_io_open(in, fd, p->mk, p->store, p->log, p->roots, 1,
+			   p->chunk_shift, p->flags, p->direct);
+	while (res == 0 && got <= p->max) {
+		n = encr_io_read(in, fd, (char *) p->plain + got,
+				 p->max + 1 - got, got);
+		if (n < 0)
+			res = n;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	encr_inode_put(p->itable, in);
+	if (res == 0 && got > p->max)
+		res = -EAGAIN;
+	if (res == 0) {
+		c->data = malloc(got + 1);
+		if (c->data == NULL)
+			res = -ENOMEM;
+	}
+	if (res == 0) {
+		memcpy(c->data, p->plain, got);
+		c->size = got;
+		c->st = fst;
+		c->len = 0;
+		strcpy(c->name, name);
+	}
+out:
+	close(fd);
+	return res;
+}
+
+// The put record of c, without its data
+static void pack_cand_rec(const struct pack_cand *c, struct pack_rec *r)
+{
+	r->type = PACK_PUT;
+	r->name = c->name;
+	r->namelen = strlen(c->name);
+	r->mode = c->st.st_mode;
+	r->uid = c->st.st_uid;
+	r->gid = c->st.st_gid;
+	r->size = c->size;
+	r->times[0] = c->st.st_atim;
+	r->times[1] = c->st.st_mtim;
+	r->times[2] = c->st.st_ctim;
+	r->data = NULL;
+}
+
+// Whether c is still the file that was read, untouched and unopened
+static int pack_unchanged(struct encr_packs *p, struct pack_dir *d,
+			  const struct pack_cand *c)
+{
+	struct encr_inode *in;
+	struct stat st;
+
+	if (fstatat(d->dirfd, c->name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    st.st_dev != c->st.st_dev || st.st_ino != c->st.st_ino ||
+	    st.st_nlink != 1 ||
+	    st.st_ctim.tv_sec != c->st.st_ctim.tv_sec ||
+	    st.st_ctim.tv_nsec != c->st.st_ctim.tv_nsec)
+		return 0;
+	in = encr_inode_lookup(p->itable, st.st_dev, st.st_ino);
+	if (in != NULL) {
+		encr_inode_put(p->itable, in);
+		return 0;
+	}
+	return 1;
+}
+
+/* Pack n candidates read from directory dpath: put and sync them, then
+ * with the gates closed remove the backing files that are unchanged */
+static void pack_batch(struct encr_packs *p, const char *dpath,
+		       const struct stat *dst, struct pack_cand *cands,
+		       size_t n)
+{
+	char rel[PATH_MAX];
+	struct pack_dir *d;
+	struct pack_cand *c;
+	struct pack_rec r;
+	size_t len;
+	ssize_t w;
+	size_t i;
+	int aborted = 0;
+	int res;
+
+	if (pack_dir_get(p, dpath, &d) != 0)
+		return;
+	if (d->dev != dst->st_dev || d->ino != dst->st_ino) {
+		pack_dir_put(p, d);
+		return;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	res = pack_load(p, d);
+	if (res == 0 && d->fd == -1)
+		res = pack_create(p, d);
+	for (i = 0; res == 0 && i < n; i++) {
+		c = &cands[i];
+		len = pack_encode(p->plain, PACK_PUT, c->name, strlen(c->name),
+				  &c->st, c->data, c->size);
+		c->off = d->tail;
+		w = pack_append(d, p->plain, len, p->rec, p->scratch);
+		if (w < 0)
+			res = w;
+		else
+			c->len = w;
+	}
+	if (res == 0 && fdatasync(d->fd) == -1)
+		res = -errno;
+	pthread_mutex_unlock(&d->lock);
+	if (res != 0)
+		fprintf(stderr, "pa5-encfs: cannot pack files in %s: %s\n",
+			dpath, strerror(-res));
+
+	pack_gates_close(p);
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < n; i++) {
+		c = &cands[i];
+		if (c->len == 0)
+			continue;
+		if (res == 0 && pack_unchanged(p, d, c) &&
+		    unlinkat(d->dirfd, c->name, 0) == 0) {
+			pack_cand_rec(c, &r);
+			if (pack_insert(d, &r, c->off, c->len) == 0) {
+				encr_xcache_inval(p->xcache, &c->st);
+				snprintf(rel, sizeof(rel), "%s/%s",
+					 dpath + strlen(p->rootdir), c->name);
+				encr_acache_inval(p->acache, rel);
+				continue;
+			}
+		}
+		// Changed meanwhile: its backing file stays and the put goes
+		d->dead += c->len;
+		aborted = 1;
+		if (pack_mark(d, PACK_DEL, c->name) != 0)
+			res = -EIO;
+	}
+	if (aborted && fdatasync(d->fd) == -1 && res == 0)
+		res = -errno;
+	pthread_mutex_unlock(&d->lock);
+	pack_gates_open(p);
+
+	// Once the removals are down the puts are settled
+	if (fsync(d->dirfd) == 0) {
+		pthread_mutex_lock(&d->lock);
+		if (d->fd != -1)
+			pack_mark(d, PACK_COMMIT, NULL);
+		pthread_mutex_unlock(&d->lock);
+	}
+	pthread_mutex_lock(&d->lock);
+	pack_account(d);
+	pthread_mutex_unlock(&d->lock);
+	pack_dir_put(p, d);
+}
+
+// Pack the first n candidates through the scheduler, and free them
+static void pack_run_batch(struct encr_packs *p, const char *dpath,
+			   const struct stat *dst, size_t n)
+{
+	size_t bytes = 0;
+	size_t i;
+	int gate;
+
+	for (i = 0; i < n; i++)
+		bytes += p->cands[i].size;
+	gate = encr_sched_enter(p->sched, ENCR_SCHED_BACKGROUND, bytes);
+	pack_batch(p, dpath, dst, p->cands, n);
+	encr_sched_leave(p->sched, gate);
+	for (i = 0; i < n; i++)
+		free(p->cands[i].data);
+}
+
+static void pack_directory(struct encr_packs *p, const char *dpath)
+{
+	struct dirent *de;
+	struct stat dst;
+	struct stat st;
+	size_t n = 0;
+	DIR *dp;
+
+	dp = opendir(dpath);
+	if (dp == NULL)
+		return;
+	if (fstat(dirfd(dp), &dst) == -1) {
+		closedir(dp);
+		return;
+	}
+	while (!pack_stopped(p) && (de = readdir(dp)) != NULL) {
+		if (encr_pack_hidden(de->d_name) ||
+		    fstatat(dirfd(dp), de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1 ||
+		    pack_candidate(p, dirfd(dp), de->d_name, &st,
+				   &p->cands[n]) != 0)
+			continue;
+		if (++n == ENCR_PACK_BATCH) {
+			pack_run_batch(p, dpath, &dst, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		pack_run_batch(p, dpath, &dst, n);
+	closedir(dp);
+}
+
+static int pack_visit(const char *fpath, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	struct encr_packs *p = pack_cur;
+	char meta[PATH_MAX];
+
+	(void) st;
+	(void) ftw;
+	if (pack_stopped(p))
+		return FTW_STOP;
+	if (type != FTW_D)
+		return FTW_CONTINUE;
+	snprintf(meta, sizeof(meta), "%s/%s", p->rootdir, ENCR_META_DIR);
+	if (strcmp(fpath, meta) == 0)
+		return FTW_SKIP_SUBTREE;
+	pack_directory(p, fpath);
+	return pack_stopped(p) ? FTW_STOP : FTW_CONTINUE;
+}
+
+// Rewrite the packs known to be mostly dead
+static void pack_sweep(struct encr_packs *p)
+{
+	struct pack_dir **list;
+	struct pack_dir *d;
+	size_t n = 0, alloc = 16;
+	size_t i;
+	int res;
+
+	list = malloc(alloc * sizeof(struct pack_dir *));
+	if (list == NULL)
+		return;
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < PACK_BUCKETS; i++) {
+		for (d = p->dirs[i]; d != NULL; d = d->next) {
+			if (!__atomic_load_n(&d->garbage, __ATOMIC_RELAXED))
+				continue;
+			if (n == alloc) {
+				struct pack_dir **more;
+
+				more = realloc(list, 2 * alloc *
+					       sizeof(struct pack_dir *));
+				if (more == NULL)
+					break;
+				list = more;
+				alloc *= 2;
+			}
+			pack_dir_ref(p, d);
+			list[n++] = d;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < n; i++) {
+		d = list[i];
+		pthread_mutex_lock(&d->lock);
+		if (d->loaded && d->garbage) {
+			res = pack_compact(p, d);
+			if (res != 0)
+				fprintf(stderr, "pa5-encfs: cannot rewrite the "
+					"pack of directory inode %lu: %s\n",
+					(unsigned long) d->ino, strerror(-res));
+		}
+		pthread_mutex_unlock(&d->lock);
+		pack_dir_put(p, d);
+	}
+	free(list);
+}
+
+static void *pack_thread(void *data)
+{
+	struct encr_packs *p = data;
+
+	do {
+		p->now = time(NULL);
+		if (p->max > 0)
+			nftw(p->rootdir, pack_visit, 16,
+			     FTW_PHYS | FTW_ACTIONRETVAL);
+		pack_sweep(p);
+	} while (!pack_sleep(p, ENCR_PACK_INTERVAL));
+	return NULL;
+}
+
+/* Setting up */
+
+int encr_packs_open(const char *rootdir, const struct encr_keys *mk,
+		    struct encr_store *store, struct encr_log *log,
+		    struct encr_roots *roots, struct encr_itable *itable,
+		    struct encr_acache *acache, struct encr_xcache *xcache,
+		    unsigned chunk_shift, unsigned flags, int direct,
+		    unsigned max, struct encr_packs **pp)
+{
+	char marker[PATH_MAX];
+	struct encr_packs *p;
+	int fd;
+	int i;
+
+	*pp = NULL;
+	snprintf(marker, sizeof(marker), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_PACK_MARKER);
+	if (max == 0) {
+		if (access(marker, F_OK) == -1)
+			return errno == ENOENT ? 0 : -errno;
+	} else {
+		fd = open(marker, O_WRONLY | O_CREAT, 0600);
+		if (fd == -1)
+			return -errno;
+		close(fd);
+	}
+
+	p = calloc(1, sizeof(struct encr_packs));
+	if (p == NULL)
+		return -ENOMEM;
+	p->rootdir = strdup(rootdir);
+	p->rec = malloc(4 + PACK_REC_MAX);
+	p->plain = malloc(PACK_PLAIN_MAX);
+	p->scratch = malloc(PACK_PLAIN_MAX + 1);
+	p->cands = calloc(ENCR_PACK_BATCH, sizeof(struct pack_cand));
+	if (p->rootdir == NULL || p->rec == NULL || p->plain == NULL ||
+	    p->scratch == NULL || p->cands == NULL) {
+		free(p->rootdir);
+		free(p->rec);
+		free(p->plain);
+		free(p->scratch);
+		free(p->cands);
+		free(p);
+		return -ENOMEM;
+	}
+	p->mk = mk;
+	p->store = store;
+	p->log = log;
+	p->roots = roots;
+	p->itable = itable;
+	p->acache = acache;
+	p->xcache = xcache;
+	p->chunk_shift = chunk_shift;
+	p->flags = flags;
+	p->direct = direct;
+	p->max = max;
+	for (i = 0; i < ENCR_PACK_GATES; i++)
+		pthread_rwlock_init(&p->gates[i], NULL);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_mutex_init(&p->tlock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	*pp = p;
+	return 0;
+}
+
+int encr_packs_start(struct encr_packs *p, struct encr_sched *sched)
+{
+	int res;
+
+	if (pack_cur != NULL)
+		return -EBUSY;
+	p->sched = sched;
+	pack_cur = p;
+	res = pthread_create(&p->tid, NULL, pack_thread, p);
+	if (res != 0) {
+		pack_cur = NULL;
+		return -res;
+	}
+	p->running = 1;
+	return 0;
+}
+
+void encr_packs_close(struct encr_packs *p)
+{
+	struct pack_dir *d, *next;
+	int i;
+
+	if (p == NULL)
+		return;
+	if (p->running) {
+		pthread_mutex_lock(&p->tlock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->tlock);
+		pthread_join(p->tid, NULL);
+		pack_cur = NULL;
+	}
+	for (i = 0; i < PACK_BUCKETS; i++) {
+		for (d = p->dirs[i]; d != NULL; d = next) {
+			next = d->next;
+			pack_dir_free(d);
+		}
+	}
+	for (i = 0; i < ENCR_PACK_GATES; i++)
+		pthread_rwlock_destroy(&p->gates[i]);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->tlock);
+	pthread_mutex_destroy(&p->lock);
+	free(p->rootdir);
+	free(p->rec);
+	free(p->plain);
+	free(p->scratch);
+	free(p->cands);
+	free(p);
+}
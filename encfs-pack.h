@@ -0,0 +1,178 @@
+/* encfs-pack.h
+ * Small-file packing for pa5-encfs
+ *
+ * A small file stored on its own costs a backing inode, a header, an
+ * xattr and a padded record, and every open of it a few syscalls. With
+ * -o pack, a background thread moves encrypted files of at most
+ * pack_max bytes that nobody has touched for ENCR_PACK_IDLE seconds
+ * into their directory's pack file, <dir>/.encfs-pack, and removes
+ * their backing files. The mount still lists, stats and reads them as
+ * ordinary files; anything that would change one (opening it for
+ * writing, truncate, chmod, chown, utimens, xattrs, rename, link) first
+ * moves it back out to a backing file of its own.
+ *
+ * A pack file is a file header (see encfs-format.h) whose data keys are
+ * used for nothing else, followed by records:
+ *
+ *   u32 len, then len bytes sealed as a chunk (see encfs-compress.h)
+ *   numbered by the offset of len, holding:
+ *
+ *   type u8 | pad u8 | namelen u16 | mode u32 | uid u32 | gid u32 |
+ *   size u64 | atime, mtime, ctime (s i64, ns u32 each) | name | data
+ *
+ *   put      a file and its contents, replacing any earlier one of
+ *            that name
+ *   del      the file is gone (deleted, or moved out to a backing file)
+ *   out      the file is being moved out
+ *   commit   everything before it is settled
+ *
+ * The index, name -> record, is built in memory when a directory is
+ * first looked at. A put or out after the last commit may not have
+ * been followed through, so if a backing file of its name exists, the
+ * backing file wins. The packer writes its puts and syncs the pack
+ * before it removes any backing file, and commits once the directory
+ * has been synced; moving out writes and syncs an out record before the
+ * backing file appears. A torn record at the end is cut off.
+ *
+ * Deleting packed files leaves dead records behind; once they outweigh
+ * the live ones the packer rewrites the pack, or removes it if nothing
+ * is left.
+ *
+ * Names starting with ENCR_PACK_FILE are reserved in every directory
+ * of a mirror that has packs. Packs are read whenever .encfs/pack
+ * exists, which the first mount with -o pack creates. encfs-rekey
+ * rewraps pack headers as it does any other, and encfs-scrub checks
+ * every record of them; the migrator leaves pack files alone.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_PACK_H
+#define ENCFS_PACK_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "encfs-format.h"
+#include "encfs-lock.h"
+#include "encfs-cache.h"
+
+#define ENCR_PACK_FILE ".encfs-pack"
+#define ENCR_PACK_MARKER "pack"		// .encfs/pack: the mirror has packs
+#define ENCR_DEFAULT_PACK_MAX 16384	// bytes
+#define ENCR_PACK_LIMIT 65536		// largest pack_max
+#define ENCR_PACK_IDLE 30		// seconds a file must be left alone
+#define ENCR_PACK_INTERVAL 60		// seconds between packer passes
+#define ENCR_PACK_BATCH 256		// files packed per directory at once
+#define ENCR_PACK_CACHE 128		// directory indexes kept while unused
+#define ENCR_PACK_GATES 64
+
+/* Packed files report inode 0, which no backing file has */
+#define ENCR_PACKED(st) ((st)->st_ino == 0)
+
+struct encr_packs;
+struct encr_sched;
+
+/* int encr_packs_open(const char *rootdir, const struct encr_keys *mk, struct encr_store *store, struct encr_log *log, struct encr_roots *roots, struct encr_itable *itable, struct encr_acache *acache, struct encr_xcache *xcache, unsigned chunk_shift, unsigned flags, int direct, unsigned max, struct encr_packs **pp)
+ * Purpose: Set up packing for a mount
+ * Args: struct encr_itable *itable : Open inode table shared with the mount
+ *       struct encr_acache *acache : Attribute cache to keep up to date
+ *       struct encr_xcache *xcache : Xattr cache to keep up to date
+ *       unsigned chunk_shift       : Chunk size files are moved out with
+ *       unsigned flags             : ENCR_FLAG_* files are moved out with
+ *       int direct                 : Whether the mount's handles may be O_DIRECT
+ *       unsigned max               : Largest file to pack, 0 to only
+ *                                    read the packs there are
+ *       struct encr_packs **pp     : Set to the packs, or to NULL if max
+ *                                    is 0 and the mirror has none
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_packs_open(const char *rootdir, const struct encr_keys *mk,
+			   struct encr_store *store, struct encr_log *log,
+			   struct encr_roots *roots,
+			   struct encr_itable *itable,
+			   struct encr_acache *acache,
+			   struct encr_xcache *xcache, unsigned chunk_shift,
+			   unsigned flags, int direct, unsigned max,
+			   struct encr_packs **pp);
+
+/* int encr_packs_start(struct encr_packs *p, struct encr_sched *sched)
+ * Purpose: Start the packer thread, unless p only reads packs; it goes
+ *          through sched (see encfs-sched.h) batch by batch, and sched
+ *          may be NULL
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_packs_start(struct encr_packs *p, struct encr_sched *sched);
+
+/* void encr_packs_close(struct encr_packs *p)
+ * Purpose: Stop the packer and free p; p may be NULL
+ */
+extern void encr_packs_close(struct encr_packs *p);
+
+/* int encr_pack_hidden(const char *name)
+ * Purpose: Whether a directory entry name is reserved for packing
+ */
+extern int encr_pack_hidden(const char *name);
+
+/* int encr_pack_enter(struct encr_packs *p)
+ * void encr_pack_leave(struct encr_packs *p, int gate)
+ * Purpose: Bracket a call that opens or changes a file by name, so the
+ *          packer never removes a backing file while it runs; enter
+ *          returns the gate to pass to leave
+ */
+extern int encr_pack_enter(struct encr_packs *p);
+extern void encr_pack_leave(struct encr_packs *p, int gate);
+
+/* int encr_pack_stat(struct encr_packs *p, const char *path, struct stat *st)
+ * Purpose: Attributes of the packed file path (relative to the mirror
+ *          root), with its plaintext size
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on failure
+ */
+extern int encr_pack_stat(struct encr_packs *p, const char *path,
+			  struct stat *st);
+
+/* int encr_pack_list(struct encr_packs *p, const char *path, int (*fn)(void *arg, const char *name, const struct stat *st), void *arg)
+ * Purpose: Call fn for every file packed in directory path, with its
+ *          attributes as encr_pack_stat() gives them, until it returns
+ *          nonzero
+ * Return: 0, what fn returned, or -errno on failure
+ */
+extern int encr_pack_list(struct encr_packs *p, const char *path,
+			  int (*fn)(void *arg, const char *name,
+				    const struct stat *st), void *arg);
+
+/* int encr_pack_read(struct encr_packs *p, const char *path, char **data, struct stat *st)
+ * Purpose: Read the packed file path into a buffer the caller frees,
+ *          st_size bytes long
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on failure
+ */
+extern int encr_pack_read(struct encr_packs *p, const char *path,
+			  char **data, struct stat *st);
+
+/* int encr_pack_drop(struct encr_packs *p, const char *path)
+ * Purpose: Delete the packed file path
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on failure
+ */
+extern int encr_pack_drop(struct encr_packs *p, const char *path);
+
+/* int encr_pack_out(struct encr_packs *p, const char *path)
+ * Purpose: Move the packed file path out to a backing file of its own,
+ *          with its mode, owner and times
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on failure
+ */
+extern int encr_pack_out(struct encr_packs *p, const char *path);
+
+/* int encr_pack_rmdir(struct encr_packs *p, const char *path)
+ * Purpose: Remove the pack of directory path if nothing in it is live,
+ *          so the directory can be removed
+ * Return: 0 on success, -ENOTEMPTY if it still holds files, -errno on failure
+ */
+extern int encr_pack_rmdir(struct encr_packs *p, const char *path);
+
+/* void encr_pack_forget(struct encr_packs *p, const struct stat *st)
+ * Purpose: Forget a directory that has been removed, st from before
+ */
+extern void encr_pack_forget(struct encr_packs *p, const struct stat *st);
+
+#endif
@@ -0,0 +1,153 @@
+/* encfs-rebalance.c
+ * Spread files of a pa5-encfs mount over every root it has
+ *
+ * After a root is added (see encfs-roots.h), files already in the mirror
+ * stay on the roots they were written to. This walks the files and
+ * directories given, inside the mount, reads how many roots each regular
+ * file is striped over with ENCR_IOC_GET_STRIPE, and asks the mount to
+ * rewrite those on fewer than all of them with ENCR_IOC_SET_CHUNK at
+ * their own chunk size (see encfs-ioctl.h). The mount copies the file the
+ * way the migrator does (see encfs-migrate.h): reads and writes carry on
+ * while it runs, and the file keeps its inode, links and xattrs. Files
+ * not encrypted yet are left to -o migrate; packed, deduplicated and
+ * log-structured files are skipped.
+ *
+ * Usage: encfs-rebalance [-n] [-v] <Path>...
+ *   -n  only list each file's width and the mount's number of roots
+ *   -v  list every file rewritten
+ *
+ * Exits 1 if any file could not be rewritten.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "encfs-ioctl.h"
+
+static int list_only;
+static int verbose;
+
+static unsigned long files;
+static unsigned long rewritten;
+static unsigned long skipped;
+static unsigned long failed;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-rebalance [-n] [-v] <Path>...\n");
+	exit(EXIT_FAILURE);
+}
+
+static int rebalance_one(const char *path)
+{
+	struct encr_stripe_info si;
+	struct encr_chunk_info ci;
+	uint32_t before;
+	int fd;
+
+	// Read-only, so a packed file is not moved out of its pack
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&si, 0, sizeof(si));
+	memset(&ci, 0, sizeof(ci));
+	if (ioctl(fd, ENCR_IOC_GET_STRIPE, &si) == -1 ||
+	    ioctl(fd, ENCR_IOC_GET_CHUNK, &ci) == -1) {
+		close(fd);
+		// Packed, or not in a pa5-encfs mount at all
+		if (errno == EBADF || errno == ENOTTY || errno == ENOSYS) {
+			skipped++;
+			return 0;
+		}
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (list_only) {
+		printf("%6u %6u %s\n", si.width, si.roots, path);
+		close(fd);
+		return 0;
+	}
+	if (si.width == 0 || si.width >= si.roots) {
+		close(fd);
+		if (si.width == 0)
+			skipped++;
+		return 0;
+	}
+	before = si.width;
+	if (ioctl(fd, ENCR_IOC_SET_CHUNK, &ci) == -1 ||
+	    ioctl(fd, ENCR_IOC_GET_STRIPE, &si) == -1) {
+		close(fd);
+		if (errno == EOPNOTSUPP) {
+			skipped++;
+			return 0;
+		}
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	close(fd);
+	if (si.width != before) {
+		rewritten++;
+		if (verbose)
+			printf("%6u -> %-6u %s\n", before, si.width, path);
+	}
+	return 0;
+}
+
+static int rebalance_visit(const char *fpath, const struct stat *st,
+			   int type, struct FTW *ftw)
+{
+	(void) ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	files++;
+	if (rebalance_one(fpath) != 0)
+		failed++;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "nv")) != -1) {
+		switch (opt) {
+		case 'n':
+			list_only = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	if (list_only)
+		printf("%6s %6s %s\n", "width", "roots", "path");
+	for (i = optind; i < argc; i++)
+		if (nftw(argv[i], rebalance_visit, 16, FTW_PHYS) == -1) {
+			perror(argv[i]);
+			failed++;
+		}
+	if (!list_only)
+		printf("%lu files, %lu rewritten, %lu skipped, %lu failed\n",
+		       files, rewritten, skipped, failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
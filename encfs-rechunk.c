@@ -0,0 +1,173 @@
+/* encfs-rechunk.c
+ * Rewrite files of a pa5-encfs mount with another chunk size
+ *
+ * Walks the files and directories given, inside a mount, and asks the
+ * mount to rewrite each regular file with ENCR_IOC_SET_CHUNK (see
+ * encfs-ioctl.h). The mount copies the file the way the migrator does
+ * (see encfs-migrate.h): reads and writes carry on while it runs, and
+ * the file keeps its inode, links and xattrs. Without -s each file goes
+ * to the chunk size its policy, chunk-want xattr or the mount's
+ * chunk_size has for it (see encfs-chunk.h); a file already there is
+ * left alone. Packed, deduplicated and log-structured files are skipped.
+ *
+ * Usage: encfs-rechunk [-n] [-v] [-s SIZE|size] <Path>...
+ *   -n       only list each file's chunk size and the one it would get
+ *   -v       list every file rewritten
+ *   -s SIZE  rewrite to SIZE byte chunks (a power of two, K or M
+ *            suffix allowed); -s size picks by each file's size
+ *
+ * Exits 1 if any file could not be rewritten.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "encfs-ioctl.h"
+
+static int list_only;
+static int verbose;
+static uint32_t want;			// as for ENCR_IOC_SET_CHUNK
+
+static unsigned long files;
+static unsigned long rewritten;
+static unsigned long skipped;
+static unsigned long failed;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-rechunk [-n] [-v] [-s SIZE|size] "
+		"<Path>...\n");
+	exit(EXIT_FAILURE);
+}
+
+static int rechunk_one(const char *path)
+{
+	struct encr_chunk_info ci;
+	uint32_t before;
+	int fd;
+
+	// Read-only, so a packed file is not moved out of its pack
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&ci, 0, sizeof(ci));
+	if (ioctl(fd, ENCR_IOC_GET_CHUNK, &ci) == -1) {
+		close(fd);
+		// Packed, or not in a pa5-encfs mount at all
+		if (errno == EBADF || errno == ENOTTY || errno == ENOSYS) {
+			skipped++;
+			return 0;
+		}
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (list_only) {
+		printf("%10u %10u %s\n", ci.chunk_size, ci.target, path);
+		close(fd);
+		return 0;
+	}
+	before = ci.chunk_size;
+	ci.chunk_size = want;
+	if (ioctl(fd, ENCR_IOC_SET_CHUNK, &ci) == -1) {
+		close(fd);
+		if (errno == EOPNOTSUPP) {
+			skipped++;
+			return 0;
+		}
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	close(fd);
+	if (ci.chunk_size != before) {
+		rewritten++;
+		if (verbose)
+			printf("%10u -> %-10u %s\n", before, ci.chunk_size,
+			       path);
+	}
+	return 0;
+}
+
+static int rechunk_visit(const char *fpath, const struct stat *st, int type,
+			 struct FTW *ftw)
+{
+	(void) ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	files++;
+	if (rechunk_one(fpath) != 0)
+		failed++;
+	return 0;
+}
+
+// "4096", "4K", "1M" or "size"
+static int parse_size(const char *s, uint32_t *size)
+{
+	unsigned long long n;
+	char *end;
+
+	if (strcmp(s, "size") == 0) {
+		*size = ENCR_CHUNK_BY_SIZE;
+		return 0;
+	}
+	n = strtoull(s, &end, 10);
+	if (*end == 'K' || *end == 'k')
+		n <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		n <<= 20, end++;
+	if (end == s || *end != '\0' || n < 2 || n > UINT32_MAX ||
+	    (n & (n - 1)) != 0)
+		return -1;
+	*size = n;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "nvs:")) != -1) {
+		switch (opt) {
+		case 'n':
+			list_only = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 's':
+			if (parse_size(optarg, &want) != 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	if (list_only)
+		printf("%10s %10s %s\n", "chunk", "target", "path");
+	for (i = optind; i < argc; i++)
+		if (nftw(argv[i], rechunk_visit, 16, FTW_PHYS) == -1) {
+			perror(argv[i]);
+			failed++;
+		}
+	if (!list_only)
+		printf("%lu files, %lu rewritten, %lu skipped, %lu failed\n",
+		       files, rewritten, skipped, failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
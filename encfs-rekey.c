@@ -0,0 +1,297 @@
+/* encfs-rekey.c
+ * Change the key phrase of a pa5-encfs mirror
+ *
+ * Every encrypted file's data keys are wrapped by the mount key in the
+ * file's header, and so are the chunk store's and the log's, so changing
+ * the key phrase only rewraps headers; file data is never touched. The
+ * new mount key is kept in .encfs/config.next until every header has
+ * been rewritten, then renamed over .encfs/config. If the run is
+ * interrupted, running it again with the same arguments picks up where
+ * it left off. Do not run it on a mounted mirror.
+ *
+ * A mirror with a migration journal still to be copied back (see
+ * encfs-migrate.h) is refused: the journal's header is under the old
+ * key, and mounting once finishes it.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-format.h"
+#include "encfs-store.h"
+#include "encfs-log.h"
+#include "encfs-migrate.h"
+
+#define MAXTHREADS 256
+
+struct rekey_job {
+	char **paths;
+	size_t npaths;
+	size_t alloc;
+	size_t next;			// next path to hand out, under lock
+	pthread_mutex_t lock;
+	struct encr_keys oldkey;
+	struct encr_keys newkey;
+	unsigned long rewrapped;
+	unsigned long skipped;
+	unsigned long failed;
+};
+
+static struct rekey_job job;
+static char metadir[PATH_MAX];
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-rekey [-j threads] <Old Key Phrase> "
+		"<New Key Phrase> <Mirror Directory>\n");
+	exit(EXIT_FAILURE);
+}
+
+static int is_encrypted(const char *path)
+{
+	char val[8];
+	ssize_t len = lgetxattr(path, ENCR_XATTR_ENCRYPTED, val, sizeof(val));
+
+	return len == 4 && memcmp(val, "true", 4) == 0;
+}
+
+static int add_path(const char *path)
+{
+	char **paths;
+
+	if (job.npaths == job.alloc) {
+		job.alloc = job.alloc ? 2 * job.alloc : 1024;
+		paths = realloc(job.paths, job.alloc * sizeof(char *));
+		if (paths == NULL)
+			return -ENOMEM;
+		job.paths = paths;
+	}
+	job.paths[job.npaths] = strdup(path);
+	if (job.paths[job.npaths] == NULL)
+		return -ENOMEM;
+	job.npaths++;
+	return 0;
+}
+
+static int collect(const char *path, const struct stat *st, int type,
+		   struct FTW *ftw)
+{
+	(void) ftw;
+	if (type == FTW_D && strcmp(path, metadir) == 0)
+		return FTW_SKIP_SUBTREE;
+	if (type != FTW_F || !S_ISREG(st->st_mode) || !is_encrypted(path))
+		return FTW_CONTINUE;
+	return add_path(path) == 0 ? FTW_CONTINUE : FTW_STOP;
+}
+
+/* Whether a migration was interrupted past its commit: its journal holds
+ * a header under the old key, which the next mount would copy back over
+ * a file already rewrapped */
+static int migrate_pending(const char *rootdir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	size_t len;
+	int found = 0;
+	DIR *dp;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_MIGRATE_DIR);
+	dp = opendir(path);
+	if (dp == NULL)
+		return 0;
+	while (!found && (de = readdir(dp)) != NULL) {
+		len = strlen(de->d_name);
+		found = len > 7 && strcmp(de->d_name + len - 7, ".commit") == 0;
+	}
+	closedir(dp);
+	return found;
+}
+
+// Rewrap one header; headers already under the new key are left alone
+static int rekey_file(const char *path)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	int fd;
+	int res;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		// Never opened through the mount yet; it gets a header then
+		close(fd);
+		return 1;
+	}
+
+	res = encr_header_decode(&hdr, &job.oldkey, buf);
+	if (res == -EBADMSG && encr_header_decode(&hdr, &job.newkey, buf) == 0)
+		res = 1;
+	else if (res == 0)
+		res = encr_header_encode(&hdr, &job.newkey, buf);
+	if (res == 0 && (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+			 fsync(fd) == -1))
+		res = -errno;
+	memset(&hdr, 0, sizeof(hdr));
+	close(fd);
+	return res;
+}
+
+static void *rekey_worker(void *data)
+{
+	size_t i;
+	int res;
+
+	(void) data;
+	for (;;) {
+		pthread_mutex_lock(&job.lock);
+		i = job.next++;
+		pthread_mutex_unlock(&job.lock);
+		if (i >= job.npaths)
+			break;
+
+		res = rekey_file(job.paths[i]);
+		pthread_mutex_lock(&job.lock);
+		if (res == 0) {
+			job.rewrapped++;
+		} else if (res > 0) {
+			job.skipped++;
+		} else {
+			job.failed++;
+			fprintf(stderr, "%s: %s\n", job.paths[i], strerror(-res));
+		}
+		pthread_mutex_unlock(&job.lock);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tids[MAXTHREADS];
+	struct encr_config cfg;
+	struct encr_config next;
+	char cpath[PATH_MAX];
+	char npath[PATH_MAX];
+	char spath[PATH_MAX];
+	char *rootdir;
+	int nthreads = 4;
+	int opt;
+	int res;
+	int i;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 3)
+		usage();
+
+	rootdir = realpath(argv[optind + 2], NULL);
+	if (rootdir == NULL) {
+		perror(argv[optind + 2]);
+		return EXIT_FAILURE;
+	}
+	snprintf(metadir, sizeof(metadir), "%s/%s", rootdir, ENCR_META_DIR);
+	snprintf(cpath, sizeof(cpath), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_CONFIG_FILE);
+	snprintf(npath, sizeof(npath), "%s/%s/%s.next", rootdir, ENCR_META_DIR,
+		 ENCR_CONFIG_FILE);
+
+	res = encr_config_read(cpath, &cfg);
+	if (res == 0)
+		res = encr_config_unlock(&cfg, argv[optind], &job.oldkey);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", cpath, res == -EACCES ?
+			"wrong old key phrase" : strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (migrate_pending(rootdir)) {
+		fprintf(stderr, "%s/%s/%s: an interrupted migration has to be "
+			"finished first; mount the mirror once and unmount "
+			"it\n", rootdir, ENCR_META_DIR, ENCR_MIGRATE_DIR);
+		return EXIT_FAILURE;
+	}
+
+	// Reuse the new key of an interrupted run, or the headers it already
+	// rewrapped would be lost
+	res = encr_config_read(npath, &next);
+	if (res == 0) {
+		res = encr_config_unlock(&next, argv[optind + 1], &job.newkey);
+		if (res == -EACCES) {
+			fprintf(stderr, "%s: an interrupted rekey to a different "
+				"key phrase has to be finished first\n", npath);
+			return EXIT_FAILURE;
+		}
+	} else if (res == -ENOENT) {
+		res = encr_config_init(&next, argv[optind + 1], &job.newkey);
+		if (res == 0)
+			res = encr_config_write(npath, &next);
+	}
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", npath, strerror(-res));
+		return EXIT_FAILURE;
+	}
+
+	if (nftw(rootdir, collect, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+		perror(rootdir);
+		return EXIT_FAILURE;
+	}
+	snprintf(spath, sizeof(spath), "%s/%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_STORE_DIR, ENCR_STORE_KEY);
+	if (access(spath, F_OK) == 0 && add_path(spath) != 0) {
+		perror(spath);
+		return EXIT_FAILURE;
+	}
+	snprintf(spath, sizeof(spath), "%s/%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_LOG_DIR, ENCR_LOG_KEY);
+	if (access(spath, F_OK) == 0 && add_path(spath) != 0) {
+		perror(spath);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_init(&job.lock, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, rekey_worker, NULL) != 0)
+			break;
+	if (i == 0)
+		rekey_worker(NULL);
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+
+	printf("%lu rewrapped, %lu already done or empty, %lu failed\n",
+	       job.rewrapped, job.skipped, job.failed);
+	if (job.failed > 0) {
+		fprintf(stderr, "Key phrase not changed; fix the errors above "
+			"and run encfs-rekey again\n");
+		return EXIT_FAILURE;
+	}
+
+	if (rename(npath, cpath) == -1) {
+		perror(cpath);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,564 @@
+/* encfs-replay.c
+ * Replay a pa5-encfs operation trace against a mount
+ *
+ * Reads a trace written with -o trace=FILE (see encfs-trace.h) and issues
+ * the system call behind each logged operation under another mount point,
+ * either at the times they were first seen or as fast as possible. Calls
+ * served by one thread of the traced mount are replayed in order by one
+ * thread here, so the original concurrency is kept. Written data is a
+ * fixed pattern and xattr values are zeros, as neither is traced.
+ *
+ * Afterwards it prints each operation's replay latency next to the
+ * latency logged in the trace. The logged one is the time the mount spent
+ * serving the call; the replayed one also includes the trip through the
+ * kernel, so compare replays of different builds with each other. Replay
+ * against a copy of the tree the trace started from, or calls that
+ * depend on what was there will fail differently (the "diff" column).
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "encfs-trace.h"
+
+#define MAXLANES 64
+#define REPLAY_BUFSIZE (1024 * 1024)	// largest read, write or xattr issued
+
+struct replay_stale {
+	int fd;
+	struct replay_stale *next;
+};
+
+// Files opened by the replay, per path id and access mode. An fd released
+// while another lane is using it is closed once that lane is done.
+struct replay_file {
+	int fd[3];			// by O_ACCMODE, -1 if none
+	unsigned count[3];		// opens not yet released
+	unsigned busy;			// lanes using one of the fds
+	struct replay_stale *stale;	// released while busy
+};
+
+struct replay {
+	const char *mount;
+	struct encr_trace_rec *recs;
+	size_t nrecs;
+	char **paths;
+	uint32_t npaths;
+	int fast;
+	struct timespec t0;		// replay time of the first record
+	uint64_t first_ns;		// trace time of the first record
+	pthread_mutex_t lock;		// files
+	struct replay_file *files;
+	int64_t *lat;			// per record, ns, -1 if skipped
+	int32_t *res;			// per record
+};
+
+struct replay_lane {
+	pthread_t tid;
+	struct replay *r;
+	size_t *idx;			// records of this lane, in order
+	size_t n;
+};
+
+static uint64_t ns_since(const struct timespec *t0)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) (ts.tv_sec - t0->tv_sec) * 1000000000ULL +
+		ts.tv_nsec - t0->tv_nsec;
+}
+
+static const char *replay_name(struct replay *r, uint32_t id)
+{
+	return id < r->npaths ? r->paths[id] : NULL;
+}
+
+static int replay_full(struct replay *r, uint32_t id, char *full)
+{
+	const char *p = replay_name(r, id);
+
+	if (p == NULL ||
+	    snprintf(full, PATH_MAX, "%s%s", r->mount, p) >= PATH_MAX)
+		return -1;
+	return 0;
+}
+
+// An fd of path id that allows mode, opening one if the trace began
+// after the file was opened; given back with replay_put()
+static int replay_fd(struct replay *r, uint32_t id, const char *full,
+		     int mode)
+{
+	struct replay_file *f = &r->files[id];
+	int fd;
+
+	pthread_mutex_lock(&r->lock);
+	fd = f->fd[O_RDWR];
+	if (fd == -1)
+		fd = f->fd[mode];
+	if (fd == -1) {
+		fd = open(full, O_RDWR);
+		if (fd == -1)
+			fd = open(full, mode);
+		if (fd != -1)
+			f->fd[fcntl(fd, F_GETFL) & O_ACCMODE] = fd;
+	}
+	if (fd != -1)
+		f->busy++;
+	pthread_mutex_unlock(&r->lock);
+	return fd;
+}
+
+static void replay_put(struct replay *r, uint32_t id)
+{
+	struct replay_file *f = &r->files[id];
+	struct replay_stale *s;
+
+	pthread_mutex_lock(&r->lock);
+	if (--f->busy == 0)
+		while ((s = f->stale) != NULL) {
+			f->stale = s->next;
+			close(s->fd);
+			free(s);
+		}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void replay_opened(struct replay *r, uint32_t id, int fd, int flags)
+{
+	struct replay_file *f = &r->files[id];
+	int mode = flags & O_ACCMODE;
+
+	pthread_mutex_lock(&r->lock);
+	if (f->fd[mode] == -1)
+		f->fd[mode] = fd;
+	else
+		close(fd);
+	f->count[mode]++;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void replay_released(struct replay *r, uint32_t id, int flags)
+{
+	struct replay_file *f = &r->files[id];
+	int mode = flags & O_ACCMODE;
+
+	pthread_mutex_lock(&r->lock);
+	if (f->count[mode] > 0 && --f->count[mode] == 0 && f->fd[mode] != -1) {
+		struct replay_stale *s = f->busy > 0 ?
+			malloc(sizeof(struct replay_stale)) : NULL;
+
+		if (s != NULL) {
+			s->fd = f->fd[mode];
+			s->next = f->stale;
+			f->stale = s;
+		} else if (f->busy == 0) {
+			close(f->fd[mode]);
+		}
+		// Out of memory with the fd in use: leave it open
+		f->fd[mode] = -1;
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static int replay_readdir(const char *full)
+{
+	DIR *dp = opendir(full);
+
+	if (dp == NULL)
+		return -1;
+	while (readdir(dp) != NULL)
+		;
+	closedir(dp);
+	return 0;
+}
+
+// Issue one record; returns its result, or 1 if it is not replayed
+static int replay_one(struct replay *r, const struct encr_trace_rec *e,
+		      char *buf)
+{
+	char full[PATH_MAX];
+	char full2[PATH_MAX];
+	struct timespec ts[2];
+	struct stat st;
+	struct statvfs sv;
+	size_t size = e->size < REPLAY_BUFSIZE ? e->size : REPLAY_BUFSIZE;
+	int fd;
+	int res;
+
+	if (replay_full(r, e->path, full) != 0)
+		return 1;
+	switch (e->op) {
+	case ENCR_OP_GETATTR:
+		res = lstat(full, &st);
+		break;
+	case ENCR_OP_FGETATTR:
+		fd = replay_fd(r, e->path, full, O_RDONLY);
+		res = fd == -1 ? -1 : fstat(fd, &st);
+		goto put;
+	case ENCR_OP_ACCESS:
+		res = access(full, e->arg);
+		break;
+	case ENCR_OP_READLINK:
+		res = readlink(full, buf, size);
+		break;
+	case ENCR_OP_READDIR:
+		// Also makes the opendir and releasedir calls
+		res = replay_readdir(full);
+		break;
+	case ENCR_OP_MKNOD:
+		res = mknod(full, e->arg, e->size);
+		break;
+	case ENCR_OP_MKDIR:
+		res = mkdir(full, e->arg);
+		break;
+	case ENCR_OP_SYMLINK:
+		if (replay_name(r, e->path2) == NULL)
+			return 1;
+		res = symlink(replay_name(r, e->path2), full);
+		break;
+	case ENCR_OP_UNLINK:
+		res = unlink(full);
+		break;
+	case ENCR_OP_RMDIR:
+		res = rmdir(full);
+		break;
+	case ENCR_OP_RENAME:
+	case ENCR_OP_LINK:
+		if (replay_full(r, e->path2, full2) != 0)
+			return 1;
+		res = e->op == ENCR_OP_RENAME ? rename(full, full2) :
+			link(full, full2);
+		break;
+	case ENCR_OP_CHMOD:
+		res = chmod(full, e->arg);
+		break;
+	case ENCR_OP_CHOWN:
+		res = lchown(full, e->arg, e->size);
+		break;
+	case ENCR_OP_TRUNCATE:
+		res = truncate(full, e->off);
+		break;
+	case ENCR_OP_FTRUNCATE:
+		fd = replay_fd(r, e->path, full, O_WRONLY);
+		res = fd == -1 ? -1 : ftruncate(fd, e->off);
+		goto put;
+	case ENCR_OP_UTIMENS:
+		ts[0].tv_sec = e->off / 1000000000LL;
+		ts[0].tv_nsec = e->off % 1000000000LL;
+		ts[1].tv_sec = e->size / 1000000000ULL;
+		ts[1].tv_nsec = e->size % 1000000000ULL;
+		res = utimensat(AT_FDCWD, full, ts, AT_SYMLINK_NOFOLLOW);
+		break;
+	case ENCR_OP_OPEN:
+	case ENCR_OP_CREATE:
+		if (e->op == ENCR_OP_OPEN)
+			fd = open(full, e->arg);
+		else
+			fd = open(full, e->size | O_CREAT, e->arg);
+		res = fd;
+		if (fd != -1)
+			replay_opened(r, e->path, fd, e->op == ENCR_OP_OPEN ?
+				      e->arg : e->size);
+		break;
+	case ENCR_OP_READ:
+		fd = replay_fd(r, e->path, full, O_RDONLY);
+		res = fd == -1 ? -1 : pread(fd, buf, size, e->off);
+		goto put;
+	case ENCR_OP_WRITE:
+		fd = replay_fd(r, e->path, full, O_WRONLY);
+		res = fd == -1 ? -1 : pwrite(fd, buf, size, e->off);
+		goto put;
+	case ENCR_OP_STATFS:
+		res = statvfs(full, &sv);
+		break;
+	case ENCR_OP_RELEASE:
+		replay_released(r, e->path, e->arg);
+		res = 0;
+		break;
+	case ENCR_OP_FSYNC:
+		fd = replay_fd(r, e->path, full, O_RDONLY);
+		res = fd == -1 ? -1 : e->arg ? fdatasync(fd) : fsync(fd);
+		goto put;
+	case ENCR_OP_SETXATTR:
+		if (replay_name(r, e->path2) == NULL)
+			return 1;
+		memset(buf, 0, size);
+		res = lsetxattr(full, replay_name(r, e->path2), buf, size,
+				e->arg);
+		break;
+	case ENCR_OP_GETXATTR:
+		if (replay_name(r, e->path2) == NULL)
+			return 1;
+		res = lgetxattr(full, replay_name(r, e->path2), buf, size);
+		break;
+	case ENCR_OP_LISTXATTR:
+		res = llistxattr(full, buf, size);
+		break;
+	case ENCR_OP_REMOVEXATTR:
+		if (replay_name(r, e->path2) == NULL)
+			return 1;
+		res = lremovexattr(full, replay_name(r, e->path2));
+		break;
+	case ENCR_OP_FSYNCDIR:
+		fd = open(full, O_RDONLY | O_DIRECTORY);
+		res = fd == -1 ? -1 : e->arg ? fdatasync(fd) : fsync(fd);
+		if (fd != -1) {
+			int err = errno;
+
+			close(fd);
+			errno = err;
+		}
+		break;
+	default:
+		// opendir and releasedir come with readdir; ioctls carry
+		// arguments the trace does not have
+		return 1;
+	}
+	return res == -1 ? -errno : 0;
+
+put:
+	if (res == -1)
+		res = -errno;
+	if (fd != -1)
+		replay_put(r, e->path);
+	return res < 0 ? res : 0;
+}
+
+static void *replay_worker(void *data)
+{
+	struct replay_lane *l = data;
+	struct replay *r = l->r;
+	char *buf = malloc(REPLAY_BUFSIZE);
+	struct timespec ts;
+	uint64_t start;
+	uint64_t end;
+	size_t i;
+
+	if (buf == NULL)
+		return NULL;
+	memset(buf, 0x5a, REPLAY_BUFSIZE);
+	for (i = 0; i < l->n; i++) {
+		const struct encr_trace_rec *e = &r->recs[l->idx[i]];
+		uint64_t due = e->start_ns - r->first_ns;
+		int res;
+
+		if (!r->fast) {
+			uint64_t now = ns_since(&r->t0);
+
+			if (due > now) {
+				ts.tv_sec = (due - now) / 1000000000ULL;
+				ts.tv_nsec = (due - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+		start = ns_since(&r->t0);
+		res = replay_one(r, e, buf);
+		end = ns_since(&r->t0);
+		// Written data goes back to the pattern after xattr zeros
+		if (e->op == ENCR_OP_SETXATTR)
+			memset(buf, 0x5a, REPLAY_BUFSIZE);
+		if (res == 1) {
+			r->lat[l->idx[i]] = -1;
+			continue;
+		}
+		r->lat[l->idx[i]] = end - start;
+		r->res[l->idx[i]] = res;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct replay *r, double elapsed)
+{
+	uint64_t *mine = malloc(r->nrecs * sizeof(uint64_t));
+	uint64_t *theirs = malloc(r->nrecs * sizeof(uint64_t));
+	size_t replayed = 0;
+	unsigned op;
+	size_t i;
+
+	if (mine == NULL || theirs == NULL) {
+		free(mine);
+		free(theirs);
+		fprintf(stderr, "Out of memory for the report\n");
+		return;
+	}
+	printf("%-12s %9s %7s %7s %10s %10s %10s %10s %10s %10s\n", "op",
+	       "count", "skipped", "diff", "mean us", "p50 us", "p99 us",
+	       "max us", "trace mean", "trace p99");
+	for (op = 1; op < ENCR_OP_NR; op++) {
+		size_t n = 0;
+		size_t skipped = 0;
+		size_t diff = 0;
+		double sum = 0;
+		double tsum = 0;
+
+		for (i = 0; i < r->nrecs; i++) {
+			const struct encr_trace_rec *e = &r->recs[i];
+
+			if (e->op != op)
+				continue;
+			if (r->lat[i] < 0) {
+				skipped++;
+				continue;
+			}
+			mine[n] = r->lat[i];
+			theirs[n] = e->end_ns - e->start_ns;
+			sum += mine[n];
+			tsum += theirs[n];
+			if ((r->res[i] < 0) != (e->result < 0))
+				diff++;
+			n++;
+		}
+		if (n + skipped == 0)
+			continue;
+		replayed += n;
+		if (n == 0) {
+			printf("%-12s %9zu %7zu\n", encr_trace_op_name(op),
+			       skipped, skipped);
+			continue;
+		}
+		qsort(mine, n, sizeof(uint64_t), cmp_u64);
+		qsort(theirs, n, sizeof(uint64_t), cmp_u64);
+		printf("%-12s %9zu %7zu %7zu %10.1f %10.1f %10.1f %10.1f "
+		       "%10.1f %10.1f\n", encr_trace_op_name(op), n + skipped,
+		       skipped, diff, sum / n / 1e3, mine[n / 2] / 1e3,
+		       mine[n * 99 / 100] / 1e3, mine[n - 1] / 1e3,
+		       tsum / n / 1e3, theirs[n * 99 / 100] / 1e3);
+	}
+	printf("%zu calls replayed in %.3f s (%.0f calls/s)\n", replayed,
+	       elapsed, elapsed > 0 ? replayed / elapsed : 0);
+	free(mine);
+	free(theirs);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f] [-j lanes] <Trace File> <Mount Point>\n",
+		prog);
+	fprintf(stderr, "Without -f, calls are issued at their traced times\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_lane lanes[MAXLANES];
+	uint32_t tids[MAXLANES];
+	struct replay r;
+	unsigned nlanes = 0;
+	unsigned maxlanes = MAXLANES;
+	unsigned l;
+	size_t i;
+	int opt;
+	int res;
+
+	memset(&r, 0, sizeof(r));
+	while ((opt = getopt(argc, argv, "fj:")) != -1) {
+		switch (opt) {
+		case 'f':
+			r.fast = 1;
+			break;
+		case 'j':
+			maxlanes = atoi(optarg);
+			if (maxlanes < 1 || maxlanes > MAXLANES)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+	r.mount = argv[optind + 1];
+
+	res = encr_trace_load(argv[optind], &r.recs, &r.nrecs, &r.paths,
+			      &r.npaths);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], res == -EINVAL ?
+			"not a pa5-encfs trace" : strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (r.nrecs == 0) {
+		fprintf(stderr, "%s: empty trace\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	r.files = malloc(r.npaths * sizeof(struct replay_file));
+	r.lat = malloc(r.nrecs * sizeof(int64_t));
+	r.res = malloc(r.nrecs * sizeof(int32_t));
+	if ((r.npaths > 0 && r.files == NULL) || r.lat == NULL ||
+	    r.res == NULL) {
+		perror("malloc error");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < r.npaths; i++) {
+		memset(&r.files[i], 0, sizeof(struct replay_file));
+		r.files[i].fd[0] = r.files[i].fd[1] = r.files[i].fd[2] = -1;
+	}
+	pthread_mutex_init(&r.lock, NULL);
+
+	// One lane per traced thread; threads past maxlanes share them
+	memset(lanes, 0, sizeof(lanes));
+	for (i = 0; i < r.nrecs; i++) {
+		for (l = 0; l < nlanes && tids[l] != r.recs[i].tid; l++)
+			;
+		if (l == nlanes && nlanes < maxlanes)
+			tids[nlanes++] = r.recs[i].tid;
+		else if (l == nlanes)
+			l = r.recs[i].tid % nlanes;
+		if (lanes[l].n % 1024 == 0) {
+			size_t *idx = realloc(lanes[l].idx, (lanes[l].n + 1024) *
+					      sizeof(size_t));
+
+			if (idx == NULL) {
+				perror("malloc error");
+				return EXIT_FAILURE;
+			}
+			lanes[l].idx = idx;
+		}
+		lanes[l].idx[lanes[l].n++] = i;
+	}
+
+	r.first_ns = r.recs[0].start_ns;
+	clock_gettime(CLOCK_MONOTONIC, &r.t0);
+	for (l = 0; l < nlanes; l++) {
+		lanes[l].r = &r;
+		if (pthread_create(&lanes[l].tid, NULL, replay_worker,
+				   &lanes[l]) != 0) {
+			fprintf(stderr, "Cannot start replay thread %u\n", l);
+			return EXIT_FAILURE;
+		}
+	}
+	for (l = 0; l < nlanes; l++)
+		pthread_join(lanes[l].tid, NULL);
+
+	report(&r, ns_since(&r.t0) / 1e9);
+	for (i = 0; i < r.npaths; i++)
+		for (l = 0; l < 3; l++)
+			if (r.files[i].fd[l] != -1)
+				close(r.files[i].fd[l]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,654 @@
+/* encfs-roots.c
+ * Striping a pa5-encfs mirror across several roots
+ *
+ * See encfs-roots.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "encfs-roots.h"
+#include "encfs-direct.h"
+#include "aes-crypt.h"
+
+#define ROOTS_MAGIC "pa5-encfs-roots"
+#define ROOT_MAGIC "pa5-encfs-root"
+#define ROOTS_VERSION 1
+#define ROOTS_ID_SIZE 16
+#define PART_ID_LABEL "pa5-encfs part"
+#define PART_INDEX 8			// u8, the root the part is on
+#define PART_WIDTH 9			// u8, the roots the file is striped over
+#define PART_NAME_SIZE (2 * ROOTS_ID_SIZE + 2)	// "xx/" and the rest
+#define PART_ABSENT -2			// looked for and not there
+
+struct encr_roots {
+	unsigned count;
+	int dirfds[ENCR_MAX_ROOTS];	// .encfs/parts of each, [0] unused
+};
+
+struct encr_parts {
+	const struct encr_roots *roots;
+	char name[PART_NAME_SIZE];
+	unsigned width;
+	unsigned fresh;			// bit per root: created since the last sync
+	int fds[ENCR_MAX_ROOTS];	// -1 until looked for, [0] unused
+};
+
+static void roots_hex(char *out, const unsigned char *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+/* Read .encfs/roots or .encfs/root: the mirror id and the count or index
+ * after it. Returns -ENOENT if there is none, -EINVAL if it is corrupt. */
+static int roots_file_read(const char *dir, const char *name,
+			   const char *magic, char *id, unsigned *val)
+{
+	char path[PATH_MAX];
+	char m[32];
+	unsigned version;
+	FILE *f;
+	int res = 0;
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", dir, ENCR_META_DIR,
+		     name) >= (int) sizeof(path))
+		return -ENAMETOOLONG;
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+	if (fscanf(f, "%31s %u id %32s %*s %u", m, &version, id, val) != 4 ||
+	    strcmp(m, magic) != 0 || version != ROOTS_VERSION ||
+	    strlen(id) != 2 * ROOTS_ID_SIZE)
+		res = -EINVAL;
+	fclose(f);
+	return res;
+}
+
+// Replace .encfs/roots or .encfs/root, as encr_config_write() does
+static int roots_file_write(const char *dir, const char *name,
+			    const char *magic, const char *id,
+			    const char *key, unsigned val)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	FILE *f;
+	int dfd;
+	int res = 0;
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", dir, ENCR_META_DIR,
+		     name) >= (int) sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+		return -ENAMETOOLONG;
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return -errno;
+	fprintf(f, "%s %u\nid %s\n%s %u\n", magic, ROOTS_VERSION, id, key, val);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		res = -errno;
+	if (fclose(f) != 0 && res == 0)
+		res = -errno;
+	if (res == 0 && rename(tmp, path) == -1)
+		res = -errno;
+	if (res != 0) {
+		unlink(tmp);
+		return res;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, ENCR_META_DIR);
+	dfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dfd == -1)
+		return -errno;
+	if (fsync(dfd) == -1)
+		res = -errno;
+	close(dfd);
+	return res;
+}
+
+// Whether a directory that is not a root yet can become one
+static int roots_dir_empty(const char *dir)
+{
+	struct dirent *d;
+	DIR *dp;
+	int empty = 1;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return -errno;
+	while ((d = readdir(dp)) != NULL)
+		if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0 &&
+		    strcmp(d->d_name, "lost+found") != 0)
+			empty = 0;
+	closedir(dp);
+	return empty;
+}
+
+// Make dir root number index of the mirror id
+static int roots_init(const char *dir, const char *id, unsigned index)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", dir, ENCR_META_DIR,
+		     ENCR_PARTS_DIR) >= (int) sizeof(path))
+		return -ENAMETOOLONG;
+	path[strlen(path) - strlen(ENCR_PARTS_DIR) - 1] = '\0';
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+	path[strlen(path)] = '/';
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+	return roots_file_write(dir, ENCR_ROOT_FILE, ROOT_MAGIC, id, "index",
+				index);
+}
+
+int encr_roots_open(const char *rootdir, const char *others, int add,
+		    struct encr_roots **rp)
+{
+	char id[2 * ROOTS_ID_SIZE + 1] = "";
+	char rid[2 * ROOTS_ID_SIZE + 1];
+	unsigned char raw[ROOTS_ID_SIZE];
+	const char *dirs[ENCR_MAX_ROOTS];
+	const char *added[ENCR_MAX_ROOTS];
+	struct stat seen[ENCR_MAX_ROOTS];
+	struct encr_roots *r = NULL;
+	char path[PATH_MAX];
+	char *list = NULL;
+	char *save = NULL;
+	char *dir;
+	unsigned count = 1;
+	unsigned nadded = 0;
+	unsigned nseen = 1;
+	unsigned index;
+	unsigned i;
+	int res;
+
+	*rp = NULL;
+	res = roots_file_read(rootdir, ENCR_ROOTS_FILE, ROOTS_MAGIC, id,
+			      &count);
+	if (res == -ENOENT) {
+		id[0] = '\0';
+		count = 1;
+	} else if (res != 0 || count < 1 || count > ENCR_MAX_ROOTS) {
+		fprintf(stderr, "pa5-encfs: %s/%s/%s is corrupt\n", rootdir,
+			ENCR_META_DIR, ENCR_ROOTS_FILE);
+		return res != 0 ? res : -EINVAL;
+	}
+	if (others == NULL || others[0] == '\0') {
+		if (count == 1)
+			return 0;
+		fprintf(stderr, "pa5-encfs: the mirror is striped over %u "
+			"roots; name the others with -o roots\n", count);
+		return -EINVAL;
+	}
+
+	list = strdup(others);
+	if (list == NULL)
+		return -ENOMEM;
+	memset(dirs, 0, sizeof(dirs));
+	if (stat(rootdir, &seen[0]) == -1) {
+		res = -errno;
+		goto out;
+	}
+	for (dir = strtok_r(list, ":", &save); dir != NULL;
+	     dir = strtok_r(NULL, ":", &save)) {
+		if (nseen == ENCR_MAX_ROOTS) {
+			fprintf(stderr, "pa5-encfs: at most %u roots\n",
+				ENCR_MAX_ROOTS);
+			res = -EINVAL;
+			goto out;
+		}
+		res = stat(dir, &seen[nseen]) == -1 ? -errno :
+			!S_ISDIR(seen[nseen].st_mode) ? -ENOTDIR : 0;
+		if (res != 0) {
+			fprintf(stderr, "pa5-encfs: root %s: %s\n", dir,
+				strerror(-res));
+			goto out;
+		}
+		for (i = 0; i < nseen; i++)
+			if (seen[i].st_dev == seen[nseen].st_dev &&
+			    seen[i].st_ino == seen[nseen].st_ino)
+				break;
+		if (i < nseen) {
+			fprintf(stderr, "pa5-encfs: root %s is named twice\n",
+				dir);
+			res = -EINVAL;
+			goto out;
+		}
+		nseen++;
+
+		res = roots_file_read(dir, ENCR_ROOT_FILE, ROOT_MAGIC, rid,
+				      &index);
+		if (res == 0) {
+			if (strcmp(rid, id) != 0) {
+				fprintf(stderr, "pa5-encfs: root %s belongs to "
+					"another mirror\n", dir);
+				res = -EINVAL;
+				goto out;
+			}
+			// Numbered past the count: an add that was cut short
+			if (index >= 1 && index < count) {
+				if (dirs[index] != NULL) {
+					fprintf(stderr, "pa5-encfs: roots %s and "
+						"%s are both root %u\n",
+						dirs[index], dir, index);
+					res = -EINVAL;
+					goto out;
+				}
+				dirs[index] = dir;
+				continue;
+			}
+		} else if (res == -ENOENT) {
+			res = roots_dir_empty(dir);
+			if (res == 0) {
+				fprintf(stderr, "pa5-encfs: root %s is neither "
+					"empty nor a root of this mirror\n", dir);
+				res = -ENOTEMPTY;
+			}
+			if (res < 0)
+				goto out;
+		} else {
+			fprintf(stderr, "pa5-encfs: root %s: %s/%s is "
+				"corrupt\n", dir, ENCR_META_DIR, ENCR_ROOT_FILE);
+			goto out;
+		}
+		if (!add) {
+			fprintf(stderr, "pa5-encfs: %s is not a root of this "
+				"mirror\n", dir);
+			res = -EINVAL;
+			goto out;
+		}
+		added[nadded++] = dir;
+	}
+	for (i = 1; i < count; i++) {
+		if (dirs[i] == NULL) {
+			fprintf(stderr, "pa5-encfs: root %u of %u is missing "
+				"from -o roots\n", i, count);
+			res = -EINVAL;
+			goto out;
+		}
+	}
+
+	// Each new root knows its number before the mirror counts it
+	if (nadded > 0) {
+		if (id[0] == '\0') {
+			if (!random_bytes(raw, sizeof(raw))) {
+				res = -EIO;
+				goto out;
+			}
+			roots_hex(id, raw, sizeof(raw));
+		}
+		for (i = 0; i < nadded; i++) {
+			res = roots_init(added[i], id, count);
+			if (res != 0) {
+				fprintf(stderr, "pa5-encfs: cannot make %s a "
+					"root: %s\n", added[i], strerror(-res));
+				goto out;
+			}
+			dirs[count++] = added[i];
+		}
+		res = roots_file_write(rootdir, ENCR_ROOTS_FILE, ROOTS_MAGIC,
+				       id, "count", count);
+		if (res != 0)
+			goto out;
+	}
+
+	r = calloc(1, sizeof(struct encr_roots));
+	if (r == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	r->count = count;
+	r->dirfds[0] = -1;
+	for (i = 1; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%s/%s", dirs[i], ENCR_META_DIR,
+			 ENCR_PARTS_DIR);
+		r->dirfds[i] = open(path, O_RDONLY | O_DIRECTORY);
+		if (r->dirfds[i] == -1) {
+			res = -errno;
+			r->count = i;
+			encr_roots_close(r);
+			r = NULL;
+			goto out;
+		}
+	}
+	*rp = r;
+	res = 0;
+out:
+	free(list);
+	return res;
+}
+
+void encr_roots_close(struct encr_roots *r)
+{
+	unsigned i;
+
+	if (r == NULL)
+		return;
+	for (i = 1; i < r->count; i++)
+		close(r->dirfds[i]);
+	free(r);
+}
+
+unsigned encr_roots_count(const struct encr_roots *r)
+{
+	return r == NULL ? 1 : r->count;
+}
+
+// Chunks in a stripe
+static uint64_t stripe_chunks(unsigned chunk_shift)
+{
+	return chunk_shift < ENCR_STRIPE_SHIFT ?
+		(uint64_t) 1 << (ENCR_STRIPE_SHIFT - chunk_shift) : 1;
+}
+
+void encr_stripe_locate(uint64_t c, unsigned chunk_shift, unsigned width,
+			unsigned *root, uint64_t *local)
+{
+	uint64_t per = stripe_chunks(chunk_shift);
+	uint64_t s = c / per;
+
+	*root = s % width;
+	*local = s / width * per + c % per;
+}
+
+uint64_t encr_stripe_chunk(uint64_t local, unsigned chunk_shift,
+			   unsigned width, unsigned root)
+{
+	uint64_t per = stripe_chunks(chunk_shift);
+
+	return (local / per * width + root) * per + local % per;
+}
+
+uint64_t encr_stripe_chunks(uint64_t n, unsigned chunk_shift, unsigned width,
+			    unsigned root)
+{
+	uint64_t per = stripe_chunks(chunk_shift);
+	uint64_t whole = n / per;
+	uint64_t have;
+
+	// Every root has had whole / width full stripes; the next ones go
+	// to the roots before the one the partial stripe is on
+	have = whole / width * per;
+	if (root < whole % width)
+		have += per;
+	else if (root == whole % width)
+		have += n % per;
+	return have;
+}
+
+static int parts_name(const struct encr_keys *k, char *name)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+
+	if (!hmac_sha256(k->mac, ENCR_KEY_SIZE,
+			 (const unsigned char *) PART_ID_LABEL,
+			 strlen(PART_ID_LABEL), NULL, 0, mac))
+		return -EIO;
+	roots_hex(name, mac, 1);
+	name[2] = '/';
+	roots_hex(name + 3, mac + 1, ROOTS_ID_SIZE - 1);
+	return 0;
+}
+
+int encr_parts_attach(struct encr_inode *in, const struct encr_header *h)
+{
+	struct encr_parts *p;
+	unsigned i;
+	int res;
+
+	if (in->parts != NULL)
+		return 0;
+	if (h->width < 2 || h->width > encr_roots_count(in->roots))
+		return -EIO;
+	p = calloc(1, sizeof(struct encr_parts));
+	if (p == NULL)
+		return -ENOMEM;
+	res = parts_name(&h->keys, p->name);
+	if (res != 0) {
+		free(p);
+		return res;
+	}
+	p->roots = in->roots;
+	p->width = h->width;
+	for (i = 0; i < ENCR_MAX_ROOTS; i++)
+		p->fds[i] = -1;
+	in->parts = p;
+	return 0;
+}
+
+// Create a part with its header, and its directory if need be
+static int part_create(struct encr_parts *p, unsigned root)
+{
+	unsigned char hdr[ENCR_HEADER_SIZE];
+	int dfd = p->roots->dirfds[root];
+	char dir[3] = { p->name[0], p->name[1], '\0' };
+	int fd;
+	int res;
+
+	fd = openat(dfd, p->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdirat(dfd, dir, 0700) == -1 && errno != EEXIST)
+			return -errno;
+		fd = openat(dfd, p->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd == -1)
+		return -errno;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, ENCR_PART_MAGIC, ENCR_MAGIC_LEN);
+	hdr[PART_INDEX] = root;
+	hdr[PART_WIDTH] = p->width;
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		res = errno ? -errno : -EIO;
+		close(fd);
+		unlinkat(dfd, p->name, 0);
+		return res;
+	}
+	p->fresh |= 1u << root;
+	return fd;
+}
+
+int encr_part_fd(struct encr_inode *in, unsigned root, int create)
+{
+	struct encr_parts *p;
+	int fd;
+
+	pthread_mutex_lock(&in->lock);
+	p = in->parts;
+	if (p == NULL || root == 0 || root >= p->width) {
+		fd = -EIO;
+		goto out;
+	}
+	fd = p->fds[root];
+	if (fd >= 0 || (fd == PART_ABSENT && !create))
+		goto out;
+
+	fd = openat(p->roots->dirfds[root], p->name, O_RDWR);
+	if (fd == -1 && errno == ENOENT && create)
+		fd = part_create(p, root);
+	else if (fd == -1)
+		fd = -errno;
+	if (fd == -ENOENT)
+		p->fds[root] = PART_ABSENT;
+	if (fd < 0)
+		goto out;
+	// Best effort, as for the handles themselves
+	if (in->direct)
+		encr_dio_enable(fd);
+	p->fds[root] = fd;
+out:
+	pthread_mutex_unlock(&in->lock);
+	return fd;
+}
+
+int encr_part_open(const struct encr_roots *r, const struct encr_keys *k,
+		   unsigned width, unsigned root)
+{
+	unsigned char hdr[ENCR_HEADER_SIZE];
+	char name[PART_NAME_SIZE];
+	ssize_t n;
+	int fd;
+	int res;
+
+	if (root == 0 || root >= width || width > encr_roots_count(r))
+		return -EIO;
+	res = parts_name(k, name);
+	if (res != 0)
+		return res;
+	fd = openat(r->dirfds[root], name, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	n = pread(fd, hdr, sizeof(hdr), 0);
+	if (n == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	if (n != sizeof(hdr) ||
+	    memcmp(hdr, ENCR_PART_MAGIC, ENCR_MAGIC_LEN) != 0 ||
+	    hdr[PART_INDEX] != root || hdr[PART_WIDTH] != width) {
+		close(fd);
+		return -EBADMSG;
+	}
+	return fd;
+}
+
+int encr_part_cut(struct encr_inode *in, unsigned root, off_t size)
+{
+	struct encr_parts *p;
+	struct stat st;
+	int fd;
+	int res = 0;
+
+	pthread_mutex_lock(&in->lock);
+	p = in->parts;
+	if (p == NULL || root == 0 || root >= p->width) {
+		res = -EIO;
+		goto out;
+	}
+	if (size == 0) {
+		if (p->fds[root] >= 0)
+			close(p->fds[root]);
+		p->fds[root] = PART_ABSENT;
+		p->fresh &= ~(1u << root);
+		if (unlinkat(p->roots->dirfds[root], p->name, 0) == -1 &&
+		    errno != ENOENT)
+			res = -errno;
+		goto out;
+	}
+	fd = p->fds[root];
+	if (fd == -1) {
+		fd = openat(p->roots->dirfds[root], p->name, O_RDWR);
+		if (fd == -1) {
+			res = errno == ENOENT ? 0 : -errno;
+			goto out;
+		}
+		p->fds[root] = fd;
+	}
+	if (fd >= 0 && (fstat(fd, &st) == -1 ||
+			(st.st_size > size && ftruncate(fd, size) == -1)))
+		res = -errno;
+out:
+	pthread_mutex_unlock(&in->lock);
+	return res;
+}
+
+int encr_parts_sync(struct encr_inode *in, int full)
+{
+	struct encr_parts *p;
+	char dir[3];
+	int fds[ENCR_MAX_ROOTS];
+	int dirfds[ENCR_MAX_ROOTS];
+	unsigned fresh;
+	unsigned width;
+	unsigned i;
+	int dfd;
+	int res = 0;
+
+	/* Synced on copies of the descriptors, so neither the inode's lock
+	 * nor its parts are held through the flush */
+	pthread_mutex_lock(&in->lock);
+	p = in->parts;
+	if (p == NULL) {
+		pthread_mutex_unlock(&in->lock);
+		return 0;
+	}
+	width = p->width;
+	fresh = p->fresh;
+	p->fresh = 0;
+	dir[0] = p->name[0];
+	dir[1] = p->name[1];
+	dir[2] = '\0';
+	for (i = 1; i < width; i++) {
+		fds[i] = p->fds[i] >= 0 ? dup(p->fds[i]) : -1;
+		dirfds[i] = p->roots->dirfds[i];
+	}
+	pthread_mutex_unlock(&in->lock);
+
+	for (i = 1; i < width; i++) {
+		if (fds[i] == -1)
+			continue;
+		if ((full ? fsync(fds[i]) : fdatasync(fds[i])) == -1 &&
+		    res == 0)
+			res = -errno;
+		close(fds[i]);
+		if (!(fresh & (1u << i)))
+			continue;
+		// The part's directory, and parts/ in case that was new too
+		dfd = openat(dirfds[i], dir, O_RDONLY | O_DIRECTORY);
+		if ((dfd == -1 || fsync(dfd) == -1 ||
+		     fsync(dirfds[i]) == -1) && res == 0)
+			res = -errno;
+		if (dfd != -1)
+			close(dfd);
+	}
+	if (res != 0) {
+		pthread_mutex_lock(&in->lock);
+		if (in->parts == p)
+			p->fresh |= fresh;
+		pthread_mutex_unlock(&in->lock);
+	}
+	return res;
+}
+
+void encr_parts_drop(struct encr_inode *in)
+{
+	unsigned i;
+
+	if (in->parts == NULL)
+		return;
+	for (i = 1; i < in->parts->width; i++)
+		if (in->parts->fds[i] >= 0)
+			close(in->parts->fds[i]);
+	free(in->parts);
+	in->parts = NULL;
+}
+
+int encr_parts_remove(const struct encr_roots *r, const struct encr_keys *k,
+		      unsigned width)
+{
+	char name[PART_NAME_SIZE];
+	unsigned i;
+	int res;
+
+	if (width > encr_roots_count(r))
+		return -EIO;
+	res = parts_name(k, name);
+	for (i = 1; i < width && res == 0; i++)
+		if (unlinkat(r->dirfds[i], name, 0) == -1 && errno != ENOENT)
+			res = -errno;
+	return res;
+}
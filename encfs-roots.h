@@ -0,0 +1,173 @@
+/* encfs-roots.h
+ * Striping a pa5-encfs mirror across several roots
+ *
+ * With -o roots=DIR[:DIR...] the files of a mount are spread over the
+ * mirror directory and the other directories named, each meant to be on
+ * a disk of its own, so large reads and writes keep all of them busy.
+ * The mirror directory, root 0, stays the one place everything but file
+ * data lives: the whole tree, permissions, xattrs, every file's header
+ * and plaintext size, .encfs and its config. The others only ever hold
+ * parts of files:
+ *
+ *   <root 0>/.encfs/roots     mirror id and how many roots it has
+ *   <root N>/.encfs/root      the same mirror id and N
+ *   <root N>/.encfs/parts/xx/<rest of id>
+ *                             file data on root N: a header
+ *                             (ENCR_PART_MAGIC, N, the file's width) and
+ *                             chunk records at the same offsets as in
+ *                             a file in the plain format
+ *
+ * where a file's part id is derived from its data keys, like its change
+ * map. A file striped over W roots (ENCR_FLAG_STRIPED, see
+ * encfs-format.h) takes ENCR_STRIPE_SHIFT bytes (or one chunk, if chunks
+ * are larger) for each root in turn: stripe s of the file goes on root
+ * s % W, as the stripes of that root numbered in order. Its first stripe
+ * is in the file on root 0 itself, after the header. A part is created
+ * when something is first written to it, and a part, or a record in one,
+ * that was never written reads back as zeros.
+ *
+ * Roots may be named in any order; each knows its number. A directory
+ * named that is empty becomes a new root, and new files are striped
+ * across every root from then on. Files already there keep their width
+ * until rewritten, which the migrator (-o migrate) or encfs-rebalance
+ * does. A root cannot be taken away again.
+ *
+ * encfs-export archives one directory, and the parts on the other roots
+ * are what a mount cannot do without, so it refuses every root of a
+ * mirror that has more than one: back such a mirror up by copying each
+ * root whole, and restore every one of them together. encfs-scrub takes
+ * the other roots with -R and checks every part.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_ROOTS_H
+#define ENCFS_ROOTS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encfs-format.h"
+#include "encfs-lock.h"
+
+#define ENCR_ROOTS_FILE "roots"		// .encfs/roots on root 0
+#define ENCR_ROOT_FILE "root"		// .encfs/root on the others
+#define ENCR_PARTS_DIR "parts"		// .encfs/parts on the others
+#define ENCR_PART_MAGIC "PA5EPART"
+#define ENCR_MAX_ROOTS 32
+/* 64 KiB of a file on each root in turn; at least ENCR_PACK_LIMIT, so a
+ * file small enough to pack never has parts (see encfs-pack.h) */
+#define ENCR_STRIPE_SHIFT 16
+
+struct encr_roots;
+struct encr_parts;
+
+/* int encr_roots_open(const char *rootdir, const char *others, int add, struct encr_roots **rp)
+ * Purpose: Find the other roots of the mirror rootdir among others, a
+ *          colon separated list of directories, making the empty ones
+ *          new roots if add is set
+ * Args: const char *others      : -o roots, NULL if not given
+ *       int add                 : 0 to refuse a directory that is not
+ *                                 a root yet, and write nothing
+ *       struct encr_roots **rp  : Set to the roots, or to NULL if the
+ *                                 mirror has only the one
+ * Return: 0 on success, -EINVAL if a root is missing, named twice or
+ *         belongs to another mirror (or is new and add is 0),
+ *         -ENOTEMPTY for a directory that is neither empty nor a root,
+ *         -errno on failure
+ */
+extern int encr_roots_open(const char *rootdir, const char *others, int add,
+			   struct encr_roots **rp);
+
+/* void encr_roots_close(struct encr_roots *r)
+ * Purpose: Free r; r may be NULL
+ */
+extern void encr_roots_close(struct encr_roots *r);
+
+/* unsigned encr_roots_count(const struct encr_roots *r)
+ * Purpose: How many roots there are, 1 if r is NULL
+ */
+extern unsigned encr_roots_count(const struct encr_roots *r);
+
+/* void encr_stripe_locate(uint64_t c, unsigned chunk_shift, unsigned width, unsigned *root, uint64_t *local)
+ * Purpose: Which root chunk c of a file striped over width roots is on,
+ *          and which of that root's chunks of the file it is
+ */
+extern void encr_stripe_locate(uint64_t c, unsigned chunk_shift,
+			       unsigned width, unsigned *root,
+			       uint64_t *local);
+
+/* uint64_t encr_stripe_chunk(uint64_t local, unsigned chunk_shift, unsigned width, unsigned root)
+ * Purpose: Which chunk of a file striped over width roots chunk local of
+ *          those on root is; the other way round from encr_stripe_locate()
+ */
+extern uint64_t encr_stripe_chunk(uint64_t local, unsigned chunk_shift,
+				  unsigned width, unsigned root);
+
+/* uint64_t encr_stripe_chunks(uint64_t n, unsigned chunk_shift, unsigned width, unsigned root)
+ * Purpose: How many of the first n chunks of a file striped over width
+ *          roots are on root
+ */
+extern uint64_t encr_stripe_chunks(uint64_t n, unsigned chunk_shift,
+				   unsigned width, unsigned root);
+
+/* int encr_parts_attach(struct encr_inode *in, const struct encr_header *h)
+ * Purpose: Set up in->parts for a striped file with header h as it is
+ *          loaded, in->lock held and in->roots set
+ * Return: 0 on success, -EIO if the file is wider than the mount has
+ *         roots, -errno on failure
+ */
+extern int encr_parts_attach(struct encr_inode *in,
+			     const struct encr_header *h);
+
+/* int encr_part_fd(struct encr_inode *in, unsigned root, int create)
+ * Purpose: The open part of a striped file on root (not 0), creating it
+ *          if it does not exist and create is set; kept open until the
+ *          inode is freed
+ * Return: A file descriptor, -ENOENT if there is no part and create is
+ *         0, -errno on failure
+ */
+extern int encr_part_fd(struct encr_inode *in, unsigned root, int create);
+
+/* int encr_part_open(const struct encr_roots *r, const struct encr_keys *k, unsigned width, unsigned root)
+ * Purpose: Open the part on root (not 0) of the file with data keys k,
+ *          striped over width roots, read only and without an inode,
+ *          checking its header (for encfs-scrub)
+ * Return: A file descriptor, -ENOENT if there is no part, -EBADMSG if
+ *         its header is not that of this part, -errno on failure
+ */
+extern int encr_part_open(const struct encr_roots *r,
+			  const struct encr_keys *k, unsigned width,
+			  unsigned root);
+
+/* int encr_part_cut(struct encr_inode *in, unsigned root, off_t size)
+ * Purpose: Cut the part on root back to size bytes, or remove it if size
+ *          is 0; a part shorter than that already is left alone. Every
+ *          stripe of in held.
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_part_cut(struct encr_inode *in, unsigned root, off_t size);
+
+/* int encr_parts_sync(struct encr_inode *in, int full)
+ * Purpose: fsync() (or with full 0, fdatasync()) every open part, and
+ *          the directory of each created since the last time
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_parts_sync(struct encr_inode *in, int full);
+
+/* void encr_parts_drop(struct encr_inode *in)
+ * Purpose: Close and free in->parts; called as the inode is freed
+ */
+extern void encr_parts_drop(struct encr_inode *in);
+
+/* int encr_parts_remove(const struct encr_roots *r, const struct encr_keys *k, unsigned width)
+ * Purpose: Remove every part of the file with data keys k, striped over
+ *          width roots, that has lost its last link and handle or been
+ *          rewritten
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_parts_remove(const struct encr_roots *r,
+			     const struct encr_keys *k, unsigned width);
+
+#endif
@@ -0,0 +1,376 @@
+/* encfs-sched.c
+ * Priority classes and per-user fair sharing of pa5-encfs's I/O
+ *
+ * See encfs-sched.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "encfs-sched.h"
+
+#define SCHED_BUCKETS 64
+#define SCHED_BURST 1.0			// seconds of a rate a bucket holds
+
+// A rate limit; tokens are bytes and go negative when overdrawn
+struct sched_bucket {
+	double rate;			// bytes/s, 0 for unlimited
+	double tokens;
+	double stamp;			// when tokens was last brought up to date
+};
+
+struct sched_user {
+	struct sched_user *next;
+	unsigned uid;
+	unsigned weight;
+	unsigned busy;			// its requests let in
+	double finish[ENCR_SCHED_CLASSES];	// tag after its last request
+	struct sched_bucket limit;
+};
+
+// Whose request the thread is running, between enter and leave
+static __thread struct sched_user *sched_held;
+
+// One request waiting to be let in, on its thread's stack
+struct sched_wait {
+	struct sched_wait *next;
+	struct sched_user *user;
+	int cls;
+	double cost;
+	double tag;
+	double since;
+	pthread_cond_t cond;		// signalled once let in
+	int granted;
+};
+
+struct sched_weight {
+	unsigned uid;
+	unsigned weight;
+};
+
+struct encr_sched {
+	pthread_mutex_t lock;
+	pthread_condattr_t attr;	// for the waiters' conditions
+	unsigned slots;
+	unsigned busy;			// requests let in, metadata aside;
+					// may be over slots, see dispatch
+	unsigned (*caller)(void);
+	double user_rate;
+	double vtime[ENCR_SCHED_CLASSES];	// tag of the last let in
+	struct sched_bucket limit[ENCR_SCHED_CLASSES];
+	struct sched_user *users[SCHED_BUCKETS];
+	struct sched_user maint;	// the background threads
+	struct sched_user spill;	// users that could not be allocated
+	struct sched_wait *queue;
+	struct sched_weight *weights;
+	size_t nweights;
+};
+
+static double sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bucket_init(struct sched_bucket *b, double rate, double now)
+{
+	b->rate = rate;
+	b->tokens = b->rate * SCHED_BURST;
+	b->stamp = now;
+}
+
+/* Whether b lets a request in at now; if not, lowers *when to the time
+ * it will */
+static int bucket_open(struct sched_bucket *b, double now, double *when)
+{
+	if (b->rate == 0)
+		return 1;
+	b->tokens += (now - b->stamp) * b->rate;
+	if (b->tokens > b->rate * SCHED_BURST)
+		b->tokens = b->rate * SCHED_BURST;
+	b->stamp = now;
+	if (b->tokens >= 0)
+		return 1;
+	if (now - b->tokens / b->rate < *when)
+		*when = now - b->tokens / b->rate;
+	return 0;
+}
+
+static int sched_parse_weights(struct encr_sched *s, const char *list)
+{
+	const char *p = list;
+	unsigned long uid, weight;
+	char *end;
+
+	while (p != NULL && *p != '\0') {
+		uid = strtoul(p, &end, 10);
+		if (end == p || *end != '=' || uid > (unsigned) -1)
+			return -EINVAL;
+		p = end + 1;
+		weight = strtoul(p, &end, 10);
+		if (end == p || (*end != ':' && *end != '\0') ||
+		    weight == 0 || weight > ENCR_SCHED_MAX_WEIGHT)
+			return -EINVAL;
+		p = *end == ':' ? end + 1 : end;
+		if (s->nweights % 16 == 0) {
+			struct sched_weight *more;
+
+			more = realloc(s->weights, (s->nweights + 16) *
+				       sizeof(struct sched_weight));
+			if (more == NULL)
+				return -ENOMEM;
+			s->weights = more;
+		}
+		s->weights[s->nweights].uid = uid;
+		s->weights[s->nweights].weight = weight;
+		s->nweights++;
+	}
+	return 0;
+}
+
+// The user uid, added on first sight; with s->lock held
+static struct sched_user *sched_user(struct encr_sched *s, unsigned uid,
+				     double now)
+{
+	struct sched_user **head = &s->users[uid % SCHED_BUCKETS];
+	struct sched_user *u;
+	size_t i;
+
+	for (u = *head; u != NULL; u = u->next)
+		if (u->uid == uid)
+			return u;
+	u = calloc(1, sizeof(struct sched_user));
+	if (u == NULL)
+		return &s->spill;
+	u->uid = uid;
+	u->weight = 1;
+	for (i = 0; i < s->nweights; i++)
+		if (s->weights[i].uid == uid)
+			u->weight = s->weights[i].weight;
+	bucket_init(&u->limit, s->user_rate, now);
+	u->next = *head;
+	*head = u;
+	return u;
+}
+
+// Whether w's budgets let it in at now, lowering *when if not
+static int sched_allowed(struct encr_sched *s, struct sched_wait *w,
+			 double now, double *when)
+{
+	int ok = 1;
+
+	if (w->cls != ENCR_SCHED_BACKGROUND)
+		ok &= bucket_open(&w->user->limit, now, when);
+	ok &= bucket_open(&s->limit[w->cls], now, when);
+	return ok;
+}
+
+/* The waiter to let in next, NULL if every one is over its budget;
+ * with s->lock held. One that has waited ENCR_SCHED_MAX_WAIT counts as
+ * foreground data and goes ahead of those that have not, oldest first. */
+static struct sched_wait *sched_pick(struct encr_sched *s, double now,
+				     double *when)
+{
+	struct sched_wait *best = NULL;
+	struct sched_wait *w;
+	int best_cls = ENCR_SCHED_CLASSES, best_aged = 0;
+	int cls, aged;
+
+	for (w = s->queue; w != NULL; w = w->next) {
+		if (!sched_allowed(s, w, now, when))
+			continue;
+		aged = (now - w->since) * 1000 >= ENCR_SCHED_MAX_WAIT;
+		cls = aged && w->cls > ENCR_SCHED_DATA ? ENCR_SCHED_DATA :
+			w->cls;
+		if (best != NULL &&
+		    (cls > best_cls ||
+		     (cls == best_cls && best_aged && !aged) ||
+		     (cls == best_cls && best_aged && aged &&
+		      w->since >= best->since) ||
+		     (cls == best_cls && !best_aged && !aged &&
+		      w->tag >= best->tag)))
+			continue;
+		best = w;
+		best_cls = cls;
+		best_aged = aged;
+	}
+	return best;
+}
+
+// Let w in, charging its budgets; with s->lock held
+static void sched_grant(struct encr_sched *s, struct sched_wait *w)
+{
+	struct sched_wait **pp;
+
+	for (pp = &s->queue; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == w) {
+			*pp = w->next;
+			break;
+		}
+	s->busy++;
+	w->user->busy++;
+	if (w->tag > s->vtime[w->cls])
+		s->vtime[w->cls] = w->tag;
+	if (w->cls != ENCR_SCHED_BACKGROUND)
+		w->user->limit.tokens -= w->cost;
+	s->limit[w->cls].tokens -= w->cost;
+	w->granted = 1;
+	pthread_cond_signal(&w->cond);
+}
+
+/* Let in whoever may go now, and set *when to the latest time anyone
+ * still waiting should look again; with s->lock held.
+ *
+ * A user with no request in goes in with foreground data at once, past
+ * the slots if need be: waiting for a slot would mean waiting for a heavy
+ * user's request to finish, as one cannot be preempted. So the slots
+ * only ever hold back a user's second request on. */
+static void sched_dispatch(struct encr_sched *s, double now, double *when)
+{
+	struct sched_wait *w, *next;
+
+	*when = now + ENCR_SCHED_MAX_WAIT / 1000.0;
+	for (w = s->queue; w != NULL; w = next) {
+		next = w->next;
+		if (w->cls == ENCR_SCHED_DATA && w->user->busy == 0 &&
+		    sched_allowed(s, w, now, when))
+			sched_grant(s, w);
+	}
+	while (s->busy < s->slots && (w = sched_pick(s, now, when)) != NULL)
+		sched_grant(s, w);
+}
+
+int encr_sched_enter(struct encr_sched *s, int cls, size_t bytes)
+{
+	struct sched_wait w;
+	struct sched_wait **pp;
+	struct timespec ts;
+	double now, when;
+	unsigned uid;
+
+	// Metadata is never held back behind data
+	if (s == NULL || cls == ENCR_SCHED_META)
+		return ENCR_SCHED_META;
+	uid = cls != ENCR_SCHED_BACKGROUND && s->caller != NULL ?
+		s->caller() : 0;
+	now = sched_now();
+
+	pthread_mutex_lock(&s->lock);
+	w.user = cls == ENCR_SCHED_BACKGROUND ? &s->maint :
+		sched_user(s, uid, now);
+	w.cls = cls;
+	w.cost = bytes > ENCR_SCHED_MIN_COST ? bytes : ENCR_SCHED_MIN_COST;
+	w.tag = s->vtime[cls] > w.user->finish[cls] ?
+		s->vtime[cls] : w.user->finish[cls];
+	w.user->finish[cls] = w.tag + w.cost / w.user->weight;
+	w.since = now;
+	w.granted = 0;
+	pthread_cond_init(&w.cond, &s->attr);
+	w.next = NULL;
+	for (pp = &s->queue; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = &w;
+
+	// Woken when let in; looks again itself when a budget fills or it
+	// comes of age, as nobody else may be about to
+	sched_dispatch(s, now, &when);
+	while (!w.granted) {
+		ts.tv_sec = (time_t) when;
+		ts.tv_nsec = (long) ((when - ts.tv_sec) * 1e9);
+		if (pthread_cond_timedwait(&w.cond, &s->lock, &ts) ==
+		    ETIMEDOUT && !w.granted)
+			sched_dispatch(s, sched_now(), &when);
+	}
+	pthread_mutex_unlock(&s->lock);
+	pthread_cond_destroy(&w.cond);
+	sched_held = w.user;
+	return cls;
+}
+
+void encr_sched_leave(struct encr_sched *s, int gate)
+{
+	double when;
+
+	if (s == NULL || gate == ENCR_SCHED_META)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->busy--;
+	sched_held->busy--;
+	sched_held = NULL;
+	sched_dispatch(s, sched_now(), &when);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int encr_sched_open(unsigned slots, const char *weights, unsigned user_rate,
+		    unsigned readahead_rate, unsigned background_rate,
+		    unsigned (*caller)(void), struct encr_sched **sp)
+{
+	struct encr_sched *s;
+	double now = sched_now();
+	long ncpu;
+	int res;
+
+	*sp = NULL;
+	if (slots == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		slots = ncpu < 1 ? 1 : ncpu > ENCR_MAX_SLOTS ?
+			ENCR_MAX_SLOTS : (unsigned) ncpu;
+	}
+	if (slots > ENCR_MAX_SLOTS)
+		return -EINVAL;
+	s = calloc(1, sizeof(struct encr_sched));
+	if (s == NULL)
+		return -ENOMEM;
+	res = sched_parse_weights(s, weights);
+	if (res != 0) {
+		free(s->weights);
+		free(s);
+		return res;
+	}
+	s->slots = slots;
+	s->caller = caller;
+	s->user_rate = user_rate * 1024.0;
+	bucket_init(&s->limit[ENCR_SCHED_READAHEAD], readahead_rate * 1024.0,
+		    now);
+	bucket_init(&s->limit[ENCR_SCHED_BACKGROUND],
+		    background_rate * 1024.0, now);
+	s->maint.weight = 1;
+	s->spill.weight = 1;
+	bucket_init(&s->spill.limit, s->user_rate, now);
+	pthread_mutex_init(&s->lock, NULL);
+	// Timed waits are for budgets, which run on the monotonic clock
+	pthread_condattr_init(&s->attr);
+	pthread_condattr_setclock(&s->attr, CLOCK_MONOTONIC);
+	*sp = s;
+	return 0;
+}
+
+void encr_sched_close(struct encr_sched *s)
+{
+	struct sched_user *u;
+	size_t i;
+
+	if (s == NULL)
+		return;
+	for (i = 0; i < SCHED_BUCKETS; i++) {
+		while ((u = s->users[i]) != NULL) {
+			s->users[i] = u->next;
+			free(u);
+		}
+	}
+	pthread_condattr_destroy(&s->attr);
+	pthread_mutex_destroy(&s->lock);
+	free(s->weights);
+	free(s);
+}
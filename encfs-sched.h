@@ -0,0 +1,111 @@
+/* encfs-sched.h
+ * Priority classes and per-user fair sharing of pa5-encfs's I/O
+ *
+ * Without a scheduler, whoever sends the most requests gets the most of
+ * the worker threads and of the crypto and backing disk behind them: a
+ * single dd, or the migrator, can leave an interactive user's reads
+ * queued behind dozens of its own. With -o io_sched the callbacks that
+ * encrypt, decrypt or move file data enter the scheduler before they
+ * take any lock and leave it once they are done, as do the background
+ * threads between units of work, and at most io_slots of them (by
+ * default one per online CPU) run at a time. The rest wait, and are let
+ * in by class first, then by user:
+ *
+ *   ENCR_SCHED_META        everything else: lookups, listings, opens and
+ *                          creates; never kept waiting, and the callbacks
+ *                          do not enter for it, so an ls or an open does
+ *                          not queue behind data
+ *   ENCR_SCHED_DATA        reads, writes and truncates; fsync does not
+ *                          enter, as it spends its time asleep on the
+ *                          disk and would only keep a slot idle
+ *   ENCR_SCHED_READAHEAD   reads that carry on a sequential run of
+ *                          ENCR_SCHED_SEQ_RUN bytes or more on a handle;
+ *                          most are the kernel reading ahead of a
+ *                          streaming reader, which can wait
+ *   ENCR_SCHED_BACKGROUND  the migrator, log cleaner, packer and cache
+ *                          flusher, between units of work
+ *
+ * A request that has waited ENCR_SCHED_MAX_WAIT ms goes in with
+ * foreground data, so the lower classes slow down under load but never
+ * stop. Within a class, users (by the uid of the caller) share the slots
+ * by start-time fair queuing: each request is tagged with its user's
+ * virtual time, advanced by its size over the user's weight, and the
+ * lowest tag goes first, so two users get data through in the ratio of
+ * their weights however many requests each has queued. Weights default
+ * to 1 and are set with -o io_weights=UID=W[:UID=W...]. A user with no
+ * request in goes straight in with foreground data, past the slots if
+ * they are full: a request already let in cannot be preempted, so that
+ * is the only way a light user's read does not wait for a bulk user's.
+ * It also means io_slots bounds each user's second request on, not the
+ * requests running: with many users active, up to io_slots plus one per
+ * user can be in at once.
+ *
+ * Rate limits in KiB/s are optional: io_user_rate caps each user's data
+ * and readahead, io_readahead_rate and io_background_rate cap those two
+ * classes as a whole. A limit lets a request in while its budget is not
+ * overdrawn and then charges all of it, so a request larger than a
+ * second's budget still goes through, and the next one waits longer.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_SCHED_H
+#define ENCFS_SCHED_H
+
+#include <stddef.h>
+
+enum encr_sched_class {
+	ENCR_SCHED_META,
+	ENCR_SCHED_DATA,
+	ENCR_SCHED_READAHEAD,
+	ENCR_SCHED_BACKGROUND,
+	ENCR_SCHED_CLASSES
+};
+
+#define ENCR_SCHED_SEQ_RUN (1 << 20)	// bytes read in a row
+#define ENCR_SCHED_MAX_WAIT 1000	// ms
+#define ENCR_SCHED_MIN_COST 4096	// bytes a request counts for at least
+#define ENCR_SCHED_MAX_WEIGHT 1000
+#define ENCR_MAX_SLOTS 256
+
+struct encr_sched;
+
+/* int encr_sched_open(unsigned slots, const char *weights, unsigned user_rate, unsigned readahead_rate, unsigned background_rate, unsigned (*caller)(void), struct encr_sched **sp)
+ * Purpose: Set up a scheduler
+ * Args: unsigned slots             : Requests let in at once, 0 for one
+ *                                    per online CPU
+ *       const char *weights        : UID=W[:UID=W...], or NULL
+ *       unsigned user_rate         : KiB/s per user, 0 for unlimited
+ *       unsigned readahead_rate    : KiB/s of readahead, 0 for unlimited
+ *       unsigned background_rate   : KiB/s of background work, 0 for
+ *                                    unlimited
+ *       unsigned (*caller)(void)   : uid of the caller of the callback
+ *                                    the current thread runs; NULL if
+ *                                    every caller is the same user
+ *       struct encr_sched **sp     : Set to the scheduler
+ * Return: 0 on success, -EINVAL if weights or slots are malformed or out
+ *         of range, -ENOMEM
+ */
+extern int encr_sched_open(unsigned slots, const char *weights,
+			   unsigned user_rate, unsigned readahead_rate,
+			   unsigned background_rate, unsigned (*caller)(void),
+			   struct encr_sched **sp);
+
+/* void encr_sched_close(struct encr_sched *s)
+ * Purpose: Free s, which nothing may be inside any more; s may be NULL
+ */
+extern void encr_sched_close(struct encr_sched *s);
+
+/* int encr_sched_enter(struct encr_sched *s, int cls, size_t bytes)
+ * void encr_sched_leave(struct encr_sched *s, int gate)
+ * Purpose: Bracket one request of class cls moving about bytes of file
+ *          data, waiting in enter until the scheduler lets it in; enter
+ *          returns the gate to pass to leave. Both do nothing if s is
+ *          NULL. Never called with a lock held that a request already
+ *          let in could wait for, nor nested.
+ */
+extern int encr_sched_enter(struct encr_sched *s, int cls, size_t bytes);
+extern void encr_sched_leave(struct encr_sched *s, int gate);
+
+#endif
@@ -0,0 +1,1061 @@
+/* encfs-scrub.c
+ * Verify every encrypted file of a pa5-encfs mirror
+ *
+ * Reads back every chunk of every encrypted file, and every chunk in the
+ * chunk store, and checks that it authenticates under the mirror's keys,
+ * the same way the mount would when the chunk is read. Nothing is
+ * written. The work is a pipeline so the disks never wait for the CPUs
+ * or the other way round:
+ *
+ *   walk    one thread lists the mirror and the chunk store
+ *   I/O     -j threads read each file's header, then its records (or
+ *           index blocks and slots, or chunk table, or records out of
+ *           the log, or a pack's records) in runs of up to
+ *           SCRUB_SEGMENT bytes, at most -r MiB/s between them; stored
+ *           chunks are read and checked here whole
+ *   verify  -v threads authenticate and decrypt the runs
+ *
+ * Damage is written to the report (-o, standard output by default) as
+ * one JSON object per line, then a summary object:
+ *
+ *   {"path":"/m/a","chunk":12,"error":"record"}
+ *   {"path":"/m/b","chunk":null,"error":"header"}
+ *   {"summary":{"files":...,"damaged_files":...,...}}
+ *
+ * where error is one of header (no header, or not written with this key
+ * phrase), size (the plaintext size field), record (a chunk fails
+ * authentication), index (an impossible compressed record length),
+ * truncated (a record past the end of the file), table (a chunk table
+ * entry fails authentication), missing (a table entry whose chunk is not
+ * in the store, or a log-structured file in a mirror without a log), log
+ * (a log record that fails the log key's tag), part (a part on another
+ * root whose header is not the file's), store (a stored chunk that is
+ * damaged) or io (with an errno text). The log (see encfs-log.h) is
+ * indexed the way the mount would, without writing a checkpoint. Every
+ * record of a directory's pack of small files (see encfs-pack.h) is
+ * checked under the pack's keys, and counts as a chunk numbered by its
+ * offset. A mirror striped over several roots (see encfs-roots.h) needs
+ * the others named with -R, as for -o roots, and each chunk of a striped
+ * file is read from root 0 or the part its stripe went to; a directory
+ * named that is not a root already is refused. Run it on an unmounted
+ * mirror, or one that is not being written; files changing under it
+ * show up as damaged.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-format.h"
+#include "encfs-compress.h"
+#include "encfs-store.h"
+#include "encfs-log.h"
+#include "encfs-pack.h"
+#include "encfs-roots.h"
+
+#define MAXTHREADS 256
+#define SCRUB_SEGMENT (1024 * 1024)	// backing bytes per read
+#define SCRUB_QUEUE 64			// items waiting between stages
+
+enum { FMT_PLAIN, FMT_COMPRESSED, FMT_DEDUP, FMT_LOG, FMT_STRIPED, FMT_PACK };
+
+// An encrypted file being checked, shared by its runs
+struct scrub_file {
+	char *path;
+	struct encr_keys keys;
+	int fmt;
+	unsigned chunk_shift;
+	unsigned width;			// roots a striped file is spread over
+	unsigned refs;			// runs not yet verified, plus the reader
+	int damaged;
+};
+
+// A run of consecutive chunks read by an I/O thread
+struct scrub_run {
+	struct scrub_file *f;
+	uint64_t c0;			// of those on root, for a striped file
+	unsigned root;
+	unsigned n;
+	size_t stride;			// from one record to the next, 0 for
+					// pack records back to back
+	uint32_t *want;			// per chunk: record length, 0 for none
+	unsigned char *buf;
+	size_t len;			// bytes read into buf
+};
+
+// Bounded queue between two stages
+struct scrub_queue {
+	void **items;
+	unsigned head;
+	unsigned count;
+	unsigned cap;
+	int done;			// no more puts
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+};
+
+// A path from the walk, with what it is
+struct scrub_item {
+	char *path;
+	int store;			// a stored chunk, path relative to the store
+	int pack;			// a directory's pack file
+	off_t size;
+};
+
+static struct {
+	char metadir[PATH_MAX];
+	char storedir[PATH_MAX];
+	struct encr_keys mkey;
+	struct encr_store *store;
+	struct encr_log *log;
+	struct encr_roots *roots;
+	struct scrub_queue paths;
+	struct scrub_queue runs;
+	double rate;			// bytes per second, 0 for no limit
+	double next_io;			// when the next read may start
+	pthread_mutex_t lock;		// report, next_io and the counters
+	FILE *report;
+	unsigned io_running;
+	unsigned long files;
+	unsigned long damaged_files;
+	unsigned long long chunks;
+	unsigned long long damaged_chunks;
+	unsigned long stored;
+	unsigned long damaged_stored;
+	unsigned long long bytes;
+	unsigned long skipped;
+} scrub;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: encfs-scrub [-j I/O threads] [-v verify threads] "
+		"[-r MiB/s] [-o report] [-R root[:root...]] <Key Phrase> "
+		"<Mirror Directory>\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int queue_init(struct scrub_queue *q, unsigned cap)
+{
+	q->items = malloc(cap * sizeof(void *));
+	if (q->items == NULL)
+		return -ENOMEM;
+	q->head = 0;
+	q->count = 0;
+	q->cap = cap;
+	q->done = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->nonempty, NULL);
+	pthread_cond_init(&q->nonfull, NULL);
+	return 0;
+}
+
+static void queue_put(struct scrub_queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap)
+		pthread_cond_wait(&q->nonfull, &q->lock);
+	q->items[(q->head + q->count++) % q->cap] = item;
+	pthread_cond_signal(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// NULL once the queue is finished and empty
+static void *queue_get(struct scrub_queue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->done)
+		pthread_cond_wait(&q->nonempty, &q->lock);
+	if (q->count > 0) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->nonfull);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+static void queue_finish(struct scrub_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void report_string(const char *s)
+{
+	fputc('"', scrub.report);
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(scrub.report, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(scrub.report, "\\u%04x", c);
+		else
+			fputc(c, scrub.report);
+	}
+	fputc('"', scrub.report);
+}
+
+// One line of damage; chunk is -1 for the file as a whole
+static void report(struct scrub_file *f, const char *path, int64_t chunk,
+		   const char *error)
+{
+	pthread_mutex_lock(&scrub.lock);
+	fputs("{\"path\":", scrub.report);
+	report_string(path);
+	if (chunk < 0)
+		fputs(",\"chunk\":null,\"error\":", scrub.report);
+	else
+		fprintf(scrub.report, ",\"chunk\":%lld,\"error\":",
+			(long long) chunk);
+	report_string(error);
+	fputs("}\n", scrub.report);
+	if (chunk >= 0)
+		scrub.damaged_chunks++;
+	if (f != NULL && !f->damaged) {
+		f->damaged = 1;
+		scrub.damaged_files++;
+	}
+	pthread_mutex_unlock(&scrub.lock);
+}
+
+// Pace reads so all I/O threads together stay under the rate
+static void throttle(size_t n)
+{
+	double t;
+	double wait;
+
+	if (scrub.rate <= 0)
+		return;
+	pthread_mutex_lock(&scrub.lock);
+	t = now();
+	if (scrub.next_io < t)
+		scrub.next_io = t;
+	wait = scrub.next_io - t;
+	scrub.next_io += n / scrub.rate;
+	pthread_mutex_unlock(&scrub.lock);
+	if (wait > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	throttle(len);
+	while (done < len) {
+		n = pread(fd, (char *) buf + done, len - done, off + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	pthread_mutex_lock(&scrub.lock);
+	scrub.bytes += done;
+	pthread_mutex_unlock(&scrub.lock);
+	return done;
+}
+
+static void file_put(struct scrub_file *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	memset(&f->keys, 0, sizeof(f->keys));
+	free(f->path);
+	free(f);
+}
+
+static void run_free(struct scrub_run *r)
+{
+	free(r->want);
+	free(r->buf);
+	free(r);
+}
+
+static int is_encrypted(const char *path)
+{
+	char val[8];
+	ssize_t len = lgetxattr(path, ENCR_XATTR_ENCRYPTED, val, sizeof(val));
+
+	return len == 4 && memcmp(val, "true", 4) == 0;
+}
+
+static int walk_visit(const char *path, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	struct scrub_item *it;
+
+	if (type == FTW_D && strcmp(path, scrub.metadir) == 0)
+		return FTW_SKIP_SUBTREE;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+	// Files being moved out of a pack, or a pack being rewritten
+	if ((strncmp(path + ftw->base, ENCR_PACK_FILE,
+		     strlen(ENCR_PACK_FILE)) == 0 &&
+	     strcmp(path + ftw->base, ENCR_PACK_FILE) != 0) ||
+	    !is_encrypted(path)) {
+		scrub.skipped++;
+		return FTW_CONTINUE;
+	}
+	it = calloc(1, sizeof(struct scrub_item));
+	if (it == NULL || (it->path = strdup(path)) == NULL) {
+		free(it);
+		return FTW_STOP;
+	}
+	it->pack = strcmp(path + ftw->base, ENCR_PACK_FILE) == 0;
+	it->size = st->st_size;
+	queue_put(&scrub.paths, it);
+	return FTW_CONTINUE;
+}
+
+// Stored chunks live in .encfs/chunks/xx/<rest of the id>
+static int walk_store(void)
+{
+	struct dirent *d;
+	struct dirent *e;
+	struct stat st;
+	DIR *top;
+	DIR *sub;
+	int fd;
+	int res = 0;
+
+	top = opendir(scrub.storedir);
+	if (top == NULL)
+		return -errno;
+	while (res == 0 && (d = readdir(top)) != NULL) {
+		if (strlen(d->d_name) != 2)
+			continue;
+		fd = openat(dirfd(top), d->d_name, O_RDONLY | O_DIRECTORY);
+		sub = fd == -1 ? NULL : fdopendir(fd);
+		if (sub == NULL) {
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		while ((e = readdir(sub)) != NULL) {
+			struct scrub_item *it;
+
+			if (e->d_name[0] == '.' || strchr(e->d_name, '.'))
+				continue;	// . .. and chunks being stored
+			if (fstatat(dirfd(sub), e->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1 ||
+			    !S_ISREG(st.st_mode))
+				continue;
+			it = calloc(1, sizeof(struct scrub_item));
+			if (it == NULL ||
+			    asprintf(&it->path, "%s/%s", d->d_name,
+				     e->d_name) == -1) {
+				free(it);
+				res = -ENOMEM;
+				break;
+			}
+			it->store = 1;
+			it->size = st.st_size;
+			queue_put(&scrub.paths, it);
+		}
+		closedir(sub);
+	}
+	closedir(top);
+	return res;
+}
+
+static void *walk_thread(void *data)
+{
+	char *rootdir = data;
+	int res;
+
+	if (nftw(rootdir, walk_visit, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0)
+		fprintf(stderr, "%s: walk stopped: %s\n", rootdir,
+			strerror(errno));
+	if (scrub.store != NULL) {
+		res = walk_store();
+		if (res != 0)
+			fprintf(stderr, "%s: %s\n", scrub.storedir,
+				strerror(-res));
+	}
+	queue_finish(&scrub.paths);
+	return NULL;
+}
+
+static void check_stored(struct scrub_item *it)
+{
+	char *path;
+	int res;
+
+	throttle(it->size);
+	res = encr_store_verify(scrub.store, it->path);
+	if (res == -EINVAL)
+		return;
+	pthread_mutex_lock(&scrub.lock);
+	scrub.stored++;
+	scrub.bytes += it->size;
+	if (res != 0)
+		scrub.damaged_stored++;
+	pthread_mutex_unlock(&scrub.lock);
+	if (res != 0 && asprintf(&path, "%s/%s", scrub.storedir,
+				 it->path) != -1) {
+		report(NULL, path, -1, res == -EIO ? "store" : strerror(-res));
+		free(path);
+	}
+}
+
+// Hand chunks [c0, c0 + n) of f (of those on root, if it is striped),
+// len bytes of which were read into buf, to the verify threads; buf is
+// freed on failure
+static int run_queue(struct scrub_file *f, unsigned root, uint64_t c0,
+		     unsigned n, size_t stride, uint32_t *want,
+		     unsigned char *buf, size_t len)
+{
+	struct scrub_run *r = calloc(1, sizeof(struct scrub_run));
+
+	if (r == NULL) {
+		free(buf);
+		return -ENOMEM;
+	}
+	r->f = f;
+	r->c0 = c0;
+	r->root = root;
+	r->n = n;
+	r->stride = stride;
+	r->want = want;
+	r->buf = buf;
+	r->len = len;
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	queue_put(&scrub.runs, r);
+	return 0;
+}
+
+// Read chunks [c0, c0 + n) of f starting at offset off of fd and hand
+// them to the verify threads
+static int read_run(struct scrub_file *f, int fd, unsigned root, uint64_t c0,
+		    unsigned n, off_t off, size_t stride, uint32_t *want)
+{
+	unsigned char *buf = malloc(n * stride);
+	ssize_t got;
+
+	if (buf == NULL)
+		return -ENOMEM;
+	got = read_full(fd, buf, n * stride, off);
+	if (got < 0) {
+		free(buf);
+		return got;
+	}
+	return run_queue(f, root, c0, n, stride, want, buf, got);
+}
+
+// Likewise for a log-structured file, whose records are wherever the
+// log's index says; a record failing the log's tag is reported here
+static int read_log_run(struct scrub_file *f, uint64_t fid, uint64_t c0,
+			unsigned n, size_t stride, uint32_t *want)
+{
+	unsigned char *buf = malloc(n * stride);
+	size_t done = 0;
+	ssize_t got;
+	unsigned i;
+
+	if (buf == NULL)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		got = encr_log_verify(scrub.log, fid, c0 + i,
+				      buf + i * stride, stride);
+		want[i] = got > 0 ? got : 0;
+		if (got > 0)
+			done += got;
+		else if (got < 0)
+			report(f, f->path, c0 + i, got == -EBADMSG ? "log" :
+			       strerror(-got));
+	}
+	throttle(done);
+	pthread_mutex_lock(&scrub.lock);
+	scrub.bytes += done;
+	pthread_mutex_unlock(&scrub.lock);
+	return run_queue(f, 0, c0, n, stride, want, buf, n * stride);
+}
+
+// Queue every chunk of an opened file, by format
+static int read_chunks(struct scrub_file *f, int fd, off_t psz)
+{
+	size_t cs = (size_t) 1 << f->chunk_shift;
+	uint64_t nch = (psz + cs - 1) >> f->chunk_shift;
+	size_t stride;
+	uint64_t fid = 0;
+	uint64_t c;
+	unsigned per;
+	unsigned n;
+	unsigned i;
+	int res = 0;
+
+	if (f->fmt == FMT_LOG && encr_log_fid(&f->keys, &fid) != 0)
+		return -EIO;
+	if (f->fmt == FMT_PLAIN)
+		stride = cs + ENCR_CHUNK_OVERHEAD;
+	else if (f->fmt == FMT_COMPRESSED || f->fmt == FMT_LOG)
+		stride = encr_cslot_size(f->chunk_shift);
+	else
+		stride = ENCR_DEDUP_ENTRY;
+	per = SCRUB_SEGMENT / stride > 0 ? SCRUB_SEGMENT / stride : 1;
+	if (f->fmt == FMT_COMPRESSED && per > ENCR_CINDEX_GROUP)
+		per = ENCR_CINDEX_GROUP;
+
+	for (c = 0; res == 0 && c < nch; c += n) {
+		unsigned char index[ENCR_CINDEX_GROUP * ENCR_CINDEX_ENTRY];
+		uint32_t *want;
+		ssize_t got;
+		off_t off;
+
+		n = nch - c < per ? nch - c : per;
+		// Compressed runs never cross a group, so one index block
+		// covers each
+		if (f->fmt == FMT_COMPRESSED &&
+		    c % ENCR_CINDEX_GROUP + n > ENCR_CINDEX_GROUP)
+			n = ENCR_CINDEX_GROUP - c % ENCR_CINDEX_GROUP;
+		want = malloc(n * sizeof(uint32_t));
+		if (want == NULL)
+			return -ENOMEM;
+		if (f->fmt == FMT_LOG) {
+			res = read_log_run(f, fid, c, n, stride, want);
+			if (res != 0)
+				free(want);
+			continue;
+		}
+		if (f->fmt == FMT_PLAIN) {
+			off = encr_record_offset(c, f->chunk_shift);
+			for (i = 0; i < n; i++)
+				want[i] = stride;
+			if (c + n == nch && (psz & (cs - 1)) != 0)
+				want[n - 1] = (psz & (cs - 1)) +
+					ENCR_CHUNK_OVERHEAD;
+		} else if (f->fmt == FMT_DEDUP) {
+			off = encr_dedup_offset(c);
+			for (i = 0; i < n; i++)
+				want[i] = stride;
+		} else {
+			got = read_full(fd, index, n * ENCR_CINDEX_ENTRY,
+					encr_cindex_offset(c, f->chunk_shift));
+			if (got < 0) {
+				free(want);
+				return got;
+			}
+			memset(index + got, 0, sizeof(index) - got);
+			for (i = 0; i < n; i++) {
+				unsigned char *e = index + i * ENCR_CINDEX_ENTRY;
+
+				want[i] = e[0] | e[1] << 8 | e[2] << 16 |
+					(uint32_t) e[3] << 24;
+			}
+			off = encr_cslot_offset(c, f->chunk_shift);
+		}
+		res = read_run(f, fd, 0, c, n, off, stride, want);
+		if (res != 0)
+			free(want);
+	}
+	return res;
+}
+
+/* Queue every chunk of a striped file root by root: those on one root
+ * lie back to back, after the header of the file itself (root 0) or of
+ * its part. A part never created, or records past the end of one, are
+ * holes. */
+static int read_striped(struct scrub_file *f, int fd, off_t psz)
+{
+	size_t cs = (size_t) 1 << f->chunk_shift;
+	size_t stride = cs + ENCR_CHUNK_OVERHEAD;
+	uint64_t nch = (psz + cs - 1) >> f->chunk_shift;
+	unsigned per = SCRUB_SEGMENT / stride > 0 ? SCRUB_SEGMENT / stride : 1;
+	uint64_t have, l, c;
+	unsigned root;
+	unsigned n;
+	unsigned i;
+	int pfd;
+	int res = 0;
+
+	for (root = 0; res == 0 && root < f->width; root++) {
+		have = encr_stripe_chunks(nch, f->chunk_shift, f->width, root);
+		if (have == 0)
+			continue;
+		pfd = root == 0 ? fd : encr_part_open(scrub.roots, &f->keys,
+						       f->width, root);
+		if (pfd == -ENOENT)
+			continue;
+		if (pfd < 0) {
+			report(f, f->path, -1, pfd == -EBADMSG ? "part" :
+			       strerror(-pfd));
+			continue;
+		}
+		for (l = 0; res == 0 && l < have; l += n) {
+			uint32_t *want;
+
+			n = have - l < per ? have - l : per;
+			want = malloc(n * sizeof(uint32_t));
+			if (want == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			for (i = 0; i < n; i++) {
+				c = encr_stripe_chunk(l + i, f->chunk_shift,
+						      f->width, root);
+				want[i] = stride;
+				if (c == nch - 1 && (psz & (cs - 1)) != 0)
+					want[i] = (psz & (cs - 1)) +
+						ENCR_CHUNK_OVERHEAD;
+			}
+			res = read_run(f, pfd, root, l, n,
+				       encr_record_offset(l, f->chunk_shift),
+				       stride, want);
+			if (res != 0)
+				free(want);
+		}
+		if (root != 0)
+			close(pfd);
+	}
+	return res;
+}
+
+/* Queue every record of a pack file in runs of whole records. A record
+ * is a u32 length and that many bytes sealed as a chunk numbered by the
+ * record's offset (see encfs-pack.h), so a run is numbered from its
+ * offset; no record comes near SCRUB_SEGMENT bytes. */
+static int read_pack(struct scrub_file *f, int fd, off_t size)
+{
+	off_t off = ENCR_HEADER_SIZE;
+	int res = 0;
+
+	while (res == 0 && off < size) {
+		size_t len = size - off < SCRUB_SEGMENT ? size - off :
+			SCRUB_SEGMENT;
+		unsigned char *buf = malloc(len);
+		uint32_t *want = malloc((len / (4 + ENCR_CHUNK_OVERHEAD) + 1) *
+					sizeof(uint32_t));
+		const char *err = NULL;
+		size_t pos = 0;
+		uint32_t rl;
+		unsigned n = 0;
+		ssize_t got;
+
+		if (buf == NULL || want == NULL) {
+			free(buf);
+			free(want);
+			return -ENOMEM;
+		}
+		got = read_full(fd, buf, len, off);
+		if (got < 0) {
+			free(buf);
+			free(want);
+			return got;
+		}
+		while (pos + 4 <= (size_t) got) {
+			rl = buf[pos] | buf[pos + 1] << 8 | buf[pos + 2] << 16 |
+				(uint32_t) buf[pos + 3] << 24;
+			if (rl <= ENCR_CHUNK_OVERHEAD ||
+			    rl > SCRUB_SEGMENT - 4) {
+				err = "record";
+				break;
+			}
+			if (pos + 4 + rl > (size_t) got)
+				break;		// in the next run
+			want[n++] = 4 + rl;
+			pos += 4 + rl;
+		}
+		// A record cut off by the end of the file
+		if (err == NULL && n == 0)
+			err = "truncated";
+		if (err != NULL)
+			report(f, f->path, off + pos, err);
+		if (n == 0) {
+			free(buf);
+			free(want);
+			break;
+		}
+		res = run_queue(f, 0, off, n, 0, want, buf, pos);
+		if (res != 0)
+			free(want);
+		off += pos;
+		if (err != NULL)
+			break;		// the rest cannot be found
+	}
+	return res;
+}
+
+static void check_file(struct scrub_item *it)
+{
+	unsigned char hdr[ENCR_HEADER_SIZE];
+	struct encr_header h;
+	struct scrub_file *f;
+	uint64_t size;
+	off_t psz;
+	ssize_t got;
+	int fd;
+	int res;
+
+	f = calloc(1, sizeof(struct scrub_file));
+	if (f == NULL) {
+		report(NULL, it->path, -1, strerror(ENOMEM));
+		return;
+	}
+	f->path = it->path;
+	it->path = NULL;
+	f->refs = 1;
+	pthread_mutex_lock(&scrub.lock);
+	scrub.files++;
+	pthread_mutex_unlock(&scrub.lock);
+
+	fd = open(f->path, O_RDONLY);
+	if (fd == -1) {
+		report(f, f->path, -1, strerror(errno));
+		file_put(f);
+		return;
+	}
+	got = read_full(fd, hdr, sizeof(hdr), 0);
+	if (got == 0) {
+		// Created but never written through the mount
+		close(fd);
+		file_put(f);
+		return;
+	}
+	if (got < 0 || got != sizeof(hdr) ||
+	    encr_header_decode(&h, &scrub.mkey, hdr) != 0) {
+		report(f, f->path, -1, got < 0 ? strerror(-got) : "header");
+		close(fd);
+		file_put(f);
+		return;
+	}
+	f->keys = h.keys;
+	f->chunk_shift = h.chunk_shift;
+	f->width = h.width;
+	f->fmt = it->pack ? FMT_PACK :
+		h.flags & ENCR_FLAG_DEDUP ? FMT_DEDUP :
+		h.flags & ENCR_FLAG_LOG ? FMT_LOG :
+		h.flags & ENCR_FLAG_STRIPED ? FMT_STRIPED :
+		h.flags & ENCR_FLAG_COMPRESSED ? FMT_COMPRESSED : FMT_PLAIN;
+	memset(&h, 0, sizeof(h));
+
+	if (f->fmt == FMT_PACK) {
+		res = read_pack(f, fd, it->size);
+		if (res != 0)
+			report(f, f->path, -1, strerror(-res));
+		close(fd);
+		file_put(f);
+		return;
+	}
+	if (f->fmt == FMT_PLAIN) {
+		psz = encr_plain_size(it->size, f->chunk_shift);
+	} else if (encr_size_decode(&f->keys, hdr + ENCR_HEADER_SIZE -
+				    ENCR_SIZE_FIELD, &size) != 0) {
+		report(f, f->path, -1, "size");
+		close(fd);
+		file_put(f);
+		return;
+	} else {
+		psz = size;
+	}
+	if ((f->fmt == FMT_DEDUP && scrub.store == NULL) ||
+	    (f->fmt == FMT_LOG && scrub.log == NULL)) {
+		report(f, f->path, -1, "missing");
+		close(fd);
+		file_put(f);
+		return;
+	}
+	if (f->fmt == FMT_STRIPED &&
+	    (f->width < 2 || f->width > encr_roots_count(scrub.roots))) {
+		report(f, f->path, -1, "header");
+		close(fd);
+		file_put(f);
+		return;
+	}
+
+	res = f->fmt == FMT_STRIPED ? read_striped(f, fd, psz) :
+		read_chunks(f, fd, psz);
+	if (res != 0)
+		report(f, f->path, -1, strerror(-res));
+	close(fd);
+	file_put(f);
+}
+
+static void *io_thread(void *data)
+{
+	struct scrub_item *it;
+
+	(void) data;
+	while ((it = queue_get(&scrub.paths)) != NULL) {
+		if (it->store)
+			check_stored(it);
+		else
+			check_file(it);
+		free(it->path);
+		free(it);
+	}
+	// The last reader out lets the verify threads finish
+	pthread_mutex_lock(&scrub.lock);
+	if (--scrub.io_running == 0)
+		queue_finish(&scrub.runs);
+	pthread_mutex_unlock(&scrub.lock);
+	return NULL;
+}
+
+// Check chunk c of a run, whose record is want bytes at rec
+static const char *verify_chunk(struct scrub_file *f, uint64_t c,
+				unsigned char *rec, size_t want, size_t avail,
+				unsigned char *plain)
+{
+	size_t cs = (size_t) 1 << f->chunk_shift;
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	int res;
+
+	switch (f->fmt) {
+	case FMT_PLAIN:
+		if (avail < want)
+			return "truncated";
+		res = encr_chunk_open(&f->keys, c, rec, want, plain);
+		return res < 0 ? "record" : NULL;
+	case FMT_COMPRESSED:
+	case FMT_LOG:
+		if (want == 0)
+			return NULL;	// never written
+		if (want > encr_cslot_size(f->chunk_shift))
+			return "index";
+		if (avail < want)
+			return "truncated";
+		res = encr_chunk_unpack(&f->keys, c, rec, want, plain, cs);
+		return res < 0 ? "record" : NULL;
+	case FMT_STRIPED:
+		// Past the end of the file or its part, a record is a hole
+		if (avail == 0)
+			return NULL;
+		if (avail < want)
+			return "truncated";
+		res = encr_chunk_open(&f->keys, c, rec, want, plain);
+		return res < 0 ? "record" : NULL;
+	case FMT_PACK:
+		// Past the record's length, checked when it was read
+		res = encr_chunk_unpack(&f->keys, c, rec + 4, want - 4, plain,
+					(size_t) 1 << ENCR_MAX_CHUNK_SHIFT);
+		return res < 0 ? "record" : NULL;
+	default:
+		// A table that stops early reads as chunks never written
+		if (avail < want)
+			return NULL;
+		res = encr_dedup_open(&f->keys, c, rec, id);
+		if (res == 1)
+			return NULL;
+		if (res != 0)
+			return "table";
+		res = encr_store_has(scrub.store, id);
+		return res == 1 ? NULL : res == 0 ? "missing" : "io";
+	}
+}
+
+static void *verify_thread(void *data)
+{
+	unsigned char *plain = malloc(1 << ENCR_MAX_CHUNK_SHIFT);
+	struct scrub_run *r;
+	size_t at;
+	unsigned i;
+
+	(void) data;
+	while ((r = queue_get(&scrub.runs)) != NULL) {
+		for (i = 0, at = 0; plain != NULL && i < r->n; i++) {
+			// Pack records are numbered by their offset
+			uint64_t c = r->stride != 0 ? r->c0 + i : r->c0 + at;
+			const char *err;
+
+			if (r->f->fmt == FMT_STRIPED)
+				c = encr_stripe_chunk(c, r->f->chunk_shift,
+						      r->f->width, r->root);
+			err = verify_chunk(r->f, c, r->buf + at, r->want[i],
+					   r->len > at ? r->len - at : 0,
+					   plain);
+			if (err != NULL)
+				report(r->f, r->f->path, c, err);
+			at += r->stride != 0 ? r->stride : r->want[i];
+		}
+		pthread_mutex_lock(&scrub.lock);
+		scrub.chunks += r->n;
+		pthread_mutex_unlock(&scrub.lock);
+		file_put(r->f);
+		run_free(r);
+	}
+	if (plain == NULL)
+		fprintf(stderr, "verify thread: %s\n", strerror(ENOMEM));
+	free(plain);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t io[MAXTHREADS];
+	pthread_t verify[MAXTHREADS];
+	pthread_t walker;
+	struct encr_config cfg;
+	char cpath[PATH_MAX];
+	char *rootdir;
+	const char *out = NULL;
+	const char *others = NULL;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nio = 4;
+	int nverify = ncpu > 0 && ncpu <= MAXTHREADS ? ncpu : 4;
+	double start;
+	double elapsed;
+	int opt;
+	int res;
+	int i;
+
+	while ((opt = getopt(argc, argv, "j:v:r:o:R:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nio = atoi(optarg);
+			if (nio < 1 || nio > MAXTHREADS)
+				usage();
+			break;
+		case 'v':
+			nverify = atoi(optarg);
+			if (nverify < 1 || nverify > MAXTHREADS)
+				usage();
+			break;
+		case 'r':
+			scrub.rate = atof(optarg) * 1024 * 1024;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'R':
+			others = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	rootdir = realpath(argv[optind + 1], NULL);
+	if (rootdir == NULL) {
+		perror(argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+	snprintf(scrub.metadir, sizeof(scrub.metadir), "%s/%s", rootdir,
+		 ENCR_META_DIR);
+	snprintf(scrub.storedir, sizeof(scrub.storedir), "%s/%s/%s", rootdir,
+		 ENCR_META_DIR, ENCR_STORE_DIR);
+	snprintf(cpath, sizeof(cpath), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_CONFIG_FILE);
+
+	res = encr_config_read(cpath, &cfg);
+	if (res == 0)
+		res = encr_config_unlock(&cfg, argv[optind], &scrub.mkey);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", cpath, res == -EACCES ?
+			"wrong key phrase" : strerror(-res));
+		return EXIT_FAILURE;
+	}
+	res = encr_store_open(rootdir, &scrub.mkey, 0, &scrub.store);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", scrub.storedir, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	res = encr_roots_open(rootdir, others, 0, &scrub.roots);
+	if (res != 0) {
+		fprintf(stderr, "%s: cannot open the roots (-R): %s\n",
+			rootdir, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	res = encr_log_open(rootdir, &scrub.mkey, ENCR_LOG_RDONLY, &scrub.log);
+	if (res != 0) {
+		fprintf(stderr, "%s/%s: %s\n", scrub.metadir, ENCR_LOG_DIR,
+			strerror(-res));
+		return EXIT_FAILURE;
+	}
+	scrub.report = out != NULL ? fopen(out, "w") : stdout;
+	if (scrub.report == NULL) {
+		perror(out);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&scrub.lock, NULL);
+	if (queue_init(&scrub.paths, SCRUB_QUEUE) != 0 ||
+	    queue_init(&scrub.runs, SCRUB_QUEUE) != 0) {
+		perror("malloc error");
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	scrub.io_running = nio;
+	if (pthread_create(&walker, NULL, walk_thread, rootdir) != 0) {
+		perror("pthread_create error");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nio; i++)
+		if (pthread_create(&io[i], NULL, io_thread, NULL) != 0) {
+			perror("pthread_create error");
+			return EXIT_FAILURE;
+		}
+	for (i = 0; i < nverify; i++)
+		if (pthread_create(&verify[i], NULL, verify_thread, NULL) != 0) {
+			perror("pthread_create error");
+			return EXIT_FAILURE;
+		}
+	pthread_join(walker, NULL);
+	for (i = 0; i < nio; i++)
+		pthread_join(io[i], NULL);
+	for (i = 0; i < nverify; i++)
+		pthread_join(verify[i], NULL);
+	elapsed = now() - start;
+
+	fprintf(scrub.report, "{\"summary\":{\"files\":%lu,\"damaged_files\":%lu,"
+		"\"chunks\":%llu,\"damaged_chunks\":%llu,\"stored_chunks\":%lu,"
+		"\"damaged_stored_chunks\":%lu,\"unencrypted_files\":%lu,"
+		"\"bytes\":%llu,\"seconds\":%.3f}}\n", scrub.files,
+		scrub.damaged_files, scrub.chunks, scrub.damaged_chunks,
+		scrub.stored, scrub.damaged_stored, scrub.skipped, scrub.bytes,
+		elapsed);
+	fprintf(stderr, "%lu files, %llu chunks and %lu stored chunks checked "
+		"in %.1f s (%.1f MiB/s): %lu files and %lu stored chunks "
+		"damaged\n", scrub.files, scrub.chunks, scrub.stored, elapsed,
+		elapsed > 0 ? scrub.bytes / elapsed / (1024 * 1024) : 0,
+		scrub.damaged_files, scrub.damaged_stored);
+	if (out != NULL && fclose(scrub.report) != 0) {
+		perror(out);
+		return EXIT_FAILURE;
+	}
+	encr_store_close(scrub.store);
+	encr_log_close(scrub.log);
+	encr_roots_close(scrub.roots);
+	return scrub.damaged_files + scrub.damaged_stored > 0 ?
+		EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,290 @@
+/* encfs-selftest.c
+ * Tamper and copy checks for the pa5-encfs on-disk format and tools
+ *
+ * Seals chunk records with fresh data keys and checks that each way of
+ * damaging one (a flipped ciphertext bit, a zeroed IV and tag, a record
+ * moved to another chunk) fails authentication, while a record that is
+ * all zeros still reads back as a hole.
+ *
+ * Copies within one encrypted file through encr_io_copy(): overlapping
+ * ranges, more than ENCR_COPY_BATCH apart, must be refused and leave the
+ * file as it was, and ranges that do not overlap must copy.
+ *
+ * Then feeds encfs-import an archive crafted to escape the directory it
+ * restores to: a symlink pointing outside, followed by a file, a
+ * directory and another symlink under it. Nothing may appear outside,
+ * and the import must report the entries it refused.
+ *
+ * Usage: encfs-selftest [encfs-import]
+ *   encfs-import  the binary to check (./encfs-import by default)
+ *
+ * Prints one line per check and exits 1 if any of them fails.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "encfs-format.h"
+#include "encfs-archive.h"
+#include "encfs-lock.h"
+#include "encfs-io.h"
+#include "aes-crypt.h"
+
+#define CHECK_SHIFT ENCR_DEFAULT_CHUNK_SHIFT
+#define CHECK_CHUNK 7
+#define CHECK_FILE (3 * ENCR_COPY_BATCH)
+
+static int failed;
+
+static void check(const char *what, int ok)
+{
+	printf("%-44s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed = 1;
+}
+
+static int all_zero(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static void check_records(void)
+{
+	size_t cs = (size_t) 1 << CHECK_SHIFT;
+	size_t reclen = cs + ENCR_CHUNK_OVERHEAD;
+	unsigned char *plain = malloc(cs);
+	unsigned char *back = malloc(cs);
+	unsigned char *rec = malloc(reclen);
+	unsigned char *bad = malloc(reclen);
+	struct encr_header h;
+	int res;
+
+	if (plain == NULL || back == NULL || rec == NULL || bad == NULL ||
+	    encr_header_init(&h, CHECK_SHIFT) != 0 ||
+	    !random_bytes(plain, cs) ||
+	    encr_chunk_seal(&h.keys, CHECK_CHUNK, plain, cs, rec) != 0) {
+		check("sealing a record", 0);
+		goto out;
+	}
+
+	res = encr_chunk_open(&h.keys, CHECK_CHUNK, rec, reclen, back);
+	check("sealed record opens",
+	      res == (int) cs && memcmp(plain, back, cs) == 0);
+
+	memcpy(bad, rec, reclen);
+	bad[ENCR_IV_SIZE + cs / 2] ^= 1;
+	check("flipped ciphertext bit is -EBADMSG",
+	      encr_chunk_open(&h.keys, CHECK_CHUNK, bad, reclen, back) ==
+	      -EBADMSG);
+
+	// Made to look like a hole over ciphertext that is still there
+	memcpy(bad, rec, reclen);
+	memset(bad, 0, ENCR_IV_SIZE);
+	memset(bad + reclen - ENCR_TAG_SIZE, 0, ENCR_TAG_SIZE);
+	check("zeroed IV and tag is -EBADMSG",
+	      encr_chunk_open(&h.keys, CHECK_CHUNK, bad, reclen, back) ==
+	      -EBADMSG);
+
+	check("record moved to another chunk is -EBADMSG",
+	      encr_chunk_open(&h.keys, CHECK_CHUNK + 1, rec, reclen, back) ==
+	      -EBADMSG);
+
+	memset(bad, 0, reclen);
+	memset(back, 0xff, cs);
+	res = encr_chunk_open(&h.keys, CHECK_CHUNK, bad, reclen, back);
+	check("all-zero record is a hole",
+	      res == (int) cs && all_zero(back, cs));
+
+out:
+	free(plain);
+	free(back);
+	free(rec);
+	free(bad);
+}
+
+static void check_copy(void)
+{
+	char path[] = "/tmp/encfs-selftest.XXXXXX";
+	char *plain = malloc(CHECK_FILE);
+	char *back = malloc(CHECK_FILE);
+	struct encr_itable *t = encr_itable_new();
+	struct encr_inode *in = NULL;
+	struct encr_header mk;
+	struct stat st;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd != -1)
+		unlink(path);
+	if (plain == NULL || back == NULL || t == NULL || fd == -1 ||
+	    fstat(fd, &st) != 0 ||
+	    (in = encr_inode_get(t, st.st_dev, st.st_ino)) == NULL ||
+	    encr_header_init(&mk, CHECK_SHIFT) != 0 ||
+	    encr_io_open(in, fd, &mk.keys, NULL, NULL, NULL, 1, CHECK_SHIFT,
+			 0, 0) != 0 ||
+	    !random_bytes((unsigned char *) plain, CHECK_FILE) ||
+	    encr_io_write(in, fd, plain, CHECK_FILE, 0) != CHECK_FILE) {
+		check("setting up the copy check", 0);
+		goto out;
+	}
+
+	check("overlapping copy within a file is -EINVAL",
+	      encr_io_copy(in, fd, 0, in, fd, ENCR_COPY_BATCH / 2,
+			   2 * ENCR_COPY_BATCH) == -EINVAL &&
+	      encr_io_copy(in, fd, ENCR_COPY_BATCH / 2, in, fd, 0,
+			   2 * ENCR_COPY_BATCH) == -EINVAL);
+	check("and leaves the file as it was",
+	      encr_io_read(in, fd, back, CHECK_FILE, 0) == CHECK_FILE &&
+	      memcmp(plain, back, CHECK_FILE) == 0);
+
+	memcpy(plain + 2 * ENCR_COPY_BATCH, plain, ENCR_COPY_BATCH);
+	check("copy to elsewhere in the same file",
+	      encr_io_copy(in, fd, 0, in, fd, 2 * ENCR_COPY_BATCH,
+			   ENCR_COPY_BATCH) == ENCR_COPY_BATCH &&
+	      encr_io_read(in, fd, back, CHECK_FILE, 0) == CHECK_FILE &&
+	      memcmp(plain, back, CHECK_FILE) == 0);
+
+out:
+	if (in != NULL)
+		encr_inode_put(t, in);
+	if (t != NULL)
+		encr_itable_free(t);
+	if (fd != -1)
+		close(fd);
+	free(plain);
+	free(back);
+}
+
+// Append one entry, with its name and body, to an archive
+static void arc_put(FILE *f, uint32_t type, uint32_t mode, const char *name,
+		    const char *body, uint64_t size, uint64_t offset)
+{
+	unsigned char hdr[ENCR_ARC_HDR_SIZE];
+	struct encr_arc_entry e;
+
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.mode = mode;
+	e.size = size;
+	e.offset = offset;
+	e.name_len = name != NULL ? strlen(name) : 0;
+	encr_arc_encode(&e, hdr);
+	fwrite(hdr, 1, sizeof(hdr), f);
+	if (name != NULL)
+		fwrite(name, 1, e.name_len, f);
+	if (body != NULL)
+		fwrite(body, 1, size, f);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	remove(path);
+	return 0;
+}
+
+static int dir_empty(const char *dir)
+{
+	struct dirent *d;
+	DIR *dp = opendir(dir);
+	int empty = 1;
+
+	if (dp == NULL)
+		return 0;
+	while ((d = readdir(dp)) != NULL)
+		if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+			empty = 0;
+	closedir(dp);
+	return empty;
+}
+
+static void check_import(const char *import)
+{
+	char top[] = "/tmp/encfs-selftest.XXXXXX";
+	char outside[PATH_MAX];
+	char arc[PATH_MAX];
+	char mirror[PATH_MAX];
+	int status = -1;
+	pid_t pid;
+	FILE *f;
+
+	if (mkdtemp(top) == NULL) {
+		check("setting up the import check", 0);
+		return;
+	}
+	snprintf(outside, sizeof(outside), "%s/outside", top);
+	snprintf(arc, sizeof(arc), "%s/escape.arc", top);
+	snprintf(mirror, sizeof(mirror), "%s/mirror", top);
+	f = fopen(arc, "w");
+	if (mkdir(outside, 0755) != 0 || f == NULL) {
+		check("setting up the import check", 0);
+		if (f != NULL)
+			fclose(f);
+		goto out;
+	}
+	fwrite(ENCR_ARC_MAGIC, 1, ENCR_ARC_MAGIC_SIZE, f);
+	arc_put(f, ENCR_ARC_DIR, S_IFDIR | 0755, ".", NULL, 0, 0);
+	arc_put(f, ENCR_ARC_SYMLINK, S_IFLNK | 0777, "a", outside,
+		strlen(outside), 0);
+	arc_put(f, ENCR_ARC_FILE, S_IFREG | 0644, "a/pwned", NULL, 5, 0);
+	arc_put(f, ENCR_ARC_DATA, 0, NULL, "owned", 5, 0);
+	arc_put(f, ENCR_ARC_DIR, S_IFDIR | 0755, "a/sub", NULL, 0, 0);
+	arc_put(f, ENCR_ARC_SYMLINK, S_IFLNK | 0777, "a/b", "x", 1, 0);
+	arc_put(f, ENCR_ARC_END, 0, NULL, NULL, 5, 6);
+	if (fclose(f) != 0) {
+		check("setting up the import check", 0);
+		goto out;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		// Its complaints about the refused entries are expected
+		if (freopen("/dev/null", "w", stderr) == NULL)
+			_exit(127);
+		execl(import, import, "-i", arc, mirror, (char *) NULL);
+		_exit(127);
+	}
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+	check("import ran",
+	      WIFEXITED(status) && WEXITSTATUS(status) != 127);
+	check("nothing imported through a symlink", dir_empty(outside));
+	check("import reports the refused entries",
+	      WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+out:
+	nftw(top, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [encfs-import]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	check_records();
+	check_copy();
+	check_import(argc > 1 ? argv[1] : "./encfs-import");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,443 @@
+/* encfs-store.c
+ * Content-addressed chunk store for deduplicated pa5-encfs files
+ *
+ * See encfs-store.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+
+#include "aes-crypt.h"
+#include "encfs-store.h"
+#include "encfs-compress.h"
+
+#define STORE_ID_LABEL "pa5-encfs chunk id"
+#define STORE_REFS 8		// reference count ahead of the record
+
+struct encr_store {
+	int dirfd;				// .encfs/chunks
+	struct encr_keys keys;			// encrypt the stored chunks
+	unsigned char idkey[ENCR_KEY_SIZE];	// names them
+	pthread_mutex_t stripes[ENCR_STORE_STRIPES];
+};
+
+// Set up a store with fresh keys, wrapped by the mount key
+static int store_create_key(int dirfd, const struct encr_keys *mk)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	struct encr_header hdr;
+	char tmp[32];
+	int fd;
+	int res;
+
+	res = encr_header_init(&hdr, ENCR_DEFAULT_CHUNK_SHIFT);
+	memset(buf, 0, sizeof(buf));
+	if (res == 0)
+		res = encr_header_encode(&hdr, mk, buf);
+	memset(&hdr, 0, sizeof(hdr));
+	if (res != 0)
+		return res;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", ENCR_STORE_KEY);
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) == -1)
+		res = errno ? -errno : -EIO;
+	close(fd);
+	if (res == 0 && renameat(dirfd, tmp, dirfd, ENCR_STORE_KEY) == -1)
+		res = -errno;
+	return res;
+}
+
+int encr_store_open(const char *rootdir, const struct encr_keys *mk,
+		    int create, struct encr_store **sp)
+{
+	unsigned char buf[ENCR_HEADER_SIZE];
+	unsigned char mac[AES_CRYPT_MACLEN];
+	char path[PATH_MAX];
+	struct encr_header hdr;
+	struct encr_store *s;
+	int fd;
+	int res;
+	int i;
+
+	*sp = NULL;
+	snprintf(path, sizeof(path), "%s/%s/%s", rootdir, ENCR_META_DIR,
+		 ENCR_STORE_DIR);
+	if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+
+	s = calloc(1, sizeof(struct encr_store));
+	if (s == NULL)
+		return -ENOMEM;
+	s->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (s->dirfd == -1) {
+		res = errno == ENOENT && !create ? 0 : -errno;
+		free(s);
+		return res;
+	}
+
+	fd = openat(s->dirfd, ENCR_STORE_KEY, O_RDONLY);
+	if (fd == -1 && errno == ENOENT && create) {
+		res = store_create_key(s->dirfd, mk);
+		if (res != 0)
+			goto err;
+		fd = openat(s->dirfd, ENCR_STORE_KEY, O_RDONLY);
+	}
+	if (fd == -1) {
+		res = -errno;
+		goto err;
+	}
+	res = pread(fd, buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -EIO;
+	close(fd);
+	if (res == 0 && encr_header_decode(&hdr, mk, buf) != 0)
+		res = -EIO;
+	if (res != 0)
+		goto err;
+
+	s->keys = hdr.keys;
+	memset(&hdr, 0, sizeof(hdr));
+	if (!hmac_sha256(s->keys.mac, ENCR_KEY_SIZE,
+			 (const unsigned char *) STORE_ID_LABEL,
+			 strlen(STORE_ID_LABEL), NULL, 0, mac)) {
+		res = -EIO;
+		goto err;
+	}
+	memcpy(s->idkey, mac, ENCR_KEY_SIZE);
+	OPENSSL_cleanse(mac, sizeof(mac));
+
+	for (i = 0; i < ENCR_STORE_STRIPES; i++)
+		pthread_mutex_init(&s->stripes[i], NULL);
+	*sp = s;
+	return 0;
+err:
+	close(s->dirfd);
+	OPENSSL_cleanse(s, sizeof(struct encr_store));
+	free(s);
+	return res;
+}
+
+void encr_store_close(struct encr_store *s)
+{
+	int i;
+
+	if (s == NULL)
+		return;
+	for (i = 0; i < ENCR_STORE_STRIPES; i++)
+		pthread_mutex_destroy(&s->stripes[i]);
+	close(s->dirfd);
+	OPENSSL_cleanse(s, sizeof(struct encr_store));
+	free(s);
+}
+
+// "xx/<rest of the id>" in hex, relative to the store
+static void store_name(const unsigned char *id, char *name)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	name[0] = hex[id[0] >> 4];
+	name[1] = hex[id[0] & 0xf];
+	name[2] = '/';
+	for (i = 1; i < ENCR_CHUNK_ID_SIZE; i++) {
+		name[1 + 2 * i] = hex[id[i] >> 4];
+		name[2 + 2 * i] = hex[id[i] & 0xf];
+	}
+	name[1 + 2 * ENCR_CHUNK_ID_SIZE] = '\0';
+}
+
+// Records are bound to the id they are stored under
+static uint64_t store_chunk_number(const unsigned char *id)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		n = (n << 8) | id[i];
+	return n;
+}
+
+static int store_read_refs(int fd, uint64_t *refs)
+{
+	unsigned char b[STORE_REFS];
+	int i;
+
+	if (pread(fd, b, sizeof(b), 0) != sizeof(b))
+		return errno ? -errno : -EIO;
+	*refs = 0;
+	for (i = STORE_REFS - 1; i >= 0; i--)
+		*refs = (*refs << 8) | b[i];
+	return 0;
+}
+
+static int store_write_refs(int fd, uint64_t refs)
+{
+	unsigned char b[STORE_REFS];
+	int i;
+
+	for (i = 0; i < STORE_REFS; i++)
+		b[i] = (refs >> (8 * i)) & 0xff;
+	if (pwrite(fd, b, sizeof(b), 0) != sizeof(b))
+		return errno ? -errno : -EIO;
+	return 0;
+}
+
+// Write a new chunk under a temporary name and move it into place
+static int store_create(struct encr_store *s, const unsigned char *id,
+			const char *name, const unsigned char *plain,
+			size_t len, int compress)
+{
+	char tmp[2 * ENCR_CHUNK_ID_SIZE + 8];
+	unsigned char *buf;
+	unsigned char *scratch;
+	ssize_t reclen;
+	int fd;
+	int res = 0;
+
+	buf = malloc(STORE_REFS + len + 1 + ENCR_CHUNK_OVERHEAD);
+	scratch = malloc(len + 1);
+	if (buf == NULL || scratch == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	reclen = encr_chunk_pack(&s->keys, store_chunk_number(id), plain, len,
+				 compress, buf + STORE_REFS, scratch);
+	if (reclen < 0) {
+		res = reclen;
+		goto out;
+	}
+	memset(buf, 0, STORE_REFS);
+	buf[0] = 1;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", name);
+	fd = openat(s->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 && errno == ENOENT) {
+		char dir[3] = { name[0], name[1], '\0' };
+
+		if (mkdirat(s->dirfd, dir, 0700) == -1 && errno != EEXIST) {
+			res = -errno;
+			goto out;
+		}
+		fd = openat(s->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	}
+	if (fd == -1) {
+		res = -errno;
+		goto out;
+	}
+	if (pwrite(fd, buf, STORE_REFS + reclen, 0) != STORE_REFS + reclen)
+		res = errno ? -errno : -EIO;
+	close(fd);
+	if (res == 0 && renameat(s->dirfd, tmp, s->dirfd, name) == -1)
+		res = -errno;
+	if (res != 0)
+		unlinkat(s->dirfd, tmp, 0);
+out:
+	free(buf);
+	free(scratch);
+	return res;
+}
+
+int encr_store_put(struct encr_store *s, const unsigned char *plain,
+		   size_t len, int compress, unsigned char *id)
+{
+	unsigned char mac[AES_CRYPT_MACLEN];
+	char name[2 * ENCR_CHUNK_ID_SIZE + 2];
+	pthread_mutex_t *lock;
+	uint64_t refs;
+	int fd;
+	int res;
+
+	if (!hmac_sha256(s->idkey, ENCR_KEY_SIZE, NULL, 0, plain, len, mac))
+		return -EIO;
+	memcpy(id, mac, ENCR_CHUNK_ID_SIZE);
+	store_name(id, name);
+
+	lock = &s->stripes[id[1] % ENCR_STORE_STRIPES];
+	pthread_mutex_lock(lock);
+	fd = openat(s->dirfd, name, O_RDWR);
+	if (fd == -1) {
+		res = errno == ENOENT ?
+			store_create(s, id, name, plain, len, compress) : -errno;
+	} else {
+		res = store_read_refs(fd, &refs);
+		if (res == 0)
+			res = store_write_refs(fd, refs + 1);
+		close(fd);
+	}
+	pthread_mutex_unlock(lock);
+	return res;
+}
+
+int encr_store_get(struct encr_store *s, const unsigned char *id,
+		   unsigned char *plain, size_t cs)
+{
+	char name[2 * ENCR_CHUNK_ID_SIZE + 2];
+	unsigned char *rec;
+	ssize_t n;
+	int fd;
+	int res;
+
+	store_name(id, name);
+	fd = openat(s->dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? -EIO : -errno;
+	rec = malloc(cs + 1 + ENCR_CHUNK_OVERHEAD + 1);
+	if (rec == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	// One byte more than any record this chunk size can have
+	n = pread(fd, rec, cs + 1 + ENCR_CHUNK_OVERHEAD + 1, STORE_REFS);
+	close(fd);
+	if (n < 0)
+		res = -errno;
+	else if ((size_t) n > cs + 1 + ENCR_CHUNK_OVERHEAD)
+		res = -EIO;
+	else
+		res = encr_chunk_unpack(&s->keys, store_chunk_number(id), rec,
+					n, plain, cs);
+	free(rec);
+	return res == -EBADMSG ? -EIO : res;
+}
+
+int encr_store_ref(struct encr_store *s, const unsigned char *id)
+{
+	char name[2 * ENCR_CHUNK_ID_SIZE + 2];
+	pthread_mutex_t *lock;
+	uint64_t refs;
+	int fd;
+	int res;
+
+	store_name(id, name);
+	lock = &s->stripes[id[1] % ENCR_STORE_STRIPES];
+	pthread_mutex_lock(lock);
+	fd = openat(s->dirfd, name, O_RDWR);
+	if (fd == -1) {
+		res = errno == ENOENT ? -EIO : -errno;
+	} else {
+		res = store_read_refs(fd, &refs);
+		if (res == 0)
+			res = store_write_refs(fd, refs + 1);
+		close(fd);
+	}
+	pthread_mutex_unlock(lock);
+	return res;
+}
+
+int encr_store_unref(struct encr_store *s, const unsigned char *id)
+{
+	char name[2 * ENCR_CHUNK_ID_SIZE + 2];
+	pthread_mutex_t *lock;
+	uint64_t refs;
+	int fd;
+	int res;
+
+	store_name(id, name);
+	lock = &s->stripes[id[1] % ENCR_STORE_STRIPES];
+	pthread_mutex_lock(lock);
+	fd = openat(s->dirfd, name, O_RDWR);
+	if (fd == -1) {
+		res = -errno;
+	} else {
+		res = store_read_refs(fd, &refs);
+		if (res == 0 && refs > 1)
+			res = store_write_refs(fd, refs - 1);
+		else if (res == 0 && unlinkat(s->dirfd, name, 0) == -1)
+			res = -errno;
+		close(fd);
+	}
+	pthread_mutex_unlock(lock);
+	return res;
+}
+
+int encr_store_has(struct encr_store *s, const unsigned char *id)
+{
+	char name[2 * ENCR_CHUNK_ID_SIZE + 2];
+	struct stat st;
+
+	store_name(id, name);
+	if (fstatat(s->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		return 1;
+	return errno == ENOENT ? 0 : -errno;
+}
+
+int encr_store_sync(struct encr_store *s)
+{
+	return syncfs(s->dirfd) == -1 ? -errno : 0;
+}
+
+// Inverse of store_name(); -EINVAL for anything else in the store
+static int store_parse_name(const char *name, unsigned char *id)
+{
+	int i;
+
+	if (strlen(name) != 1 + 2 * ENCR_CHUNK_ID_SIZE || name[2] != '/')
+		return -EINVAL;
+	for (i = 0; i < 2 * ENCR_CHUNK_ID_SIZE; i++) {
+		char c = name[i < 2 ? i : i + 1];
+		int v;
+
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else
+			return -EINVAL;
+		if (i % 2 == 0)
+			id[i / 2] = v << 4;
+		else
+			id[i / 2] |= v;
+	}
+	return 0;
+}
+
+int encr_store_verify(struct encr_store *s, const char *name)
+{
+	unsigned char id[ENCR_CHUNK_ID_SIZE];
+	unsigned char mac[AES_CRYPT_MACLEN];
+	unsigned char *plain;
+	uint64_t refs;
+	int fd;
+	int res;
+
+	res = store_parse_name(name, id);
+	if (res != 0)
+		return res;
+	fd = openat(s->dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	res = store_read_refs(fd, &refs);
+	close(fd);
+	if (res == 0 && refs == 0)
+		res = -EIO;
+	if (res != 0)
+		return res;
+
+	plain = malloc(1 << ENCR_MAX_CHUNK_SHIFT);
+	if (plain == NULL)
+		return -ENOMEM;
+	res = encr_store_get(s, id, plain, 1 << ENCR_MAX_CHUNK_SHIFT);
+	// The name has to still be the chunk's id, or files find wrong data
+	if (res >= 0 && !hmac_sha256(s->idkey, ENCR_KEY_SIZE, NULL, 0, plain,
+				     res, mac))
+		res = -EIO;
+	else if (res >= 0)
+		res = memcmp(mac, id, ENCR_CHUNK_ID_SIZE) == 0 ? 0 : -EIO;
+	free(plain);
+	return res;
+}
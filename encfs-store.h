@@ -0,0 +1,108 @@
+/* encfs-store.h
+ * Content-addressed chunk store for deduplicated pa5-encfs files
+ *
+ * Files created while the mirror is mounted with -o dedup keep no data
+ * of their own: each chunk is a reference into .encfs/chunks, where
+ * every distinct chunk is stored once. A chunk's id is an HMAC-SHA256 of
+ * its plaintext under a key only the mount has, so equal chunks meet
+ * without the ids telling outsiders anything about the contents.
+ *
+ *   .encfs/chunks/key        a file header (see encfs-format.h) whose data
+ *                            keys encrypt every stored chunk and derive
+ *                            the id key; rewrapped by encfs-rekey
+ *   .encfs/chunks/xx/<id>    one stored chunk, in a directory named after
+ *                            the first byte of its id: a reference count
+ *                            (u64, little endian) and a chunk record as
+ *                            in encfs-compress.h, bound to the id
+ *
+ * A write takes a reference on the new chunk before the file's table
+ * points at it, and drops the old one only afterwards, so a crash can
+ * leak a chunk but never free one still in use. Reference counts are
+ * kept under one of ENCR_STORE_STRIPES locks picked by id.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_STORE_H
+#define ENCFS_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+#define ENCR_STORE_DIR "chunks"
+#define ENCR_STORE_KEY "key"
+#define ENCR_STORE_STRIPES 64
+
+struct encr_store;
+
+/* int encr_store_open(const char *rootdir, const struct encr_keys *mk, int create, struct encr_store **sp)
+ * Purpose: Open the mirror's chunk store
+ * Args: int create          : Set the store up if the mirror has none yet
+ *       struct encr_store **sp : Set to the store, or to NULL if there is
+ *                                none and create is 0
+ * Return: 0 on success, -errno on failure (-EIO for a bad key file)
+ */
+extern int encr_store_open(const char *rootdir, const struct encr_keys *mk,
+			   int create, struct encr_store **sp);
+
+/* void encr_store_close(struct encr_store *s)
+ * Purpose: Free a store opened by encr_store_open(); s may be NULL
+ */
+extern void encr_store_close(struct encr_store *s);
+
+/* int encr_store_put(struct encr_store *s, const unsigned char *plain, size_t len, int compress, unsigned char *id)
+ * Purpose: Take a reference on the chunk holding len bytes of plain,
+ *          storing it first if no file has it yet
+ * Args: int compress       : Whether a newly stored chunk is compressed
+ *       unsigned char *id  : Set to the chunk's ENCR_CHUNK_ID_SIZE byte id
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_store_put(struct encr_store *s, const unsigned char *plain,
+			  size_t len, int compress, unsigned char *id);
+
+/* int encr_store_get(struct encr_store *s, const unsigned char *id, unsigned char *plain, size_t cs)
+ * Purpose: Read a stored chunk into plain, which has room for cs bytes
+ * Return: Plaintext length, or -errno (-EIO when it fails authentication)
+ */
+extern int encr_store_get(struct encr_store *s, const unsigned char *id,
+			  unsigned char *plain, size_t cs);
+
+/* int encr_store_ref(struct encr_store *s, const unsigned char *id)
+ * Purpose: Take another reference on a chunk some file already points at
+ * Return: 0 on success, -errno on failure (-EIO if there is no such chunk)
+ */
+extern int encr_store_ref(struct encr_store *s, const unsigned char *id);
+
+/* int encr_store_unref(struct encr_store *s, const unsigned char *id)
+ * Purpose: Drop a reference, removing the chunk with its last one
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_store_unref(struct encr_store *s, const unsigned char *id);
+
+/* int encr_store_has(struct encr_store *s, const unsigned char *id)
+ * Purpose: Check that a chunk is in the store, without reading it
+ * Return: 1 if it is, 0 if not, -errno on failure
+ */
+extern int encr_store_has(struct encr_store *s, const unsigned char *id);
+
+/* int encr_store_sync(struct encr_store *s)
+ * Purpose: Make every chunk and reference count written so far durable
+ *          Chunks are not synced as they are put, so this syncs the
+ *          whole filesystem the store is on.
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_store_sync(struct encr_store *s);
+
+/* int encr_store_verify(struct encr_store *s, const char *name)
+ * Purpose: Check one stored chunk, named by its path in the store
+ *          ("xx/<rest of the id>"): its reference count is not zero, its
+ *          record authenticates and its plaintext still has its id
+ * Return: 0 if it is intact, -EIO if it is damaged, -EINVAL if name is
+ *         not a chunk, -errno on failure
+ */
+extern int encr_store_verify(struct encr_store *s, const char *name);
+
+#endif
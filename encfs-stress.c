@@ -0,0 +1,398 @@
+/* encfs-stress.c
+ * Multithreaded single-file and single-directory stress test
+ *
+ * Every thread hammers its own disjoint region of one file with
+ * block-sized pread()/pwrite() calls for a fixed time. Run it against a
+ * file inside a pa5-encfs mount with increasing thread counts to see
+ * whether disjoint ranges of one file really proceed in parallel. With
+ * -x the threads share the whole file instead, so their reads and
+ * writes land on the same chunks.
+ *
+ * With -m dir the path is a directory instead, and every thread creates,
+ * writes, reads back, renames, unlinks and stats files from one small
+ * pool of names in it, and lists it, so the threads keep running into
+ * each other's files. Losing such a race (ENOENT, EEXIST) is expected;
+ * any other error, a listing with a name not from the pool, or a file
+ * reading back anything but what was written fails the run.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define MODE_READ 0
+#define MODE_WRITE 1
+#define MODE_MIXED 2
+#define MODE_DIR 3
+#define MAXTHREADS 256
+#define STRESS_NAMES 64		// pool of file names in dir mode
+#define STRESS_FILL 'x'		// every byte written in dir mode
+
+struct stress_thread {
+	pthread_t tid;
+	int fd;
+	const char *dir;
+	int mode;
+	unsigned seed;
+	size_t blocksize;
+	off_t region_start;
+	off_t region_blocks;
+	volatile int *stop;
+	unsigned long ops;
+	unsigned long long bytes;
+	int error;
+	const char *where;	// the call that failed
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *stress_worker(void *data)
+{
+	struct stress_thread *t = data;
+	char *buf = malloc(t->blocksize);
+	off_t off;
+	ssize_t res;
+	int write_op;
+
+	if (buf == NULL) {
+		t->error = ENOMEM;
+		return NULL;
+	}
+	memset(buf, 'a' + (t->seed % 26), t->blocksize);
+	while (!*t->stop) {
+		off = t->region_start +
+			(off_t) (rand_r(&t->seed) % t->region_blocks) * t->blocksize;
+		write_op = t->mode == MODE_WRITE ||
+			(t->mode == MODE_MIXED && (rand_r(&t->seed) & 1));
+		if (write_op)
+			res = pwrite(t->fd, buf, t->blocksize, off);
+		else
+			res = pread(t->fd, buf, t->blocksize, off);
+		if (res < 0) {
+			t->error = errno;
+			t->where = write_op ? "pwrite" : "pread";
+			break;
+		}
+		t->ops++;
+		t->bytes += res;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void stress_name(char *path, const char *dir, unsigned i)
+{
+	snprintf(path, PATH_MAX, "%s/s%03u", dir, i % STRESS_NAMES);
+}
+
+// Write a block to a pool file and read it back through the same handle
+static int stress_file(struct stress_thread *t, char *buf, const char *path)
+{
+	ssize_t res;
+	ssize_t i;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		t->where = "open";
+		return -1;
+	}
+	memset(buf, STRESS_FILL, t->blocksize);
+	res = pwrite(fd, buf, t->blocksize, 0);
+	if (res >= 0) {
+		t->bytes += res;
+		// Others may truncate it, never write anything else to it
+		res = pread(fd, buf, t->blocksize, 0);
+	}
+	if (res < 0) {
+		t->where = "pwrite/pread";
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < res; i++)
+		if (buf[i] != STRESS_FILL) {
+			t->where = "read back";
+			close(fd);
+			errno = EIO;
+			return -1;
+		}
+	if (close(fd) == -1) {
+		t->where = "close";
+		return -1;
+	}
+	return 0;
+}
+
+// List the directory; every name in it must be one of the pool's
+static int stress_list(struct stress_thread *t)
+{
+	DIR *dp;
+	struct dirent *de;
+	char *end;
+	unsigned long n;
+
+	dp = opendir(t->dir);
+	if (dp == NULL) {
+		t->where = "opendir";
+		return -1;
+	}
+	errno = 0;
+	while ((de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		n = de->d_name[0] == 's' ?
+			strtoul(de->d_name + 1, &end, 10) : STRESS_NAMES;
+		if (n >= STRESS_NAMES || *end != '\0' ||
+		    strlen(de->d_name) != 4) {
+			t->where = "readdir: stray name";
+			closedir(dp);
+			errno = EIO;
+			return -1;
+		}
+	}
+	if (errno != 0) {
+		t->where = "readdir";
+		closedir(dp);
+		return -1;
+	}
+	if (closedir(dp) == -1) {
+		t->where = "closedir";
+		return -1;
+	}
+	return 0;
+}
+
+static void *stress_dir_worker(void *data)
+{
+	struct stress_thread *t = data;
+	char *buf = malloc(t->blocksize);
+	char path[PATH_MAX];
+	char other[PATH_MAX];
+	struct stat st;
+	int res;
+
+	if (buf == NULL) {
+		t->error = ENOMEM;
+		return NULL;
+	}
+	while (!*t->stop) {
+		stress_name(path, t->dir, rand_r(&t->seed));
+		switch (rand_r(&t->seed) % 5) {
+		case 0:
+			res = stress_file(t, buf, path);
+			break;
+		case 1:
+			res = unlink(path);
+			t->where = "unlink";
+			break;
+		case 2:
+			stress_name(other, t->dir, rand_r(&t->seed));
+			res = rename(path, other);
+			t->where = "rename";
+			break;
+		case 3:
+			res = lstat(path, &st);
+			t->where = "lstat";
+			break;
+		default:
+			res = stress_list(t);
+			break;
+		}
+		if (res == -1 && errno != ENOENT && errno != EEXIST) {
+			t->error = errno;
+			break;
+		}
+		t->ops++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int stress_run(int fd, const char *dir, int nthreads, int mode,
+		      int shared, size_t blocksize, off_t filesize,
+		      double seconds)
+{
+	struct stress_thread threads[MAXTHREADS];
+	volatile int stop = 0;
+	unsigned long ops = 0;
+	unsigned long long bytes = 0;
+	off_t region = shared ? filesize : filesize / nthreads;
+	double start;
+	double elapsed;
+	int i;
+
+	if (mode != MODE_DIR && region < (off_t) blocksize) {
+		fprintf(stderr, "file too small for %d threads\n", nthreads);
+		return -1;
+	}
+	memset(threads, 0, sizeof(threads));
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].fd = fd;
+		threads[i].dir = dir;
+		threads[i].mode = mode;
+		threads[i].seed = i + 1;
+		threads[i].blocksize = blocksize;
+		threads[i].region_start = shared ? 0 : region * i;
+		threads[i].region_blocks = region / blocksize;
+		threads[i].stop = &stop;
+		if (pthread_create(&threads[i].tid, NULL,
+				   mode == MODE_DIR ? stress_dir_worker :
+				   stress_worker, &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	usleep((useconds_t) (seconds * 1e6));
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].error) {
+			fprintf(stderr, "thread %d: %s: %s\n", i,
+				threads[i].where != NULL ?
+				threads[i].where : "setup",
+				strerror(threads[i].error));
+			return -1;
+		}
+		ops += threads[i].ops;
+		bytes += threads[i].bytes;
+	}
+	elapsed = now() - start;
+
+	printf("%8d %12.0f %12.2f\n", nthreads, ops / elapsed,
+	       bytes / elapsed / (1024 * 1024));
+	return 0;
+}
+
+// Remove what dir mode left behind
+static void stress_clean(const char *dir)
+{
+	char path[PATH_MAX];
+	unsigned i;
+
+	for (i = 0; i < STRESS_NAMES; i++) {
+		stress_name(path, dir, i);
+		unlink(path);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s %s\n", prog,
+		"[-t threads] [-m read|write|mixed|dir] [-x] [-b blocksize] "
+		"[-S file size MiB] [-s seconds] <file or directory path>");
+	fprintf(stderr, "Without -t, runs with 1, 2, 4, ... 32 threads\n");
+	fprintf(stderr, "-x shares the whole file between the threads; "
+		"-m dir works on files in a directory\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads = 0;
+	int mode = MODE_MIXED;
+	int shared = 0;
+	size_t blocksize = 4096;
+	off_t filesize = 256 * 1024 * 1024;
+	double seconds = 5;
+	int opt;
+	int fd = -1;
+	const char *dir = NULL;
+	int n;
+
+	while ((opt = getopt(argc, argv, "t:m:xb:S:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "read"))
+				mode = MODE_READ;
+			else if (!strcmp(optarg, "write"))
+				mode = MODE_WRITE;
+			else if (!strcmp(optarg, "mixed"))
+				mode = MODE_MIXED;
+			else if (!strcmp(optarg, "dir"))
+				mode = MODE_DIR;
+			else
+				usage(argv[0]);
+			break;
+		case 'x':
+			shared = 1;
+			break;
+		case 'b':
+			blocksize = strtoul(optarg, NULL, 0);
+			if (blocksize == 0)
+				usage(argv[0]);
+			break;
+		case 'S':
+			filesize = (off_t) strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 's':
+			seconds = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (mode == MODE_DIR) {
+		dir = argv[optind];
+		if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+			perror("mkdir error");
+			return EXIT_FAILURE;
+		}
+	} else {
+		fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+		if (fd == -1) {
+			perror("open error");
+			return EXIT_FAILURE;
+		}
+		/* Make sure reads hit real data rather than a hole past EOF */
+		if (ftruncate(fd, filesize) == -1) {
+			perror("ftruncate error");
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%8s %12s %12s\n", "threads", "ops/s", "MiB/s");
+	if (nthreads) {
+		if (stress_run(fd, dir, nthreads, mode, shared, blocksize,
+			       filesize, seconds))
+			return EXIT_FAILURE;
+	} else {
+		for (n = 1; n <= 32; n *= 2)
+			if (stress_run(fd, dir, n, mode, shared, blocksize,
+				       filesize, seconds))
+				return EXIT_FAILURE;
+	}
+
+	if (dir != NULL)
+		stress_clean(dir);
+	else
+		close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/* encfs-sync.c
+ * Group commit fsync for pa5-encfs
+ *
+ * See encfs-sync.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "encfs-sync.h"
+#include "encfs-lock.h"
+#include "encfs-store.h"
+#include "encfs-log.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+
+void encr_sync_init(struct encr_sync *s)
+{
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->running = 0;
+	s->want_full = 0;
+	s->started = 0;
+	s->done = 0;
+	s->done_full = 0;
+	s->fail_id = 0;
+	s->fail_err = 0;
+	s->synced = 0;
+	s->synced_gen = 0;
+}
+
+void encr_sync_destroy(struct encr_sync *s)
+{
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+}
+
+// One backing flush; runs with s->lock dropped
+static int encr_sync_flush(struct encr_inode *in, int fd, int full)
+{
+	int res;
+
+	// Blocks only in the cache tier go to the mirror first
+	res = encr_tier_flush(in);
+	if (res != 0)
+		return res;
+	res = full ? fsync(fd) : fdatasync(fd);
+	if (res == -1)
+		return -errno;
+	// Chunks are written to the store or log without syncing each one
+	if (in->store != NULL && (in->hdr.flags & ENCR_FLAG_DEDUP))
+		return encr_store_sync(in->store);
+	if (in->log != NULL && (in->hdr.flags & ENCR_FLAG_LOG))
+		return encr_log_sync(in->log);
+	// and a striped file's parts are files of their own
+	if (in->hdr.flags & ENCR_FLAG_STRIPED)
+		return encr_parts_sync(in, full);
+	return 0;
+}
+
+int encr_sync_file(struct encr_inode *in, int fd, int datasync)
+{
+	struct encr_sync *s = &in->sync;
+	unsigned long gen;
+	uint64_t target;
+	uint64_t id;
+	int full;
+	int res;
+
+	pthread_mutex_lock(&s->lock);
+	gen = __atomic_load_n(&in->wgen, __ATOMIC_ACQUIRE);
+	if (datasync && s->synced && s->synced_gen == gen) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	// A flush already running may have started before our writes ended
+	target = s->started + 1;
+	if (!datasync)
+		s->want_full = 1;
+	for (;;) {
+		if ((datasync ? s->done : s->done_full) >= target) {
+			res = s->fail_id >= target ? s->fail_err : 0;
+			pthread_mutex_unlock(&s->lock);
+			return res;
+		}
+		if (!s->running)
+			break;
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+
+	// Lead the flush for ourselves and everyone waiting on it
+	s->running = 1;
+	id = ++s->started;
+	full = !datasync || s->want_full;
+	s->want_full = 0;
+	gen = __atomic_load_n(&in->wgen, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&s->lock);
+
+	res = encr_sync_flush(in, fd, full);
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	s->done = id;
+	if (full)
+		s->done_full = id;
+	if (res != 0) {
+		s->fail_id = id;
+		s->fail_err = res;
+	} else {
+		s->synced = 1;
+		s->synced_gen = gen;
+	}
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
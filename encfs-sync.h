@@ -0,0 +1,60 @@
+/* encfs-sync.h
+ * Group commit fsync for pa5-encfs
+ *
+ * Every fsync() of a file, through any of its handles, asks for one
+ * flush of the backing inode that starts after the call was made. While
+ * a flush runs, the calls that arrive wait for the next one, and the
+ * first of them to find no flush running issues it for all the others;
+ * so however many threads fsync a file at once, at most two backing
+ * flushes are in progress or queued for it. A flush is a full fsync()
+ * when any caller waiting on it asked for one, and fdatasync() when they
+ * all asked for fdatasync() only. fdatasync() of a file that has not
+ * been written since its last successful flush returns at once.
+ *
+ * A caller is only woken by a flush that began after it arrived, so a
+ * grouped fsync() promises exactly what its own fsync() would have.
+ * When a flush fails, every caller it covered gets its error.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_SYNC_H
+#define ENCFS_SYNC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct encr_inode;
+
+struct encr_sync {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;			// a flush is in progress
+	int want_full;			// the next flush must be a full fsync()
+	uint64_t started;		// flushes begun, the id of the last
+	uint64_t done;			// id of the last flush to finish
+	uint64_t done_full;		// id of the last full flush to finish
+	uint64_t fail_id;		// id of the last flush that failed
+	int fail_err;			// and its -errno
+	int synced;			// synced_gen is valid
+	unsigned long synced_gen;	// wgen the last good flush covered
+};
+
+/* void encr_sync_init(struct encr_sync *s)
+ * void encr_sync_destroy(struct encr_sync *s)
+ * Purpose: Set up and tear down a file's flush state
+ */
+extern void encr_sync_init(struct encr_sync *s);
+extern void encr_sync_destroy(struct encr_sync *s);
+
+/* int encr_sync_file(struct encr_inode *in, int fd, int datasync)
+ * Purpose: fsync() (or fdatasync() if datasync is set) the backing file
+ *          in, open on fd, sharing the flush with concurrent callers
+ *          Files in a chunk store also have the store's filesystem
+ *          synced, and log-structured files the log.
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_sync_file(struct encr_inode *in, int fd, int datasync);
+
+#endif
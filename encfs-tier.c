@@ -0,0 +1,1381 @@
+/* encfs-tier.c
+ * Local cache tier in front of a slow pa5-encfs mirror
+ *
+ * See encfs-tier.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "encfs-tier.h"
+#include "encfs-direct.h"
+#include "encfs-sched.h"
+
+#define TIER_BLOCK ((size_t) 1 << ENCR_TIER_SHIFT)
+#define TIER_VERSION 1
+#define TIER_HDR_SIZE 48
+#define TIER_REC_SIZE 56
+#define TIER_FILE_BUCKETS 1024
+#define TIER_EVICT_SCAN 64		// slots looked at per segment for a victim
+#define TIER_FLUSH_INTERVAL 1		// seconds between flusher passes
+
+enum { SLOT_FREE, SLOT_FILLING, SLOT_VALID };
+enum { LIST_FREE, LIST_PROBATION, LIST_PROTECTED, LIST_NONE };
+
+struct tier_slot {
+	struct tier_slot *hnext;	// in its hash bucket
+	struct tier_slot *prev;		// on its list
+	struct tier_slot *next;
+	struct tier_slot *fprev;	// among its file's
+	struct tier_slot *fnext;
+	struct encr_tier_file *file;
+	uint64_t block;
+	uint32_t len;			// bytes of the block held
+	unsigned pins;			// readers, writers and write-backs
+	unsigned char state;
+	unsigned char list;
+	unsigned char spoiled;		// out of the hash, freed when unpinned
+	unsigned char dirty;
+	time_t dirtied;
+};
+
+struct encr_tier_file {
+	struct encr_tier_file *hnext;
+	dev_t dev;
+	ino_t ino;
+	int refs;			// inodes attached
+	int fd;				// dup of the first one's fd, -1 if none
+	int direct;
+	int writeback;
+	off_t size;			// of the backing file, while attached
+	off_t ssize;			// stamp of a detached file's slots
+	struct timespec smtime;
+	struct tier_slot *slots;
+	unsigned nslots;
+	unsigned io;			// dirty slots being written back
+	pthread_mutex_t grow;		// held by writes extending the file
+};
+
+struct tier_list {
+	struct tier_slot *head;		// most recently used
+	struct tier_slot *tail;
+	size_t n;
+};
+
+struct encr_tier {
+	pthread_mutex_t lock;		// guards everything below
+	pthread_cond_t cond;		// a slot unpinned or a file detached
+	pthread_cond_t wake;		// for the flusher
+	int dirfd;
+	int datafd;			// flock()ed while the cache is in use
+	int writeback;
+	size_t nslots;
+	struct tier_slot *slot;
+	struct tier_slot **sbuckets;	// nslots of them
+	struct encr_tier_file *fbuckets[TIER_FILE_BUCKETS];
+	struct tier_list lists[LIST_NONE];
+	size_t ndirty;
+	dev_t rdev;			// the mirror's root
+	ino_t rino;
+	int stop;
+	int running;
+	pthread_t flusher;
+	struct encr_sched *sched;	// lets the flusher in, NULL for none
+};
+
+static const unsigned char tier_zero[TIER_BLOCK];
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *p, unsigned n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+static ssize_t tier_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pread(fd, (char *) buf + done, len - done, off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t tier_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < len) {
+		res = pwrite(fd, (const char *) buf + done, len - done,
+			     off + done);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+// The mirror's copy, bounced through aligned buffers if fd may be O_DIRECT
+static ssize_t tier_raw_pread(struct encr_tier_file *f, int fd, void *buf,
+			      size_t len, off_t off)
+{
+	if (f->direct)
+		return encr_dio_pread(fd, buf, len, off);
+	return tier_pread_full(fd, buf, len, off);
+}
+
+static ssize_t tier_raw_pwrite(struct encr_tier_file *f, int fd,
+			       const void *buf, size_t len, off_t off)
+{
+	if (f->direct)
+		return encr_dio_pwrite(fd, buf, len, off);
+	return tier_pwrite_full(fd, buf, len, off);
+}
+
+static off_t tier_slot_off(struct encr_tier *t, struct tier_slot *s)
+{
+	return (off_t) (s - t->slot) << ENCR_TIER_SHIFT;
+}
+
+/* Lists and hashes, all with t->lock held */
+
+static void tier_list_unlink(struct encr_tier *t, struct tier_slot *s)
+{
+	struct tier_list *l;
+
+	if (s->list == LIST_NONE)
+		return;
+	l = &t->lists[s->list];
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		l->head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		l->tail = s->prev;
+	s->prev = s->next = NULL;
+	s->list = LIST_NONE;
+	l->n--;
+}
+
+static void tier_list_push(struct encr_tier *t, struct tier_slot *s, int which)
+{
+	struct tier_list *l = &t->lists[which];
+
+	s->prev = NULL;
+	s->next = l->head;
+	if (l->head)
+		l->head->prev = s;
+	else
+		l->tail = s;
+	l->head = s;
+	s->list = which;
+	l->n++;
+}
+
+static size_t tier_shash(struct encr_tier *t, struct encr_tier_file *f,
+			 uint64_t block)
+{
+	uint64_t h = (uint64_t) (uintptr_t) f ^ (block * 0x9e3779b97f4a7c15ULL);
+
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return (size_t) (h >> 32) % t->nslots;
+}
+
+static size_t tier_fhash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev << 32) ^ (uint64_t) ino;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (size_t) (h >> 32) % TIER_FILE_BUCKETS;
+}
+
+static struct tier_slot *tier_find(struct encr_tier *t,
+				   struct encr_tier_file *f, uint64_t block)
+{
+	struct tier_slot *s;
+
+	for (s = t->sbuckets[tier_shash(t, f, block)]; s != NULL; s = s->hnext)
+		if (s->file == f && s->block == block)
+			return s;
+	return NULL;
+}
+
+static struct encr_tier_file *tier_file_find(struct encr_tier *t, dev_t dev,
+					     ino_t ino)
+{
+	struct encr_tier_file *f;
+
+	for (f = t->fbuckets[tier_fhash(dev, ino)]; f != NULL; f = f->hnext)
+		if (f->dev == dev && f->ino == ino)
+			return f;
+	return NULL;
+}
+
+static struct encr_tier_file *tier_file_new(struct encr_tier *t, dev_t dev,
+					    ino_t ino)
+{
+	struct encr_tier_file *f = calloc(1, sizeof(struct encr_tier_file));
+	size_t b;
+
+	if (f == NULL)
+		return NULL;
+	f->dev = dev;
+	f->ino = ino;
+	f->fd = -1;
+	pthread_mutex_init(&f->grow, NULL);
+	b = tier_fhash(dev, ino);
+	f->hnext = t->fbuckets[b];
+	t->fbuckets[b] = f;
+	return f;
+}
+
+// Free f once nothing refers to it any more
+static void tier_file_put(struct encr_tier *t, struct encr_tier_file *f)
+{
+	struct encr_tier_file **pp;
+
+	if (f->refs > 0 || f->fd != -1 || f->slots != NULL)
+		return;
+	for (pp = &t->fbuckets[tier_fhash(f->dev, f->ino)]; *pp != f;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = f->hnext;
+	pthread_mutex_destroy(&f->grow);
+	free(f);
+}
+
+// Give s block of f, pinned and filling
+static void tier_slot_bind(struct encr_tier *t, struct tier_slot *s,
+			   struct encr_tier_file *f, uint64_t block)
+{
+	size_t b = tier_shash(t, f, block);
+
+	s->file = f;
+	s->block = block;
+	s->len = 0;
+	s->pins = 1;
+	s->state = SLOT_FILLING;
+	s->spoiled = 0;
+	s->dirty = 0;
+	s->hnext = t->sbuckets[b];
+	t->sbuckets[b] = s;
+	s->fprev = NULL;
+	s->fnext = f->slots;
+	if (f->slots)
+		f->slots->fprev = s;
+	f->slots = s;
+	f->nslots++;
+}
+
+// Take s out of the hash and its file, so it can no longer be found
+static void tier_slot_unbind(struct encr_tier *t, struct tier_slot *s)
+{
+	struct encr_tier_file *f = s->file;
+	struct tier_slot **pp;
+
+	for (pp = &t->sbuckets[tier_shash(t, f, s->block)]; *pp != s;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = s->hnext;
+	s->hnext = NULL;
+	if (s->fprev)
+		s->fprev->fnext = s->fnext;
+	else
+		f->slots = s->fnext;
+	if (s->fnext)
+		s->fnext->fprev = s->fprev;
+	s->fprev = s->fnext = NULL;
+	f->nslots--;
+	if (s->dirty) {
+		s->dirty = 0;
+		t->ndirty--;
+	}
+	tier_list_unlink(t, s);
+}
+
+/* Put s back on the free list; its file is left for the caller, which
+ * may still be using it, to tier_file_put() */
+static void tier_slot_release(struct encr_tier *t, struct tier_slot *s)
+{
+	s->file = NULL;
+	s->state = SLOT_FREE;
+	s->spoiled = 0;
+	tier_list_push(t, s, LIST_FREE);
+}
+
+/* Drop what s holds: it stops being found at once and goes back on the
+ * free list when the last pin goes */
+static void tier_spoil(struct encr_tier *t, struct tier_slot *s)
+{
+	if (s->spoiled)
+		return;
+	tier_slot_unbind(t, s);
+	s->spoiled = 1;
+	if (s->pins == 0)
+		tier_slot_release(t, s);
+}
+
+static void tier_unpin(struct encr_tier *t, struct tier_slot *s)
+{
+	if (--s->pins > 0)
+		return;
+	if (s->spoiled)
+		tier_slot_release(t, s);
+	pthread_cond_broadcast(&t->cond);
+}
+
+// A read hit: probation moves up to protected, which pushes its oldest down
+static void tier_touch(struct encr_tier *t, struct tier_slot *s)
+{
+	struct tier_list *p = &t->lists[LIST_PROTECTED];
+
+	if (s->list == LIST_NONE)
+		return;
+	tier_list_unlink(t, s);
+	tier_list_push(t, s, LIST_PROTECTED);
+	if (p->n * 100 > t->nslots * ENCR_TIER_PROTECTED) {
+		s = p->tail;
+		tier_list_unlink(t, s);
+		tier_list_push(t, s, LIST_PROBATION);
+	}
+}
+
+static void tier_mark_dirty(struct encr_tier *t, struct tier_slot *s)
+{
+	if (s->dirty)
+		return;
+	s->dirty = 1;
+	s->dirtied = time(NULL);
+	if (++t->ndirty * 2 > t->nslots)
+		pthread_cond_signal(&t->wake);
+}
+
+static struct tier_slot *tier_victim(struct encr_tier *t, int which)
+{
+	struct tier_slot *s;
+	int n;
+
+	for (s = t->lists[which].tail, n = 0; s != NULL && n < TIER_EVICT_SCAN;
+	     s = s->prev, n++)
+		if (s->pins == 0 && !s->dirty)
+			return s;
+	return NULL;
+}
+
+/* A slot for block of f, pinned and filling, evicting the least recently
+ * used clean one if none is free; NULL if every one looked at is busy */
+static struct tier_slot *tier_slot_alloc(struct encr_tier *t,
+					 struct encr_tier_file *f,
+					 uint64_t block)
+{
+	struct tier_slot *s = t->lists[LIST_FREE].tail;
+	struct encr_tier_file *old;
+
+	if (s == NULL)
+		s = tier_victim(t, LIST_PROBATION);
+	if (s == NULL)
+		s = tier_victim(t, LIST_PROTECTED);
+	if (s == NULL) {
+		// Dirty ones, most likely; the flusher makes them clean
+		if (t->ndirty > 0)
+			pthread_cond_signal(&t->wake);
+		return NULL;
+	}
+	if (s->file != NULL) {
+		old = s->file;
+		tier_slot_unbind(t, s);
+		s->file = NULL;
+		tier_file_put(t, old);
+	}
+	tier_list_unlink(t, s);
+	tier_slot_bind(t, s, f, block);
+	return s;
+}
+
+/* Filling */
+
+/* Fetch blocks [b, b + n) of f from the mirror into the slots claimed
+ * for them, and copy len bytes at off into buf. Returns what was copied,
+ * short at the end of the file, or -errno. */
+static ssize_t tier_fill(struct encr_tier *t, struct encr_tier_file *f, int fd,
+			 struct tier_slot **run, uint64_t b, unsigned n,
+			 char *buf, size_t len, off_t off)
+{
+	size_t boff = off - ((off_t) b << ENCR_TIER_SHIFT);
+	unsigned char *bounce;
+	ssize_t got, w;
+	size_t have;
+	unsigned i;
+
+	bounce = malloc((size_t) n << ENCR_TIER_SHIFT);
+	got = bounce == NULL ? -ENOMEM :
+		tier_raw_pread(f, fd, bounce, (size_t) n << ENCR_TIER_SHIFT,
+			       (off_t) b << ENCR_TIER_SHIFT);
+
+	for (i = 0; i < n; i++) {
+		have = got <= (ssize_t) ((size_t) i << ENCR_TIER_SHIFT) ? 0 :
+			(size_t) got - ((size_t) i << ENCR_TIER_SHIFT);
+		if (have > TIER_BLOCK)
+			have = TIER_BLOCK;
+		w = got < 0 ? got : tier_pwrite_full(t->datafd, bounce +
+				((size_t) i << ENCR_TIER_SHIFT), have,
+				tier_slot_off(t, run[i]));
+		pthread_mutex_lock(&t->lock);
+		if (w < 0) {
+			tier_spoil(t, run[i]);
+		} else if (!run[i]->spoiled) {
+			run[i]->len = have;
+			run[i]->state = SLOT_VALID;
+			tier_list_push(t, run[i], LIST_PROBATION);
+		}
+		tier_unpin(t, run[i]);
+		pthread_mutex_unlock(&t->lock);
+	}
+
+	if (got >= 0) {
+		have = (size_t) got > boff ? (size_t) got - boff : 0;
+		got = have < len ? have : len;
+		memcpy(buf, bounce + boff, got);
+	}
+	free(bounce);
+	return got;
+}
+
+/* Read from the block at off, or from a run of missing blocks starting
+ * there. Returns the bytes read, 0 at the end of the file, or -errno. */
+static ssize_t tier_read(struct encr_tier *t, struct encr_tier_file *f,
+			 int fd, char *buf, size_t len, off_t off)
+{
+	struct tier_slot *run[ENCR_TIER_FILL_MAX];
+	struct tier_slot *s;
+	uint64_t b = (uint64_t) off >> ENCR_TIER_SHIFT;
+	uint64_t last;
+	size_t boff = off & (TIER_BLOCK - 1);
+	size_t have, n;
+	ssize_t got;
+	unsigned nb;
+	int retry;
+
+	pthread_mutex_lock(&t->lock);
+	if (off >= f->size) {
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	if ((off_t) len > f->size - off)
+		len = f->size - off;
+	last = ((uint64_t) off + len - 1) >> ENCR_TIER_SHIFT;
+	if (len > TIER_BLOCK - boff)
+		n = TIER_BLOCK - boff;
+	else
+		n = len;
+
+	s = tier_find(t, f, b);
+	if (s != NULL && s->state == SLOT_VALID) {
+		s->pins++;
+		tier_touch(t, s);
+		have = s->len;
+		pthread_mutex_unlock(&t->lock);
+
+		// Past what the slot holds, up to the end of the file, is zeros
+		got = boff >= have ? 0 : tier_pread_full(t->datafd, buf,
+				have - boff < n ? have - boff : n,
+				tier_slot_off(t, s) + boff);
+		if (got >= 0 && boff + got < have && (size_t) got < n)
+			got = -EIO;
+		if (got >= 0)
+			memset(buf + got, 0, n - got);
+
+		pthread_mutex_lock(&t->lock);
+		// Fall back on the mirror if a clean copy cannot be read
+		retry = got < 0 && !s->dirty;
+		if (retry)
+			tier_spoil(t, s);
+		tier_unpin(t, s);
+		pthread_mutex_unlock(&t->lock);
+		if (retry)
+			return tier_raw_pread(f, fd, buf, n, off);
+		return got < 0 ? got : (ssize_t) n;
+	}
+	if (s != NULL) {
+		// Being fetched by someone else; read around it
+		pthread_mutex_unlock(&t->lock);
+		return tier_raw_pread(f, fd, buf, n, off);
+	}
+
+	for (nb = 0; b + nb <= last && nb < ENCR_TIER_FILL_MAX; nb++) {
+		if (nb > 0 && tier_find(t, f, b + nb) != NULL)
+			break;
+		run[nb] = tier_slot_alloc(t, f, b + nb);
+		if (run[nb] == NULL)
+			break;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (nb == 0)
+		return tier_raw_pread(f, fd, buf, n, off);
+	n = ((size_t) nb << ENCR_TIER_SHIFT) - boff;
+	return tier_fill(t, f, fd, run, b, nb, buf, len < n ? len : n, off);
+}
+
+ssize_t encr_tier_pread(struct encr_inode *in, int fd, void *buf, size_t len,
+			off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = tier_read(in->tier, in->tfile, fd, (char *) buf + done,
+			      len - done, off + done);
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/* Writing */
+
+/* Copy len bytes at boff of s's block into it, zeroing any gap after
+ * what it held. s is pinned; the gap is zeroed with t->lock held, so a
+ * writer further on cannot have it zeroed over its data. */
+static int tier_patch(struct encr_tier *t, struct tier_slot *s,
+		      const char *buf, size_t boff, size_t len)
+{
+	ssize_t n = 0;
+
+	pthread_mutex_lock(&t->lock);
+	if (boff > s->len)
+		n = tier_pwrite_full(t->datafd, tier_zero, boff - s->len,
+				     tier_slot_off(t, s) + s->len);
+	if (n >= 0 && boff + len > s->len)
+		s->len = boff + len;
+	pthread_mutex_unlock(&t->lock);
+	if (n >= 0)
+		n = tier_pwrite_full(t->datafd, buf, len,
+				     tier_slot_off(t, s) + boff);
+	return n < 0 ? (int) n : 0;
+}
+
+/* Bring the cached copy of block b in line with len bytes at boff just
+ * written to the mirror: patch it if there is one, or with alloc keep
+ * the data as a new one if it is all the block holds. A copy being
+ * fetched may have missed the write and is dropped. Patched copies of a
+ * file written back are redirtied, as the flusher may have been writing
+ * out what they held before. */
+static void tier_update(struct encr_tier *t, struct encr_tier_file *f,
+			const char *buf, uint64_t b, size_t boff, size_t len,
+			int alloc)
+{
+	off_t start = (off_t) b << ENCR_TIER_SHIFT;
+	struct tier_slot *s;
+	int fresh = 0;
+
+	pthread_mutex_lock(&t->lock);
+	s = tier_find(t, f, b);
+	if (s != NULL && s->state == SLOT_FILLING) {
+		tier_spoil(t, s);
+		s = NULL;
+	} else if (s != NULL) {
+		s->pins++;
+	} else if (alloc && boff == 0 && (off_t) len >= f->size - start) {
+		s = tier_slot_alloc(t, f, b);
+		fresh = 1;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (s == NULL)
+		return;
+
+	if (tier_patch(t, s, buf, boff, len) != 0) {
+		pthread_mutex_lock(&t->lock);
+		tier_spoil(t, s);
+	} else {
+		pthread_mutex_lock(&t->lock);
+		if (fresh && !s->spoiled) {
+			s->state = SLOT_VALID;
+			tier_list_push(t, s, LIST_PROBATION);
+		} else if (!fresh && f->writeback && !s->spoiled) {
+			tier_mark_dirty(t, s);
+		}
+	}
+	tier_unpin(t, s);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* Write to the mirror, then update the cache. A write that fails may
+ * have changed some of the range, so every cached block of it goes. */
+static ssize_t tier_write_around(struct encr_tier *t, struct encr_tier_file *f,
+				 int fd, const char *buf, size_t len, off_t off,
+				 int alloc)
+{
+	uint64_t b = (uint64_t) off >> ENCR_TIER_SHIFT;
+	size_t boff = off & (TIER_BLOCK - 1);
+	struct tier_slot *s;
+	size_t done, n;
+	ssize_t res;
+
+	res = tier_raw_pwrite(f, fd, buf, len, off);
+	pthread_mutex_lock(&t->lock);
+	if (res >= 0 && off + (off_t) len > f->size)
+		f->size = off + len;
+	for (done = 0; res < 0 && done < len; done += n, b++, boff = 0) {
+		n = len - done < TIER_BLOCK - boff ? len - done : TIER_BLOCK - boff;
+		// A dirty copy is newer than anything the write left behind
+		s = tier_find(t, f, b);
+		if (s != NULL && !s->dirty)
+			tier_spoil(t, s);
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (res < 0)
+		return res;
+
+	for (done = 0; done < len; done += n, b++, boff = 0) {
+		n = len - done < TIER_BLOCK - boff ? len - done : TIER_BLOCK - boff;
+		tier_update(t, f, buf + done, b, boff, n, alloc);
+	}
+	return len;
+}
+
+/* Write len bytes at boff of block b of a file written back into its
+ * cached copy, fetching the rest of the block first if it is not cached
+ * yet; if no slot can be had, write to the mirror instead */
+static int tier_write_block(struct encr_tier *t, struct encr_tier_file *f,
+			    int fd, const char *buf, uint64_t b, size_t boff,
+			    size_t len)
+{
+	off_t start = (off_t) b << ENCR_TIER_SHIFT;
+	unsigned char *bounce = NULL;
+	struct tier_slot *s;
+	int fresh = 0;
+	int fill = 0;
+	ssize_t n;
+	int res = 0;
+
+	pthread_mutex_lock(&t->lock);
+	s = tier_find(t, f, b);
+	if (s != NULL && s->state == SLOT_FILLING) {
+		tier_spoil(t, s);
+		s = NULL;
+	} else if (s != NULL) {
+		s->pins++;
+		tier_touch(t, s);
+	} else {
+		s = tier_slot_alloc(t, f, b);
+		fresh = 1;
+		// Nothing to fetch past the end, or if it is all written now
+		fill = start < f->size &&
+			!(boff == 0 && (off_t) len >= f->size - start);
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (s == NULL)
+		goto around;
+
+	if (fill) {
+		bounce = malloc(TIER_BLOCK);
+		n = bounce == NULL ? -ENOMEM :
+			tier_raw_pread(f, fd, bounce, TIER_BLOCK, start);
+		if (n >= 0)
+			n = tier_pwrite_full(t->datafd, bounce, n,
+					     tier_slot_off(t, s));
+		free(bounce);
+		res = n < 0 ? (int) n : 0;
+		if (res == 0) {
+			pthread_mutex_lock(&t->lock);
+			s->len = n;
+			pthread_mutex_unlock(&t->lock);
+		}
+	}
+	if (res == 0)
+		res = tier_patch(t, s, buf, boff, len);
+
+	pthread_mutex_lock(&t->lock);
+	if (res == 0 && !s->spoiled) {
+		if (fresh) {
+			s->state = SLOT_VALID;
+			tier_list_push(t, s, LIST_PROBATION);
+		}
+		tier_mark_dirty(t, s);
+		tier_unpin(t, s);
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	// What a dirty copy holds is nowhere else
+	if (res != 0 && !fresh && s->dirty) {
+		tier_unpin(t, s);
+		pthread_mutex_unlock(&t->lock);
+		return res;
+	}
+	tier_spoil(t, s);
+	tier_unpin(t, s);
+	pthread_mutex_unlock(&t->lock);
+around:
+	n = tier_write_around(t, f, fd, buf, len, start + boff, 0);
+	return n < 0 ? (int) n : 0;
+}
+
+static ssize_t tier_write_back(struct encr_tier *t, struct encr_tier_file *f,
+			       int fd, const char *buf, size_t len, off_t off)
+{
+	uint64_t b = (uint64_t) off >> ENCR_TIER_SHIFT;
+	size_t boff = off & (TIER_BLOCK - 1);
+	size_t done, n;
+	int grow;
+	int res;
+
+	for (done = 0; done < len; done += n, b++, boff = 0) {
+		n = len - done < TIER_BLOCK - boff ? len - done : TIER_BLOCK - boff;
+		res = tier_write_block(t, f, fd, buf + done, b, boff, n);
+		if (res != 0)
+			return res;
+	}
+
+	// The mirror's copy grows now, so its size stays the file's
+	pthread_mutex_lock(&t->lock);
+	grow = off + (off_t) len > f->size;
+	pthread_mutex_unlock(&t->lock);
+	if (grow && ftruncate(fd, off + len) == -1)
+		return -errno;
+	if (grow) {
+		pthread_mutex_lock(&t->lock);
+		f->size = off + len;
+		pthread_mutex_unlock(&t->lock);
+	}
+	return len;
+}
+
+ssize_t encr_tier_pwrite(struct encr_inode *in, int fd, const void *buf,
+			 size_t len, off_t off)
+{
+	struct encr_tier *t = in->tier;
+	struct encr_tier_file *f = in->tfile;
+	ssize_t res;
+	int grow;
+
+	/* Writes that make the file longer go one at a time, so that one
+	 * growing the mirror's copy cannot cut another's short */
+	pthread_mutex_lock(&t->lock);
+	grow = off + (off_t) len > f->size;
+	pthread_mutex_unlock(&t->lock);
+	if (grow)
+		pthread_mutex_lock(&f->grow);
+	// A file may turn deduplicated as a copy lands in it
+	if (f->writeback && !(in->hdr.flags & ENCR_FLAG_DEDUP))
+		res = tier_write_back(t, f, fd, buf, len, off);
+	else
+		res = tier_write_around(t, f, fd, buf, len, off, 1);
+	if (grow)
+		pthread_mutex_unlock(&f->grow);
+	return res;
+}
+
+/* Writing back */
+
+/* Write dirty slot s to the mirror, with t->lock held, which is dropped
+ * meanwhile. The slot is clean from the start, so a write landing in it
+ * while this runs dirties it again; on failure it is dirtied again. */
+static int tier_flush_slot(struct encr_tier *t, struct tier_slot *s,
+			   unsigned char *buf)
+{
+	struct encr_tier_file *f = s->file;
+	off_t start = (off_t) s->block << ENCR_TIER_SHIFT;
+	size_t len = s->len;
+	ssize_t n;
+
+	s->pins++;
+	s->dirty = 0;
+	t->ndirty--;
+	f->io++;
+	pthread_mutex_unlock(&t->lock);
+
+	n = tier_pread_full(t->datafd, buf, len, tier_slot_off(t, s));
+	if (n >= 0 && (size_t) n != len)
+		n = -EIO;
+	if (n >= 0)
+		n = tier_raw_pwrite(f, f->fd, buf, len, start);
+
+	pthread_mutex_lock(&t->lock);
+	if (n < 0 && !s->spoiled)
+		tier_mark_dirty(t, s);
+	if (--f->io == 0)
+		pthread_cond_broadcast(&t->cond);
+	tier_unpin(t, s);
+	return n < 0 ? (int) n : 0;
+}
+
+static int tier_cmp_block(const void *a, const void *b)
+{
+	const struct tier_slot *x = *(struct tier_slot * const *) a;
+	const struct tier_slot *y = *(struct tier_slot * const *) b;
+
+	return x->block < y->block ? 1 : x->block > y->block ? -1 : 0;
+}
+
+/* Write back every dirty slot of f, last block first so the header goes
+ * out after what it describes, and wait for those the flusher has under
+ * way; with t->lock held */
+static int tier_flush_file(struct encr_tier *t, struct encr_tier_file *f)
+{
+	struct tier_slot **dirty;
+	struct tier_slot *s;
+	unsigned char *buf;
+	size_t i, n = 0;
+	int first = 0;
+	int res;
+
+	for (s = f->slots; s != NULL; s = s->fnext)
+		n += s->dirty;
+	if (n > 0) {
+		dirty = malloc(n * sizeof(*dirty));
+		buf = malloc(TIER_BLOCK);
+		if (dirty == NULL || buf == NULL) {
+			free(dirty);
+			free(buf);
+			return -ENOMEM;
+		}
+		n = 0;
+		for (s = f->slots; s != NULL; s = s->fnext)
+			if (s->dirty) {
+				s->pins++;
+				dirty[n++] = s;
+			}
+		qsort(dirty, n, sizeof(*dirty), tier_cmp_block);
+		for (i = 0; i < n; i++) {
+			if (dirty[i]->dirty) {
+				res = tier_flush_slot(t, dirty[i], buf);
+				if (first == 0)
+					first = res;
+			}
+			tier_unpin(t, dirty[i]);
+		}
+		free(dirty);
+		free(buf);
+	}
+	while (f->io > 0)
+		pthread_cond_wait(&t->cond, &t->lock);
+	return first;
+}
+
+int encr_tier_flush(struct encr_inode *in)
+{
+	struct encr_tier *t = in->tier;
+	int res;
+
+	if (in->tfile == NULL || !in->tfile->writeback)
+		return 0;
+	pthread_mutex_lock(&t->lock);
+	res = tier_flush_file(t, in->tfile);
+	pthread_mutex_unlock(&t->lock);
+	return res;
+}
+
+static void *tier_flusher(void *data)
+{
+	struct encr_tier *t = data;
+	struct timespec ts;
+	struct tier_slot *s;
+	unsigned char *buf;
+	time_t now;
+	size_t i;
+	int gate;
+	int all;
+
+	buf = malloc(TIER_BLOCK);
+	if (buf == NULL)
+		return NULL;
+	pthread_mutex_lock(&t->lock);
+	while (!t->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TIER_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&t->wake, &t->lock, &ts);
+		now = time(NULL);
+		all = t->ndirty * 2 > t->nslots;
+		for (i = 0; i < t->nslots && t->ndirty > 0 && !t->stop; i++) {
+			s = &t->slot[i];
+			if (!s->dirty || s->file->fd == -1 ||
+			    (!all && now - s->dirtied < ENCR_TIER_FLUSH_AGE))
+				continue;
+			if (t->sched == NULL) {
+				tier_flush_slot(t, s, buf);
+				continue;
+			}
+			// Nothing pinned while waiting, as the callbacks let
+			// in may be waiting for the pin to go; so the slot is
+			// looked at again once in
+			pthread_mutex_unlock(&t->lock);
+			gate = encr_sched_enter(t->sched, ENCR_SCHED_BACKGROUND,
+						TIER_BLOCK);
+			pthread_mutex_lock(&t->lock);
+			if (s->dirty && s->file->fd != -1)
+				tier_flush_slot(t, s, buf);
+			encr_sched_leave(t->sched, gate);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	free(buf);
+	return NULL;
+}
+
+/* Files */
+
+// Drop every slot of f, waiting for each to be unpinned; with t->lock held
+static void tier_drop_file(struct encr_tier *t, struct encr_tier_file *f)
+{
+	struct tier_slot *s;
+
+	while ((s = f->slots) != NULL) {
+		if (s->pins > 0) {
+			pthread_cond_wait(&t->cond, &t->lock);
+			continue;
+		}
+		tier_spoil(t, s);
+	}
+}
+
+void encr_tier_attach(struct encr_inode *in, int fd)
+{
+	struct encr_tier *t = in->tier;
+	struct encr_tier_file *f;
+	struct stat st;
+	int dfd;
+
+	if (t == NULL || (in->hdr.flags & (ENCR_FLAG_STRIPED | ENCR_FLAG_LOG)) ||
+	    fstat(fd, &st) == -1)
+		return;
+	pthread_mutex_lock(&t->lock);
+	// The inode this file had a moment ago may still be detaching
+	while ((f = tier_file_find(t, in->dev, in->ino)) != NULL &&
+	       f->refs == 0 && f->fd != -1)
+		pthread_cond_wait(&t->cond, &t->lock);
+	if (f == NULL)
+		f = tier_file_new(t, in->dev, in->ino);
+	if (f == NULL)
+		goto out;
+	if (f->refs == 0) {
+		// Changed since its slots were stamped, so they are stale
+		if (f->slots != NULL && (f->ssize != st.st_size ||
+		    f->smtime.tv_sec != st.st_mtim.tv_sec ||
+		    f->smtime.tv_nsec != st.st_mtim.tv_nsec))
+			tier_drop_file(t, f);
+		dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (dfd == -1) {
+			tier_file_put(t, f);
+			goto out;
+		}
+		f->fd = dfd;
+		f->size = st.st_size;
+		f->direct = in->direct;
+		f->writeback = t->writeback &&
+			(fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+	}
+	f->refs++;
+	in->tfile = f;
+out:
+	pthread_mutex_unlock(&t->lock);
+}
+
+void encr_tier_detach(struct encr_inode *in)
+{
+	struct encr_tier *t = in->tier;
+	struct encr_tier_file *f = in->tfile;
+	struct stat st;
+	int res;
+	int fd;
+
+	if (f == NULL)
+		return;
+	in->tfile = NULL;
+	pthread_mutex_lock(&t->lock);
+	if (--f->refs > 0) {
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+	res = tier_flush_file(t, f);
+	if (res != 0) {
+		fprintf(stderr, "pa5-encfs: writing back cached blocks of inode "
+			"%lu failed: %s\n", (unsigned long) f->ino,
+			strerror(-res));
+		tier_drop_file(t, f);
+	}
+	if (fstat(f->fd, &st) == -1 || st.st_nlink == 0) {
+		tier_drop_file(t, f);
+	} else {
+		f->ssize = st.st_size;
+		f->smtime = st.st_mtim;
+	}
+	fd = f->fd;
+	f->fd = -1;
+	pthread_cond_broadcast(&t->cond);
+	tier_file_put(t, f);
+	pthread_mutex_unlock(&t->lock);
+	close(fd);
+}
+
+int encr_tier_truncate(struct encr_inode *in, int fd, off_t size)
+{
+	struct encr_tier *t = in->tier;
+	struct encr_tier_file *f = in->tfile;
+	struct tier_slot *s, *next;
+	off_t start;
+	int res = 0;
+
+	// Cut first, so the flusher cannot write what is cut off back
+	pthread_mutex_lock(&t->lock);
+again:
+	for (s = f->slots; s != NULL; s = next) {
+		next = s->fnext;
+		start = (off_t) s->block << ENCR_TIER_SHIFT;
+		if (start + (off_t) s->len <= size)
+			continue;
+		if (s->pins > 0) {
+			pthread_cond_wait(&t->cond, &t->lock);
+			goto again;
+		}
+		if (start >= size)
+			tier_spoil(t, s);
+		else
+			s->len = size - start;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (ftruncate(fd, size) == -1)
+		res = -errno;
+	pthread_mutex_lock(&t->lock);
+	if (res == 0)
+		f->size = size;
+	pthread_mutex_unlock(&t->lock);
+	return res;
+}
+
+void encr_tier_forget(struct encr_inode *in)
+{
+	struct encr_tier *t = in->tier;
+	struct encr_tier_file *f = in->tfile;
+	struct stat st;
+
+	if (f == NULL)
+		return;
+	pthread_mutex_lock(&t->lock);
+	tier_drop_file(t, f);
+	if (fstat(f->fd, &st) == 0)
+		f->size = st.st_size;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* Opening and closing */
+
+static void tier_index_header(struct encr_tier *t, unsigned char *hdr)
+{
+	memcpy(hdr, ENCR_TIER_MAGIC, 8);
+	put_le(hdr + 8, TIER_VERSION, 4);
+	put_le(hdr + 12, ENCR_TIER_SHIFT, 4);
+	put_le(hdr + 16, t->nslots, 8);
+	put_le(hdr + 24, t->rdev, 8);
+	put_le(hdr + 32, t->rino, 8);
+	memset(hdr + 40, 0, TIER_HDR_SIZE - 40);
+}
+
+// Take back what the index says the slots held; anything odd drops it all
+static void tier_load_index(struct encr_tier *t)
+{
+	unsigned char hdr[TIER_HDR_SIZE];
+	unsigned char want[TIER_HDR_SIZE];
+	unsigned char rec[TIER_REC_SIZE];
+	struct encr_tier_file *f;
+	struct tier_slot *s;
+	uint64_t idx;
+	int which;
+	FILE *fp;
+	int fd;
+
+	fd = openat(t->dirfd, ENCR_TIER_INDEX, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+	tier_index_header(t, want);
+	if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	    memcmp(hdr, want, sizeof(hdr)) != 0)
+		goto out;
+	while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+		idx = get_le(rec + 24, 4);
+		which = rec[52];
+		if (idx >= t->nslots || get_le(rec + 28, 4) > TIER_BLOCK ||
+		    (which != LIST_PROBATION && which != LIST_PROTECTED))
+			break;
+		s = &t->slot[idx];
+		if (s->list != LIST_FREE)
+			break;
+		f = tier_file_find(t, get_le(rec, 8), get_le(rec + 8, 8));
+		if (f == NULL) {
+			f = tier_file_new(t, get_le(rec, 8), get_le(rec + 8, 8));
+			if (f == NULL)
+				break;
+			f->smtime.tv_sec = (time_t) get_le(rec + 32, 8);
+			f->smtime.tv_nsec = get_le(rec + 40, 4);
+			f->ssize = get_le(rec + 44, 8);
+		}
+		if (tier_find(t, f, get_le(rec + 16, 8)) != NULL)
+			break;
+		tier_list_unlink(t, s);
+		tier_slot_bind(t, s, f, get_le(rec + 16, 8));
+		s->pins = 0;
+		s->len = get_le(rec + 28, 4);
+		s->state = SLOT_VALID;
+		tier_list_push(t, s, which);
+	}
+	if (!feof(fp)) {
+		fprintf(stderr, "pa5-encfs: the cache index is damaged; the "
+			"cache starts empty\n");
+		for (idx = 0; idx < t->nslots; idx++)
+			if (t->slot[idx].file != NULL)
+				tier_spoil(t, &t->slot[idx]);
+	}
+out:
+	fclose(fp);
+}
+
+// Oldest first, so loading pushes each back to where it was
+static int tier_save_list(struct encr_tier *t, int which, FILE *fp)
+{
+	unsigned char rec[TIER_REC_SIZE];
+	struct encr_tier_file *f;
+	struct tier_slot *s;
+
+	for (s = t->lists[which].tail; s != NULL; s = s->prev) {
+		f = s->file;
+		if (s->dirty || f->refs > 0)
+			continue;
+		put_le(rec, f->dev, 8);
+		put_le(rec + 8, f->ino, 8);
+		put_le(rec + 16, s->block, 8);
+		put_le(rec + 24, s - t->slot, 4);
+		put_le(rec + 28, s->len, 4);
+		put_le(rec + 32, (uint64_t) f->smtime.tv_sec, 8);
+		put_le(rec + 40, f->smtime.tv_nsec, 4);
+		put_le(rec + 44, f->ssize, 8);
+		rec[52] = which;
+		memset(rec + 53, 0, sizeof(rec) - 53);
+		if (fwrite(rec, 1, sizeof(rec), fp) != sizeof(rec))
+			return -EIO;
+	}
+	return 0;
+}
+
+static int tier_save_index(struct encr_tier *t)
+{
+	unsigned char hdr[TIER_HDR_SIZE];
+	FILE *fp;
+	int fd;
+	int res;
+
+	// The blocks must be there before an index says they are
+	if (fdatasync(t->datafd) == -1)
+		return -errno;
+	fd = openat(t->dirfd, ENCR_TIER_INDEX ".tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -errno;
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	tier_index_header(t, hdr);
+	res = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) ? 0 : -EIO;
+	if (res == 0)
+		res = tier_save_list(t, LIST_PROBATION, fp);
+	if (res == 0)
+		res = tier_save_list(t, LIST_PROTECTED, fp);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+		res = res ? res : -errno;
+	if (fclose(fp) != 0 && res == 0)
+		res = -errno;
+	if (res == 0 && renameat(t->dirfd, ENCR_TIER_INDEX ".tmp", t->dirfd,
+				 ENCR_TIER_INDEX) == -1)
+		res = -errno;
+	return res;
+}
+
+static void tier_free(struct encr_tier *t)
+{
+	struct encr_tier_file *f, *next;
+	size_t b;
+
+	for (b = 0; b < TIER_FILE_BUCKETS; b++)
+		for (f = t->fbuckets[b]; f != NULL; f = next) {
+			next = f->hnext;
+			if (f->fd != -1)
+				close(f->fd);
+			pthread_mutex_destroy(&f->grow);
+			free(f);
+		}
+	if (t->datafd != -1)
+		close(t->datafd);
+	if (t->dirfd != -1)
+		close(t->dirfd);
+	pthread_cond_destroy(&t->wake);
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t->sbuckets);
+	free(t->slot);
+	free(t);
+}
+
+int encr_tier_open(const char *dir, const char *rootdir, unsigned size,
+		   int writeback, struct encr_tier **tp)
+{
+	struct encr_tier *t;
+	struct stat st;
+	size_t i;
+	int fd;
+	int res;
+
+	*tp = NULL;
+	if (dir == NULL || dir[0] == '\0')
+		return 0;
+	if (size < ENCR_TIER_MIN_SIZE)
+		return -EINVAL;
+	if (stat(rootdir, &st) == -1)
+		return -errno;
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return -errno;
+
+	t = calloc(1, sizeof(struct encr_tier));
+	if (t == NULL)
+		return -ENOMEM;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	pthread_cond_init(&t->wake, NULL);
+	t->writeback = writeback;
+	t->rdev = st.st_dev;
+	t->rino = st.st_ino;
+	t->nslots = ((size_t) size << 20) >> ENCR_TIER_SHIFT;
+	t->datafd = -1;
+	t->slot = calloc(t->nslots, sizeof(struct tier_slot));
+	t->sbuckets = calloc(t->nslots, sizeof(struct tier_slot *));
+	t->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (t->slot == NULL || t->sbuckets == NULL) {
+		res = -ENOMEM;
+		goto fail;
+	}
+	if (t->dirfd == -1) {
+		res = -errno;
+		goto fail;
+	}
+	for (i = t->nslots; i-- > 0; ) {
+		t->slot[i].list = LIST_NONE;
+		tier_list_push(t, &t->slot[i], LIST_FREE);
+	}
+
+	t->datafd = openat(t->dirfd, ENCR_TIER_DATA,
+			   O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (t->datafd == -1) {
+		res = -errno;
+		goto fail;
+	}
+	if (flock(t->datafd, LOCK_EX | LOCK_NB) == -1) {
+		res = errno == EWOULDBLOCK ? -EBUSY : -errno;
+		goto fail;
+	}
+	if (ftruncate(t->datafd, (off_t) t->nslots << ENCR_TIER_SHIFT) == -1) {
+		res = -errno;
+		goto fail;
+	}
+
+	if (faccessat(t->dirfd, ENCR_TIER_OPEN, F_OK, 0) == 0)
+		fprintf(stderr, "pa5-encfs: the last mount did not stop "
+			"cleanly; the cache starts empty\n");
+	else
+		tier_load_index(t);
+	fd = openat(t->dirfd, ENCR_TIER_OPEN, O_WRONLY | O_CREAT | O_CLOEXEC,
+		    0600);
+	if (fd == -1 || fsync(fd) != 0 || fsync(t->dirfd) != 0) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		goto fail;
+	}
+	close(fd);
+	*tp = t;
+	return 0;
+fail:
+	tier_free(t);
+	return res;
+}
+
+int encr_tier_start(struct encr_tier *t, struct encr_sched *sched)
+{
+	int res;
+
+	if (!t->writeback)
+		return 0;
+	t->sched = sched;
+	res = pthread_create(&t->flusher, NULL, tier_flusher, t);
+	if (res != 0)
+		return -res;
+	t->running = 1;
+	return 0;
+}
+
+void encr_tier_close(struct encr_tier *t)
+{
+	if (t == NULL)
+		return;
+	if (t->running) {
+		pthread_mutex_lock(&t->lock);
+		t->stop = 1;
+		pthread_cond_signal(&t->wake);
+		pthread_mutex_unlock(&t->lock);
+		pthread_join(t->flusher, NULL);
+	}
+	// Without an index the next mount starts empty, which is safe too
+	if (tier_save_index(t) == 0 &&
+	    unlinkat(t->dirfd, ENCR_TIER_OPEN, 0) == 0)
+		fsync(t->dirfd);
+	tier_free(t);
+}
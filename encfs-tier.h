@@ -0,0 +1,150 @@
+/* encfs-tier.h
+ * Local cache tier in front of a slow pa5-encfs mirror
+ *
+ * With -o cache_dir=DIR, backing file blocks of encrypted files are kept
+ * in DIR, meant to be on a fast local disk or tmpfs while the mirror is
+ * on a network share or a slow disk. What is cached is the backing file
+ * exactly as it is in the mirror, so DIR only ever holds ciphertext and
+ * needs no more protection than the mirror does:
+ *
+ *   DIR/data    cache_size MiB of slots, one ENCR_TIER_SHIFT byte block
+ *               of a backing file each
+ *   DIR/index   which block of which file every clean slot held when the
+ *               last mount stopped: a header (ENCR_TIER_MAGIC, version,
+ *               block size, slots, the mirror's device and inode) and a
+ *               record per slot, little-endian
+ *   DIR/open    present while a mount uses the cache
+ *
+ * A read that misses fetches whole blocks, up to ENCR_TIER_FILL_MAX of
+ * them with one read of the mirror, and keeps them. Slots are evicted
+ * least recently used first, from two segments: a block read once
+ * lands in the probation segment and only moves to the protected one
+ * when it is read again, so one pass over a large file cannot push out
+ * what is read all the time. The protected segment is held to
+ * ENCR_TIER_PROTECTED percent of the slots.
+ *
+ * Writes go through to the mirror and update any cached copy. With
+ * -o cache_writeback they go to the cache alone and a flusher thread
+ * writes blocks back once they have been dirty for ENCR_TIER_FLUSH_AGE
+ * seconds, or at once when half the slots are dirty; fsync() and the
+ * last close of a file write back all of its blocks first, its header
+ * block last. Unsynced writes can then be lost in a crash, as they can
+ * from the page cache, and a file can be left holding some of them but
+ * not others. Deduplicated files are always written through, as their
+ * chunk references must not run ahead of their tables.
+ *
+ * Only files in the plain, compressed and deduplicated formats are
+ * cached; a striped file's parts are on roots of their own, and a
+ * log-structured file holds nothing but its header.
+ *
+ * A mount that stops cleanly writes the index, so the next one starts
+ * warm. Files are known by their backing device and inode, and a file
+ * whose size or modification time has changed since is dropped from
+ * the cache when it is next opened; a change made to the mirror behind
+ * the mount's back that keeps both is not seen. After a mount that did
+ * not stop cleanly the cache starts empty. Only one mount may use a
+ * cache directory at a time.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_TIER_H
+#define ENCFS_TIER_H
+
+#include <sys/types.h>
+
+#include "encfs-lock.h"
+
+#define ENCR_TIER_DATA "data"
+#define ENCR_TIER_INDEX "index"
+#define ENCR_TIER_OPEN "open"
+#define ENCR_TIER_MAGIC "PA5ETIER"
+#define ENCR_TIER_SHIFT 16		// 64 KiB blocks
+#define ENCR_TIER_FILL_MAX 16		// blocks fetched per read of the mirror
+#define ENCR_TIER_PROTECTED 80		// percent
+#define ENCR_TIER_FLUSH_AGE 5		// seconds
+#define ENCR_TIER_MIN_SIZE 1		// MiB
+#define ENCR_DEFAULT_CACHE_SIZE 1024	// MiB
+
+struct encr_tier;
+struct encr_tier_file;
+struct encr_sched;
+
+/* int encr_tier_open(const char *dir, const char *rootdir, unsigned size, int writeback, struct encr_tier **tp)
+ * Purpose: Open or set up the cache directory dir for the mirror rootdir
+ *          and load its index, if the last mount stopped cleanly and
+ *          used it for the same mirror with the same size
+ * Args: const char *dir        : Cache directory, created if missing;
+ *                                NULL or empty for no cache
+ *       unsigned size          : Size of the cache in MiB
+ *       int writeback          : Whether writes go to the cache alone
+ *       struct encr_tier **tp  : Set to the cache, or to NULL if dir is
+ *                                NULL or empty
+ * Return: 0 on success, -EBUSY if another mount uses dir, -errno on failure
+ */
+extern int encr_tier_open(const char *dir, const char *rootdir,
+			  unsigned size, int writeback, struct encr_tier **tp);
+
+/* int encr_tier_start(struct encr_tier *t, struct encr_sched *sched)
+ * Purpose: Start the flusher thread, if writes are written back; it goes
+ *          through sched (see encfs-sched.h) block by block, and sched
+ *          may be NULL
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_tier_start(struct encr_tier *t, struct encr_sched *sched);
+
+/* void encr_tier_close(struct encr_tier *t)
+ * Purpose: Stop the flusher, write the index and free the cache; every
+ *          inode must already have been put. t may be NULL.
+ */
+extern void encr_tier_close(struct encr_tier *t);
+
+/* void encr_tier_attach(struct encr_inode *in, int fd)
+ * Purpose: Cache the blocks of a newly loaded encrypted file, which fd
+ *          has open, from now on; does nothing if in->tier is NULL
+ *          Called with in->lock held, once the file's header is known.
+ */
+extern void encr_tier_attach(struct encr_inode *in, int fd);
+
+/* void encr_tier_detach(struct encr_inode *in)
+ * Purpose: Write back the file's dirty blocks as its inode is put, and
+ *          stamp the rest with its size and modification time, or drop
+ *          them if the file has no links left
+ */
+extern void encr_tier_detach(struct encr_inode *in);
+
+/* ssize_t encr_tier_pread(struct encr_inode *in, int fd, void *buf, size_t len, off_t off)
+ * ssize_t encr_tier_pwrite(struct encr_inode *in, int fd, const void *buf, size_t len, off_t off)
+ * Purpose: pread()/pwrite() of an attached file's backing file, which fd
+ *          has open, through the cache
+ * Return: Bytes transferred, short only at the end of the file, or -errno
+ */
+extern ssize_t encr_tier_pread(struct encr_inode *in, int fd, void *buf,
+			       size_t len, off_t off);
+extern ssize_t encr_tier_pwrite(struct encr_inode *in, int fd,
+				const void *buf, size_t len, off_t off);
+
+/* int encr_tier_truncate(struct encr_inode *in, int fd, off_t size)
+ * Purpose: ftruncate() of an attached file's backing file, cutting its
+ *          cached blocks to match; every stripe of in held
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_tier_truncate(struct encr_inode *in, int fd, off_t size);
+
+/* int encr_tier_flush(struct encr_inode *in)
+ * Purpose: Write back the file's dirty blocks, header block last, and
+ *          wait for any the flusher is writing; does nothing if the file
+ *          is not attached
+ * Return: 0 on success, or the first -errno a block failed with
+ */
+extern int encr_tier_flush(struct encr_inode *in);
+
+/* void encr_tier_forget(struct encr_inode *in)
+ * Purpose: Drop every cached block of a file whose backing file was just
+ *          rewritten around the cache, dirty ones too; every stripe of in
+ *          held, and does nothing if the file is not attached
+ */
+extern void encr_tier_forget(struct encr_inode *in);
+
+#endif
@@ -0,0 +1,415 @@
+/* encfs-trace.c
+ * Binary operation trace for pa5-encfs
+ *
+ * See encfs-trace.h for details
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "encfs-trace.h"
+
+#define TRACE_PATHS_MIN 1024	// initial path table slots
+
+struct encr_tpath {
+	char *path;		// NULL for a free slot
+	uint32_t id;
+};
+
+struct encr_trace {
+	struct encr_trace_hdr *hdr;	// mapped file, ring after the header
+	struct encr_trace_rec *ring;
+	size_t map_size;
+	struct timespec start;		// CLOCK_MONOTONIC of start_ns 0
+	pthread_mutex_t lock;		// path table and path file
+	int paths_fd;
+	struct encr_tpath *paths;	// open addressing, power of two slots
+	size_t nslots;
+	uint32_t npaths;		// ids handed out so far
+};
+
+static const char *op_names[ENCR_OP_NR] = {
+	[ENCR_OP_GETATTR] = "getattr",
+	[ENCR_OP_ACCESS] = "access",
+	[ENCR_OP_READLINK] = "readlink",
+	[ENCR_OP_READDIR] = "readdir",
+	[ENCR_OP_MKNOD] = "mknod",
+	[ENCR_OP_MKDIR] = "mkdir",
+	[ENCR_OP_SYMLINK] = "symlink",
+	[ENCR_OP_UNLINK] = "unlink",
+	[ENCR_OP_RMDIR] = "rmdir",
+	[ENCR_OP_RENAME] = "rename",
+	[ENCR_OP_LINK] = "link",
+	[ENCR_OP_CHMOD] = "chmod",
+	[ENCR_OP_CHOWN] = "chown",
+	[ENCR_OP_TRUNCATE] = "truncate",
+	[ENCR_OP_FTRUNCATE] = "ftruncate",
+	[ENCR_OP_FGETATTR] = "fgetattr",
+	[ENCR_OP_UTIMENS] = "utimens",
+	[ENCR_OP_OPEN] = "open",
+	[ENCR_OP_READ] = "read",
+	[ENCR_OP_WRITE] = "write",
+	[ENCR_OP_STATFS] = "statfs",
+	[ENCR_OP_CREATE] = "create",
+	[ENCR_OP_RELEASE] = "release",
+	[ENCR_OP_FSYNC] = "fsync",
+	[ENCR_OP_OPENDIR] = "opendir",
+	[ENCR_OP_RELEASEDIR] = "releasedir",
+	[ENCR_OP_IOCTL] = "ioctl",
+	[ENCR_OP_SETXATTR] = "setxattr",
+	[ENCR_OP_GETXATTR] = "getxattr",
+	[ENCR_OP_LISTXATTR] = "listxattr",
+	[ENCR_OP_REMOVEXATTR] = "removexattr",
+	[ENCR_OP_FSYNCDIR] = "fsyncdir",
+};
+
+const char *encr_trace_op_name(unsigned op)
+{
+	if (op >= ENCR_OP_NR || op_names[op] == NULL)
+		return "?";
+	return op_names[op];
+}
+
+// FNV-1a
+static size_t trace_hash(const char *path)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *path != '\0'; path++) {
+		h ^= (unsigned char) *path;
+		h *= 0x100000001b3ULL;
+	}
+	return (size_t) h;
+}
+
+int encr_trace_open(const char *file, uint64_t capacity,
+		    struct encr_trace **tp)
+{
+	char ppath[PATH_MAX];
+	struct encr_trace *t;
+	struct timespec now;
+	int fd;
+	int res;
+
+	if (capacity == 0)
+		return -EINVAL;
+	if (snprintf(ppath, sizeof(ppath), "%s%s", file, ENCR_TRACE_PATHS) >=
+	    (int) sizeof(ppath))
+		return -ENAMETOOLONG;
+	t = calloc(1, sizeof(struct encr_trace));
+	if (t == NULL)
+		return -ENOMEM;
+	t->nslots = TRACE_PATHS_MIN;
+	t->paths = calloc(t->nslots, sizeof(struct encr_tpath));
+	t->map_size = ENCR_TRACE_HDR_SIZE +
+		capacity * sizeof(struct encr_trace_rec);
+	t->paths_fd = -1;
+	if (t->paths == NULL) {
+		res = -ENOMEM;
+		goto fail;
+	}
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		res = -errno;
+		goto fail;
+	}
+	if (ftruncate(fd, t->map_size) == -1) {
+		res = -errno;
+		close(fd);
+		goto fail;
+	}
+	t->hdr = mmap(NULL, t->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      fd, 0);
+	close(fd);
+	if (t->hdr == MAP_FAILED) {
+		t->hdr = NULL;
+		res = -errno;
+		goto fail;
+	}
+	t->ring = (struct encr_trace_rec *) ((char *) t->hdr +
+					     ENCR_TRACE_HDR_SIZE);
+
+	t->paths_fd = open(ppath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			   0600);
+	if (t->paths_fd == -1) {
+		res = -errno;
+		goto fail;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(t->hdr->magic, ENCR_TRACE_MAGIC, sizeof(t->hdr->magic));
+	t->hdr->rec_size = sizeof(struct encr_trace_rec);
+	t->hdr->capacity = capacity;
+	t->hdr->head = 0;
+	t->hdr->epoch_sec = now.tv_sec;
+	t->hdr->epoch_nsec = now.tv_nsec;
+	pthread_mutex_init(&t->lock, NULL);
+	*tp = t;
+	return 0;
+
+fail:
+	encr_trace_close(t);
+	return res;
+}
+
+void encr_trace_close(struct encr_trace *t)
+{
+	size_t i;
+
+	if (t == NULL)
+		return;
+	if (t->hdr != NULL) {
+		msync(t->hdr, t->map_size, MS_SYNC);
+		munmap(t->hdr, t->map_size);
+	}
+	if (t->paths_fd != -1)
+		close(t->paths_fd);
+	for (i = 0; i < t->nslots; i++)
+		free(t->paths[i].path);
+	free(t->paths);
+	free(t);
+}
+
+uint64_t encr_trace_now(const struct encr_trace *t)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) (ts.tv_sec - t->start.tv_sec) * 1000000000ULL +
+		ts.tv_nsec - t->start.tv_nsec;
+}
+
+// Double the path table; called with t->lock held
+static int trace_grow(struct encr_trace *t)
+{
+	size_t nslots = t->nslots * 2;
+	struct encr_tpath *paths = calloc(nslots, sizeof(struct encr_tpath));
+	size_t i;
+	size_t j;
+
+	if (paths == NULL)
+		return -ENOMEM;
+	for (i = 0; i < t->nslots; i++) {
+		if (t->paths[i].path == NULL)
+			continue;
+		for (j = trace_hash(t->paths[i].path) & (nslots - 1);
+		     paths[j].path != NULL; j = (j + 1) & (nslots - 1))
+			;
+		paths[j] = t->paths[i];
+	}
+	free(t->paths);
+	t->paths = paths;
+	t->nslots = nslots;
+	return 0;
+}
+
+uint32_t encr_trace_path(struct encr_trace *t, const char *path)
+{
+	struct encr_tpath *p;
+	uint32_t len;
+	uint32_t id = 0;
+	char *rec;
+	size_t i;
+
+	if (path == NULL)
+		return 0;
+	pthread_mutex_lock(&t->lock);
+	for (i = trace_hash(path) & (t->nslots - 1); t->paths[i].path != NULL;
+	     i = (i + 1) & (t->nslots - 1))
+		if (strcmp(t->paths[i].path, path) == 0) {
+			id = t->paths[i].id;
+			goto out;
+		}
+	if (t->npaths == UINT32_MAX || t->npaths + 1 >= t->nslots)
+		goto out;
+
+	// New path: log it, then remember it at most half full
+	len = strlen(path);
+	rec = malloc(2 * sizeof(uint32_t) + len);
+	p = &t->paths[i];
+	p->path = strdup(path);
+	if (rec == NULL || p->path == NULL) {
+		free(rec);
+		free(p->path);
+		p->path = NULL;
+		goto out;
+	}
+	p->id = t->npaths + 1;
+	memcpy(rec, &p->id, sizeof(uint32_t));
+	memcpy(rec + sizeof(uint32_t), &len, sizeof(uint32_t));
+	memcpy(rec + 2 * sizeof(uint32_t), path, len);
+	if (write(t->paths_fd, rec, 2 * sizeof(uint32_t) + len) !=
+	    (ssize_t) (2 * sizeof(uint32_t) + len)) {
+		free(p->path);
+		p->path = NULL;
+	} else {
+		id = p->id;
+		t->npaths++;
+		if (t->npaths * 2 > t->nslots)
+			trace_grow(t);
+	}
+	free(rec);
+out:
+	pthread_mutex_unlock(&t->lock);
+	return id;
+}
+
+static __thread uint32_t trace_tid;
+
+void encr_trace_log(struct encr_trace *t, struct encr_trace_rec *r)
+{
+	uint64_t seq = __atomic_fetch_add(&t->hdr->head, 1, __ATOMIC_RELAXED);
+	struct encr_trace_rec *slot = &t->ring[seq % t->hdr->capacity];
+
+	if (trace_tid == 0)
+		trace_tid = syscall(SYS_gettid);
+	r->tid = trace_tid;
+	// A zero seq marks the slot as half written until the last store
+	r->seq = 0;
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	memcpy(slot, r, sizeof(*r));
+	r->seq = seq + 1;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_by_start(const void *a, const void *b)
+{
+	const struct encr_trace_rec *x = a;
+	const struct encr_trace_rec *y = b;
+
+	if (x->start_ns != y->start_ns)
+		return x->start_ns < y->start_ns ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int trace_load_paths(const char *file, char ***paths,
+			    uint32_t *npaths)
+{
+	char ppath[PATH_MAX];
+	char **v = NULL;
+	uint32_t n = 0;
+	uint32_t hd[2];
+	FILE *f;
+	int res = 0;
+
+	snprintf(ppath, sizeof(ppath), "%s%s", file, ENCR_TRACE_PATHS);
+	f = fopen(ppath, "r");
+	if (f == NULL)
+		return -errno;
+	while (fread(hd, sizeof(uint32_t), 2, f) == 2) {
+		char *p;
+
+		if (hd[0] == 0 || hd[1] > PATH_MAX) {
+			res = -EINVAL;
+			break;
+		}
+		if (hd[0] >= n) {
+			uint32_t nn = hd[0] + 1 > n * 2 ? hd[0] + 1 : n * 2;
+			char **nv = realloc(v, nn * sizeof(char *));
+
+			if (nv == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			memset(nv + n, 0, (nn - n) * sizeof(char *));
+			v = nv;
+			n = nn;
+		}
+		p = malloc(hd[1] + 1);
+		if (p == NULL) {
+			res = -ENOMEM;
+			break;
+		}
+		if (fread(p, 1, hd[1], f) != hd[1]) {
+			// Cut short while being written
+			free(p);
+			break;
+		}
+		p[hd[1]] = '\0';
+		free(v[hd[0]]);
+		v[hd[0]] = p;
+	}
+	fclose(f);
+	if (res != 0) {
+		while (n > 0)
+			free(v[--n]);
+		free(v);
+		return res;
+	}
+	*paths = v;
+	*npaths = n;
+	return 0;
+}
+
+int encr_trace_load(const char *file, struct encr_trace_rec **recs,
+		    size_t *nrecs, char ***paths, uint32_t *npaths)
+{
+	struct encr_trace_hdr hdr;
+	struct encr_trace_rec *v;
+	struct stat st;
+	size_t n = 0;
+	uint64_t i;
+	int fd;
+	int res;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = -EINVAL;
+	if (st.st_size < ENCR_TRACE_HDR_SIZE ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, ENCR_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.rec_size != sizeof(struct encr_trace_rec) ||
+	    hdr.capacity == 0 ||
+	    hdr.capacity > ((uint64_t) st.st_size - ENCR_TRACE_HDR_SIZE) /
+	    sizeof(struct encr_trace_rec))
+		goto out;
+	v = malloc(hdr.capacity * sizeof(struct encr_trace_rec));
+	if (v == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	if (pread(fd, v, hdr.capacity * sizeof(struct encr_trace_rec),
+		  ENCR_TRACE_HDR_SIZE) !=
+	    (ssize_t) (hdr.capacity * sizeof(struct encr_trace_rec))) {
+		res = -EIO;
+		free(v);
+		goto out;
+	}
+	for (i = 0; i < hdr.capacity; i++)
+		if (v[i].seq != 0 && v[i].op < ENCR_OP_NR)
+			v[n++] = v[i];
+	qsort(v, n, sizeof(struct encr_trace_rec), trace_by_start);
+
+	res = trace_load_paths(file, paths, npaths);
+	if (res != 0) {
+		free(v);
+		goto out;
+	}
+	*recs = v;
+	*nrecs = n;
+out:
+	close(fd);
+	return res;
+}
@@ -0,0 +1,145 @@
+/* encfs-trace.h
+ * Binary operation trace for pa5-encfs
+ *
+ * With -o trace=FILE every filesystem call the mount serves is logged as
+ * one fixed size record (struct encr_trace_rec) in FILE, a ring of
+ * trace_size records after a header. The ring is mapped into memory, so
+ * logging a call costs no system call; once it is full the oldest
+ * records are overwritten. Paths are logged as small ids, and each id's
+ * path is appended to FILE.paths the first time it is seen:
+ *
+ *   FILE         struct encr_trace_hdr, padded to ENCR_TRACE_HDR_SIZE,
+ *                then capacity records; record n is in slot n % capacity
+ *   FILE.paths   per path: id (u32), length (u32), the path's bytes,
+ *                all in host byte order
+ *
+ * Only what the calls were asked to do is logged; file data and xattr
+ * values never are, so a trace of an encrypted mirror holds none of its
+ * contents. encfs-replay reads both files back.
+ *
+ * Written for Programming Assignment 4
+ * in CSCI 3753 Operating Systems
+ */
+
+#ifndef ENCFS_TRACE_H
+#define ENCFS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENCR_TRACE_MAGIC "ENCRTRC1"
+#define ENCR_TRACE_HDR_SIZE 4096
+#define ENCR_TRACE_PATHS ".paths"		// suffix of the path file
+#define ENCR_DEFAULT_TRACE_SIZE (1 << 20)	// records (64 MiB)
+#define ENCR_MIN_TRACE_SIZE 1024
+
+enum encr_trace_op {
+	ENCR_OP_GETATTR = 1,	// path
+	ENCR_OP_ACCESS,		// path, arg = mask
+	ENCR_OP_READLINK,	// path, size
+	ENCR_OP_READDIR,	// path, off
+	ENCR_OP_MKNOD,		// path, arg = mode, size = rdev
+	ENCR_OP_MKDIR,		// path, arg = mode
+	ENCR_OP_SYMLINK,	// path = link, path2 = its contents
+	ENCR_OP_UNLINK,		// path
+	ENCR_OP_RMDIR,		// path
+	ENCR_OP_RENAME,		// path = from, path2 = to
+	ENCR_OP_LINK,		// path = from, path2 = to
+	ENCR_OP_CHMOD,		// path, arg = mode
+	ENCR_OP_CHOWN,		// path, arg = uid, size = gid
+	ENCR_OP_TRUNCATE,	// path, off = new size
+	ENCR_OP_FTRUNCATE,	// path, off = new size
+	ENCR_OP_FGETATTR,	// path
+	ENCR_OP_UTIMENS,	// path, off = atime, size = mtime (ns)
+	ENCR_OP_OPEN,		// path, arg = open flags
+	ENCR_OP_READ,		// path, off, size
+	ENCR_OP_WRITE,		// path, off, size
+	ENCR_OP_STATFS,		// path
+	ENCR_OP_CREATE,		// path, arg = mode, size = open flags
+	ENCR_OP_RELEASE,	// path, arg = open flags
+	ENCR_OP_FSYNC,		// path, arg = datasync
+	ENCR_OP_OPENDIR,	// path
+	ENCR_OP_RELEASEDIR,	// path
+	ENCR_OP_IOCTL,		// path, arg = cmd
+	ENCR_OP_SETXATTR,	// path, path2 = name, size, arg = flags
+	ENCR_OP_GETXATTR,	// path, path2 = name, size
+	ENCR_OP_LISTXATTR,	// path, size
+	ENCR_OP_REMOVEXATTR,	// path, path2 = name
+	ENCR_OP_FSYNCDIR,	// path, arg = datasync
+	ENCR_OP_NR
+};
+
+struct encr_trace_hdr {
+	char magic[8];		// ENCR_TRACE_MAGIC
+	uint32_t rec_size;	// sizeof(struct encr_trace_rec)
+	uint32_t pad;
+	uint64_t capacity;	// records in the ring
+	uint64_t head;		// records ever logged
+	int64_t epoch_sec;	// wall clock time of start_ns 0
+	int64_t epoch_nsec;
+};
+
+struct encr_trace_rec {
+	uint64_t seq;		// 1 + the head it was logged at, 0 if unused
+	uint64_t start_ns;	// since the trace began, CLOCK_MONOTONIC
+	uint64_t end_ns;
+	int64_t off;
+	uint64_t size;
+	uint32_t path;		// path id, 0 for none
+	uint32_t path2;		// second path id, 0 for none
+	uint32_t tid;		// thread that served the call
+	int32_t result;		// return value, -errno on failure
+	uint16_t op;		// ENCR_OP_*
+	uint16_t pad;
+	uint32_t arg;
+};
+
+struct encr_trace;
+
+/* int encr_trace_open(const char *file, uint64_t capacity, struct encr_trace **tp)
+ * Purpose: Start a new trace in file and file.paths, replacing any
+ *          old one
+ * Args: uint64_t capacity : Records kept in the ring
+ * Return: 0 on success, -errno on failure
+ */
+extern int encr_trace_open(const char *file, uint64_t capacity,
+			   struct encr_trace **tp);
+
+/* void encr_trace_close(struct encr_trace *t)
+ * Purpose: Flush and free a trace; t may be NULL
+ */
+extern void encr_trace_close(struct encr_trace *t);
+
+/* uint64_t encr_trace_now(const struct encr_trace *t)
+ * Return: Nanoseconds since the trace began
+ */
+extern uint64_t encr_trace_now(const struct encr_trace *t);
+
+/* uint32_t encr_trace_path(struct encr_trace *t, const char *path)
+ * Purpose: Id of path, logging it to the path file if it is new
+ * Return: The id, or 0 if path is NULL or cannot be logged
+ */
+extern uint32_t encr_trace_path(struct encr_trace *t, const char *path);
+
+/* void encr_trace_log(struct encr_trace *t, struct encr_trace_rec *r)
+ * Purpose: Add r to the ring, filling in its seq and tid
+ */
+extern void encr_trace_log(struct encr_trace *t, struct encr_trace_rec *r);
+
+/* int encr_trace_load(const char *file, struct encr_trace_rec **recs, size_t *nrecs, char ***paths, uint32_t *npaths)
+ * Purpose: Read back a trace, whether or not it is still being written
+ * Args: struct encr_trace_rec **recs : Set to a malloc()ed array of the
+ *                                      records in the ring, by start time
+ *       char ***paths                : Set to a malloc()ed array of
+ *                                      paths by id, NULL where unknown
+ * Return: 0 on success, -errno on failure (-EINVAL if it is no trace)
+ */
+extern int encr_trace_load(const char *file, struct encr_trace_rec **recs,
+			   size_t *nrecs, char ***paths, uint32_t *npaths);
+
+/* const char *encr_trace_op_name(unsigned op)
+ * Return: The name of ENCR_OP_* op, like "read", or "?"
+ */
+extern const char *encr_trace_op_name(unsigned op);
+
+#endif
@@ -3,577 +3,249 @@
  * Encrypted Filesystem Mirror 
  * written by Anne Gatchell
  * 
- * 
- * 
+ * Mounts the callbacks of encfs-ops.c: parses the command line, sets
+ * up the shared state (see encfs-ops.h) and runs the fuse loop.
+ *
  * Modified from:
   FUSE: Filesystem in Userspace
   Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
 
-  Minor modifications and note by Andy Sayler (2012) <www.andysayler.com>
-
-  Source: fuse-2.8.7.tar.gz examples directory
-  http://sourceforge.net/projects/fuse/files/fuse-2.X/
-
   This program can be distributed under the terms of the GNU GPL.
   See the file COPYING.
 
-  gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
-
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
-
 */
 #include "params.h"
 
 #define FUSE_USE_VERSION 28
-#define HAVE_SETXATTR
-
-#ifdef HAVE_CONFIG_H
-#include <config.h>
-#endif
-
-#ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
-#endif
 
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <errno.h>
-#include <sys/time.h>
-#include <limits.h>
-#ifdef HAVE_SETXATTR
-#include <sys/xattr.h>
-#endif
-
-
-// Report errors to logfile and give -errno to caller
-static int encr_error(char *str)
-{
-    int ret = -errno;
-    fprintf(stderr, "%s",str);
-    return ret;
-}
-//  All the paths I see are relative to the root of the mounted
-//  filesystem.  In order to get to the underlying filesystem, I need to
-//  have the mountpoint.  I'll save it away early on in main(), and then
-//  whenever I need a path for something I'll call this to construct
-//  it.
-static void encr_fullpath(char fpath[PATH_MAX], const char *path)
-{
-    strcpy(fpath, ENCR_DATA->rootdir);
-    strncat(fpath, path, PATH_MAX); // ridiculously long paths will
-				    // break here
-}
-
-//Updated to fullpath
-static int encr_getattr(const char *path, struct stat *stbuf)
-{
-	int res;
-	char fpath[PATH_MAX];
-	
-	encr_fullpath(fpath, path);
-
-	res = lstat(fpath, stbuf);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to fullpath
-static int encr_access(const char *path, int mask)
-{
-	int res;
-	char fpath[PATH_MAX];
-	
-	encr_fullpath(fpath, path);
-
-	res = access(fpath, mask);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to fullpath
-static int encr_readlink(const char *path, char *buf, size_t size)
-{
-	int res;
-	char fpath[PATH_MAX];
-	
-	encr_fullpath(fpath, path);
-	res = readlink(fpath, buf, size - 1);
-	if (res == -1)
-		return -errno;
-
-	buf[res] = '\0';
-	return 0;
-}
-
-
-static int encr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
-{
-	int retstat = 0;
-	DIR *dp;
-	struct dirent *de;
-	
-	//Get rid of unused parameter warnings
-	char fpath[PATH_MAX];
-	encr_fullpath(fpath, path);
-	off_t warn_relief = offset;
-	offset = warn_relief;
+#include <sys/stat.h>
+
+#include "encfs-ops.h"
+#include "encfs-loop.h"
+#include "encfs-cache.h"
+#include "encfs-format.h"
+#include "encfs-io.h"
+#include "encfs-migrate.h"
+#include "encfs-pack.h"
+#include "encfs-trace.h"
+#include "encfs-roots.h"
+#include "encfs-tier.h"
+#include "encfs-sched.h"
+
+#define ENCR_OPT(t, p, v) { t, offsetof(struct encr_state, p), v }
+
+enum {
+	KEY_ENTRY_TIMEOUT,
+	KEY_ATTR_TIMEOUT,
+	KEY_NEGATIVE_TIMEOUT,
+	KEY_MAX_WRITE,
+	KEY_MAX_READ,
+	KEY_MAX_READAHEAD,
+};
 
-	// once again, no need for fullpath -- but note that I need to cast fi->fh
-	//I do not understand this
-	dp = (DIR *) (uintptr_t) fi->fh;
+static struct fuse_opt encr_opts[] = {
+	ENCR_OPT("max_threads=%u", max_threads, 0),
+	ENCR_OPT("max_idle_threads=%u", max_idle_threads, 0),
+	ENCR_OPT("attr_cache_size=%u", attr_cache_size, 0),
+	ENCR_OPT("xattr_cache_size=%u", xattr_cache_size, 0),
+	ENCR_OPT("chunk_size=%u", chunk_size, 0),
+	ENCR_OPT("chunk_auto", chunk_auto, 1),
+	ENCR_OPT("compress", compress, 1),
+	ENCR_OPT("dedup", dedup, 1),
+	ENCR_OPT("log", log, 1),
+	ENCR_OPT("direct_backing", direct_backing, 1),
+	ENCR_OPT("migrate", migrate, 1),
+	ENCR_OPT("migrate_rate=%u", migrate_rate, 0),
+	ENCR_OPT("migrate_cpu=%u", migrate_cpu, 0),
+	ENCR_OPT("trace=%s", trace_file, 0),
+	ENCR_OPT("trace_size=%u", trace_size, 0),
+	ENCR_OPT("pack", pack, 1),
+	ENCR_OPT("pack_max=%u", pack_max, 0),
+	ENCR_OPT("track_changes", track_changes, 1),
+	ENCR_OPT("roots=%s", roots, 0),
+	ENCR_OPT("cache_dir=%s", cache_dir, 0),
+	ENCR_OPT("cache_size=%u", cache_size, 0),
+	ENCR_OPT("cache_writeback", cache_writeback, 1),
+	ENCR_OPT("io_sched", io_sched, 1),
+	ENCR_OPT("io_slots=%u", io_slots, 0),
+	ENCR_OPT("io_weights=%s", io_weights, 0),
+	ENCR_OPT("io_user_rate=%u", io_user_rate, 0),
+	ENCR_OPT("io_readahead_rate=%u", io_readahead_rate, 0),
+	ENCR_OPT("io_background_rate=%u", io_background_rate, 0),
+	FUSE_OPT_KEY("entry_timeout=", KEY_ENTRY_TIMEOUT),
+	FUSE_OPT_KEY("attr_timeout=", KEY_ATTR_TIMEOUT),
+	FUSE_OPT_KEY("negative_timeout=", KEY_NEGATIVE_TIMEOUT),
+	FUSE_OPT_KEY("max_write=", KEY_MAX_WRITE),
+	FUSE_OPT_KEY("max_read=", KEY_MAX_READ),
+	FUSE_OPT_KEY("max_readahead=", KEY_MAX_READAHEAD),
+	FUSE_OPT_END
+};
 
-	// Every directory contains at least two entries: . and ..  If my
-    // first call to the system readdir() returns NULL I've got an
-    // error; near as I can tell, that's the only condition under
-    // which I can get an error from readdir()
-    de = readdir(dp);
-    if (de == 0) {
-		retstat = encr_error("encr_readdir readdir");
-		return retstat;
-    }
-    
-    // This will copy the entire directory into the buffer.  The loop exits
-    // when either the system readdir() returns NULL, or filler()
-    // returns something non-zero.  The first case just means I've
-    // read the whole directory; the second means the buffer is full.
-    do {
-		//log_msg("calling filler with name %s\n", de->d_name);
-		if (filler(buf, de->d_name, NULL, 0) != 0) {
-			//log_msg("    ERROR bb_readdir filler:  buffer full");
-			return -ENOMEM;
-		}
-    } while ((de = readdir(dp)) != NULL);
-    
-    
-    return retstat;
-}
-//Updated to fullpath
-static int encr_mknod(const char *path, mode_t mode, dev_t rdev)
+// The kernel cache timeouts belong to fuse, but we record them too so our
+// own attribute cache never outlives what the kernel was told. Request
+// sizes are fuse's too; we only check them against what we handle.
+static int encr_opt_proc(void *data, const char *arg, int key,
+			 struct fuse_args *outargs)
 {
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	if (S_ISREG(mode)) {
-		res = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-		if (res >= 0)
-			res = close(res);
-	} else if (S_ISFIFO(mode)){
-		res = mkfifo(fpath, mode);
-	} else{
-		res = mknod(fpath, mode, rdev);
+	struct encr_state *encr_data = data;
+	const char *val = strchr(arg, '=');
+
+	(void) outargs;
+	switch (key) {
+	case KEY_ENTRY_TIMEOUT:
+		encr_data->entry_timeout = atof(val + 1);
+		break;
+	case KEY_ATTR_TIMEOUT:
+		encr_data->attr_timeout = atof(val + 1);
+		break;
+	case KEY_NEGATIVE_TIMEOUT:
+		encr_data->negative_timeout = atof(val + 1);
+		break;
+	case KEY_MAX_WRITE:
+		encr_data->max_write = strtoul(val + 1, NULL, 0);
+		break;
+	case KEY_MAX_READ:
+		encr_data->max_read = strtoul(val + 1, NULL, 0);
+		break;
+	case KEY_MAX_READAHEAD:
+		encr_data->max_readahead = strtoul(val + 1, NULL, 0);
+		break;
 	}
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to fullpath
-static int encr_mkdir(const char *path, mode_t mode)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	res = mkdir(fpath, mode);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to fullpath
-static int encr_unlink(const char *path)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-
-	res = unlink(fpath);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_rmdir(const char *path)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	res = rmdir(fpath);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-/** Create a symbolic link */
-// The parameters here are a little bit confusing, but do correspond
-// to the symlink() system call.  The 'path' is where the link points,
-// while the 'link' is the link itself.  So we need to leave the path
-// unaltered, but insert the link into the mounted directory.
-static int encr_symlink(const char *from, const char *to)
-{
-	int res;
-	char fto[PATH_MAX];
-    
-    encr_fullpath(fto, to);
-
-	//retstat = symlink(path, flink);
-	res = symlink(from, fto);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_rename(const char *from, const char *to)
-{
-	int res;
-	char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
-    
-    encr_fullpath(fpath, from);
-    encr_fullpath(fnewpath, to);
-	
-	res = rename(fpath,fnewpath);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_link(const char *from, const char *to)
-{
-	int res;
-	char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
-    
-    encr_fullpath(fpath, from);
-    encr_fullpath(fnewpath, to);
-
-	res = link(fpath, fnewpath);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_chmod(const char *path, mode_t mode)
-{
-	int res;
-	char fpath[PATH_MAX];
-   
-    encr_fullpath(fpath, path);
-
-	res = chmod(fpath, mode);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_chown(const char *path, uid_t uid, gid_t gid)
-{
-	int res;
-	char fpath[PATH_MAX];
-
-    encr_fullpath(fpath, path);
-    
-	res = lchown(fpath, uid, gid);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	return 1; // keep it for fuse
 }
-//Updated to full path
-static int encr_truncate(const char *path, off_t size)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-    
-	res = truncate(fpath, size);
-	if (res == -1)
-		return -errno;
 
-	return 0;
-}
-//Updated to full path
-static int encr_utimens(const char *path, const struct timespec ts[2])
+// Who made the call the current worker is serving, for the scheduler
+static unsigned encr_caller_uid(void)
 {
-	int res;
-	struct timeval tv[2];
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
-	res = utimes(fpath, tv);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	return fuse_get_context()->uid;
 }
-//Updated to full path
-static int encr_open(const char *path, struct fuse_file_info *fi)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-
-	res = open(fpath, fi->flags);
-	if (res == -1)
-		return -errno;
 
-	close(res);
-	return 0;
+void encr_usage(){
+	fprintf(stderr, "Usage: ./pa5-encfs [FUSE and mount options] <Key Phrase> <Mirror Directory> <Mount Point>\n"
+		"\n"
+		"pa5-encfs options:\n"
+		"    -o max_threads=N       maximum number of worker threads (default %d)\n"
+		"    -o max_idle_threads=N  idle worker threads kept around, at least 1\n"
+		"                           (default %d)\n"
+		"    -s                     serve requests on a single thread\n"
+		"    -o entry_timeout=T     cache names for T seconds (default %g)\n"
+		"    -o attr_timeout=T      cache attributes for T seconds (default %g)\n"
+		"    -o negative_timeout=T  cache missing names for T seconds (default %g);\n"
+		"                           longer timeouts save lookups, but files changed\n"
+		"                           in the mirror directly look stale that long\n"
+		"    -o max_write=N         largest write request in bytes, from %d to %d\n"
+		"                           (default %d; big_writes is always on)\n"
+		"    -o max_read=N          largest read request in bytes, from %d to %d\n"
+		"    -o max_readahead=N     kernel readahead in bytes, at most %d\n"
+		"    -o attr_cache_size=N   attributes cached inside pa5-encfs (default %d)\n"
+		"    -o xattr_cache_size=N  bytes of xattrs cached inside pa5-encfs (default %d)\n"
+		"    -o chunk_size=N        encryption chunk size of new files, a power of two\n"
+		"                           from %d to %d (default %d)\n"
+		"    -o chunk_auto          pick the chunk size of each file from size\n"
+		"                           hints and its writes (see encfs-chunk.h)\n"
+		"    -o compress            compress the chunks of new files before\n"
+		"                           encrypting them\n"
+		"    -o dedup               store the chunks of new files once each in\n"
+		"                           the mirror's chunk store\n"
+		"    -o log                 append the chunks of new files to the mirror's\n"
+		"                           log, so random writes go out sequentially;\n"
+		"                           not with -o dedup\n"
+		"    -o direct_backing      read and write encrypted backing files with\n"
+		"                           O_DIRECT, so only plaintext is cached\n"
+		"    -o migrate             rewrite plaintext and old-format files, and\n"
+		"                           files due another chunk size, in the\n"
+		"                           background while mounted\n"
+		"    -o migrate_rate=N      migration I/O budget in KiB/s, 0 for none (default %d)\n"
+		"    -o migrate_cpu=N       migration CPU budget in percent, 0 for none (default %d)\n"
+		"    -o trace=FILE          log every call to FILE for encfs-replay\n"
+		"    -o trace_size=N        calls kept in the trace before the oldest are\n"
+		"                           overwritten, at least %d (default %d)\n"
+		"    -o pack                pack small files into their directory's pack\n"
+		"                           once left alone for %d seconds\n"
+		"    -o pack_max=N          largest file packed in bytes, at most %d\n"
+		"                           (default %d)\n"
+		"    -o track_changes       keep a map of what changed in each encrypted\n"
+		"                           file for encfs-changed (see encfs-changes.h)\n"
+		"    -o roots=DIR[:DIR...]  stripe file data over these directories as\n"
+		"                           well as the mirror, at most %d in all; empty\n"
+		"                           ones become new roots (see encfs-roots.h);\n"
+		"                           not with -o compress, dedup or log\n"
+		"    -o cache_dir=DIR       keep backing file blocks in DIR as well, on a\n"
+		"                           faster disk than the mirror's (see encfs-tier.h)\n"
+		"    -o cache_size=N        size of the cache in MiB (default %d)\n"
+		"    -o cache_writeback     write to the cache alone, and to the mirror\n"
+		"                           within %d seconds or on fsync\n"
+		"    -o io_sched            let file data through by class, then fairly\n"
+		"                           between users (see encfs-sched.h)\n"
+		"    -o io_slots=N          requests let through at once besides each\n"
+		"                           user's first, at most %d and best below\n"
+		"                           max_threads (default one per CPU)\n"
+		"    -o io_weights=UID=W[:UID=W...]\n"
+		"                           users' shares, from 1 to %d (default 1)\n"
+		"    -o io_user_rate=N      each user's data in KiB/s, 0 for no limit\n"
+		"    -o io_readahead_rate=N readahead in KiB/s, 0 for no limit\n"
+		"    -o io_background_rate=N\n"
+		"                           migration, cleaning, packing and cache\n"
+		"                           flushing in KiB/s, 0 for no limit\n",
+		ENCR_DEFAULT_MAX_THREADS, ENCR_DEFAULT_MAX_IDLE_THREADS,
+		ENCR_DEFAULT_ENTRY_TIMEOUT, ENCR_DEFAULT_ATTR_TIMEOUT,
+		ENCR_DEFAULT_NEGATIVE_TIMEOUT, ENCR_MIN_REQUEST, ENCR_MAX_REQUEST,
+		ENCR_DEFAULT_MAX_WRITE, ENCR_MIN_REQUEST, ENCR_MAX_REQUEST,
+		ENCR_MAX_REQUEST, ENCR_DEFAULT_ACACHE_SIZE,
+		ENCR_DEFAULT_XCACHE_SIZE, 1 << ENCR_MIN_CHUNK_SHIFT,
+		1 << ENCR_MAX_CHUNK_SHIFT, 1 << ENCR_DEFAULT_CHUNK_SHIFT,
+		ENCR_DEFAULT_MIGRATE_RATE, ENCR_DEFAULT_MIGRATE_CPU,
+		ENCR_MIN_TRACE_SIZE, ENCR_DEFAULT_TRACE_SIZE,
+		ENCR_PACK_IDLE, ENCR_PACK_LIMIT, ENCR_DEFAULT_PACK_MAX,
+		ENCR_MAX_ROOTS, ENCR_DEFAULT_CACHE_SIZE, ENCR_TIER_FLUSH_AGE,
+		ENCR_MAX_SLOTS, ENCR_SCHED_MAX_WEIGHT);
+	abort();
 }
-//Updated to full path
-static int encr_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
-{
-	int fd;
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
 
-	(void) fi;
-	fd = open(fpath, O_RDONLY);
-	if (fd == -1)
-		return -errno;
-
-	res = pread(fd, buf, size, offset);
-	if (res == -1)
-		res = -errno;
-
-	close(fd);
-	return res;
-}
-//Updated to full path
-static int encr_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+// Equivalent of fuse_main(), except that the multithreaded loop is ours
+// so the worker pool can be bounded by the mount options.
+static int encr_main(struct fuse_args *args, struct encr_state *encr_data)
 {
-	int fd;
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded;
 	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
 
-	(void) fi;
-	fd = open(fpath, O_WRONLY);
-	if (fd == -1)
-		return -errno;
+	fuse = fuse_setup(args->argc, args->argv, encr_data->trace != NULL ?
+			  &encr_trace_oper : &encr_oper, sizeof(encr_oper),
+			  &mountpoint, &multithreaded, encr_data);
+	if (fuse == NULL)
+		return 1;
 
-	res = pwrite(fd, buf, size, offset);
-	if (res == -1)
-		res = -errno;
+	// Started only now: fuse_setup() may have forked into the background
+	encr_ops_start(encr_data);
 
-	close(fd);
-	return res;
-}
-//Updated to full path
-static int encr_statfs(const char *path, struct statvfs *stbuf)
-{
-	int res;
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
+	if (multithreaded)
+		res = encr_loop_mt(fuse, encr_data->max_threads,
+				   encr_data->max_idle_threads);
+	else
+		res = fuse_loop(fuse);
 
-	res = statvfs(fpath, stbuf);
+	encr_ops_stop(encr_data);
+	fuse_teardown(fuse, mountpoint);
 	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-//Updated to full path
-static int encr_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-
-    (void) fi;
-    char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-
-    int res;
-    res = creat(fpath, mode);
-    if(res == -1)
-	return -errno;
-
-    close(res);
-
-    return 0;
-}
-
-
-static int encr_release(const char *path, struct fuse_file_info *fi)
-{
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-
-	(void) path;
-	(void) fi;
-	return 0;
-}
-
-static int encr_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
-{
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+		return 1;
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
 	return 0;
 }
 
-/** Open directory
- *
- * This method should check if the open operation is permitted for
- * this  directory
- *
- * Introduced in version 2.3
- */
-int encr_opendir(const char *path, struct fuse_file_info *fi)
-{
-    DIR *dp;
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-    
-    dp = opendir(fpath);
-    if (dp == NULL)
-		fprintf(stderr,"bb_opendir opendir");
-    
-    fi->fh = (intptr_t) dp;
-    
-    //log_fi(fi);
-    
-    return retstat;
-}
-
-
-
-
-#ifdef HAVE_SETXATTR
-//Updated to full path
-static int encr_setxattr(const char *path, const char *name, const char *value,
-			size_t size, int flags)
-{
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	int res = lsetxattr(fpath, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
-}
-//Updated to full path
-static int encr_getxattr(const char *path, const char *name, char *value,
-			size_t size)
-{
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	int res = lgetxattr(fpath, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
-}
-//Updated to full path
-static int encr_listxattr(const char *path, char *list, size_t size)
-{
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	int res = llistxattr(fpath, list, size);
-	if (res == -1)
-		return -errno;
-	return res;
-}
-//Updated to full path
-static int encr_removexattr(const char *path, const char *name)
-{
-	char fpath[PATH_MAX];
-    
-    encr_fullpath(fpath, path);
-	int res = lremovexattr(fpath, name);
-	if (res == -1)
-		return -errno;
-	return 0;
-}
-#endif /* HAVE_SETXATTR */
-
-
-
-static struct fuse_operations encr_oper = {
-	.getattr	= encr_getattr,
-	.access		= encr_access,
-	.readlink	= encr_readlink,
-	.readdir	= encr_readdir,
-	.mknod		= encr_mknod,
-	.mkdir		= encr_mkdir,
-	.symlink	= encr_symlink,
-	.unlink		= encr_unlink,
-	.rmdir		= encr_rmdir,
-	.rename		= encr_rename,
-	.link		= encr_link,
-	.chmod		= encr_chmod,
-	.chown		= encr_chown,
-	.truncate	= encr_truncate,
-	.utimens	= encr_utimens,
-	.open		= encr_open,
-	.read		= encr_read,
-	.write		= encr_write,
-	.statfs		= encr_statfs,
-	.create     = encr_create,
-	.release	= encr_release,
-	.fsync		= encr_fsync,
-	.opendir	= encr_opendir,
-#ifdef HAVE_SETXATTR
-	.setxattr	= encr_setxattr,
-	.getxattr	= encr_getxattr,
-	.listxattr	= encr_listxattr,
-	.removexattr	= encr_removexattr,
-#endif
-};
-
-void encr_usage(){
-	fprintf(stderr, "Usage: ./pa5-encfs <Key Phrase> <Mirror Directory> <Mount Point>");
-	abort();
-}
-
 int main(int argc, char *argv[])
 {
 	struct encr_state *encr_data; //place to store my private data
+	struct fuse_args args;
+	char defaults[192];
+	int res;
 	umask(0); //Really not sure what this does.
 	
 	// bbfs doesn't do any access checking on its own (the comment
@@ -602,16 +274,73 @@ int main(int argc, char *argv[])
 		perror("Main, malloc error");
 		abort();	
 	}
+	encr_ops_defaults(encr_data);
 	
 	// Pull the rootdir out of the argument list and save it in my
     // internal data
     encr_data->rootdir = realpath(argv[argc-2], NULL);
+    if (encr_data->rootdir == NULL) {
+		perror(argv[argc-2]);
+		return 1;
+    }
     encr_data->key_phrase = argv[argc-3];
     argv[argc-3] = argv[argc-1]; //Move the mount point to the first arg
     argv[argc-2] = NULL; //Set later args to null
     argv[argc-1] = NULL;
     argc-=2;
     
-	
-	return fuse_main(argc, argv, &encr_oper, encr_data);
+	// Strip our own -o options before handing the rest to fuse
+	args.argc = argc;
+	args.argv = argv;
+	args.allocated = 0;
+	// Our defaults go first so anything on the command line overrides them.
+	// Without big_writes the kernel splits every write into pages.
+	snprintf(defaults, sizeof(defaults),
+		 "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g,"
+		 "big_writes,max_write=%u",
+		 encr_data->entry_timeout, encr_data->attr_timeout,
+		 encr_data->negative_timeout, encr_data->max_write);
+	if (fuse_opt_insert_arg(&args, 1, defaults) == -1)
+		encr_usage();
+	if (fuse_opt_parse(&args, encr_data, encr_opts, encr_opt_proc) == -1)
+		encr_usage();
+	if (encr_data->max_write < ENCR_MIN_REQUEST ||
+	    encr_data->max_write > ENCR_MAX_REQUEST ||
+	    (encr_data->max_read != 0 &&
+	     (encr_data->max_read < ENCR_MIN_REQUEST ||
+	      encr_data->max_read > ENCR_MAX_REQUEST)) ||
+	    encr_data->max_readahead > ENCR_MAX_REQUEST)
+		encr_usage();
+	// With no idle worker allowed, a pool whose workers are all busy at
+	// once would exit to the last one and leave nobody reading requests
+	if (encr_data->max_threads == 0 || encr_data->max_idle_threads == 0)
+		encr_usage();
+	if (encr_data->trace_size < ENCR_MIN_TRACE_SIZE)
+		encr_usage();
+	if (encr_data->max_idle_threads > encr_data->max_threads)
+		encr_data->max_idle_threads = encr_data->max_threads;
+	if (encr_ops_check(encr_data) != 0)
+		encr_usage();
+
+	encr_data->caller_uid = encr_caller_uid;
+	encr_ops_bind(encr_data);
+	if (encr_ops_open(encr_data) != 0)
+		return 1;
+
+	// Opened before fuse_setup() can change directory into the background
+	if (encr_data->trace_file != NULL) {
+		res = encr_trace_open(encr_data->trace_file,
+				      encr_data->trace_size, &encr_data->trace);
+		if (res != 0) {
+			fprintf(stderr, "Cannot start the trace %s: %s\n",
+				encr_data->trace_file, strerror(-res));
+			return 1;
+		}
+	}
+
+	res = encr_main(&args, encr_data);
+	encr_trace_close(encr_data->trace);
+	encr_ops_close(encr_data);
+	fuse_opt_free_args(&args);
+	return res;
 }
@@ -11,10 +11,84 @@
 //#ifndef _PARAMS_H_
 //#define _PARAMS_H_
 
+/* Everything in here is set up (see encfs-ops.h) before fuse starts and is only
+ * read afterwards, so callbacks running on different worker threads can
+ * share it without locking. Mutable state added later must carry its
+ * own lock. */
+struct encr_itable;
+struct encr_acache;
+struct encr_xcache;
+struct encr_keys;
+struct encr_migrate;
+struct encr_store;
+struct encr_log;
+struct encr_trace;
+struct encr_packs;
+struct encr_chunks;
+struct encr_changes;
+struct encr_roots;
+struct encr_tier;
+struct encr_sched;
+
 struct encr_state{
 	char *rootdir;
 	char *key_phrase;
+	unsigned max_threads;		// -o max_threads=N
+	unsigned max_idle_threads;	// -o max_idle_threads=N
+	struct encr_itable *itable;	// open inodes, has its own lock
+	double entry_timeout;		// -o entry_timeout=T, also seen by fuse
+	double attr_timeout;		// -o attr_timeout=T, also seen by fuse
+	double negative_timeout;	// -o negative_timeout=T, also seen by fuse
+	unsigned max_write;		// -o max_write=N, also seen by fuse
+	unsigned max_read;		// -o max_read=N, also seen by fuse, 0 if unset
+	unsigned max_readahead;		// -o max_readahead=N, also seen by fuse, 0 if unset
+	unsigned attr_cache_size;	// -o attr_cache_size=N
+	struct encr_acache *acache;	// getattr results, has its own lock
+	unsigned xattr_cache_size;	// -o xattr_cache_size=N (bytes)
+	struct encr_xcache *xcache;	// xattrs per inode, has its own lock
+	struct encr_keys *mkey;		// mount key unlocked from .encfs/config
+	unsigned chunk_size;		// -o chunk_size=N, for new and migrated files
+	unsigned chunk_shift;		// log2(chunk_size)
+	int chunk_auto;			// -o chunk_auto
+	struct encr_chunks *chunks;	// per-file chunk sizes (encfs-chunk.h)
+	int compress;			// -o compress
+	int dedup;			// -o dedup
+	int log;			// -o log
+	unsigned file_flags;		// ENCR_FLAG_* for new and migrated files
+	int direct_backing;		// -o direct_backing
+	int migrate;			// -o migrate
+	unsigned migrate_rate;		// -o migrate_rate=N (KiB/s)
+	unsigned migrate_cpu;		// -o migrate_cpu=N (percent)
+	struct encr_migrate *migrator;	// background migration thread, if any
+	struct encr_store *store;	// chunk store, NULL if the mirror has none
+	struct encr_log *logstore;	// log, NULL if the mirror has none
+	char *trace_file;		// -o trace=FILE
+	unsigned trace_size;		// -o trace_size=N (records)
+	struct encr_trace *trace;	// call log, NULL unless tracing
+	int pack;			// -o pack
+	unsigned pack_max;		// -o pack_max=N (bytes)
+	struct encr_packs *packs;	// packed small files, NULL if none
+	int track_changes;		// -o track_changes
+	struct encr_changes *changes;	// change maps, NULL if not tracking
+	char *roots;			// -o roots=DIR[:DIR...]
+	struct encr_roots *rootset;	// other roots, NULL if the mirror has one
+	char *cache_dir;		// -o cache_dir=DIR
+	unsigned cache_size;		// -o cache_size=N (MiB)
+	int cache_writeback;		// -o cache_writeback
+	struct encr_tier *tier;		// cache tier, NULL if none
+	int io_sched;			// -o io_sched
+	unsigned io_slots;		// -o io_slots=N, 0 for one per CPU
+	char *io_weights;		// -o io_weights=UID=W[:UID=W...]
+	unsigned io_user_rate;		// -o io_user_rate=N (KiB/s)
+	unsigned io_readahead_rate;	// -o io_readahead_rate=N (KiB/s)
+	unsigned io_background_rate;	// -o io_background_rate=N (KiB/s)
+	unsigned (*caller_uid)(void);	// uid calling the running callback,
+					// NULL outside a mount
+	struct encr_sched *sched;	// I/O scheduler, NULL if none
 };
-#define ENCR_DATA ((struct encr_state *) fuse_get_context()->private_data)
+// Bound by encr_ops_bind() rather than read from fuse_get_context(), so
+// the callbacks also run outside a mount (see encfs-ops.h)
+extern struct encr_state *encr_ops_data;
+#define ENCR_DATA (encr_ops_data)
 
 //#endif